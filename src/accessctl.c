@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 
@@ -34,6 +35,93 @@
 /* configuration storage */
 extern struct siproxd_config configuration;
 
+/*
+ * Access lists are compiled when the configuration is loaded: the
+ * numeric entries into a sorted array of non-overlapping address
+ * ranges that is searched binary (O(log n)), so even lists with
+ * thousands of networks (acl_file) are cheap to check for every
+ * received packet. Entries given by hostname (e.g. dyndns) are
+ * kept as they are and resolved at the time of the check, the
+ * asynchronous resolver keeps them in the DNS cache (dns_async_keep).
+ */
+typedef struct {
+   unsigned int start;		/* host byte order */
+   unsigned int end;
+} acl_range_t;
+
+typedef struct {
+   int used;			/* number of ranges */
+   int size;			/* allocated ranges */
+   acl_range_t *range;
+   int dyn_used;		/* number of hostname entries */
+   struct {
+      char *host;
+      unsigned int bitmask;
+   } *dyn;
+} acl_list_t;
+
+static acl_list_t acl_deny_sip;
+static acl_list_t acl_allow_sip;
+static acl_list_t acl_allow_reg;
+
+/* compiled lists of process_aclist(), by string */
+static struct {
+   char *aclist;		/* the callers string */
+   char *copy;			/* to detect changes of it */
+   acl_list_t acl;
+} acl_cache[ACL_CACHE_SIZE];
+static int acl_cache_next=0;
+
+/* local prototypes */
+static int acl_add(acl_list_t *acl, char *entry, char *where);
+static int acl_compile(acl_list_t *acl, char *aclist);
+static int acl_load_file(char *filename);
+static void acl_finish(acl_list_t *acl);
+static void acl_free(acl_list_t *acl);
+static int acl_match(acl_list_t *acl, struct sockaddr_in from);
+static int acl_range_cmp(const void *a, const void *b);
+
+
+/*
+ * compile the access lists of the configuration
+ * (hosts_deny_sip, hosts_allow_sip, hosts_allow_reg, acl_file)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int accesslist_init(void) {
+   acl_free(&acl_deny_sip);
+   acl_free(&acl_allow_sip);
+   acl_free(&acl_allow_reg);
+
+   if ((acl_compile(&acl_deny_sip, configuration.hosts_deny_sip)
+        != STS_SUCCESS) ||
+       (acl_compile(&acl_allow_sip, configuration.hosts_allow_sip)
+        != STS_SUCCESS) ||
+       (acl_compile(&acl_allow_reg, configuration.hosts_allow_reg)
+        != STS_SUCCESS)) {
+      return STS_FAILURE;
+   }
+
+   if (configuration.acl_file && (configuration.acl_file[0] != '\0')) {
+      if (acl_load_file(configuration.acl_file) != STS_SUCCESS) {
+         return STS_FAILURE;
+      }
+   }
+
+   acl_finish(&acl_deny_sip);
+   acl_finish(&acl_allow_sip);
+   acl_finish(&acl_allow_reg);
+
+   DEBUGC(DBCLASS_ACCESS, "access lists: deny SIP %i+%i, allow SIP %i+%i, "
+          "allow REG %i+%i ranges+hostnames",
+          acl_deny_sip.used, acl_deny_sip.dyn_used,
+          acl_allow_sip.used, acl_allow_sip.dyn_used,
+          acl_allow_reg.used, acl_allow_reg.dyn_used);
+   return STS_SUCCESS;
+}
+
 
 /*
  * verifies the from address agains the access lists
@@ -44,20 +132,12 @@ extern struct siproxd_config configuration;
 int accesslist_check (struct sockaddr_in from) {
    int access = 0;
 
-   DEBUGC(DBCLASS_ACCESS,"deny  list (SIP):%s",
-      configuration.hosts_deny_sip? configuration.hosts_deny_sip : "*NULL*");
-   DEBUGC(DBCLASS_ACCESS,"allow list (SIP):%s",
-      configuration.hosts_allow_sip? configuration.hosts_allow_sip : "*NULL*");
-   DEBUGC(DBCLASS_ACCESS,"allow list (REG):%s",
-      configuration.hosts_allow_reg? configuration.hosts_allow_reg : "*NULL*");
-
 /*
  * check DENY list
  */
-   if ( (configuration.hosts_deny_sip !=NULL) &&
-        (strcmp(configuration.hosts_deny_sip,"")!=0) ) {
+   if ((acl_deny_sip.used > 0) || (acl_deny_sip.dyn_used > 0)) {
       /* non-empty list -> check agains it */
-      if (process_aclist(configuration.hosts_deny_sip, from)== STS_SUCCESS) {
+      if (acl_match(&acl_deny_sip, from) == STS_SUCCESS) {
          /* yup - this one is blacklisted */
          DEBUGC(DBCLASS_ACCESS,"caught by deny list");
          return 0;
@@ -67,10 +147,9 @@ int accesslist_check (struct sockaddr_in from) {
 /*
  * check SIP allow list
  */
-   if ( (configuration.hosts_allow_sip !=NULL) &&
-        (strcmp(configuration.hosts_allow_sip,"")!=0) ) {
+   if ((acl_allow_sip.used > 0) || (acl_allow_sip.dyn_used > 0)) {
       /* non-empty list -> check agains it */
-      if (process_aclist(configuration.hosts_allow_sip, from)==STS_SUCCESS) {
+      if (acl_match(&acl_allow_sip, from) == STS_SUCCESS) {
          /* SIP access granted */
          DEBUGC(DBCLASS_ACCESS,"granted SIP access");
          access |= ACCESSCTL_SIP;
@@ -82,10 +161,9 @@ int accesslist_check (struct sockaddr_in from) {
 /*
  * check SIP registration allow list
  */
-   if ( (configuration.hosts_allow_reg !=NULL) &&
-        (strcmp(configuration.hosts_allow_reg,"")!=0) ) {
+   if ((acl_allow_reg.used > 0) || (acl_allow_reg.dyn_used > 0)) {
       /* non-empty list -> check against it */
-      if (process_aclist(configuration.hosts_allow_reg, from)==STS_SUCCESS) {
+      if (acl_match(&acl_allow_reg, from) == STS_SUCCESS) {
          /* SIP registration access granted */
          DEBUGC(DBCLASS_ACCESS,"granted REG/SIP access");
          access |= ACCESSCTL_REG | ACCESSCTL_SIP;
@@ -101,87 +179,289 @@ int accesslist_check (struct sockaddr_in from) {
 
 /*
  * checks for a match of the 'from' address with the supplied
- * access list.
+ * access list. The list is compiled on first use and kept, as long
+ * as the string does not change.
  *
  * RETURNS
  *	STS_SUCCESS for a match
  *	STS_FAILURE for no match
  */
 int process_aclist (char *aclist, struct sockaddr_in from) {
-   int i, sts;
-   int lastentry;
-   char *p1, *p2;
-   char address[HOSTNAME_SIZE+1]; /* dotted decimal IP - max 15 chars */
-                                  /* or hostname*/
-   char mask[8];                  /* mask - max 2 digits */
-   int  mask_int;
-   struct in_addr inaddr;
-   unsigned int bitmask;
+   int i;
+
+   if (aclist == NULL) return STS_FAILURE;
 
+   for (i=0; i<ACL_CACHE_SIZE; i++) {
+      if ((acl_cache[i].aclist == aclist) &&
+          (strcmp(acl_cache[i].copy, aclist) == 0)) break;
+   }
+
+   if (i >= ACL_CACHE_SIZE) {
+      /* compile it, replacing the oldest compiled list */
+      i=acl_cache_next;
+      acl_cache_next=(acl_cache_next + 1) % ACL_CACHE_SIZE;
+      acl_free(&acl_cache[i].acl);
+      free(acl_cache[i].copy);
+      acl_cache[i].aclist=NULL;
+      acl_cache[i].copy=strdup(aclist);
+      if (acl_cache[i].copy == NULL) return STS_FAILURE;
+      if (acl_compile(&acl_cache[i].acl, aclist) != STS_SUCCESS) {
+         free(acl_cache[i].copy);
+         acl_cache[i].copy=NULL;
+         return STS_FAILURE;
+      }
+      acl_finish(&acl_cache[i].acl);
+      acl_cache[i].aclist=aclist;
+   }
+
+   return acl_match(&acl_cache[i].acl, from);
+}
 
-   for (i=0, p1=aclist, lastentry=0; !lastentry && p1-aclist<strlen(aclist); i++) {
 
 /*
- * extract one entry from the access list
+ * module local functions
  */
-      /* address */
-      p2=strchr(p1,'/');
-      if (!p2) {
-         ERROR("CONFIG: accesslist [%s]- no mask separator found", aclist);
-         return STS_FAILURE;
+
+/*
+ * check an address against a compiled list
+ *
+ * RETURNS
+ *	STS_SUCCESS for a match
+ *	STS_FAILURE for no match
+ */
+static int acl_match(acl_list_t *acl, struct sockaddr_in from) {
+   unsigned int ip=ntohl(from.sin_addr.s_addr);
+   struct in_addr inaddr;
+   int lo, hi, mid, i;
+
+   /* last range starting at or below ip */
+   lo=0;
+   hi=acl->used - 1;
+   while (lo <= hi) {
+      mid=(lo + hi) / 2;
+      if (acl->range[mid].start <= ip) {
+         lo=mid + 1;
+      } else {
+         hi=mid - 1;
       }
+   }
+   if ((hi >= 0) && (ip <= acl->range[hi].end)) {
+      DEBUGC(DBCLASS_ACCESS, "acl_match: MATCH %s in range %i",
+             utils_inet_ntoa(from.sin_addr), hi);
+      return STS_SUCCESS;
+   }
 
-      if (p2-p1 >= sizeof(address)) {
-         ERROR("CONFIG: accesslist [%s]- illegal ip address format or netmask separator", aclist);
-         return STS_FAILURE;
+   /* hostnames, resolved now (DNS cache) */
+   for (i=0; i<acl->dyn_used; i++) {
+      if (get_ip_by_host(acl->dyn[i].host, &inaddr) != STS_SUCCESS) {
+         DEBUGC(DBCLASS_ACCESS, "acl_match: cannot resolve address [%s]",
+                acl->dyn[i].host);
+         continue;
       }
-      memset(address,0,sizeof(address));
-      memcpy(address,p1,p2-p1);
-      p1=p2+1;
-
-      /* mask */
-      p2=strchr(p1,',');
-      if (!p2) { /* then this must be the last entry in the list */
-         p2=strchr(p1,'\0');
-         lastentry=1;
+      if ((ntohl(inaddr.s_addr) & acl->dyn[i].bitmask) ==
+          (ip & acl->dyn[i].bitmask)) {
+         DEBUGC(DBCLASS_ACCESS, "acl_match: MATCH %s by [%s]",
+                utils_inet_ntoa(from.sin_addr), acl->dyn[i].host);
+         return STS_SUCCESS;
       }
+   }
 
-      if (p2-p1 >= sizeof(mask)) {
-         ERROR("CONFIG: accesslist [%s]- illegal netmask format or IP separator", aclist);
-         return STS_FAILURE;
+   DEBUGC(DBCLASS_ACCESS, "acl_match: no match");
+   return STS_FAILURE;
+}
+
+
+/*
+ * compile a comma separated list of address/mask entries
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int acl_compile(acl_list_t *acl, char *aclist) {
+   char entry[HOSTNAME_SIZE+8];
+   char *p1, *p2;
+   size_t len;
+
+   if (aclist == NULL) return STS_SUCCESS;
+
+   for (p1=aclist; *p1; p1=p2) {
+      p2=strchr(p1, ',');
+      if (p2 == NULL) p2=p1 + strlen(p1);
+      len=p2 - p1;
+      if (*p2 == ',') p2++;
+
+      if (len >= sizeof(entry)) {
+         ERROR("CONFIG: accesslist [%s]- entry too long", aclist);
+         continue;
       }
-      memset(mask,0,sizeof(mask));
-      memcpy(mask,p1,p2-p1);
-      p1=p2+1;
+      memcpy(entry, p1, len);
+      entry[len]='\0';
+      if (acl_add(acl, entry, aclist) != STS_SUCCESS) return STS_FAILURE;
+   }
+   return STS_SUCCESS;
+}
 
-      DEBUGC(DBCLASS_ACCESS,"[%i] extracted address=%s", i, address);
-      DEBUGC(DBCLASS_ACCESS,"[%i] extracted mask   =%s", i, mask);
 
 /*
- * check for a match
+ * load an ACL file. Each line contains a list name and one entry:
+ *   deny_sip  192.0.2.0/24
+ *   allow_sip 10.0.0.0/8
+ *   allow_reg 10.1.0.0/16
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
  */
-      sts=get_ip_by_host(address, &inaddr);
-      if (sts == STS_FAILURE) {
-         DEBUGC(DBCLASS_ACCESS, "process_aclist: cannot resolve address [%s]",
-                address);
+static int acl_load_file(char *filename) {
+   FILE *f;
+   char buff[HOSTNAME_SIZE+64];
+   char list[16], entry[HOSTNAME_SIZE+8];
+   char where[PATH_STRING_SIZE+16];
+   int line=0, count=0;
+   acl_list_t *acl;
+
+   f=fopen(filename, "r");
+   if (f == NULL) {
+      ERROR("unable to open ACL file [%s]", filename);
+      return STS_FAILURE;
+   }
+
+   while (fgets(buff, sizeof(buff), f) != NULL) {
+      line++;
+      if (sscanf(buff, "%15s %135s", list, entry) != 2) continue;
+      if (list[0] == '#') continue;
+
+      if (strcmp(list, "deny_sip") == 0) {
+         acl=&acl_deny_sip;
+      } else if (strcmp(list, "allow_sip") == 0) {
+         acl=&acl_allow_sip;
+      } else if (strcmp(list, "allow_reg") == 0) {
+         acl=&acl_allow_reg;
+      } else {
+         ERROR("ACL file %s, line %i: unknown list [%s]",
+               filename, line, list);
+         continue;
+      }
+
+      snprintf(where, sizeof(where), "%s:%i", filename, line);
+      if (acl_add(acl, entry, where) != STS_SUCCESS) {
+         fclose(f);
          return STS_FAILURE;
       }
+      count++;
+   }
+   fclose(f);
+
+   INFO("loaded %i entries from ACL file %s", count, filename);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * add one address/mask entry to a list. Malformed entries are
+ * reported and skipped.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if out of memory
+ */
+static int acl_add(acl_list_t *acl, char *entry, char *where) {
+   char *p;
+   int mask_int=32;
+   unsigned int bitmask;
+   struct in_addr inaddr;
+   void *tmp;
+
+   /* strip white space */
+   while (isspace((unsigned char)*entry)) entry++;
+   for (p=entry + strlen(entry); (p > entry) && isspace((unsigned char)p[-1]);
+        p--) {
+      p[-1]='\0';
+   }
+   if (*entry == '\0') return STS_SUCCESS;
 
-      mask_int=atoi(mask);
+   p=strchr(entry, '/');
+   if (p) {
+      *p++='\0';
+      mask_int=atoi(p);
       if ((mask_int < 0) || (mask_int > 32)) mask_int=32;
-      bitmask= (mask_int)? (0xffffffff<<(32-mask_int)) : 0;
+   }
+   bitmask=(mask_int)? (0xffffffff<<(32-mask_int)) : 0;
 
-      DEBUGC(DBCLASS_ACCESS,"check match: entry=%i, filter=%lx, from=%lx", i,
-                            (long)ntohl(inaddr.s_addr) & bitmask,
-			    (long)ntohl(from.sin_addr.s_addr) & bitmask);
+   if (*entry == '\0') {
+      ERROR("CONFIG: accesslist [%s]- illegal entry", where);
+      return STS_SUCCESS;
+   }
 
-      if ( (ntohl(inaddr.s_addr) & bitmask) == 
-           (ntohl(from.sin_addr.s_addr) & bitmask) ) {
-         DEBUGC(DBCLASS_ACCESS, "process_aclist: MATCH");
-         return STS_SUCCESS;
-      }
+   /* hostname: resolved when checked, kept in the DNS cache */
+   if (utils_inet_aton(entry, &inaddr) <= 0) {
+      dns_async_keep(entry);
+      tmp=realloc(acl->dyn, (acl->dyn_used+1) * sizeof(acl->dyn[0]));
+      if (tmp == NULL) goto nomem;
+      acl->dyn=tmp;
+      acl->dyn[acl->dyn_used].host=strdup(entry);
+      if (acl->dyn[acl->dyn_used].host == NULL) goto nomem;
+      acl->dyn[acl->dyn_used].bitmask=bitmask;
+      acl->dyn_used++;
+      return STS_SUCCESS;
+   }
+
+   if (acl->used >= acl->size) {
+      tmp=realloc(acl->range, (acl->size+ACL_GROW) * sizeof(acl_range_t));
+      if (tmp == NULL) goto nomem;
+      acl->range=tmp;
+      acl->size += ACL_GROW;
    }
+   acl->range[acl->used].start=ntohl(inaddr.s_addr) & bitmask;
+   acl->range[acl->used].end=acl->range[acl->used].start | ~bitmask;
+   acl->used++;
+   return STS_SUCCESS;
 
-   DEBUGC(DBCLASS_ACCESS, "process_aclist: no match");
+nomem:
+   ERROR("out of memory compiling access list [%s]", where);
    return STS_FAILURE;
 }
+
+
+/*
+ * sort the ranges of a list and merge overlapping ones
+ */
+static void acl_finish(acl_list_t *acl) {
+   int i, n;
+
+   if (acl->used <= 1) return;
+
+   qsort(acl->range, acl->used, sizeof(acl_range_t), acl_range_cmp);
+   for (i=1, n=0; i<acl->used; i++) {
+      if ((acl->range[n].end == 0xffffffff) ||
+          (acl->range[i].start <= acl->range[n].end + 1)) {
+         if (acl->range[i].end > acl->range[n].end) {
+            acl->range[n].end=acl->range[i].end;
+         }
+      } else {
+         acl->range[++n]=acl->range[i];
+      }
+   }
+   acl->used=n + 1;
+}
+
+
+static void acl_free(acl_list_t *acl) {
+   int i;
+
+   for (i=0; i<acl->dyn_used; i++) free(acl->dyn[i].host);
+   free(acl->dyn);
+   free(acl->range);
+   memset(acl, 0, sizeof(acl_list_t));
+}
+
+
+static int acl_range_cmp(const void *a, const void *b) {
+   const acl_range_t *r1=a, *r2=b;
+
+   if (r1->start < r2->start) return -1;
+   if (r1->start > r2->start) return 1;
+   return 0;
+}
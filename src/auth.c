@@ -24,7 +24,9 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
+#include <time.h>
 #include <sys/time.h>
 
 #ifdef HAVE_GETRANDOM
@@ -47,10 +49,58 @@ extern struct siproxd_config configuration;
 /* Global File instance on pw file */
 extern FILE *siproxd_passwordfile;
 
+/* credentials from the password file, hashed by username */
+typedef struct {
+   char username[USERNAME_SIZE];
+   HASHHEX ha1;
+   int next;				/* next in hash chain, -1=end */
+} auth_entry_t;
+
+static struct {
+   auth_entry_t *entries;
+   int *buckets;			/* first entry, -1=none */
+   int nbuckets;			/* power of 2 */
+   int count;
+} auth_pw={NULL, NULL, 0, 0};
+
+/* nonces: timestamp, serial and HMAC (hex) */
+#define AUTH_NONCE_LEN		(8+8+HASHHEXLEN)
+#define AUTH_SECRET_LEN		16	/* bytes of random secret */
+#define AUTH_SECRET_BLOCK	64	/* MD5 block size */
+#define AUTH_NC_WAYS		4	/* entries per hash set */
+#define AUTH_NC_WINDOW		64	/* nonce counts tracked, bits of "seen" */
+
+/* nonce count tracking of a nonce */
+typedef struct {
+   unsigned int ts;			/* nonce timestamp, 0=unused */
+   unsigned int serial;
+   unsigned long nc;			/* highest nonce count seen */
+   unsigned long long seen;		/* bit i set: nc-i has been seen */
+   unsigned int req_hash;		/* Call-ID hash of the request with nc */
+   unsigned long cseq;			/* CSeq of the request with nc */
+   time_t nc_ts;			/* time nc has been seen first */
+} auth_nc_t;
+
+static unsigned char auth_secret[AUTH_SECRET_BLOCK];
+static int auth_secret_set=0;
+static unsigned int auth_serial=0;
+static auth_nc_t auth_nc[AUTH_NC_CACHE];
+/* per hash set: older unknown nonces are stale */
+static unsigned int auth_nc_floor[AUTH_NC_CACHE / AUTH_NC_WAYS];
+
 /* local protorypes */
 static char *auth_generate_nonce(void);
-static int auth_check(osip_proxy_authorization_t *proxy_auth);
-static char *auth_getpwd(char *username);
+static void auth_init_secret(void);
+static void auth_hmac(char *data, size_t len, HASHHEX mac);
+static int auth_verify_nonce(char *nonce, unsigned int *ts,
+                             unsigned int *serial);
+static int auth_nc_check(unsigned int ts, unsigned int serial,
+                         unsigned long nc, unsigned int req_hash,
+                         unsigned long cseq, time_t now, int ttl);
+static int auth_check(osip_proxy_authorization_t *proxy_auth,
+                      osip_message_t *sipmsg);
+static unsigned char *auth_lookup(char *username);
+static unsigned int auth_hash(char *username);
 
 /*
  * perform proxy authentication
@@ -59,9 +109,11 @@ static char *auth_getpwd(char *username);
  *	STS_SUCCESS : authentication ok / not needed
  *	STS_FAILURE : authentication failed
  *	STS_NEEDAUTH: authentication needed
+ *	STS_STALE_AUTH: credentials ok, but the nonce is stale
  */
 int authenticate_proxy(osip_message_t *sipmsg) {
    osip_proxy_authorization_t *proxy_auth=NULL;
+   int sts;
    
    /* required by config? */
    if (configuration.proxy_auth_realm == NULL) {
@@ -76,9 +128,16 @@ int authenticate_proxy(osip_message_t *sipmsg) {
    }
 
    /* verify supplied authentication */
-   if (auth_check(proxy_auth) == STS_SUCCESS) {
+   sts=auth_check(proxy_auth, sipmsg);
+   if (sts == STS_SUCCESS) {
       DEBUGC(DBCLASS_AUTH,"proxy-auth succeeded");
       return STS_SUCCESS;
+   } else if (sts == STS_NEED_AUTH) {
+      DEBUGC(DBCLASS_AUTH,"proxy-auth with unknown nonce");
+      return STS_NEED_AUTH;
+   } else if (sts == STS_STALE_AUTH) {
+      DEBUGC(DBCLASS_AUTH,"proxy-auth with stale nonce");
+      return STS_STALE_AUTH;
    }
 
    /* authentication failed */
@@ -88,12 +147,13 @@ int authenticate_proxy(osip_message_t *sipmsg) {
 
 /*
  * includes proxy authentication header in SIP message
+ * stale	nonce of the request was stale (stale=true)
  *
  * RETURNS
  *	STS_SUCCESS
  *	STS_FAILURE
  */
-int auth_include_authrq(osip_message_t *sipmsg) {
+int auth_include_authrq(osip_message_t *sipmsg, int stale) {
    osip_proxy_authenticate_t *p_auth;
    char *realm=NULL;
 
@@ -113,6 +173,11 @@ int auth_include_authrq(osip_message_t *sipmsg) {
             (long)strlen(configuration.proxy_auth_realm)+3);
       return STS_FAILURE;
    }
+   /* qop: the client may reuse the nonce, counting up nc */
+   osip_proxy_authenticate_set_qop_options(p_auth, osip_strdup("\"auth\""));
+   if (stale) {
+      osip_proxy_authenticate_set_stale(p_auth, osip_strdup("true"));
+   }
 
    osip_list_add (&(sipmsg->proxy_authenticates), p_auth, -1);
 
@@ -122,14 +187,78 @@ int auth_include_authrq(osip_message_t *sipmsg) {
 }
 
 /*
- * generates a nonce string
+ * renders the proxy authentication header line (incl. CRLF) into
+ * buf, the raw message counterpart of auth_include_authrq(). The
+ * part up to the nonce is rendered only once.
+ * stale	nonce of the request was stale (stale=true)
+ *
+ * RETURNS
+ *	STS_SUCCESS
+ *	STS_FAILURE if buf is too small
+ */
+int auth_render_authrq(char *buf, size_t size, int stale) {
+   static char prefix[256];
+   static int prefix_len=-1;
+   char *nonce, *suffix;
+   size_t nonce_len, suffix_len;
+
+   if (prefix_len < 0) {
+      prefix_len=snprintf(prefix, sizeof(prefix),
+                          "Proxy-Authenticate: Digest realm=\"%s\", "
+                          "qop=\"auth\", nonce=",
+                          configuration.proxy_auth_realm);
+      if (prefix_len >= (int)sizeof(prefix)) prefix_len=sizeof(prefix);
+   }
+   if (prefix_len >= (int)sizeof(prefix)) return STS_FAILURE;
+
+   nonce=auth_generate_nonce();
+   nonce_len=strlen(nonce);
+   suffix=(stale) ? ", stale=true\r\n" : "\r\n";
+   suffix_len=strlen(suffix);
+   if (prefix_len + nonce_len + suffix_len + 1 > size) return STS_FAILURE;
+
+   memcpy(buf, prefix, prefix_len);
+   memcpy(buf+prefix_len, nonce, nonce_len);
+   memcpy(buf+prefix_len+nonce_len, suffix, suffix_len+1);
+
+   return STS_SUCCESS;
+}
+
+/*
+ * generates a nonce string:
+ *   <timestamp><serial><HMAC-MD5(secret, timestamp serial)>
+ * (hex, quoted). Such a nonce can be verified without keeping any
+ * state (see auth_verify_nonce) and may be used by the client until
+ * it expires after proxy_auth_nonce_ttl seconds.
  *
  * RETURNS nonce string
  */
 static char *auth_generate_nonce() {
-   static char nonce[40];
-   static const char hexchars[] = "0123456789abcdef";
-   unsigned char random_bytes[16];
+   static char nonce[AUTH_NONCE_LEN+3];
+   char data[17];
+   HASHHEX mac;
+
+   if (!auth_secret_set) auth_init_secret();
+
+   snprintf(data, sizeof(data), "%8.8x%8.8x",
+            (unsigned int)time(NULL), auth_serial++);
+   auth_hmac(data, 16, mac);
+   sprintf(nonce, "\"%s%s\"", data, mac);
+
+   DEBUGC(DBCLASS_AUTH, "created nonce=%s", nonce);
+   return nonce;
+}
+
+
+/*
+ * create the secret the nonces are signed with. It only lives in
+ * memory, after a restart all nonces issued before are unknown.
+ *
+ * RETURNS
+ *	-
+ */
+static void auth_init_secret(void) {
+   unsigned char random_bytes[AUTH_SECRET_LEN+4];
    struct timeval tv;
    int i;
 
@@ -144,27 +273,172 @@ static char *auth_generate_nonce() {
    #error "need getrandom() or arc4random_buf()"
    if (0) {
 #endif
-
-      nonce[0] = '"';
-      /* Convert to hex string */
-      for (i = 0; i < 16; i++) {
-         nonce[1 + i*2] = hexchars[(random_bytes[i] >> 4) & 0x0f];
-         nonce[1 + i*2 + 1] = hexchars[random_bytes[i] & 0x0f];
-      }
-      nonce[33] = '"';
-      nonce[34] = '\0';
-
+      /* nothing more to do */
    } else {
       // getrandom() failed or did not return the expected number
       // of bytes - fallback to something else (not secure)
       WARN("getrandom() failed, falling back to less secure mechanism");
       gettimeofday (&tv, NULL);
-      sprintf(nonce, "\"%8.8lx%8.8lx%8.8x%8.8x\"",
-              (long)tv.tv_sec, (long)tv.tv_usec, rand(), rand() );
+      srand(tv.tv_sec ^ tv.tv_usec);
+      for (i = 0; i < sizeof(random_bytes); i++) {
+         random_bytes[i] = rand() & 0xff;
+      }
    }
 
-   DEBUGC(DBCLASS_AUTH, "created nonce=%s", nonce);
-   return nonce;
+   /* HMAC key, zero padded to the MD5 block size */
+   memset(auth_secret, 0, sizeof(auth_secret));
+   memcpy(auth_secret, random_bytes, AUTH_SECRET_LEN);
+   memcpy(&auth_serial, random_bytes+AUTH_SECRET_LEN, sizeof(auth_serial));
+   memset(random_bytes, 0, sizeof(random_bytes));
+   auth_secret_set=1;
+}
+
+
+/*
+ * HMAC-MD5 (RFC2104) of data under the server secret, as hex string
+ *
+ * RETURNS
+ *	-
+ */
+static void auth_hmac(char *data, size_t len, HASHHEX mac) {
+   osip_MD5_CTX Md5Ctx;
+   unsigned char pad[AUTH_SECRET_BLOCK];
+   HASH digest;
+   int i;
+
+   for (i = 0; i < AUTH_SECRET_BLOCK; i++) pad[i] = auth_secret[i] ^ 0x36;
+   osip_MD5Init(&Md5Ctx);
+   osip_MD5Update(&Md5Ctx, pad, AUTH_SECRET_BLOCK);
+   osip_MD5Update(&Md5Ctx, (unsigned char*)data, len);
+   osip_MD5Final(digest, &Md5Ctx);
+
+   for (i = 0; i < AUTH_SECRET_BLOCK; i++) pad[i] = auth_secret[i] ^ 0x5c;
+   osip_MD5Init(&Md5Ctx);
+   osip_MD5Update(&Md5Ctx, pad, AUTH_SECRET_BLOCK);
+   osip_MD5Update(&Md5Ctx, digest, HASHLEN);
+   osip_MD5Final(digest, &Md5Ctx);
+
+   CvtHex(digest, mac);
+}
+
+
+/*
+ * verify a nonce supplied by the client has been issued by us
+ * nonce	the nonce (without quotes)
+ * ts		returns the time the nonce has been issued
+ * serial	returns the serial number of the nonce
+ *
+ * RETURNS
+ *	STS_SUCCESS if the nonce is genuine
+ *	STS_FAILURE if not
+ */
+static int auth_verify_nonce(char *nonce, unsigned int *ts,
+                             unsigned int *serial) {
+   HASHHEX mac;
+   char tmp[9];
+   int i, diff=0;
+
+   if (!auth_secret_set) return STS_FAILURE;
+   if ((strlen(nonce) != AUTH_NONCE_LEN) ||
+       (strspn(nonce, "0123456789abcdef") != AUTH_NONCE_LEN)) {
+      return STS_FAILURE;
+   }
+
+   /* constant time compare */
+   auth_hmac(nonce, 16, mac);
+   for (i = 0; i < HASHHEXLEN; i++) diff |= mac[i] ^ nonce[16+i];
+   if (diff) return STS_FAILURE;
+
+   tmp[8]='\0';
+   memcpy(tmp, nonce, 8);
+   *ts=strtoul(tmp, NULL, 16);
+   memcpy(tmp, nonce+8, 8);
+   *serial=strtoul(tmp, NULL, 16);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * replay protection: check a nonce count has not been used before
+ * with this nonce. For every nonce in use, the highest nonce count
+ * and a window of the AUTH_NC_WINDOW counts below are remembered in
+ * a fixed size, set associative table. If a still valid nonce must
+ * be dropped from a hash set, all unknown nonces of this set issued
+ * up to that time are considered stale from then on (auth_nc_floor),
+ * the clients simply get a fresh nonce.
+ * The highest nonce count may be used again by a retransmission of the
+ * same request (same Call-ID and CSeq) within the lifetime of a
+ * transaction (SIP_TRANS_LIFETIME), as UDP retransmissions are only
+ * absorbed if sip_trans_cache is enabled.
+ *
+ * RETURNS
+ *	STS_SUCCESS if the nonce count is fresh or a retransmission
+ *	STS_FAILURE if replayed or unknown (nonce is stale)
+ */
+static int auth_nc_check(unsigned int ts, unsigned int serial,
+                         unsigned long nc, unsigned int req_hash,
+                         unsigned long cseq, time_t now, int ttl) {
+   auth_nc_t *set, *e, *victim=NULL;
+   unsigned long diff;
+   unsigned int h;
+   int i;
+
+   h=(ts ^ serial) * 2654435761U;
+   h=(h ^ (h >> 15)) & (AUTH_NC_CACHE / AUTH_NC_WAYS - 1);
+   set=&auth_nc[h * AUTH_NC_WAYS];
+
+   for (i = 0; i < AUTH_NC_WAYS; i++) {
+      e=&set[i];
+      if ((e->ts != ts) || (e->serial != serial) || (e->ts == 0)) continue;
+
+      if (nc > e->nc) {
+         /* slide the window */
+         diff=nc - e->nc;
+         e->seen=(diff >= AUTH_NC_WINDOW) ? 0 : e->seen << diff;
+         e->seen |= 1;
+         e->nc=nc;
+         e->req_hash=req_hash;
+         e->cseq=cseq;
+         e->nc_ts=now;
+         return STS_SUCCESS;
+      }
+      /* retransmission of the request that used the highest nc */
+      if ((nc == e->nc) && (req_hash == e->req_hash) && (cseq == e->cseq) &&
+          ((long)(now - e->nc_ts) <= SIP_TRANS_LIFETIME/1000)) {
+         return STS_SUCCESS;
+      }
+      diff=e->nc - nc;
+      if ((diff >= AUTH_NC_WINDOW) || (e->seen & (1ULL << diff))) {
+         return STS_FAILURE;
+      }
+      e->seen |= 1ULL << diff;
+      return STS_SUCCESS;
+   }
+
+   /* first use of this nonce */
+   if (ts <= auth_nc_floor[h]) return STS_FAILURE;
+
+   for (i = 0; i < AUTH_NC_WAYS; i++) {
+      if ((set[i].ts == 0) || ((long)(now - set[i].ts) > ttl)) {
+         victim=&set[i];
+         break;
+      }
+      if ((victim == NULL) || (set[i].ts < victim->ts)) victim=&set[i];
+   }
+   /* replacing a nonce that is still valid */
+   if ((victim->ts != 0) && ((long)(now - victim->ts) <= ttl) &&
+       (victim->ts > auth_nc_floor[h])) {
+      auth_nc_floor[h]=victim->ts;
+   }
+
+   victim->ts=ts;
+   victim->serial=serial;
+   victim->nc=nc;
+   victim->seen=1;
+   victim->req_hash=req_hash;
+   victim->cseq=cseq;
+   victim->nc_ts=now;
+   return STS_SUCCESS;
 }
 
 
@@ -174,10 +448,16 @@ static char *auth_generate_nonce() {
  * RETURNS
  *	STS_SUCCESS if succeeded
  *	STS_FAILURE if failed
+ *	STS_NEED_AUTH if the nonce has not been issued by us
+ *	STS_STALE_AUTH if the nonce has expired or the nonce count is reused
  */
-static int auth_check(osip_proxy_authorization_t *proxy_auth) {
-   char *password=NULL;
-   int sts;
+static int auth_check(osip_proxy_authorization_t *proxy_auth,
+                      osip_message_t *sipmsg) {
+   unsigned char *ha1;
+   unsigned int nonce_ts, nonce_serial, req_hash;
+   unsigned long nc, cseq;
+   time_t now;
+   int sts, ttl;
 
    HASHHEX HA1;
    HASHHEX HA2 = "";
@@ -217,19 +497,58 @@ static int auth_check(osip_proxy_authorization_t *proxy_auth) {
    if (proxy_auth->response)
       Response=osip_strdup_without_quote(proxy_auth->response);
 
-   /* get password */
-   if (configuration.proxy_auth_pwfile) {
-      /* check in passwd file */
-      password=auth_getpwd(Username);
-   } else if (configuration.proxy_auth_passwd) {
-      /* get password from configuration */
-      password=configuration.proxy_auth_passwd;
+   /* get H(A1) */
+   if ((Username == NULL) || (Response == NULL)) {
+      DEBUGC(DBCLASS_AUTH,"incomplete credentials");
+      sts = STS_FAILURE;
+      goto auth_free;
    }
 
-   if (password == NULL) {
-      DEBUGC(DBCLASS_AUTH,"user [%s] not in password file!",
-             (Username)?Username:"*NULL*");
-      return STS_FAILURE;
+   /* nonce issued by us (since the last restart)? */
+   if ((Nonce == NULL) ||
+       (auth_verify_nonce(Nonce, &nonce_ts, &nonce_serial) != STS_SUCCESS)) {
+      DEBUGC(DBCLASS_AUTH,"nonce [%s] not issued by us",
+             (Nonce)?Nonce:"*NULL*");
+      sts = STS_NEED_AUTH;
+      goto auth_free;
+   }
+
+   /* nonce count - without qop a nonce can be used only once */
+   nc=1;
+   if (Qpop) {
+      if ((NonceCount == NULL) || (CNonce == NULL) ||
+          (strlen(NonceCount) != 8) ||
+          (strspn(NonceCount, "0123456789abcdefABCDEF") != 8) ||
+          ((nc=strtoul(NonceCount, NULL, 16)) == 0)) {
+         DEBUGC(DBCLASS_AUTH,"invalid nonce count / cnonce");
+         sts = STS_FAILURE;
+         goto auth_free;
+      }
+   }
+
+   if (configuration.proxy_auth_pwfile) {
+      /* precomputed from the password file, for our realm only */
+      if ((Realm == NULL) ||
+          (strcmp(Realm, configuration.proxy_auth_realm) != 0)) {
+         DEBUGC(DBCLASS_AUTH,"user [%s] used foreign realm [%s]",
+                Username, (Realm)?Realm:"*NULL*");
+         sts = STS_FAILURE;
+         goto auth_free;
+      }
+      ha1=auth_lookup(Username);
+      if (ha1 == NULL) {
+         DEBUGC(DBCLASS_AUTH,"user [%s] not in password file!", Username);
+         sts = STS_FAILURE;
+         goto auth_free;
+      }
+      memcpy(HA1, ha1, sizeof(HASHHEX));
+   } else if (configuration.proxy_auth_passwd) {
+      /* password from configuration */
+      DigestCalcHA1("MD5", Username, Realm, configuration.proxy_auth_passwd,
+                    Nonce, CNonce, HA1);
+   } else {
+      sts = STS_FAILURE;
+      goto auth_free;
    }
 
    DEBUGC(DBCLASS_BABBLE," username=\"%s\"",Username  );
@@ -242,110 +561,196 @@ static int auth_check(osip_proxy_authorization_t *proxy_auth) {
    DEBUGC(DBCLASS_BABBLE," response=\"%s\"",Response  );
 
    /* calculate the MD5 digest (heavily inspired from linphone code) */
-   DigestCalcHA1("MD5", Username, Realm, password, Nonce, CNonce, HA1);
    DigestCalcResponse(HA1, Nonce, NonceCount, CNonce, Qpop,
 		      "REGISTER", Uri, HA2, Lcl_Response);
 
    DEBUGC(DBCLASS_BABBLE,"calculated Response=\"%s\"", Lcl_Response);
 
    if (strcmp((char*)Lcl_Response, Response)==0) {
-      DEBUGC(DBCLASS_AUTH,"Authentication succeeded");
-      sts = STS_SUCCESS;
+      /* credentials are ok, but is the nonce still fresh? */
+      ttl=(configuration.proxy_auth_nonce_ttl > 0) ?
+          configuration.proxy_auth_nonce_ttl : AUTH_NONCE_TTL;
+      time(&now);
+
+      /* Call-ID and CSeq tell a retransmission from a replay */
+      req_hash=0;
+      cseq=0;
+      if (sipmsg->call_id) {
+         if (sipmsg->call_id->number) {
+            req_hash=auth_hash(sipmsg->call_id->number);
+         }
+         if (sipmsg->call_id->host) {
+            req_hash=(req_hash * 31) ^ auth_hash(sipmsg->call_id->host);
+         }
+      }
+      if (sipmsg->cseq && sipmsg->cseq->number) {
+         cseq=strtoul(sipmsg->cseq->number, NULL, 10);
+      }
+
+      if ((long)(now - nonce_ts) > ttl) {
+         DEBUGC(DBCLASS_AUTH,"Authentication with expired nonce");
+         sts = STS_STALE_AUTH;
+      } else if (auth_nc_check(nonce_ts, nonce_serial, nc, req_hash, cseq,
+                               now, ttl) != STS_SUCCESS) {
+         DEBUGC(DBCLASS_AUTH,"Authentication with reused nonce count %lu",
+                nc);
+         sts = STS_STALE_AUTH;
+      } else {
+         DEBUGC(DBCLASS_AUTH,"Authentication succeeded");
+         sts = STS_SUCCESS;
+      }
    } else {
       DEBUGC(DBCLASS_AUTH,"Authentication failed");
       sts = STS_FAILURE;
    }
 
    /* free allocated memory from above */
-   if (Username)   free(Username);
-   if (Realm)      free(Realm);
-   if (Nonce)      free(Nonce);
-   if (CNonce)     free(CNonce);
-   if (NonceCount) free(NonceCount);
-   if (Qpop)       free(Qpop);
-   if (Uri)        free(Uri);
-   if (Response)   free(Response);
+auth_free:
+   if (Username)   osip_free(Username);
+   if (Realm)      osip_free(Realm);
+   if (Nonce)      osip_free(Nonce);
+   if (CNonce)     osip_free(CNonce);
+   if (NonceCount) osip_free(NonceCount);
+   if (Qpop)       osip_free(Qpop);
+   if (Uri)        osip_free(Uri);
+   if (Response)   osip_free(Response);
 
    return sts;
 }
 
 
 /*
- * lookup in the password file and return
- * the user specific password for 'username'
+ * (re)load the password file into the credentials hash table. For
+ * every user H(A1) = MD5(username:realm:password) is stored, the
+ * plaintext passwords are not kept. Entries of the form
+ *   <username> ha1:<32 hex digits>
+ * hold a precomputed H(A1) (for proxy_auth_realm).
+ * On reload (reopen != 0), the file is opened again by its name
+ * (it may have been replaced). If this is not possible (e.g. outside
+ * of the chroot jail), the already open file is read again.
+ * The old table stays active if loading fails.
  *
  * RETURNS
- *	password for user or NULL if not found
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
  */
-static char *auth_getpwd(char *username) {
-   typedef struct {
-      char username[USERNAME_SIZE];
-      char password[PASSWORD_SIZE];
-   } auth_cache_t;
+int auth_load_pwfile(int reopen) {
+   char buff[USERNAME_SIZE+PASSWORD_SIZE+16];
+   char username[USERNAME_SIZE];
+   char password[PASSWORD_SIZE];
+   char *realm=configuration.proxy_auth_realm;
+   auth_entry_t *entries=NULL, *tmpptr;
+   int *buckets=NULL;
+   int size=0, count=0, nbuckets;
+   int i, h, lineno=0;
+   FILE *fp;
+
+   if (configuration.proxy_auth_pwfile == NULL) return STS_SUCCESS;
+
+   if (reopen) {
+      fp=fopen(configuration.proxy_auth_pwfile, "r");
+      if (fp) {
+         if (siproxd_passwordfile) fclose(siproxd_passwordfile);
+         siproxd_passwordfile=fp;
+      }
+   }
 
-   char buff[128];
-   int i;
-   static auth_cache_t *auth_cache=NULL;
-   void *tmpptr;
-   static int auth_cache_size=0;
-   static int auth_cache_count=0;
-
-   if (auth_cache==NULL) {
-      DEBUGC(DBCLASS_AUTH,"initialize password cache");
-
-      /* config file not found or unable to open for read */
-      if (siproxd_passwordfile==NULL) {
-         ERROR ("could not open password file: %s", strerror(errno));
-         return NULL;
+   /* config file not found or unable to open for read */
+   if (siproxd_passwordfile==NULL) {
+      ERROR("could not open password file %s",
+            configuration.proxy_auth_pwfile);
+      return STS_FAILURE;
+   }
+   rewind(siproxd_passwordfile);
+
+   while (fgets(buff,sizeof(buff),siproxd_passwordfile) != NULL) {
+      lineno++;
+      i=sscanf(buff,"%127s %127s", username, password);
+      /* empty lines, comments, incomplete entries */
+      if ((i < 1) || (username[0] == '#')) continue;
+      if (i != 2) {
+         WARN("password file, line %i: no password for user %s",
+              lineno, username);
+         continue;
+      }
+
+      /* allocate space whenever needed */
+      if (count >= size) {
+         size=(size)? size*2 : AUTH_PW_GROW;
+         tmpptr=realloc(entries, size*sizeof(auth_entry_t));
+         if (tmpptr == NULL) {
+            ERROR("realloc failed! this is not good");
+            free(entries);
+            memset(password, 0, sizeof(password));
+            return STS_FAILURE;
+         }
+         entries=tmpptr;
       }
-      
-      rewind(siproxd_passwordfile);
-
-      while (fgets(buff,sizeof(buff),siproxd_passwordfile) != NULL) {
-         /* life insurance */
-         buff[sizeof(buff)-1]='\0';
-
-	 /* strip newline if present */
-	 if (buff[strlen(buff)-1]=='\n') buff[strlen(buff)-1]='\0';
-
-	 /* strip emty lines */
-	 if (strlen(buff) == 0) continue;
-
-	 /* strip comments and line with only whitespaces */
-	 for (i=0;i<strlen(buff);i++) {
-            if ((buff[i] == ' ') || (buff[i] == '\t')) continue;
-            if (buff[i] =='#') i=strlen(buff);
-            break;
-	 }
-	 if (i == strlen(buff)) continue;
-
-         /* allocate space whenever needed */
-	 if (auth_cache_count >= auth_cache_size) {
-	    auth_cache_size+=10;
-	    tmpptr=realloc(auth_cache, auth_cache_size*sizeof(auth_cache_t));
-            if (tmpptr != NULL) {
-               auth_cache= (auth_cache_t *)tmpptr;
-	    } else {
-               ERROR("realloc failed! this is not good");
-	       auth_cache_size-=10;
-	       return NULL;
-	    }
-         } /* cnt > size */
-
-         i=sscanf(buff,"%127s %127s",auth_cache[auth_cache_count].username,
-	                       auth_cache[auth_cache_count].password);
-         /* if I got username & passwd, make it valid and increment counter */
-         if (i == 2) auth_cache_count++;
+
+      strcpy(entries[count].username, username);
+      if ((strncasecmp(password, "ha1:", 4) == 0) &&
+          (strlen(password) == 4+HASHHEXLEN) &&
+          (strspn(password+4, "0123456789abcdefABCDEF") == HASHHEXLEN)) {
+         /* precomputed */
+         for (i=0; i<=HASHHEXLEN; i++) {
+            entries[count].ha1[i]=tolower((int)password[4+i]);
+         }
+      } else {
+         DigestCalcHA1("MD5", username, realm, password, NULL, NULL,
+                       entries[count].ha1);
       }
+      count++;
+   }
+   /* no plaintext passwords left on the stack */
+   memset(buff, 0, sizeof(buff));
+   memset(password, 0, sizeof(password));
+
+   /* hash table, first entry of a username wins */
+   for (nbuckets=AUTH_PW_GROW; nbuckets < count; nbuckets <<= 1);
+   buckets=malloc(nbuckets * sizeof(int));
+   if (buckets == NULL) {
+      ERROR("malloc failed! this is not good");
+      free(entries);
+      return STS_FAILURE;
+   }
+   for (i=0; i<nbuckets; i++) buckets[i]=-1;
+   for (i=count-1; i>=0; i--) {
+      h=auth_hash(entries[i].username) & (nbuckets-1);
+      entries[i].next=buckets[h];
+      buckets[h]=i;
+   }
+
+   /* activate */
+   free(auth_pw.entries);
+   free(auth_pw.buckets);
+   auth_pw.entries=entries;
+   auth_pw.buckets=buckets;
+   auth_pw.nbuckets=nbuckets;
+   auth_pw.count=count;
+
+   INFO("loaded %i accounts from password file %s", count,
+        configuration.proxy_auth_pwfile);
+   return STS_SUCCESS;
+}
 
-   } /* initialize cache */
 
-   /* search cache for user */
+/*
+ * lookup the H(A1) of 'username' in the credentials table
+ *
+ * RETURNS
+ *	H(A1) of the user or NULL if not found
+ */
+static unsigned char *auth_lookup(char *username) {
+   int i;
+
+   if (auth_pw.count == 0) return NULL;
+
    DEBUGC(DBCLASS_AUTH,"searching password entry for user %s",username);
-   for (i=0; i< auth_cache_count;i++) {
-      if (strcmp(username, auth_cache[i].username)==0) {
+   for (i=auth_pw.buckets[auth_hash(username) & (auth_pw.nbuckets-1)];
+        i >= 0; i=auth_pw.entries[i].next) {
+      if (strcmp(username, auth_pw.entries[i].username)==0) {
          DEBUGC(DBCLASS_AUTH,"found password entry for user %s",username);
-         return auth_cache[i].password;
+         return auth_pw.entries[i].ha1;
       }
    }
 
@@ -354,6 +759,20 @@ static char *auth_getpwd(char *username) {
 }
 
 
+/*
+ * hash of a username (FNV-1a)
+ */
+static unsigned int auth_hash(char *username) {
+   unsigned int h=2166136261U;
+
+   while (*username) {
+      h ^= (unsigned char)*username++;
+      h *= 16777619U;
+   }
+   return h;
+}
+
+
 /*-------------------------------------------------------------------------
   -------------------------------------------------------------------------
   The routines below have been taken from linphone
@@ -468,8 +887,11 @@ void DigestCalcResponse(
 
  auth_withqop:
 
-  osip_MD5Update(&Md5Ctx, (unsigned char*)":", 1);
-  osip_MD5Update(&Md5Ctx, HEntity, HASHHEXLEN);
+  /* H(entity body) only for qop="auth-int" (RFC2617, 3.2.2.3) */
+  if (strcasecmp(pszQop, "auth-int") == 0) {
+    osip_MD5Update(&Md5Ctx, (unsigned char*)":", 1);
+    osip_MD5Update(&Md5Ctx, HEntity, HASHHEXLEN);
+  }
   osip_MD5Final(HA2, &Md5Ctx);
   CvtHex(HA2, HA2Hex);
 
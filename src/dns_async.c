@@ -0,0 +1,854 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+extern struct urlmap_s *urlmap;		/* URL mapping table     */
+extern int urlmap_size;
+
+/*
+ * Asynchronous DNS resolution
+ *
+ * Names are resolved by a pool of resolver threads (dns_threads),
+ * the SIP thread never waits for the resolver. Lookups of the same
+ * name are merged into one. A resolver thread signals a completed
+ * lookup through a pipe that is part of the select() in
+ * sipsock_waitfordata(), the result is then stored into the DNS
+ * cache by the SIP thread.
+ *
+ * Before a received message is processed, the names it will need
+ * (next hop and Request-URI of a request, Route and Record-Route,
+ * Via, To and From hosts, outbound host and proxy, SDP connection
+ * addresses, Contacts of a REGISTER) are checked against the DNS
+ * cache. If one is unknown, the raw message is parked and the
+ * lookups are started. Once all of them have completed, the message
+ * is delivered again by sipsock_waitfordata() and processed from the
+ * beginning - now with the names in the cache. The next hop may need
+ * several rounds (NAPTR, SRV, A of the target), a message is parked
+ * at most DNS_PARK_ROUNDS times.
+ *
+ * Names that are not taken from the message (outbound host and
+ * proxies, hosts of registered clients, names registered by
+ * dns_async_keep() like ACL hostnames or the STUN server) are
+ * resolved at startup and refreshed before they expire
+ * (dns_async_refresh()), so they are always in the cache.
+ *
+ * Any other name that is not in the cache (get_ip_by_host()) fails
+ * immediately and is looked up in the background.
+ */
+
+/* lookup states */
+#define DNS_LOOKUP_FREE		0
+#define DNS_LOOKUP_QUEUED	1
+#define DNS_LOOKUP_RUNNING	2
+#define DNS_LOOKUP_DONE		3
+
+/* lookups, shared with the resolver threads */
+static struct {
+   int state;
+   int type;				/* DNS_QUERY_* */
+   int found;				/* A: resolved, else number of rr */
+   struct in_addr addr;
+   dns_srv_t rr[DNS_SRV_RECORDS];
+   int ttl;
+   char hostname[HOSTNAME_SIZE+1];
+} dns_lookup[DNS_ASYNC_MAX];
+
+static pthread_mutex_t dns_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond=PTHREAD_COND_INITIALIZER;
+static int dns_pipe[2]={-1, -1};	/* completion signal */
+
+/* parked messages, only used by the SIP thread */
+static struct {
+   char *buf;				/* raw message, NULL=free */
+   size_t len;
+   struct sockaddr_in from;
+   int protocol;
+   time_t timestamp;
+   unsigned long seq;			/* order of parking */
+   int rounds;				/* times parked */
+   int waiting;				/* number of names pending */
+   int types[DNS_PARK_NAMES];
+   char *names[DNS_PARK_NAMES];
+} dns_park[DNS_PARK_SIZE];
+
+static int dns_park_used=0;
+static int dns_park_ready=0;
+static unsigned long dns_park_seq=0;
+static int dns_resumed=0;		/* times current message was parked */
+
+/* names kept resolved, see dns_async_keep() */
+static char *dns_keep[DNS_KEEP_SIZE];
+static int dns_keep_used=0;
+
+/* statistics */
+static dns_async_stats_t dns_stats;
+
+/* local prototypes */
+static void *dns_async_main(void *arg);
+static int dns_async_need(int type, char *hostname,
+                          int *types, char **names, int n);
+static void dns_async_wakeup(int type, char *hostname);
+static void dns_async_unpark(int i);
+static char *dns_async_outbound(osip_message_t *sipmsg);
+static int dns_async_sdp(osip_message_t *sipmsg,
+                         int *types, char **names, int n);
+static int dns_async_due(char *hostname);
+
+
+/*
+ * start the resolver threads
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int dns_async_init(int threads) {
+   int i, sts;
+   pthread_t tid;
+   pthread_attr_t attr;
+
+   memset(dns_lookup, 0, sizeof(dns_lookup));
+   memset(dns_park, 0, sizeof(dns_park));
+   memset(&dns_stats, 0, sizeof(dns_stats));
+
+   if (threads <= 0) {
+      DEBUGC(DBCLASS_DNS, "asynchronous DNS resolution disabled");
+      return STS_SUCCESS;
+   }
+
+   if (pipe(dns_pipe) != 0) {
+      ERROR("unable to create DNS completion pipe: %s", strerror(errno));
+      return STS_FAILURE;
+   }
+   fcntl(dns_pipe[0], F_SETFL, fcntl(dns_pipe[0], F_GETFL) | O_NONBLOCK);
+   fcntl(dns_pipe[1], F_SETFL, fcntl(dns_pipe[1], F_GETFL) | O_NONBLOCK);
+
+   /* thread stack size as for the RTP thread (thread_stack_size) */
+   pthread_attr_init(&attr);
+   if (configuration.thread_stack_size > 0) {
+      pthread_attr_setstacksize(&attr, configuration.thread_stack_size*1024);
+   }
+   for (i=0; i<threads; i++) {
+      sts=pthread_create(&tid, &attr, dns_async_main, NULL);
+      if (sts != 0) {
+         ERROR("unable to start DNS resolver thread: %s", strerror(sts));
+         break;
+      }
+      pthread_detach(tid);
+   }
+   pthread_attr_destroy(&attr);
+
+   if (i == 0) {
+      close(dns_pipe[0]);
+      close(dns_pipe[1]);
+      dns_pipe[0]=-1;
+      dns_pipe[1]=-1;
+      return STS_FAILURE;
+   }
+
+   DEBUGC(DBCLASS_DNS, "started %i DNS resolver threads", i);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * is the asynchronous resolution running
+ *
+ * RETURNS
+ *	STS_TRUE if running
+ *	STS_FALSE if not
+ */
+int dns_async_running(void) {
+   return (dns_pipe[0] >= 0) ? STS_TRUE : STS_FALSE;
+}
+
+
+/*
+ * file descriptor to be included in select(), readable when
+ * lookups have completed
+ *
+ * RETURNS
+ *	file descriptor, -1 if not running
+ */
+int dns_async_fd(void) {
+   return dns_pipe[0];
+}
+
+
+/*
+ * start the lookup of the A record of a hostname
+ *
+ * RETURNS
+ *	STS_SUCCESS if the lookup is in progress
+ *	STS_FAILURE if not running or too many lookups in progress
+ */
+int dns_async_lookup(char *hostname) {
+   return dns_async_query(DNS_QUERY_A, hostname);
+}
+
+
+/*
+ * start a lookup (DNS_QUERY_A, _SRV or _NAPTR). If the same lookup
+ * is already in progress, the request is merged.
+ *
+ * RETURNS
+ *	STS_SUCCESS if the lookup is in progress
+ *	STS_FAILURE if not running or too many lookups in progress
+ */
+int dns_async_query(int type, char *hostname) {
+   int i, free_slot=-1;
+
+   if ((dns_async_running() != STS_TRUE) || (hostname == NULL)) {
+      return STS_FAILURE;
+   }
+
+   pthread_mutex_lock(&dns_mutex);
+   for (i=0; i<DNS_ASYNC_MAX; i++) {
+      if (dns_lookup[i].state == DNS_LOOKUP_FREE) {
+         if (free_slot < 0) free_slot=i;
+         continue;
+      }
+      if ((dns_lookup[i].type == type) &&
+          (strcasecmp(dns_lookup[i].hostname, hostname) == 0)) {
+         pthread_mutex_unlock(&dns_mutex);
+         dns_stats.merged++;
+         return STS_SUCCESS;
+      }
+   }
+
+   if (free_slot < 0) {
+      pthread_mutex_unlock(&dns_mutex);
+      DEBUGC(DBCLASS_DNS, "too many DNS lookups in progress, "
+             "not resolving %s", hostname);
+      dns_stats.full++;
+      return STS_FAILURE;
+   }
+
+   strncpy(dns_lookup[free_slot].hostname, hostname, HOSTNAME_SIZE);
+   dns_lookup[free_slot].hostname[HOSTNAME_SIZE]='\0';
+   dns_lookup[free_slot].type=type;
+   dns_lookup[free_slot].state=DNS_LOOKUP_QUEUED;
+   pthread_cond_signal(&dns_cond);
+   pthread_mutex_unlock(&dns_mutex);
+
+   DEBUGC(DBCLASS_DNS, "started DNS lookup of %s (type %i)", hostname, type);
+   dns_stats.lookups++;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * process the completed lookups: store them into the DNS cache and
+ * release the parked messages that have been waiting for them.
+ * To be called when dns_async_fd() is readable.
+ *
+ * RETURNS: -
+ */
+void dns_async_complete(void) {
+   int i, type, found, ttl;
+   char buf[64];
+   char hostname[HOSTNAME_SIZE+1];
+   struct in_addr addr;
+   dns_srv_t rr[DNS_SRV_RECORDS];
+
+   if (dns_async_running() != STS_TRUE) return;
+
+   /* drain the pipe */
+   while (read(dns_pipe[0], buf, sizeof(buf)) > 0);
+
+   for (i=0; i<DNS_ASYNC_MAX; i++) {
+      pthread_mutex_lock(&dns_mutex);
+      if (dns_lookup[i].state != DNS_LOOKUP_DONE) {
+         pthread_mutex_unlock(&dns_mutex);
+         continue;
+      }
+      memcpy(hostname, dns_lookup[i].hostname, sizeof(hostname));
+      memcpy(&addr, &dns_lookup[i].addr, sizeof(addr));
+      memcpy(rr, dns_lookup[i].rr, sizeof(rr));
+      type=dns_lookup[i].type;
+      found=dns_lookup[i].found;
+      ttl=dns_lookup[i].ttl;
+      dns_lookup[i].state=DNS_LOOKUP_FREE;
+      pthread_mutex_unlock(&dns_mutex);
+
+      if (type == DNS_QUERY_A) {
+         DEBUGC(DBCLASS_DNS, "DNS lookup of %s completed: %s", hostname,
+                (found) ? utils_inet_ntoa(addr) : "failed");
+         dns_cache_store(hostname, (found) ? &addr : NULL, ttl);
+      } else {
+         DEBUGC(DBCLASS_DNS, "DNS lookup of %s (type %i) completed: "
+                "%i records", hostname, type, found);
+         dns_srv_store(type, hostname, rr, found, ttl);
+      }
+      dns_async_wakeup(type, hostname);
+   }
+}
+
+
+/*
+ * check if the names required to process a message are in the
+ * DNS cache. If not, the message is parked until the lookups have
+ * completed.
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message can be processed
+ *	STS_FAILURE if the message has been parked (or dropped)
+ */
+int dns_async_park(sip_ticket_t *ticket) {
+   osip_message_t *sipmsg=ticket->sipmsg;
+   osip_route_t *route=NULL;
+   osip_record_route_t *rr;
+   osip_contact_t *contact;
+   osip_via_t *via;
+   osip_uri_t *url=NULL;
+   char *outbound;
+   char *names[DNS_PARK_NAMES];
+   int types[DNS_PARK_NAMES];
+   char name[HOSTNAME_SIZE+1];
+   int i, k, n=0, type;
+
+   if (dns_async_running() != STS_TRUE) return STS_SUCCESS;
+
+   /* a resumed message is parked again only for the next step of
+    * its next hop resolution, and only DNS_PARK_ROUNDS times */
+   if (dns_resumed >= DNS_PARK_ROUNDS) return STS_SUCCESS;
+
+   /* collect the names that have to be resolved */
+   if (MSG_IS_REQUEST(sipmsg)) {
+      /* next hop: topmost Route or Request-URI. An outbound proxy
+       * makes the SRV lookup of the Request-URI unnecessary. */
+      route=(osip_route_t *) osip_list_get(&(sipmsg->routes), 0);
+      if (route && route->url) {
+         url=route->url;
+      } else if (sipmsg->req_uri) {
+         url=sipmsg->req_uri;
+      }
+      outbound=dns_async_outbound(sipmsg);
+      if (url && (dns_resumed == 0)) {
+         n=dns_async_need(DNS_QUERY_A, url->host, types, names, n);
+      }
+      if (url && (route || (outbound == NULL)) &&
+          (dns_srv_pending(url->host, url->port, ticket->protocol,
+                           &type, name, sizeof(name)) == STS_TRUE)) {
+         n=dns_async_need(type, name, types, names, n);
+      }
+
+      if (dns_resumed == 0) {
+         if (sipmsg->req_uri) {
+            n=dns_async_need(DNS_QUERY_A, sipmsg->req_uri->host,
+                             types, names, n);
+         }
+         n=dns_async_need(DNS_QUERY_A, outbound, types, names, n);
+
+         /* a REGISTER: the Contacts become the registered hosts */
+         if (MSG_IS_REGISTER(sipmsg)) {
+            for (k=0; (contact=(osip_contact_t *)
+                       osip_list_get(&(sipmsg->contacts), k)) != NULL; k++) {
+               if (contact->url) {
+                  n=dns_async_need(DNS_QUERY_A, contact->url->host,
+                                   types, names, n);
+               }
+            }
+         }
+      }
+   }
+
+   /* everything else is needed only the first time */
+   if (dns_resumed == 0) {
+      for (k=0; k<2; k++) {
+         via=(osip_via_t *) osip_list_get(&(sipmsg->vias), k);
+         if (via) n=dns_async_need(DNS_QUERY_A, via->host, types, names, n);
+      }
+      if (sipmsg->to && sipmsg->to->url) {
+         n=dns_async_need(DNS_QUERY_A, sipmsg->to->url->host,
+                          types, names, n);
+      }
+      if (sipmsg->from && sipmsg->from->url) {
+         n=dns_async_need(DNS_QUERY_A, sipmsg->from->url->host,
+                          types, names, n);
+      }
+      for (k=0; (route=(osip_route_t *)
+                 osip_list_get(&(sipmsg->routes), k)) != NULL; k++) {
+         if (route->url) {
+            n=dns_async_need(DNS_QUERY_A, route->url->host,
+                             types, names, n);
+         }
+      }
+      for (k=0; (rr=(osip_record_route_t *)
+                 osip_list_get(&(sipmsg->record_routes), k)) != NULL; k++) {
+         if (rr->url) {
+            n=dns_async_need(DNS_QUERY_A, rr->url->host, types, names, n);
+         }
+      }
+      n=dns_async_need(DNS_QUERY_A, configuration.outbound_host,
+                       types, names, n);
+      n=dns_async_sdp(sipmsg, types, names, n);
+   }
+
+   if (n == 0) return STS_SUCCESS;
+
+   /* a retransmission of a message already parked is dropped */
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if ((dns_park[i].buf != NULL) &&
+          (dns_park[i].len == ticket->raw_buffer_len) &&
+          (dns_park[i].protocol == ticket->protocol) &&
+          (memcmp(&dns_park[i].from, &ticket->from,
+                  sizeof(struct sockaddr_in)) == 0) &&
+          (memcmp(dns_park[i].buf, ticket->raw_buffer,
+                  ticket->raw_buffer_len) == 0)) {
+         DEBUGC(DBCLASS_DNS, "retransmission of parked message dropped");
+         for (k=0; k<n; k++) free(names[k]);
+         dns_stats.dropped++;
+         return STS_FAILURE;
+      }
+   }
+
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if (dns_park[i].buf == NULL) break;
+   }
+   if (i >= DNS_PARK_SIZE) {
+      /* no room, process it without waiting */
+      DEBUGC(DBCLASS_DNS, "DNS park full, processing message anyway");
+      for (k=0; k<n; k++) free(names[k]);
+      dns_stats.full++;
+      return STS_SUCCESS;
+   }
+
+   /* start the lookups */
+   for (k=0; k<n; k++) {
+      if (dns_async_query(types[k], names[k]) != STS_SUCCESS) break;
+   }
+   if (k < n) {
+      for (k=0; k<n; k++) free(names[k]);
+      return STS_SUCCESS;
+   }
+
+   dns_park[i].buf=malloc(ticket->raw_buffer_len);
+   if (dns_park[i].buf == NULL) {
+      for (k=0; k<n; k++) free(names[k]);
+      return STS_SUCCESS;
+   }
+   memcpy(dns_park[i].buf, ticket->raw_buffer, ticket->raw_buffer_len);
+   dns_park[i].len=ticket->raw_buffer_len;
+   memcpy(&dns_park[i].from, &ticket->from, sizeof(struct sockaddr_in));
+   dns_park[i].protocol=ticket->protocol;
+   dns_park[i].timestamp=ticket->timestamp;
+   dns_park[i].seq=dns_park_seq++;
+   dns_park[i].rounds=dns_resumed+1;
+   dns_park[i].waiting=n;
+   for (k=0; k<DNS_PARK_NAMES; k++) {
+      dns_park[i].types[k]=(k < n) ? types[k] : 0;
+      dns_park[i].names[k]=(k < n) ? names[k] : NULL;
+   }
+   dns_park_used++;
+   dns_stats.parked++;
+
+   DEBUGC(DBCLASS_DNS, "parked message from %s:%i, waiting for %i lookups",
+          utils_inet_ntoa(ticket->from.sin_addr),
+          ntohs(ticket->from.sin_port), n);
+   return STS_FAILURE;
+}
+
+
+/*
+ * get the next parked message whose lookups have completed,
+ * to be called before every other message is received
+ *
+ * RETURNS
+ *	length of the message copied to buf, 0 if none is ready
+ */
+int dns_async_resume(char *buf, size_t bufsize,
+                     struct sockaddr_in *from, int *protocol) {
+   int i, oldest=-1;
+   size_t len;
+
+   dns_resumed=0;
+   if (dns_park_ready <= 0) return 0;
+
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if ((dns_park[i].buf == NULL) || (dns_park[i].waiting > 0)) continue;
+      if ((oldest < 0) || (dns_park[i].seq < dns_park[oldest].seq)) {
+         oldest=i;
+      }
+   }
+   if (oldest < 0) {
+      dns_park_ready=0;
+      return 0;
+   }
+
+   i=oldest;
+   len=dns_park[i].len;
+   if (len > bufsize) len=bufsize;
+   memcpy(buf, dns_park[i].buf, len);
+   memcpy(from, &dns_park[i].from, sizeof(struct sockaddr_in));
+   *protocol=dns_park[i].protocol;
+
+   DEBUGC(DBCLASS_DNS, "resuming parked message from %s:%i",
+          utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+   dns_park_ready--;
+   dns_resumed=dns_park[i].rounds;
+   dns_stats.resumed++;
+   dns_async_unpark(i);
+   return (int)len;
+}
+
+
+/*
+ * is the message being processed a resumed, parked one
+ *
+ * RETURNS
+ *	STS_TRUE if it is
+ *	STS_FALSE if not
+ */
+int dns_async_resumed(void) {
+   return (dns_resumed > 0) ? STS_TRUE : STS_FALSE;
+}
+
+
+/*
+ * drop parked messages that have been waiting too long
+ *
+ * RETURNS: -
+ */
+void dns_async_expire(void) {
+   int i;
+   time_t t;
+
+   if (dns_park_used <= 0) return;
+
+   time(&t);
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if (dns_park[i].buf == NULL) continue;
+      if (dns_park[i].timestamp + DNS_PARK_TIMEOUT >= t) continue;
+      DEBUGC(DBCLASS_DNS, "parked message from %s:%i timed out",
+             utils_inet_ntoa(dns_park[i].from.sin_addr),
+             ntohs(dns_park[i].from.sin_port));
+      if (dns_park[i].waiting == 0) dns_park_ready--;
+      dns_stats.dropped++;
+      dns_async_unpark(i);
+   }
+}
+
+
+/*
+ * keep a name resolved: it is looked up at startup and refreshed
+ * before it expires by dns_async_refresh(). For names used outside
+ * of the message processing (e.g. ACL hostnames, STUN server).
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if too many names are kept
+ */
+int dns_async_keep(char *hostname) {
+   struct in_addr addr;
+   int i;
+
+   if ((hostname == NULL) || (hostname[0] == '\0')) return STS_SUCCESS;
+   if (strlen(hostname) > HOSTNAME_SIZE) return STS_FAILURE;
+   if (utils_inet_aton(hostname, &addr) > 0) return STS_SUCCESS;
+
+   for (i=0; i<dns_keep_used; i++) {
+      if (strcasecmp(dns_keep[i], hostname) == 0) return STS_SUCCESS;
+   }
+   if (dns_keep_used >= DNS_KEEP_SIZE) {
+      WARN("too many hostnames to keep resolved, not keeping %s", hostname);
+      return STS_FAILURE;
+   }
+   dns_keep[dns_keep_used]=strdup(hostname);
+   if (dns_keep[dns_keep_used] == NULL) return STS_FAILURE;
+   dns_keep_used++;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * start the lookups of the names that are kept resolved: outbound
+ * host and proxies, hosts of the registered clients and the names
+ * of dns_async_keep(), if they are not in the DNS cache, failed or
+ * expire soon. To be called at startup and then at least every
+ * DNS_PREFETCH_TIME/2 seconds.
+ *
+ * RETURNS: -
+ */
+void dns_async_refresh(void) {
+   int i;
+
+   if (dns_async_running() != STS_TRUE) return;
+
+   /* stop if no more lookups can be started */
+   if (dns_async_due(configuration.outbound_host) != STS_SUCCESS) return;
+   if (dns_async_due(configuration.outbound_proxy_host) != STS_SUCCESS) return;
+   for (i=0; i<configuration.outbound_proxy_domain_host.used; i++) {
+      if (dns_async_due(configuration.outbound_proxy_domain_host.string[i])
+          != STS_SUCCESS) return;
+   }
+   for (i=0; i<dns_keep_used; i++) {
+      if (dns_async_due(dns_keep[i]) != STS_SUCCESS) return;
+   }
+   for (i=0; i<urlmap_size; i++) {
+      if ((urlmap[i].active == 0) || (urlmap[i].true_url == NULL)) continue;
+      if (dns_async_due(urlmap[i].true_url->host) != STS_SUCCESS) return;
+   }
+}
+
+
+/*
+ * get the asynchronous resolver statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not running
+ */
+int dns_async_get_stats(dns_async_stats_t *stats) {
+   int i;
+
+   if ((dns_async_running() != STS_TRUE) || (stats == NULL)) {
+      return STS_FAILURE;
+   }
+   memcpy(stats, &dns_stats, sizeof(dns_async_stats_t));
+   stats->pending=0;
+   pthread_mutex_lock(&dns_mutex);
+   for (i=0; i<DNS_ASYNC_MAX; i++) {
+      if (dns_lookup[i].state != DNS_LOOKUP_FREE) stats->pending++;
+   }
+   pthread_mutex_unlock(&dns_mutex);
+   stats->waiting=dns_park_used;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * resolver thread
+ */
+static void *dns_async_main(void *arg) {
+   int i, sts, ttl, type, found;
+   char hostname[HOSTNAME_SIZE+1];
+   struct in_addr addr;
+   dns_srv_t rr[DNS_SRV_RECORDS];
+
+   pthread_mutex_lock(&dns_mutex);
+   for (;;) {
+      for (i=0; i<DNS_ASYNC_MAX; i++) {
+         if (dns_lookup[i].state == DNS_LOOKUP_QUEUED) break;
+      }
+      if (i >= DNS_ASYNC_MAX) {
+         pthread_cond_wait(&dns_cond, &dns_mutex);
+         continue;
+      }
+
+      dns_lookup[i].state=DNS_LOOKUP_RUNNING;
+      memcpy(hostname, dns_lookup[i].hostname, sizeof(hostname));
+      type=dns_lookup[i].type;
+      memset(&addr, 0, sizeof(addr));
+      pthread_mutex_unlock(&dns_mutex);
+
+      switch (type) {
+      case DNS_QUERY_SRV:
+         found=resolve_SRV_records(hostname, rr, DNS_SRV_RECORDS, &ttl);
+         break;
+      case DNS_QUERY_NAPTR:
+         found=resolve_NAPTR_records(hostname, rr, DNS_SRV_RECORDS, &ttl);
+         break;
+      default:
+         sts=dns_resolve_host(hostname, &addr, &ttl);
+         found=(sts == STS_SUCCESS);
+         break;
+      }
+
+      pthread_mutex_lock(&dns_mutex);
+      dns_lookup[i].found=found;
+      memcpy(&dns_lookup[i].addr, &addr, sizeof(addr));
+      if (type != DNS_QUERY_A) {
+         memcpy(dns_lookup[i].rr, rr, sizeof(rr));
+      }
+      dns_lookup[i].ttl=ttl;
+      dns_lookup[i].state=DNS_LOOKUP_DONE;
+
+      /* the pipe may be full, then a wakeup is pending anyway */
+      if (write(dns_pipe[1], "", 1) < 0) {};
+   }
+   /* not reached */
+   return NULL;
+}
+
+
+/*
+ * add a name to the list of names to resolve, if an A record is
+ * not known to the DNS cache. NAPTR and SRV lookups are always added
+ * (see dns_srv_pending()).
+ *
+ * RETURNS
+ *	new number of names in the list
+ */
+static int dns_async_need(int type, char *hostname,
+                          int *types, char **names, int n) {
+   int i;
+
+   if ((hostname == NULL) || (hostname[0] == '\0')) return n;
+   if (n >= DNS_PARK_NAMES) return n;
+   if (strlen(hostname) > HOSTNAME_SIZE) return n;
+   if ((type == DNS_QUERY_A) &&
+       (dns_cache_known(hostname) == STS_TRUE)) return n;
+
+   for (i=0; i<n; i++) {
+      if ((types[i] == type) &&
+          (strcasecmp(names[i], hostname) == 0)) return n;
+   }
+   names[n]=strdup(hostname);
+   if (names[n] == NULL) return n;
+   types[n]=type;
+   return n+1;
+}
+
+
+/*
+ * outbound proxy used for a request: the one for the From domain
+ * (outbound_domain_name) or outbound_proxy_host, as chosen by
+ * sip_find_outbound_proxy()
+ *
+ * RETURNS
+ *	hostname of the outbound proxy, NULL if none is used
+ */
+static char *dns_async_outbound(osip_message_t *sipmsg) {
+   int i;
+
+   if (sipmsg->from && sipmsg->from->url && sipmsg->from->url->host &&
+       (configuration.outbound_proxy_domain_name.used ==
+        configuration.outbound_proxy_domain_host.used)) {
+      for (i=0; i<configuration.outbound_proxy_domain_name.used; i++) {
+         if (strcasecmp(configuration.outbound_proxy_domain_name.string[i],
+                        sipmsg->from->url->host) == 0) {
+            return configuration.outbound_proxy_domain_host.string[i];
+         }
+      }
+   }
+   return configuration.outbound_proxy_host;
+}
+
+
+/*
+ * add the hostnames of the SDP connection lines (c=IN IP4 host)
+ * to the list of names to resolve
+ *
+ * RETURNS
+ *	new number of names in the list
+ */
+static int dns_async_sdp(osip_message_t *sipmsg,
+                         int *types, char **names, int n) {
+   osip_body_t *body=NULL;
+   char host[HOSTNAME_SIZE+1];
+   char *p;
+   size_t len;
+
+   if ((osip_message_get_body(sipmsg, 0, &body) != 0) ||
+       (body == NULL) || (body->body == NULL)) return n;
+
+   for (p=body->body; p != NULL; p=strchr(p, '\n')) {
+      if (*p == '\n') p++;
+      if (strncmp(p, "c=IN IP4 ", 9) != 0) continue;
+      p+=9;
+      len=strcspn(p, "/ \t\r\n");
+      if ((len == 0) || (len > HOSTNAME_SIZE)) continue;
+      memcpy(host, p, len);
+      host[len]='\0';
+      n=dns_async_need(DNS_QUERY_A, host, types, names, n);
+   }
+   return n;
+}
+
+
+/*
+ * start the lookup of a name that is kept resolved, if it is due
+ *
+ * RETURNS
+ *	STS_SUCCESS if started or not due
+ *	STS_FAILURE if too many lookups are in progress
+ */
+static int dns_async_due(char *hostname) {
+   if (dns_cache_due(hostname) != STS_TRUE) return STS_SUCCESS;
+   DEBUGC(DBCLASS_DNS, "refreshing %s", hostname);
+   return dns_async_lookup(hostname);
+}
+
+
+/*
+ * a lookup has completed, release the parked messages that have
+ * been waiting for it
+ */
+static void dns_async_wakeup(int type, char *hostname) {
+   int i, k;
+
+   if (dns_park_used <= 0) return;
+
+   for (i=0; i<DNS_PARK_SIZE; i++) {
+      if ((dns_park[i].buf == NULL) || (dns_park[i].waiting == 0)) continue;
+      for (k=0; k<DNS_PARK_NAMES; k++) {
+         if (dns_park[i].names[k] == NULL) continue;
+         if (dns_park[i].types[k] != type) continue;
+         if (strcasecmp(dns_park[i].names[k], hostname) != 0) continue;
+         free(dns_park[i].names[k]);
+         dns_park[i].names[k]=NULL;
+         dns_park[i].waiting--;
+         if (dns_park[i].waiting == 0) dns_park_ready++;
+      }
+   }
+}
+
+
+/*
+ * free a parked message
+ */
+static void dns_async_unpark(int i) {
+   int k;
+
+   free(dns_park[i].buf);
+   dns_park[i].buf=NULL;
+   for (k=0; k<DNS_PARK_NAMES; k++) {
+      free(dns_park[i].names[k]);
+      dns_park[i].names[k]=NULL;
+   }
+   dns_park[i].waiting=0;
+   dns_park_used--;
+}
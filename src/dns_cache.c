@@ -0,0 +1,449 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * DNS cache
+ *
+ * Hash table of resolved hostnames (dns_cache_size entries), only
+ * used by the SIP thread. Each entry lives as long as the TTL of
+ * its DNS record. Names that do not exist are cached for
+ * dns_negative_ttl seconds, other failures are retried up to
+ * DNS_ATTEMPTS times before the name is blacklisted for DNS_BAD_AGE.
+ *
+ * Entries are expired lazily, when a lookup comes across them. If
+ * the table is full, the least recently used entry is replaced.
+ * With the asynchronous resolver running, expired good entries are
+ * served for another DNS_STALE_AGE seconds while they are refreshed
+ * in the background. Entries that are used frequently are refreshed
+ * shortly before they expire (prefetch).
+ */
+
+static struct {
+   char hostname[HOSTNAME_SIZE+1];	/* empty = free */
+   struct in_addr addr;		/* IP address or 0.0.0.0 if a bad entry */
+   time_t expires_timestamp;	/* time of expiration */
+   char   error_count;		/* counts failed resolution attempts */
+   char   bad_entry;		/* != 0 if resolving failed */
+   char   refreshing;		/* prefetch started */
+   unsigned int hits;		/* uses since stored */
+   int hash_next;		/* hash chain / free list, -1=end */
+   int lru_prev;		/* LRU list, more recently used */
+   int lru_next;		/* LRU list, less recently used */
+} *dns_cache=NULL;
+
+static int dns_cache_size=0;
+static int *dns_hash=NULL;
+static unsigned int dns_hash_size=0;	/* power of 2 */
+static int dns_free=-1;			/* free list */
+static int dns_lru_head=-1;		/* most recently used */
+static int dns_lru_tail=-1;		/* least recently used */
+static int dns_entries=0;
+
+/* statistics */
+static dns_cache_stats_t dns_cache_stats;
+
+/* local prototypes */
+static unsigned int dns_cache_hash(char *hostname);
+static int dns_cache_find(char *hostname, time_t now, int *state);
+static void dns_cache_remove(int i);
+static void dns_lru_unlink(int i);
+static void dns_lru_push(int i);
+
+
+/*
+ * initialize the DNS cache
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int dns_cache_init(int size) {
+   int i;
+
+   if (dns_cache) return STS_SUCCESS;
+
+   if (size <= 0) size=DNS_CACHE_SIZE;
+   for (dns_hash_size=1; dns_hash_size < (unsigned int)size; ) {
+      dns_hash_size <<= 1;
+   }
+
+   dns_cache=malloc(size*sizeof(*dns_cache));
+   dns_hash=malloc(dns_hash_size*sizeof(int));
+   if ((dns_cache == NULL) || (dns_hash == NULL)) {
+      ERROR("unable to allocate DNS cache (%i entries)", size);
+      free(dns_cache);
+      free(dns_hash);
+      dns_cache=NULL;
+      dns_hash=NULL;
+      return STS_FAILURE;
+   }
+
+   memset(dns_cache, 0, size*sizeof(*dns_cache));
+   for (i=0; i<(int)dns_hash_size; i++) dns_hash[i]=-1;
+   /* all entries are free */
+   for (i=0; i<size; i++) {
+      dns_cache[i].hash_next=(i+1 < size) ? i+1 : -1;
+      dns_cache[i].lru_prev=-1;
+      dns_cache[i].lru_next=-1;
+   }
+   dns_free=0;
+   dns_lru_head=-1;
+   dns_lru_tail=-1;
+   dns_entries=0;
+   dns_cache_size=size;
+   memset(&dns_cache_stats, 0, sizeof(dns_cache_stats));
+
+   DEBUGC(DBCLASS_DNS, "initialized DNS cache (%i entries)", size);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * look up a hostname in the DNS cache
+ *
+ * RETURNS
+ *	DNS_CACHE_HIT		resolved, address returned
+ *	DNS_CACHE_STALE		expired, address returned, needs refresh
+ *	DNS_CACHE_NEGATIVE	name cannot be resolved (cached failure)
+ *	DNS_CACHE_FAILED	last resolution failed, retry
+ *	DNS_CACHE_MISS		not in cache
+ */
+int dns_cache_lookup(char *hostname, struct in_addr *addr) {
+   int i, state;
+
+   if ((dns_cache == NULL) &&
+       (dns_cache_init(configuration.dns_cache_size) != STS_SUCCESS)) {
+      return DNS_CACHE_MISS;
+   }
+
+   i=dns_cache_find(hostname, time(NULL), &state);
+   if (i < 0) {
+      dns_cache_stats.misses++;
+      return DNS_CACHE_MISS;
+   }
+
+   /* most recently used */
+   if (i != dns_lru_head) {
+      dns_lru_unlink(i);
+      dns_lru_push(i);
+   }
+
+   memcpy(addr, &dns_cache[i].addr, sizeof(struct in_addr));
+   switch (state) {
+   case DNS_CACHE_HIT:
+      dns_cache_stats.hits++;
+      dns_cache[i].hits++;
+      /* popular and about to expire: refresh in the background */
+      if ((dns_cache[i].refreshing == 0) &&
+          (dns_cache[i].hits >= DNS_PREFETCH_HITS) &&
+          (dns_cache[i].expires_timestamp - time(NULL) <= DNS_PREFETCH_TIME) &&
+          (dns_async_lookup(hostname) == STS_SUCCESS)) {
+         DEBUGC(DBCLASS_DNS, "DNS cache - prefetching %s", hostname);
+         dns_cache[i].refreshing=1;
+      }
+      break;
+   case DNS_CACHE_STALE:
+      dns_cache_stats.stale++;
+      break;
+   case DNS_CACHE_NEGATIVE:
+      dns_cache_stats.negative++;
+      break;
+   default:
+      dns_cache_stats.misses++;
+      break;
+   }
+   return state;
+}
+
+
+/*
+ * check if a hostname is known to the DNS cache (resolved or cannot
+ * be resolved), plain IPv4 addresses are always known. A name whose
+ * last resolution failed is not known, it is retried.
+ *
+ * RETURNS
+ *	STS_TRUE if known
+ *	STS_FALSE if a lookup is required
+ */
+int dns_cache_known(char *hostname) {
+   struct in_addr addr;
+   int state;
+
+   if (hostname == NULL) return STS_TRUE;
+   if (utils_inet_aton(hostname, &addr) > 0) return STS_TRUE;
+   if (dns_cache == NULL) return STS_FALSE;
+   if (dns_cache_find(hostname, time(NULL), &state) < 0) return STS_FALSE;
+   return (state == DNS_CACHE_FAILED) ? STS_FALSE : STS_TRUE;
+}
+
+
+/*
+ * check if a hostname that is to be kept resolved needs a lookup:
+ * it is not in the cache, its last resolution failed or it expires
+ * within DNS_PREFETCH_TIME. Plain IPv4 addresses never do.
+ *
+ * RETURNS
+ *	STS_TRUE if a lookup is due
+ *	STS_FALSE if not
+ */
+int dns_cache_due(char *hostname) {
+   struct in_addr addr;
+   int i, state;
+   time_t now;
+
+   if ((hostname == NULL) || (hostname[0] == '\0')) return STS_FALSE;
+   if (utils_inet_aton(hostname, &addr) > 0) return STS_FALSE;
+   if (dns_cache == NULL) return STS_TRUE;
+
+   time(&now);
+   i=dns_cache_find(hostname, now, &state);
+   if (i < 0) return STS_TRUE;
+   switch (state) {
+   case DNS_CACHE_NEGATIVE:
+      return STS_FALSE;
+   case DNS_CACHE_HIT:
+      return (dns_cache[i].expires_timestamp - now <= DNS_PREFETCH_TIME) ?
+             STS_TRUE : STS_FALSE;
+   default:
+      return STS_TRUE;
+   }
+}
+
+
+/*
+ * store the result of a lookup into the DNS cache
+ * addr		resolved address, NULL if the resolution failed
+ * ttl		time to cache the result, for failures 0 means
+ *		the failure is temporary
+ *
+ * RETURNS: -
+ */
+void dns_cache_store(char *hostname, struct in_addr *addr, int ttl) {
+   int i, state;
+   unsigned int h;
+   time_t now;
+
+   if ((dns_cache == NULL) &&
+       (dns_cache_init(configuration.dns_cache_size) != STS_SUCCESS)) {
+      return;
+   }
+   if (strlen(hostname) > HOSTNAME_SIZE) return;
+
+   time(&now);
+   i=dns_cache_find(hostname, now, &state);
+
+   if (i < 0) {
+      /* new entry, if the table is full replace the LRU entry */
+      if (dns_free < 0) {
+         DEBUGC(DBCLASS_DNS, "DNS cache full, evicting %s",
+                dns_cache[dns_lru_tail].hostname);
+         dns_cache_remove(dns_lru_tail);
+         dns_cache_stats.evicted++;
+      }
+      i=dns_free;
+      dns_free=dns_cache[i].hash_next;
+
+      memset(&dns_cache[i], 0, sizeof(dns_cache[0]));
+      strcpy(dns_cache[i].hostname, hostname);
+      h=dns_cache_hash(hostname);
+      dns_cache[i].hash_next=dns_hash[h];
+      dns_hash[h]=i;
+      dns_lru_push(i);
+      dns_entries++;
+   } else if (i != dns_lru_head) {
+      dns_lru_unlink(i);
+      dns_lru_push(i);
+   }
+   dns_cache[i].refreshing = 0;
+   dns_cache[i].hits /= 2;
+
+   DEBUGC(DBCLASS_DNS, "DNS lookup - store into cache, entry %i, ttl=%i",
+          i, ttl);
+   if (addr) {
+      memcpy(&dns_cache[i].addr, addr, sizeof(struct in_addr));
+      dns_cache[i].expires_timestamp = now + ttl;
+      dns_cache[i].error_count = 0;
+      dns_cache[i].bad_entry = 0;
+   } else if (ttl > 0) {
+      /* name does not exist */
+      DEBUGC(DBCLASS_DNS, "DNS lookup - negative entry");
+      memset(&dns_cache[i].addr, 0, sizeof(struct in_addr));
+      dns_cache[i].expires_timestamp = now + ttl;
+      dns_cache[i].bad_entry = 1;
+   } else {
+      dns_cache[i].error_count++;
+      dns_cache[i].expires_timestamp = now + DNS_GOOD_AGE;
+      DEBUGC(DBCLASS_DNS, "DNS lookup - errcnt=%i", dns_cache[i].error_count);
+      if (dns_cache[i].error_count >= DNS_ATTEMPTS) {
+         DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisting entry");
+         dns_cache[i].expires_timestamp = now + DNS_BAD_AGE;
+         dns_cache[i].bad_entry = 1;
+      }
+   }
+}
+
+
+/*
+ * get the DNS cache statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the cache is not initialized
+ */
+int dns_cache_get_stats(dns_cache_stats_t *stats) {
+   if ((dns_cache == NULL) || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &dns_cache_stats, sizeof(dns_cache_stats_t));
+   stats->entries=dns_entries;
+   stats->size=dns_cache_size;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * case insensitive FNV-1a hash of a hostname
+ */
+static unsigned int dns_cache_hash(char *hostname) {
+   unsigned int h=2166136261U;
+
+   while (*hostname) {
+      h ^= (unsigned char)tolower((unsigned char)*hostname++);
+      h *= 16777619U;
+   }
+   return h & (dns_hash_size-1);
+}
+
+
+/*
+ * find a hostname, expired entries of the hash chain are removed
+ *
+ * RETURNS
+ *	index of cache entry, -1 if not found
+ *	state returns the DNS_CACHE_* state of the entry
+ */
+static int dns_cache_find(char *hostname, time_t now, int *state) {
+   int i, next, found=-1;
+   time_t stale;
+
+   /* good entries are kept a while longer if they can be refreshed
+    * in the background */
+   stale = (dns_async_running() == STS_TRUE) ? DNS_STALE_AGE : 0;
+
+   for (i=dns_hash[dns_cache_hash(hostname)]; i >= 0; i=next) {
+      next=dns_cache[i].hash_next;
+
+      /* lazy expiry */
+      if (dns_cache[i].bad_entry || (dns_cache[i].error_count > 0)) {
+         if (dns_cache[i].expires_timestamp < now) {
+            dns_cache_remove(i);
+            dns_cache_stats.expired++;
+            continue;
+         }
+      } else if (dns_cache[i].expires_timestamp + stale < now) {
+         dns_cache_remove(i);
+         dns_cache_stats.expired++;
+         continue;
+      }
+
+      if ((found < 0) && (strcasecmp(hostname, dns_cache[i].hostname) == 0)) {
+         found=i;
+      }
+   }
+   if (found < 0) return -1;
+
+   i=found;
+   if (dns_cache[i].bad_entry) {
+      *state=DNS_CACHE_NEGATIVE;
+   } else if (dns_cache[i].error_count > 0) {
+      *state=DNS_CACHE_FAILED;
+   } else if (dns_cache[i].expires_timestamp < now) {
+      *state=DNS_CACHE_STALE;
+   } else {
+      *state=DNS_CACHE_HIT;
+   }
+   return i;
+}
+
+
+/*
+ * remove an entry from the hash chain and the LRU list
+ */
+static void dns_cache_remove(int i) {
+   int *pp;
+
+   for (pp=&dns_hash[dns_cache_hash(dns_cache[i].hostname)];
+        *pp >= 0; pp=&dns_cache[*pp].hash_next) {
+      if (*pp == i) {
+         *pp=dns_cache[i].hash_next;
+         break;
+      }
+   }
+   dns_lru_unlink(i);
+   dns_cache[i].hostname[0]='\0';
+   dns_cache[i].hash_next=dns_free;
+   dns_free=i;
+   dns_entries--;
+}
+
+
+static void dns_lru_unlink(int i) {
+   if (dns_cache[i].lru_prev >= 0) {
+      dns_cache[dns_cache[i].lru_prev].lru_next=dns_cache[i].lru_next;
+   } else {
+      dns_lru_head=dns_cache[i].lru_next;
+   }
+   if (dns_cache[i].lru_next >= 0) {
+      dns_cache[dns_cache[i].lru_next].lru_prev=dns_cache[i].lru_prev;
+   } else {
+      dns_lru_tail=dns_cache[i].lru_prev;
+   }
+   dns_cache[i].lru_prev=-1;
+   dns_cache[i].lru_next=-1;
+}
+
+
+static void dns_lru_push(int i) {
+   dns_cache[i].lru_prev=-1;
+   dns_cache[i].lru_next=dns_lru_head;
+   if (dns_lru_head >= 0) dns_cache[dns_lru_head].lru_prev=i;
+   dns_lru_head=i;
+   if (dns_lru_tail < 0) dns_lru_tail=i;
+}
@@ -0,0 +1,481 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * SIP next-hop resolution (RFC 3263)
+ *
+ * A target (host, port) is resolved as:
+ *  - numeric IP address or explicit port: A record
+ *  - NAPTR records of the domain, the first one (order, preference)
+ *    for the transport in use gives the SRV name
+ *  - without a usable NAPTR record: _sip._udp.<domain> or
+ *    _sip._tcp.<domain>
+ *  - the SRV target is chosen by priority and weight (RFC 2782),
+ *    targets that cannot be resolved are skipped
+ *  - without SRV records: A record of the domain, port 5060
+ *
+ * NAPTR and SRV answers (also negative ones) are cached with their
+ * TTL. An entry that is used frequently is refreshed in the
+ * background shortly before it expires, so busy targets are always
+ * served from the cache.
+ */
+
+static struct {
+   int type;			/* DNS_QUERY_*, 0 = free */
+   char name[HOSTNAME_SIZE+1];
+   time_t expires;
+   int ttl;
+   unsigned int hits;		/* uses since stored */
+   int refreshing;		/* background refresh started */
+   int count;			/* number of records, 0 = none exist */
+   dns_srv_t rr[DNS_SRV_RECORDS];
+   int hash_next;
+} srv_cache[DNS_SRV_CACHE_SIZE];
+
+static int srv_hash[DNS_SRV_CACHE_SIZE];
+static int srv_initialized=0;
+
+/* local prototypes */
+static unsigned int dns_srv_hash(int type, char *name);
+static int dns_srv_get(int type, char *name, int *idx);
+static int dns_srv_valid(int i, time_t now);
+static int dns_srv_name(char *host, int protocol, char *name, int len);
+static int dns_srv_select(int idx, struct in_addr *addr, in_port_t *port);
+static void dns_srv_init(void);
+static void dns_srv_remove(int i);
+
+
+/*
+ * resolve the next hop for a SIP URI host and port
+ * host		host part of the URI
+ * portstr	port part of the URI, may be NULL
+ * protocol	PROTO_UDP / PROTO_TCP
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure (or if lookups are still in progress)
+ */
+int dns_srv_resolve(char *host, char *portstr, int protocol,
+                    struct in_addr *addr, in_port_t *port) {
+   char name[HOSTNAME_SIZE+1];
+   int i, sts, p;
+
+   if (host == NULL) return STS_FAILURE;
+
+   /* explicit port or IP address: no SRV lookup */
+   *port=SIP_PORT;
+   if (portstr) {
+      p=atoi(portstr);
+      if ((p > 0) && (p <= 65535)) *port=p;
+   }
+   if ((portstr != NULL) || (utils_inet_aton(host, addr) > 0)) {
+      return get_ip_by_host(host, addr);
+   }
+
+   /* NAPTR -> SRV name */
+   sts=dns_srv_name(host, protocol, name, sizeof(name));
+   if (sts != STS_SUCCESS) return STS_FAILURE;
+
+   /* SRV records */
+   sts=dns_srv_get(DNS_QUERY_SRV, name, &i);
+   if (sts != STS_SUCCESS) return STS_FAILURE;
+
+   if (srv_cache[i].count > 0) {
+      return dns_srv_select(i, addr, port);
+   }
+
+   /* no SRV records, A record of the domain */
+   return get_ip_by_host(host, addr);
+}
+
+
+/*
+ * find out which lookup is still required to resolve a target,
+ * used to park messages until it is done (see dns_async_park())
+ *
+ * RETURNS
+ *	STS_TRUE if a lookup is required, type and name of the
+ *	         lookup are returned
+ *	STS_FALSE if everything is cached
+ */
+int dns_srv_pending(char *host, char *portstr, int protocol,
+                    int *type, char *name, int len) {
+   char srvname[HOSTNAME_SIZE+1];
+   struct in_addr addr;
+   int i, k, prio=-1;
+   time_t now;
+
+   if (host == NULL) return STS_FALSE;
+
+   /* explicit port or IP address: A record only */
+   if ((portstr != NULL) || (utils_inet_aton(host, &addr) > 0)) {
+      if (dns_cache_known(host) == STS_TRUE) return STS_FALSE;
+      *type=DNS_QUERY_A;
+      snprintf(name, len, "%s", host);
+      return STS_TRUE;
+   }
+
+   dns_srv_init();
+   time(&now);
+
+   /* NAPTR of the domain (expired entries must be looked up again) */
+   for (i=srv_hash[dns_srv_hash(DNS_QUERY_NAPTR, host)]; i >= 0;
+        i=srv_cache[i].hash_next) {
+      if ((srv_cache[i].type == DNS_QUERY_NAPTR) &&
+          (strcasecmp(srv_cache[i].name, host) == 0)) break;
+   }
+   if ((i < 0) || (dns_srv_valid(i, now) != STS_TRUE)) {
+      *type=DNS_QUERY_NAPTR;
+      snprintf(name, len, "%s", host);
+      return STS_TRUE;
+   }
+
+   /* SRV */
+   if (dns_srv_name(host, protocol, srvname, sizeof(srvname))
+       != STS_SUCCESS) {
+      return STS_FALSE;
+   }
+   for (i=srv_hash[dns_srv_hash(DNS_QUERY_SRV, srvname)]; i >= 0;
+        i=srv_cache[i].hash_next) {
+      if ((srv_cache[i].type == DNS_QUERY_SRV) &&
+          (strcasecmp(srv_cache[i].name, srvname) == 0)) break;
+   }
+   if ((i < 0) || (dns_srv_valid(i, now) != STS_TRUE)) {
+      *type=DNS_QUERY_SRV;
+      snprintf(name, len, "%s", srvname);
+      return STS_TRUE;
+   }
+
+   /* A of the targets with the lowest priority, or of the domain */
+   if (srv_cache[i].count == 0) {
+      if (dns_cache_known(host) == STS_TRUE) return STS_FALSE;
+      *type=DNS_QUERY_A;
+      snprintf(name, len, "%s", host);
+      return STS_TRUE;
+   }
+   for (k=0; k<srv_cache[i].count; k++) {
+      if ((prio < 0) || (srv_cache[i].rr[k].prio < prio)) {
+         prio=srv_cache[i].rr[k].prio;
+      }
+   }
+   for (k=0; k<srv_cache[i].count; k++) {
+      if (srv_cache[i].rr[k].prio != prio) continue;
+      if (dns_cache_known(srv_cache[i].rr[k].target) == STS_TRUE) continue;
+      *type=DNS_QUERY_A;
+      snprintf(name, len, "%s", srv_cache[i].rr[k].target);
+      return STS_TRUE;
+   }
+   return STS_FALSE;
+}
+
+
+/*
+ * store NAPTR or SRV records into the cache
+ * count	number of records, 0 if none exist,
+ *		-1 on temporary failure
+ *
+ * RETURNS: -
+ */
+void dns_srv_store(int type, char *name, dns_srv_t *rr, int count, int ttl) {
+   int i, oldest=-1;
+   unsigned int h;
+   time_t now;
+
+   dns_srv_init();
+   if (strlen(name) > HOSTNAME_SIZE) return;
+
+   /* temporary failures are retried soon */
+   if (count < 0) {
+      count=0;
+      ttl=DNS_MIN_TTL;
+   }
+   if (count > DNS_SRV_RECORDS) count=DNS_SRV_RECORDS;
+   if (ttl < DNS_MIN_TTL) ttl=DNS_MIN_TTL;
+   if (ttl > DNS_MAX_TTL) ttl=DNS_MAX_TTL;
+
+   time(&now);
+   h=dns_srv_hash(type, name);
+   for (i=srv_hash[h]; i >= 0; i=srv_cache[i].hash_next) {
+      if ((srv_cache[i].type == type) &&
+          (strcasecmp(srv_cache[i].name, name) == 0)) break;
+   }
+
+   if (i < 0) {
+      /* free slot, or replace the one that expires first */
+      for (i=0; i<DNS_SRV_CACHE_SIZE; i++) {
+         if (srv_cache[i].type == 0) break;
+         if ((oldest < 0) || (srv_cache[i].expires < srv_cache[oldest].expires)) {
+            oldest=i;
+         }
+      }
+      if (i >= DNS_SRV_CACHE_SIZE) {
+         i=oldest;
+         dns_srv_remove(i);
+      }
+      srv_cache[i].type=type;
+      strcpy(srv_cache[i].name, name);
+      srv_cache[i].hits=0;
+      srv_cache[i].hash_next=srv_hash[h];
+      srv_hash[h]=i;
+   } else {
+      /* refreshed, keep it popular only if it is used further on */
+      srv_cache[i].hits /= 2;
+   }
+
+   DEBUGC(DBCLASS_DNS, "dns_srv_store: type=%i [%s], %i records, ttl=%i",
+          type, name, count, ttl);
+   srv_cache[i].expires=now + ttl;
+   srv_cache[i].ttl=ttl;
+   srv_cache[i].refreshing=0;
+   srv_cache[i].count=count;
+   if (count > 0) memcpy(srv_cache[i].rr, rr, count*sizeof(dns_srv_t));
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * get NAPTR or SRV records from the cache or resolve them
+ *
+ * RETURNS
+ *	STS_SUCCESS and the cache index in *idx
+ *	STS_FAILURE if not available (yet)
+ */
+static int dns_srv_get(int type, char *name, int *idx) {
+   int i, count, ttl;
+   unsigned int h;
+   time_t now;
+   dns_srv_t rr[DNS_SRV_RECORDS];
+
+   dns_srv_init();
+
+   time(&now);
+   h=dns_srv_hash(type, name);
+   for (i=srv_hash[h]; i >= 0; i=srv_cache[i].hash_next) {
+      if ((srv_cache[i].type == type) &&
+          (strcasecmp(srv_cache[i].name, name) == 0)) break;
+   }
+
+   /* expired, unless it is being refreshed */
+   if ((i >= 0) && (dns_srv_valid(i, now) != STS_TRUE)) {
+      dns_srv_remove(i);
+      i=-1;
+   }
+
+   if (i >= 0) {
+      srv_cache[i].hits++;
+      /* popular and about to expire: refresh in the background */
+      if ((srv_cache[i].refreshing == 0) &&
+          (srv_cache[i].hits >= DNS_PREFETCH_HITS) &&
+          (srv_cache[i].expires - now <= DNS_PREFETCH_TIME) &&
+          (dns_async_query(type, name) == STS_SUCCESS)) {
+         DEBUGC(DBCLASS_DNS, "dns_srv_get: prefetching [%s]", name);
+         srv_cache[i].refreshing=1;
+      }
+      *idx=i;
+      return STS_SUCCESS;
+   }
+
+   /* not cached */
+   if (dns_async_running() == STS_TRUE) {
+      dns_async_query(type, name);
+      return STS_FAILURE;
+   }
+
+   if (type == DNS_QUERY_NAPTR) {
+      count=resolve_NAPTR_records(name, rr, DNS_SRV_RECORDS, &ttl);
+   } else {
+      count=resolve_SRV_records(name, rr, DNS_SRV_RECORDS, &ttl);
+   }
+   dns_srv_store(type, name, rr, count, ttl);
+
+   for (i=srv_hash[h]; i >= 0; i=srv_cache[i].hash_next) {
+      if ((srv_cache[i].type == type) &&
+          (strcasecmp(srv_cache[i].name, name) == 0)) break;
+   }
+   if (i < 0) return STS_FAILURE;
+   *idx=i;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * check if a cache entry may still be used: not expired, or
+ * expired but being refreshed and not older than DNS_STALE_AGE
+ *
+ * RETURNS
+ *	STS_TRUE if usable
+ *	STS_FALSE if expired
+ */
+static int dns_srv_valid(int i, time_t now) {
+   if (srv_cache[i].expires >= now) return STS_TRUE;
+   if (srv_cache[i].refreshing &&
+       (srv_cache[i].expires + DNS_STALE_AGE >= now)) return STS_TRUE;
+   return STS_FALSE;
+}
+
+
+/*
+ * get the SRV name for a domain, from its NAPTR records if any
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if NAPTR lookup is still in progress
+ */
+static int dns_srv_name(char *host, int protocol, char *name, int len) {
+   int i, k, best=-1;
+
+   if (dns_srv_get(DNS_QUERY_NAPTR, host, &i) != STS_SUCCESS) {
+      return STS_FAILURE;
+   }
+
+   for (k=0; k<srv_cache[i].count; k++) {
+      if (srv_cache[i].rr[k].protocol != protocol) continue;
+      if ((best < 0) ||
+          (srv_cache[i].rr[k].prio < srv_cache[i].rr[best].prio) ||
+          ((srv_cache[i].rr[k].prio == srv_cache[i].rr[best].prio) &&
+           (srv_cache[i].rr[k].weight < srv_cache[i].rr[best].weight))) {
+         best=k;
+      }
+   }
+
+   if (best >= 0) {
+      snprintf(name, len, "%s", srv_cache[i].rr[best].target);
+   } else {
+      snprintf(name, len, "_sip._%s.%s",
+               (protocol == PROTO_TCP) ? "tcp" : "udp", host);
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * choose a target of a SRV record set: lowest priority first,
+ * within a priority weighted random (RFC 2782). Targets that cannot
+ * be resolved are skipped.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if no target can be resolved
+ */
+static int dns_srv_select(int idx, struct in_addr *addr, in_port_t *port) {
+   dns_srv_t *rr=srv_cache[idx].rr;
+   int count=srv_cache[idx].count;
+   struct in_addr tmp[DNS_SRV_RECORDS];
+   int usable[DNS_SRV_RECORDS];
+   int k, prio, last=-1, sum, r;
+
+   for (;;) {
+      /* next priority */
+      prio=-1;
+      for (k=0; k<count; k++) {
+         if ((rr[k].prio > last) && ((prio < 0) || (rr[k].prio < prio))) {
+            prio=rr[k].prio;
+         }
+      }
+      if (prio < 0) break;
+      last=prio;
+
+      /* targets of this priority that can be resolved */
+      sum=0;
+      for (k=0; k<count; k++) {
+         usable[k]=0;
+         if (rr[k].prio != prio) continue;
+         if (get_ip_by_host(rr[k].target, &tmp[k]) != STS_SUCCESS) continue;
+         usable[k]=1;
+         sum += rr[k].weight + 1;
+      }
+      if (sum == 0) continue;
+
+      r=rand() % sum;
+      for (k=0; k<count; k++) {
+         if (!usable[k]) continue;
+         r -= rr[k].weight + 1;
+         if (r < 0) break;
+      }
+
+      memcpy(addr, &tmp[k], sizeof(struct in_addr));
+      *port=(rr[k].port) ? rr[k].port : SIP_PORT;
+      DEBUGC(DBCLASS_DNS, "dns_srv_select: [%s] -> %s (%s:%i)",
+             srv_cache[idx].name, rr[k].target, utils_inet_ntoa(*addr),
+             *port);
+      return STS_SUCCESS;
+   }
+
+   DEBUGC(DBCLASS_DNS, "dns_srv_select: no target of [%s] resolved",
+          srv_cache[idx].name);
+   return STS_FAILURE;
+}
+
+
+static unsigned int dns_srv_hash(int type, char *name) {
+   unsigned int h=2166136261U ^ (unsigned int)type;
+
+   while (*name) {
+      h ^= (unsigned char)tolower((unsigned char)*name++);
+      h *= 16777619U;
+   }
+   return h & (DNS_SRV_CACHE_SIZE-1);
+}
+
+
+static void dns_srv_init(void) {
+   int i;
+
+   if (srv_initialized) return;
+   memset(srv_cache, 0, sizeof(srv_cache));
+   for (i=0; i<DNS_SRV_CACHE_SIZE; i++) srv_hash[i]=-1;
+   srv_initialized=1;
+}
+
+
+static void dns_srv_remove(int i) {
+   int *pp;
+
+   for (pp=&srv_hash[dns_srv_hash(srv_cache[i].type, srv_cache[i].name)];
+        *pp >= 0; pp=&srv_cache[*pp].hash_next) {
+      if (*pp == i) {
+         *pp=srv_cache[i].hash_next;
+         break;
+      }
+   }
+   srv_cache[i].type=0;
+   srv_cache[i].hash_next=-1;
+}
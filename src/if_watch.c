@@ -0,0 +1,467 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/*
+ * Interface address tracking
+ *
+ * On Linux, siproxd subscribes to the rtnetlink link and IPv4 address
+ * events. The table of local interfaces and their addresses is
+ * loaded once at startup and then kept current by the events, which
+ * are read by the SIP thread (the netlink socket is part of the
+ * select() in sipsock_waitfordata()). get_ip_by_ifname() answers
+ * from this table and never has to call getifaddrs(), address
+ * changes (e.g. on a dynamic IP uplink) take effect immediately.
+ *
+ * If the events cannot be received, get_ip_by_ifname() falls back
+ * to its own cache and polls the interfaces.
+ */
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+/* interfaces */
+static struct {
+   int index;			/* 0 = free */
+   int isup;			/* IFF_UP */
+   char name[IFNAME_SIZE+1];
+} if_link[IFADR_CACHE_SIZE];
+
+/* IPv4 addresses */
+static struct {
+   int index;			/* interface, 0 = free */
+   int secondary;		/* IFA_F_SECONDARY */
+   struct in_addr addr;
+   char label[IFNAME_SIZE+1];	/* name incl. alias (eth0:1) */
+} if_addr[IFADR_WATCH_SIZE];
+
+static int nl_socket=-1;
+static unsigned int nl_seq=0;
+static int nl_loading=0;		/* loading the table, be quiet */
+
+/* local prototypes */
+static int if_watch_dump(int type);
+static void if_watch_parse(char *buf, int len, int *done);
+static void if_watch_link(struct nlmsghdr *nlh);
+static void if_watch_addr(struct nlmsghdr *nlh);
+static void if_watch_forget(int index);
+
+
+/*
+ * subscribe to the rtnetlink events and load the current
+ * interfaces and addresses
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error (interfaces are polled then)
+ */
+int if_watch_init(void) {
+   struct sockaddr_nl sa;
+
+   if (nl_socket >= 0) return STS_SUCCESS;
+
+   nl_socket=socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+   if (nl_socket < 0) {
+      ERROR("unable to create netlink socket: %s", strerror(errno));
+      return STS_FAILURE;
+   }
+
+   memset(&sa, 0, sizeof(sa));
+   sa.nl_family=AF_NETLINK;
+   sa.nl_groups=RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+   if (bind(nl_socket, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+      ERROR("unable to bind netlink socket: %s", strerror(errno));
+      close(nl_socket);
+      nl_socket=-1;
+      return STS_FAILURE;
+   }
+
+   if ((if_watch_dump(RTM_GETLINK) != STS_SUCCESS) ||
+       (if_watch_dump(RTM_GETADDR) != STS_SUCCESS)) {
+      close(nl_socket);
+      nl_socket=-1;
+      return STS_FAILURE;
+   }
+
+   fcntl(nl_socket, F_SETFL, fcntl(nl_socket, F_GETFL) | O_NONBLOCK);
+   DEBUGC(DBCLASS_NET, "tracking interface addresses via rtnetlink");
+   return STS_SUCCESS;
+}
+
+
+/*
+ * file descriptor to be included in select(), readable when
+ * interface events are pending
+ *
+ * RETURNS
+ *	file descriptor, -1 if not tracking
+ */
+int if_watch_fd(void) {
+   return nl_socket;
+}
+
+
+/*
+ * read the pending interface events and update the table.
+ * To be called when if_watch_fd() is readable.
+ *
+ * RETURNS: -
+ */
+void if_watch_process(void) {
+   char buf[8192];
+   int len;
+
+   if (nl_socket < 0) return;
+
+   for (;;) {
+      len=recv(nl_socket, buf, sizeof(buf), 0);
+      if (len > 0) {
+         if_watch_parse(buf, len, NULL);
+         continue;
+      }
+      if ((len < 0) && (errno == EINTR)) continue;
+      if ((len < 0) && (errno == ENOBUFS)) {
+         /* events have been lost, reload everything */
+         WARN("interface events lost, reloading interface table");
+         memset(if_link, 0, sizeof(if_link));
+         memset(if_addr, 0, sizeof(if_addr));
+         fcntl(nl_socket, F_SETFL, fcntl(nl_socket, F_GETFL) & ~O_NONBLOCK);
+         if ((if_watch_dump(RTM_GETLINK) != STS_SUCCESS) ||
+             (if_watch_dump(RTM_GETADDR) != STS_SUCCESS)) {
+            ERROR("unable to reload interfaces, polling them from now on");
+            close(nl_socket);
+            nl_socket=-1;
+            return;
+         }
+         fcntl(nl_socket, F_SETFL, fcntl(nl_socket, F_GETFL) | O_NONBLOCK);
+         continue;
+      }
+      break;
+   }
+}
+
+
+/*
+ * look up the IPv4 address of an interface
+ * ifname	interface name, also alias labels (eth0:1)
+ *
+ * RETURNS
+ *	STS_SUCCESS if the interface is tracked, address and state
+ *	            are returned (*addr is 0.0.0.0 if it has no
+ *	            IPv4 address)
+ *	STS_FAILURE if not tracking, the caller has to poll
+ */
+int if_watch_lookup(char *ifname, struct in_addr *addr, int *isup) {
+   int i, found=-1;
+
+   if (nl_socket < 0) return STS_FAILURE;
+
+   memset(addr, 0, sizeof(struct in_addr));
+   *isup=0;
+
+   /* the primary address of an interface wins */
+   for (i=0; i<IFADR_WATCH_SIZE; i++) {
+      if (if_addr[i].index == 0) continue;
+      if (strcmp(if_addr[i].label, ifname) != 0) continue;
+      if ((found < 0) || (if_addr[found].secondary && !if_addr[i].secondary)) {
+         found=i;
+      }
+   }
+
+   if (found < 0) {
+      DEBUGC(DBCLASS_DNS, "if_watch_lookup: %s has no IPv4 address", ifname);
+      return STS_SUCCESS;
+   }
+
+   memcpy(addr, &if_addr[found].addr, sizeof(struct in_addr));
+   for (i=0; i<IFADR_CACHE_SIZE; i++) {
+      if (if_link[i].index == if_addr[found].index) {
+         *isup=if_link[i].isup;
+         break;
+      }
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * request a dump (RTM_GETLINK, RTM_GETADDR) and process it
+ */
+static int if_watch_dump(int type) {
+   struct {
+      struct nlmsghdr nlh;
+      struct rtgenmsg g;
+   } req;
+   char buf[8192];
+   int len, done=0;
+
+   nl_loading=1;
+   memset(&req, 0, sizeof(req));
+   req.nlh.nlmsg_len=NLMSG_LENGTH(sizeof(struct rtgenmsg));
+   req.nlh.nlmsg_type=type;
+   req.nlh.nlmsg_flags=NLM_F_REQUEST | NLM_F_DUMP;
+   req.nlh.nlmsg_seq=++nl_seq;
+   req.g.rtgen_family=(type == RTM_GETADDR) ? AF_INET : AF_UNSPEC;
+
+   if (send(nl_socket, &req, req.nlh.nlmsg_len, 0) < 0) {
+      ERROR("unable to request interface table: %s", strerror(errno));
+      nl_loading=0;
+      return STS_FAILURE;
+   }
+
+   while (!done) {
+      len=recv(nl_socket, buf, sizeof(buf), 0);
+      if (len < 0) {
+         if (errno == EINTR) continue;
+         ERROR("unable to read interface table: %s", strerror(errno));
+         nl_loading=0;
+         return STS_FAILURE;
+      }
+      if (len == 0) break;
+      if_watch_parse(buf, len, &done);
+   }
+   nl_loading=0;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * process the netlink messages in a buffer, *done is set at the
+ * end of our dump
+ */
+static void if_watch_parse(char *buf, int len, int *done) {
+   struct nlmsghdr *nlh;
+
+   for (nlh=(struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+        nlh=NLMSG_NEXT(nlh, len)) {
+      switch (nlh->nlmsg_type) {
+      case NLMSG_DONE:
+      case NLMSG_ERROR:
+         if (done && (nlh->nlmsg_seq == nl_seq)) *done=1;
+         break;
+      case RTM_NEWLINK:
+      case RTM_DELLINK:
+         if_watch_link(nlh);
+         break;
+      case RTM_NEWADDR:
+      case RTM_DELADDR:
+         if_watch_addr(nlh);
+         break;
+      default:
+         break;
+      }
+   }
+}
+
+
+/*
+ * interface appeared, changed or disappeared
+ */
+static void if_watch_link(struct nlmsghdr *nlh) {
+   struct ifinfomsg *ifi=NLMSG_DATA(nlh);
+   struct rtattr *rta;
+   int i, free_slot=-1, rtlen;
+   char *name=NULL;
+
+   if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) return;
+
+   if (nlh->nlmsg_type == RTM_DELLINK) {
+      DEBUGC(DBCLASS_NET, "interface index %i removed", ifi->ifi_index);
+      if_watch_forget(ifi->ifi_index);
+      return;
+   }
+
+   rtlen=IFLA_PAYLOAD(nlh);
+   for (rta=IFLA_RTA(ifi); RTA_OK(rta, rtlen); rta=RTA_NEXT(rta, rtlen)) {
+      if (rta->rta_type == IFLA_IFNAME) name=(char *)RTA_DATA(rta);
+   }
+
+   for (i=0; i<IFADR_CACHE_SIZE; i++) {
+      if (if_link[i].index == ifi->ifi_index) break;
+      if ((if_link[i].index == 0) && (free_slot < 0)) free_slot=i;
+   }
+   if (i >= IFADR_CACHE_SIZE) {
+      if (free_slot < 0) {
+         WARN("too many interfaces, not tracking interface index %i",
+              ifi->ifi_index);
+         return;
+      }
+      i=free_slot;
+      if_link[i].index=ifi->ifi_index;
+   }
+
+   if (name) {
+      strncpy(if_link[i].name, name, IFNAME_SIZE);
+      if_link[i].name[IFNAME_SIZE]='\0';
+   }
+   if (!nl_loading &&
+       (if_link[i].isup != ((ifi->ifi_flags & IFF_UP) ? 1 : 0))) {
+      INFO("interface %s is %s", if_link[i].name,
+           (ifi->ifi_flags & IFF_UP) ? "UP" : "DOWN");
+   }
+   if_link[i].isup=(ifi->ifi_flags & IFF_UP) ? 1 : 0;
+}
+
+
+/*
+ * IPv4 address added or removed
+ */
+static void if_watch_addr(struct nlmsghdr *nlh) {
+   struct ifaddrmsg *ifa=NLMSG_DATA(nlh);
+   struct rtattr *rta;
+   struct in_addr addr;
+   int i, free_slot=-1, rtlen, have_addr=0;
+   char *label=NULL;
+
+   if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa))) return;
+   if (ifa->ifa_family != AF_INET) return;
+
+   rtlen=IFA_PAYLOAD(nlh);
+   for (rta=IFA_RTA(ifa); RTA_OK(rta, rtlen); rta=RTA_NEXT(rta, rtlen)) {
+      switch (rta->rta_type) {
+      case IFA_LOCAL:
+         memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+         have_addr=2;
+         break;
+      case IFA_ADDRESS:
+         /* on point-to-point links this is the peer address */
+         if (have_addr < 2) {
+            memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+            have_addr=1;
+         }
+         break;
+      case IFA_LABEL:
+         label=(char *)RTA_DATA(rta);
+         break;
+      default:
+         break;
+      }
+   }
+   if (!have_addr) return;
+
+   for (i=0; i<IFADR_WATCH_SIZE; i++) {
+      if ((if_addr[i].index == (int)ifa->ifa_index) &&
+          (memcmp(&if_addr[i].addr, &addr, sizeof(addr)) == 0)) break;
+      if ((if_addr[i].index == 0) && (free_slot < 0)) free_slot=i;
+   }
+
+   if (nlh->nlmsg_type == RTM_DELADDR) {
+      if (i < IFADR_WATCH_SIZE) {
+         INFO("interface %s: address %s removed", if_addr[i].label,
+              utils_inet_ntoa(addr));
+         memset(&if_addr[i], 0, sizeof(if_addr[0]));
+      }
+      return;
+   }
+
+   if (i >= IFADR_WATCH_SIZE) {
+      if (free_slot < 0) {
+         WARN("too many interface addresses, not tracking %s",
+              utils_inet_ntoa(addr));
+         return;
+      }
+      i=free_slot;
+      if_addr[i].index=ifa->ifa_index;
+      memcpy(&if_addr[i].addr, &addr, sizeof(addr));
+      if (!nl_loading) {
+         INFO("interface %s: address %s added", (label) ? label : "?",
+              utils_inet_ntoa(addr));
+      }
+   }
+
+   if_addr[i].secondary=(ifa->ifa_flags & IFA_F_SECONDARY) ? 1 : 0;
+   if (label) {
+      strncpy(if_addr[i].label, label, IFNAME_SIZE);
+      if_addr[i].label[IFNAME_SIZE]='\0';
+   } else {
+      /* no label, use the name of the interface */
+      for (free_slot=0; free_slot<IFADR_CACHE_SIZE; free_slot++) {
+         if (if_link[free_slot].index == (int)ifa->ifa_index) {
+            strcpy(if_addr[i].label, if_link[free_slot].name);
+            break;
+         }
+      }
+   }
+}
+
+
+/*
+ * interface has gone, drop it and its addresses
+ */
+static void if_watch_forget(int index) {
+   int i;
+
+   for (i=0; i<IFADR_CACHE_SIZE; i++) {
+      if (if_link[i].index == index) {
+         memset(&if_link[i], 0, sizeof(if_link[0]));
+      }
+   }
+   for (i=0; i<IFADR_WATCH_SIZE; i++) {
+      if (if_addr[i].index == index) {
+         memset(&if_addr[i], 0, sizeof(if_addr[0]));
+      }
+   }
+}
+
+#else /* HAVE_LINUX_RTNETLINK_H */
+
+/* no rtnetlink, interfaces are polled by get_ip_by_ifname() */
+int if_watch_init(void) {
+   DEBUGC(DBCLASS_NET, "no interface events on this platform, polling");
+   return STS_SUCCESS;
+}
+
+int if_watch_fd(void) {
+   return -1;
+}
+
+void if_watch_process(void) {
+}
+
+int if_watch_lookup(char *ifname, struct in_addr *addr, int *isup) {
+   return STS_FAILURE;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
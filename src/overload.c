@@ -0,0 +1,277 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Overload control
+ *
+ * If siproxd cannot keep up, received UDP messages pile up in the
+ * kernel receive queue and eventually are dropped at random - BYEs
+ * and responses just as well as new calls. To avoid this, the load
+ * is watched and new work is refused early while overloaded:
+ *
+ * - the time spent on each received message (service time) and the
+ *   message size are averaged (EWMA)
+ * - every OVERLOAD_SAMPLE msec the receive queues of the SIP UDP
+ *   sockets and the priority queue (sip_prio.c) are inspected. From
+ *   the queued bytes the lag (time until the last queued message
+ *   will be processed) is estimated.
+ * - overload is entered if the queue fill level exceeds overload_queue
+ *   percent or the lag exceeds overload_lag msec. It is left again
+ *   if both are below half of these limits.
+ *
+ * While overloaded, initial INVITE and REGISTER requests are answered
+ * with a 503 (Retry-After) directly from the raw message and are not
+ * processed any further. Everything else (responses, ACK, BYE,
+ * in-dialog requests) is processed as usual.
+ *
+ * If overload_oc is set, the RFC7339 overload control parameters are
+ * added to the Via header of such 503 responses to upstream servers
+ * that announced support for it ("oc" parameter in the Via).
+ */
+
+#define OL_SCALE	16	/* fixed point shift for averages */
+
+static int ol_overloaded=0;
+static struct timeval ol_start;		/* begin of current message */
+static int ol_busy=0;			/* ol_start is valid */
+static long long ol_next_sample=0;	/* time of next sample (msec) */
+static long ol_avg_service=0;		/* usec << OL_SCALE */
+static long ol_avg_size=0;		/* bytes << OL_SCALE */
+static unsigned int ol_seq=0;		/* oc-seq */
+
+/* statistics */
+static overload_stats_t ol_stats;
+
+/* local prototypes */
+static void ol_sample(long long now);
+static int ol_via_has_oc(sip_ticket_t *ticket);
+
+
+/*
+ * a message has been received, start measuring its service time
+ *
+ * RETURNS
+ *	-
+ */
+void overload_begin(size_t size) {
+   long long now;
+
+   gettimeofday(&ol_start, NULL);
+   ol_busy=1;
+
+   /* avg += (x - avg) / 8 */
+   ol_avg_size += (((long)size << OL_SCALE) - ol_avg_size) >> 3;
+
+   now=(long long)ol_start.tv_sec * 1000 + ol_start.tv_usec / 1000;
+   if (now >= ol_next_sample) ol_sample(now);
+}
+
+
+/*
+ * processing of the current message is finished (whatever way),
+ * account its service time
+ *
+ * RETURNS
+ *	-
+ */
+void overload_end(void) {
+   struct timeval tv;
+   long usec;
+
+   if (!ol_busy) return;
+   ol_busy=0;
+
+   gettimeofday(&tv, NULL);
+   usec=(tv.tv_sec - ol_start.tv_sec) * 1000000L +
+        (tv.tv_usec - ol_start.tv_usec);
+   if (usec < 0) usec=0;
+   /* clock jumps and the like */
+   if (usec > 1000000L) usec=1000000L;
+
+   ol_avg_service += ((usec << OL_SCALE) - ol_avg_service) >> 3;
+}
+
+
+/*
+ * shed new work while overloaded: initial INVITE and REGISTER
+ * requests are answered with 503
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message is to be processed
+ *	STS_FAILURE if the message has been rejected
+ */
+int overload_check(sip_ticket_t *ticket) {
+   char via_params[80];
+   char extra[40];
+   char *oc=NULL;
+   int pct;
+
+   if (!ol_overloaded) return STS_SUCCESS;
+   if (sip_raw_is_initial(ticket) != STS_TRUE) return STS_SUCCESS;
+
+   ol_stats.rejected++;
+
+   snprintf(extra, sizeof(extra), "Retry-After: %i\r\n",
+            configuration.overload_retry_after);
+
+   /* RFC7339: upstream announced "oc" in its Via */
+   if (configuration.overload_oc && (ol_via_has_oc(ticket) == STS_TRUE)) {
+      /* requested reduction, follows the queue fill level */
+      pct=ol_stats.queue_fill;
+      if (pct < 10) pct=10;
+      if (pct > 100) pct=100;
+      snprintf(via_params, sizeof(via_params),
+               ";oc=%i;oc-algo=\"loss\";oc-validity=%i;oc-seq=%u",
+               pct, configuration.overload_retry_after * 1000, ol_seq);
+      oc=via_params;
+   }
+
+   DEBUGC(DBCLASS_SIP, "overload: rejecting request from %s:%u with 503",
+          utils_inet_ntoa(ticket->from.sin_addr),
+          ntohs(ticket->from.sin_port));
+   sip_raw_respond(ticket, 503, NULL, oc, extra);
+
+   return STS_FAILURE;
+}
+
+
+/*
+ * get the overload control statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int overload_get_stats(overload_stats_t *stats) {
+   if (stats == NULL) return STS_FAILURE;
+   memcpy(stats, &ol_stats, sizeof(overload_stats_t));
+   stats->overloaded=ol_overloaded;
+   stats->avg_service=ol_avg_service >> OL_SCALE;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * inspect the receive queues and update the overload state
+ */
+static void ol_sample(long long now) {
+   sipsock_stats_t sockstats;
+   sip_prio_stats_t priostats;
+   long queued=0, rcvbuf=0;
+   long avg_size, lag;
+   int i, fill;
+
+   ol_next_sample=now + OVERLOAD_SAMPLE;
+
+   for (i=0; sipsock_udp_stats(i, &sockstats) == STS_SUCCESS; i++) {
+      if ((sockstats.rx_queued < 0) || (sockstats.rcvbuf <= 0)) continue;
+      queued += sockstats.rx_queued;
+      rcvbuf += sockstats.rcvbuf;
+   }
+
+   fill=(rcvbuf > 0) ? (int)((long long)queued * 100 / rcvbuf) : 0;
+
+   /* messages already moved into the priority queue are waiting, too */
+   if (sip_prio_get_stats(&priostats) == STS_SUCCESS) {
+      queued += priostats.bytes;
+      i=(priostats.depth[SIP_PRIO_HIGH] + priostats.depth[SIP_PRIO_INVITE] +
+         priostats.depth[SIP_PRIO_LOW]) * 100 / priostats.size;
+      if (i > fill) fill=i;
+   }
+
+   /* estimated time to work through the queue (msec) */
+   avg_size=ol_avg_size >> OL_SCALE;
+   if (avg_size <= 0) avg_size=1;
+   lag=(long)(((long long)queued / avg_size *
+               (ol_avg_service >> OL_SCALE)) / 1000);
+
+   ol_stats.queue_fill=fill;
+   ol_stats.lag=lag;
+   if (lag > ol_stats.max_lag) ol_stats.max_lag=lag;
+
+   if (!ol_overloaded) {
+      if (((configuration.overload_queue > 0) &&
+           (fill >= configuration.overload_queue)) ||
+          ((configuration.overload_lag > 0) &&
+           (lag >= configuration.overload_lag))) {
+         ol_overloaded=1;
+         ol_seq++;
+         ol_stats.episodes++;
+         WARN("overload: entering overload state, queue %i%%, lag %lims",
+              fill, lag);
+      }
+   } else {
+      if (((configuration.overload_queue <= 0) ||
+           (fill < configuration.overload_queue / 2)) &&
+          ((configuration.overload_lag <= 0) ||
+           (lag < configuration.overload_lag / 2))) {
+         ol_overloaded=0;
+         INFO("overload: leaving overload state, %lu requests rejected",
+              ol_stats.rejected);
+      }
+   }
+}
+
+
+/*
+ * does the topmost Via carry the "oc" parameter (RFC7339, 5.1)
+ */
+static int ol_via_has_oc(sip_ticket_t *ticket) {
+   char *end=ticket->raw_buffer + ticket->raw_buffer_len;
+   char *line, *p;
+   size_t len, i;
+
+   p=memchr(ticket->raw_buffer, '\n', ticket->raw_buffer_len);
+   if (p == NULL) return STS_FALSE;
+   line=sip_raw_get_header(p+1, end, "Via", 'v', &len);
+   if (line == NULL) return STS_FALSE;
+
+   for (i=0; i+3 <= len; i++) {
+      /* only the first Via value */
+      if (line[i] == ',') break;
+      if ((line[i] == ';') && (strncasecmp(&line[i+1], "oc", 2) == 0) &&
+          ((i+3 == len) || (strchr("=; \t\r\n,", line[i+3]) != NULL))) {
+         return STS_TRUE;
+      }
+   }
+   return STS_FALSE;
+}
@@ -207,6 +207,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
    // set new content length
    sprintf(clen,"%ld",(long)buflen);
    sts = osip_message_set_content_length(ticket->sipmsg, clen);
+   ticket->modified |= SIP_MOD_BODY;
 
    return STS_SUCCESS;
 }
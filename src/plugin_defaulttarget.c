@@ -183,6 +183,7 @@ static int plugin_defaulttarget_redirect(sip_ticket_t *ticket) {
    osip_contact_clone(default_target, &contact);
 
    osip_list_add(&(ticket->sipmsg->contacts),contact,0);
+   ticket->modified |= SIP_MOD_CONTACT;
 
    /* sent redirect message back to local client */
    sip_gen_response(ticket, 302 /*Moved temporarily*/);
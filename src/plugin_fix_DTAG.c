@@ -156,6 +156,7 @@ static int sip_fix_topvia(sip_ticket_t *ticket) {
       sts = osip_list_remove(&(ticket->sipmsg->vias), 0);
       osip_via_free (via);
       via = NULL;
+      ticket->modified |= SIP_MOD_VIA;
 
       /* 3) add my via header */
       DEBUGC(DBCLASS_PLUGIN, "plugin_fix_DTAG: adding new via");
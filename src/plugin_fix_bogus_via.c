@@ -155,6 +155,7 @@ static int sip_patch_topvia(sip_ticket_t *ticket) {
       via->port=osip_malloc(PORTSTRING_SIZE); /* 5 digits + \0 */
       snprintf(via->port, PORTSTRING_SIZE, "%u", ntohs(ticket->from.sin_port));
       via->port[PORTSTRING_SIZE-1] ='\0';
+      ticket->modified |= SIP_MOD_VIA;
 
       DEBUGC(DBCLASS_PLUGIN, "plugin_fix_bogus_via:  -> %s:%s",
              via->host, via->port);
@@ -44,7 +44,8 @@ static char desc[]="Fixes issues with incoming anonymous calls on Fritzbox UAs";
 extern struct siproxd_config configuration;
 
 /* global URL mapping table */
-extern struct urlmap_s urlmap[];
+extern struct urlmap_s *urlmap;
+extern int urlmap_size;
 
 /* plugin configuration storage */
 static struct plugin_config {
@@ -172,7 +173,7 @@ find some additional markers that allow nailing the actual phone number
 
 
          /* loop through urlmap table */
-         for (idx=0; idx<URLMAP_SIZE; idx++){
+         for (idx=0; idx<urlmap_size; idx++){
             if (urlmap[idx].active == 0) continue;
             if (urlmap[idx].expires < ticket->timestamp) continue;
             if (urlmap[idx].true_url == NULL) continue;
@@ -284,6 +285,7 @@ find some additional markers that allow nailing the actual phone number
             osip_free(contact->url->username);
             osip_uri_set_username(contact->url, 
                                   osip_strdup(urlmap[param_match_idx].true_url->username));
+            ticket->modified |= SIP_MOD_CONTACT;
 
             DEBUGC(DBCLASS_PLUGIN, "sanitized Contact from [%s] (uniq= match)",
                    utils_inet_ntoa(ticket->from.sin_addr));
@@ -295,6 +297,7 @@ find some additional markers that allow nailing the actual phone number
             osip_free(contact->url->username);
             osip_uri_set_username(contact->url, 
                                   osip_strdup(urlmap[to_user_match_idx].true_url->username));
+            ticket->modified |= SIP_MOD_CONTACT;
 
             DEBUGC(DBCLASS_PLUGIN, "sanitized Contact from [%s]"
                    " (To: user match)", utils_inet_ntoa(ticket->from.sin_addr));
@@ -249,6 +249,7 @@ static int plugin_prefix_redirect(sip_ticket_t *ticket) {
    /* strncpy may not terminate - do it manually to be sure */
    new_to_user[username_len-1]='\0';
    osip_list_add(&(ticket->sipmsg->contacts),contact,0);
+   ticket->modified |= SIP_MOD_CONTACT;
 
    INFO("redirecting %s -> %s", to_user, new_to_user);
 
@@ -345,6 +345,7 @@ static int plugin_regex_redirect(sip_ticket_t *ticket) {
    /* insert one new Contact header containing the new target address */
    osip_contact_init(&contact);
    osip_list_add(&(ticket->sipmsg->contacts),contact,0);
+   ticket->modified |= SIP_MOD_CONTACT;
    
    /* link the new_to_url into the Contact list */
    contact->url = new_to_url;
@@ -247,6 +247,7 @@ static int plugin_regex_body_redirect(sip_ticket_t *ticket) {
    mymsg->content_length=NULL;
    sprintf(clen,"%ld", (long) body_length);
    sts = osip_message_set_content_length(mymsg, clen);
+   ticket->modified |= SIP_MOD_BODY;
 
    return sts;
 }
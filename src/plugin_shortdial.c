@@ -236,6 +236,7 @@ static int plugin_shortdial_redirect(sip_ticket_t *ticket, int shortcut_no) {
    }
 
    osip_list_add(&(ticket->sipmsg->contacts),contact,0);
+   ticket->modified |= SIP_MOD_CONTACT;
 
    /* sent redirect message back to local client */
    sip_gen_response(ticket, 302 /*Moved temporarily*/);
@@ -43,7 +43,8 @@ static char desc[]="Handles SIP trunks with multiple numbers on same SIP account
 
 /* global configuration storage - required for config file location */
 extern struct siproxd_config configuration;
-extern struct urlmap_s urlmap[];		/* URL mapping table     */
+extern struct urlmap_s *urlmap;		/* URL mapping table     */
+extern int urlmap_size;
 
 /* plugin configuration storage */
 static struct plugin_config {
@@ -242,7 +243,7 @@ static int plugin_siptrunk_process(sip_ticket_t *ticket) {
          }
 
          /* search for an Account entry in registration DB */
-         for (j=0; j<URLMAP_SIZE; j++){
+         for (j=0; j<urlmap_size; j++){
             if (urlmap[j].active == 0) continue;
             if (urlmap[j].expires < ticket->timestamp) continue;
 
@@ -59,7 +59,8 @@ extern struct siproxd_config configuration;
       a stream during stats dump.
 */
 extern rtp_proxytable_t rtp_proxytable[];
-extern struct urlmap_s urlmap[];
+extern struct urlmap_s *urlmap;
+extern int urlmap_size;
 
 /* plugin configuration storage */
 static struct plugin_config {
@@ -83,6 +84,7 @@ static int stats_num_streams=0;
 static int stats_num_calls=0;
 static int stats_num_act_clients=0;
 static int stats_num_reg_clients=0;
+static const char *prio_names[SIP_PRIO_CLASSES]={"high", "INVITE", "low"};
 
 
 /* local prototypes */
@@ -395,7 +397,7 @@ static void stats_prepare(void) {
       }
    }
    
-   for (i=0; i < URLMAP_SIZE; i++) {
+   for (i=0; i < urlmap_size; i++) {
       if ((urlmap[i].active == 1) && (urlmap[j].expires >= time(NULL))) {
          stats_num_reg_clients++;
       }
@@ -404,8 +406,116 @@ static void stats_prepare(void) {
 }
 
 static void stats_to_syslog(void) {
+   int i;
+   sipsock_stats_t sockstats;
+   sip_arena_stats_t arenastats;
+   sip_raw_stats_t rawstats;
+   sip_splice_stats_t splicestats;
+   sip_trans_stats_t transstats;
+   sip_dialog_stats_t dialogstats;
+   register_stats_t regstats;
+   dns_async_stats_t dnsstats;
+   dns_cache_stats_t dnscachestats;
+   ratelimit_stats_t rlstats;
+   overload_stats_t olstats;
+   sip_prio_stats_t priostats;
+
    INFO("STATS: %i active Streams, %i active Calls, %i active Clients, %i registered Clients", 
         stats_num_streams, stats_num_calls, stats_num_act_clients, stats_num_reg_clients);
+
+   for (i=0; sipsock_udp_stats(i, &sockstats) == STS_SUCCESS; i++) {
+      INFO("STATS: SIP UDP socket %i: %lu received, %i drops, %i bytes queued, rcvbuf %i",
+           i, sockstats.rx_count, sockstats.drops, sockstats.rx_queued,
+           sockstats.rcvbuf);
+   }
+
+   if (sip_arena_get_stats(&arenastats) == STS_SUCCESS) {
+      INFO("STATS: SIP arena: %lu messages, %lu arena allocs, %lu heap allocs, "
+           "max %lu allocs/msg, high water %lu of %lu bytes, %lu extra chunks",
+           arenastats.messages, arenastats.arena_allocs, arenastats.heap_allocs,
+           arenastats.max_allocs, (unsigned long)arenastats.high_water,
+           (unsigned long)arenastats.arena_size, arenastats.extra_chunks);
+   }
+
+   if (sip_raw_get_stats(&rawstats) == STS_SUCCESS) {
+      INFO("STATS: fast path: %lu keepalives (%lu answered), "
+           "%lu OPTIONS answered, %lu non-SIP dropped, "
+           "%lu responses rendered",
+           rawstats.keepalives, rawstats.pongs, rawstats.options,
+           rawstats.dropped, rawstats.responses);
+   }
+
+   if (sip_splice_get_stats(&splicestats) == STS_SUCCESS) {
+      INFO("STATS: splicing: %lu messages spliced, %lu fully printed",
+           splicestats.spliced, splicestats.full);
+   }
+
+   if (sip_trans_get_stats(&transstats) == STS_SUCCESS) {
+      INFO("STATS: transaction cache: %lu lookups, %lu forwarded, "
+           "%lu answered from cache (%lu%% hits)",
+           transstats.lookups, transstats.req_hits, transstats.resp_hits,
+           (transstats.lookups)? (transstats.req_hits+transstats.resp_hits)
+                                 * 100 / transstats.lookups : 0);
+   }
+
+   if (sip_dialog_get_stats(&dialogstats) == STS_SUCCESS) {
+      INFO("STATS: dialogs: %lu active, %lu hits, %lu misses, %lu created, "
+           "%lu expired, %lu table full",
+           dialogstats.active, dialogstats.hits, dialogstats.misses,
+           dialogstats.created, dialogstats.expired, dialogstats.full);
+   }
+
+   if (register_get_stats(&regstats) == STS_SUCCESS) {
+      INFO("STATS: registrations: %lu active (table %lu/%lu), "
+           "%lu unregistered, %lu expired, next expiry in %lis",
+           regstats.active, regstats.size, regstats.max,
+           regstats.unregistered, regstats.expired, regstats.next_expiry);
+   }
+
+   if (dns_async_get_stats(&dnsstats) == STS_SUCCESS) {
+      INFO("STATS: DNS: %lu lookups, %lu merged, %lu pending, "
+           "%lu messages parked, %lu resumed, %lu dropped, %lu waiting",
+           dnsstats.lookups, dnsstats.merged, dnsstats.pending,
+           dnsstats.parked, dnsstats.resumed, dnsstats.dropped,
+           dnsstats.waiting);
+   }
+
+   if (dns_cache_get_stats(&dnscachestats) == STS_SUCCESS) {
+      INFO("STATS: DNS cache: %lu/%lu entries, %lu hits, %lu stale, "
+           "%lu negative, %lu misses, %lu expired, %lu evicted",
+           dnscachestats.entries, dnscachestats.size, dnscachestats.hits,
+           dnscachestats.stale, dnscachestats.negative,
+           dnscachestats.misses, dnscachestats.expired,
+           dnscachestats.evicted);
+   }
+
+   if (ratelimit_get_stats(&rlstats) == STS_SUCCESS) {
+      INFO("STATS: rate limit: %lu passed, %lu dropped, %lu bans, "
+           "%lu/%lu sources, %lu evicted",
+           rlstats.passed, rlstats.dropped, rlstats.banned,
+           rlstats.sources, rlstats.size, rlstats.evicted);
+   }
+
+   if (overload_get_stats(&olstats) == STS_SUCCESS) {
+      INFO("STATS: overload: %s, queue %i%%, lag %li ms (max %li ms), "
+           "service %li us, %lu episodes, %lu rejected",
+           olstats.overloaded ? "ACTIVE" : "no", olstats.queue_fill,
+           olstats.lag, olstats.max_lag, olstats.avg_service,
+           olstats.episodes, olstats.rejected);
+   }
+
+   if (sip_prio_get_stats(&priostats) == STS_SUCCESS) {
+      for (i=0; i<SIP_PRIO_CLASSES; i++) {
+         INFO("STATS: priority %s: %lu queued, %lu delivered, %lu aged, "
+              "%i waiting (max %i), max wait %li ms", prio_names[i],
+              priostats.queued[i], priostats.delivered[i], priostats.aged[i],
+              priostats.depth[i], priostats.max_depth[i],
+              priostats.max_wait[i]);
+      }
+      if (priostats.rejected) {
+         INFO("STATS: priority queue full %lu times", priostats.rejected);
+      }
+   }
 }
 
 static void stats_to_file(void) {
@@ -415,6 +525,20 @@ static void stats_to_file(void) {
    char remip[IPSTRING_SIZE];
    char lclip[IPSTRING_SIZE];
    time_t now;
+   sipsock_stats_t sockstats;
+   sip_arena_stats_t arenastats;
+   sip_raw_stats_t rawstats;
+   sip_splice_stats_t splicestats;
+   sip_trans_stats_t transstats;
+   sip_dialog_stats_t dialogstats;
+   register_stats_t regstats;
+   dns_async_stats_t dnsstats;
+   dns_cache_stats_t dnscachestats;
+   ratelimit_stats_t rlstats;
+   ratelimit_source_t rlsources[RATELIMIT_REPORT];
+   overload_stats_t olstats;
+   sip_prio_stats_t priostats;
+   int n;
 
    if (plugin_cfg.filename) {
       DEBUGC(DBCLASS_PLUGIN,"opening stats file for write");
@@ -444,6 +568,136 @@ static void stats_to_file(void) {
       fprintf(stream, "active Calls:       %6i\n", stats_num_calls);
       fprintf(stream, "active Streams:     %6i\n", stats_num_streams);
 
+      fprintf(stream, "\nSIP UDP Sockets\n---------------\n");
+      fprintf(stream, "Header; Socket; Received; Drops; Queued; RcvBuf\n");
+      for (i=0; sipsock_udp_stats(i, &sockstats) == STS_SUCCESS; i++) {
+         fprintf(stream, "Data;%i;%lu;%i;%i;%i\n", i, sockstats.rx_count,
+                 sockstats.drops, sockstats.rx_queued, sockstats.rcvbuf);
+      }
+
+      if (sip_arena_get_stats(&arenastats) == STS_SUCCESS) {
+         fprintf(stream, "\nSIP Message Arena\n-----------------\n");
+         fprintf(stream, "messages:           %6lu\n", arenastats.messages);
+         fprintf(stream, "arena allocations:  %6lu\n", arenastats.arena_allocs);
+         fprintf(stream, "heap allocations:   %6lu\n", arenastats.heap_allocs);
+         fprintf(stream, "max allocs/message: %6lu\n", arenastats.max_allocs);
+         fprintf(stream, "high water (bytes): %6lu\n",
+                 (unsigned long)arenastats.high_water);
+         fprintf(stream, "arena size (bytes): %6lu\n",
+                 (unsigned long)arenastats.arena_size);
+         fprintf(stream, "extra chunks:       %6lu\n", arenastats.extra_chunks);
+      }
+
+      if (sip_raw_get_stats(&rawstats) == STS_SUCCESS) {
+         fprintf(stream, "\nFast Path\n---------\n");
+         fprintf(stream, "keepalives:         %6lu\n", rawstats.keepalives);
+         fprintf(stream, "keepalive pongs:    %6lu\n", rawstats.pongs);
+         fprintf(stream, "OPTIONS answered:   %6lu\n", rawstats.options);
+         fprintf(stream, "non-SIP dropped:    %6lu\n", rawstats.dropped);
+         fprintf(stream, "responses rendered: %6lu\n", rawstats.responses);
+      }
+
+      if (sip_splice_get_stats(&splicestats) == STS_SUCCESS) {
+         fprintf(stream, "\nMessage Splicing\n----------------\n");
+         fprintf(stream, "spliced messages:   %6lu\n", splicestats.spliced);
+         fprintf(stream, "fully printed:      %6lu\n", splicestats.full);
+      }
+
+      if (sip_trans_get_stats(&transstats) == STS_SUCCESS) {
+         fprintf(stream, "\nTransaction Cache\n-----------------\n");
+         fprintf(stream, "requests looked up: %6lu\n", transstats.lookups);
+         fprintf(stream, "forwarded from cache:%5lu\n", transstats.req_hits);
+         fprintf(stream, "answered from cache:%6lu\n", transstats.resp_hits);
+         fprintf(stream, "messages stored:    %6lu\n", transstats.stored);
+      }
+
+      if (sip_dialog_get_stats(&dialogstats) == STS_SUCCESS) {
+         fprintf(stream, "\nDialog Table\n------------\n");
+         fprintf(stream, "active dialogs:     %6lu\n", dialogstats.active);
+         fprintf(stream, "lookup hits:        %6lu\n", dialogstats.hits);
+         fprintf(stream, "lookup misses:      %6lu\n", dialogstats.misses);
+         fprintf(stream, "dialogs created:    %6lu\n", dialogstats.created);
+         fprintf(stream, "dialogs expired:    %6lu\n", dialogstats.expired);
+         fprintf(stream, "table full:         %6lu\n", dialogstats.full);
+      }
+
+      if (register_get_stats(&regstats) == STS_SUCCESS) {
+         fprintf(stream, "\nRegistration Table\n------------------\n");
+         fprintf(stream, "active entries:     %6lu\n", regstats.active);
+         fprintf(stream, "table size:         %6lu\n", regstats.size);
+         fprintf(stream, "max_registrations:  %6lu\n", regstats.max);
+         fprintf(stream, "unregistered:       %6lu\n", regstats.unregistered);
+         fprintf(stream, "expired:            %6lu\n", regstats.expired);
+         fprintf(stream, "next expiry [s]:    %6li\n", regstats.next_expiry);
+      }
+
+      if (dns_async_get_stats(&dnsstats) == STS_SUCCESS) {
+         fprintf(stream, "\nAsynchronous DNS\n----------------\n");
+         fprintf(stream, "lookups started:    %6lu\n", dnsstats.lookups);
+         fprintf(stream, "lookups merged:     %6lu\n", dnsstats.merged);
+         fprintf(stream, "lookups pending:    %6lu\n", dnsstats.pending);
+         fprintf(stream, "messages parked:    %6lu\n", dnsstats.parked);
+         fprintf(stream, "messages resumed:   %6lu\n", dnsstats.resumed);
+         fprintf(stream, "messages dropped:   %6lu\n", dnsstats.dropped);
+         fprintf(stream, "messages waiting:   %6lu\n", dnsstats.waiting);
+         fprintf(stream, "no room:            %6lu\n", dnsstats.full);
+      }
+
+      if (dns_cache_get_stats(&dnscachestats) == STS_SUCCESS) {
+         fprintf(stream, "\nDNS Cache\n---------\n");
+         fprintf(stream, "entries:            %6lu\n", dnscachestats.entries);
+         fprintf(stream, "cache size:         %6lu\n", dnscachestats.size);
+         fprintf(stream, "hits:               %6lu\n", dnscachestats.hits);
+         fprintf(stream, "stale hits:         %6lu\n", dnscachestats.stale);
+         fprintf(stream, "negative hits:      %6lu\n", dnscachestats.negative);
+         fprintf(stream, "misses:             %6lu\n", dnscachestats.misses);
+         fprintf(stream, "expired:            %6lu\n", dnscachestats.expired);
+         fprintf(stream, "evicted:            %6lu\n", dnscachestats.evicted);
+      }
+
+      if (ratelimit_get_stats(&rlstats) == STS_SUCCESS) {
+         fprintf(stream, "\nRate Limiter\n------------\n");
+         fprintf(stream, "messages passed:    %6lu\n", rlstats.passed);
+         fprintf(stream, "messages dropped:   %6lu\n", rlstats.dropped);
+         fprintf(stream, "sources banned:     %6lu\n", rlstats.banned);
+         fprintf(stream, "sources tracked:    %6lu\n", rlstats.sources);
+         fprintf(stream, "table size:         %6lu\n", rlstats.size);
+         fprintf(stream, "sources evicted:    %6lu\n", rlstats.evicted);
+         n=ratelimit_get_sources(rlsources, RATELIMIT_REPORT);
+         fprintf(stream, "Header; Source; Dropped; Banned [s]\n");
+         for (i=0; i<n; i++) {
+            fprintf(stream, "Data;%s;%lu;%li\n",
+                    utils_inet_ntoa(rlsources[i].addr),
+                    rlsources[i].dropped, rlsources[i].banned);
+         }
+      }
+
+      if (overload_get_stats(&olstats) == STS_SUCCESS) {
+         fprintf(stream, "\nOverload Control\n----------------\n");
+         fprintf(stream, "overloaded:         %6s\n",
+                 olstats.overloaded ? "yes" : "no");
+         fprintf(stream, "queue fill [%%]:     %6i\n", olstats.queue_fill);
+         fprintf(stream, "lag [ms]:           %6li\n", olstats.lag);
+         fprintf(stream, "max lag [ms]:       %6li\n", olstats.max_lag);
+         fprintf(stream, "service time [us]:  %6li\n", olstats.avg_service);
+         fprintf(stream, "episodes:           %6lu\n", olstats.episodes);
+         fprintf(stream, "requests rejected:  %6lu\n", olstats.rejected);
+      }
+
+      if (sip_prio_get_stats(&priostats) == STS_SUCCESS) {
+         fprintf(stream, "\nPriority Queue\n--------------\n");
+         fprintf(stream, "queue size:         %6i\n", priostats.size);
+         fprintf(stream, "queue full:         %6lu\n", priostats.rejected);
+         fprintf(stream, "Header; Class; Queued; Delivered; Aged; Waiting; "
+                         "Max Waiting; Max Wait [ms]\n");
+         for (i=0; i<SIP_PRIO_CLASSES; i++) {
+            fprintf(stream, "Data;%s;%lu;%lu;%lu;%i;%i;%li\n", prio_names[i],
+                    priostats.queued[i], priostats.delivered[i],
+                    priostats.aged[i], priostats.depth[i],
+                    priostats.max_depth[i], priostats.max_wait[i]);
+         }
+      }
+
 #if 0
 //&&& future feature:
       fprintf(stream, "\nRegistered Clients\n------------------\n");
@@ -130,6 +130,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
                        pos, allow->value);
                 osip_list_remove(&ticket->sipmsg->allows, pos);
                 osip_allow_free(allow);
+                ticket->modified |= SIP_MOD_OTHER;
                 allow=NULL;
              } else {
                 /* remove only values "header_remove_args" */
@@ -138,6 +139,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
                           pos, allow->value);
                    osip_list_remove(&ticket->sipmsg->allows, pos);
                    osip_allow_free(allow);
+                   ticket->modified |= SIP_MOD_OTHER;
                    allow=NULL;
                 } else {
                    pos++;
@@ -160,6 +162,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
              osip_free(tmpstr);
              osip_list_remove(&ticket->sipmsg->record_routes, pos);
              osip_record_route_free(rroute);
+             ticket->modified |= SIP_MOD_RROUTE;
              rroute=NULL;
           }
 
@@ -176,6 +179,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
                        pos, h->hname, h->hvalue);
                 osip_list_remove(&ticket->sipmsg->headers, pos);
                 osip_header_free(h);
+                ticket->modified |= SIP_MOD_OTHER;
              } else {
                 /* remove only values "header_remove_args" */
                 if (osip_strcasecmp(header_remove_args, h->hvalue) == 0) {
@@ -183,6 +187,7 @@ int  PLUGIN_PROCESS(int stage, sip_ticket_t *ticket){
                           pos, h->hname, h->hvalue);
                    osip_list_remove(&ticket->sipmsg->headers, pos);
                    osip_header_free(h);
+                   ticket->modified |= SIP_MOD_OTHER;
                    h=NULL;
                 } else {
                    pos++;
@@ -100,9 +100,8 @@ int  PLUGIN_INIT(plugin_def_t *plugin_def) {
       return STS_FAILURE;
    }
 
-/*&&& resolve STUN server
-store IP
-*/
+   /* keep the STUN server resolved */
+   dns_async_keep(plugin_cfg.server);
 
    INFO("plugin_stun is initialized, using %s:%i as STUN server",
         plugin_cfg.server, plugin_cfg.port);
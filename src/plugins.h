@@ -89,7 +89,7 @@ typedef struct {
    lt_ptr dlhandle;	/* handle returned by dlopen() */
 } plugin_def_t;
 
-#define SIPROXD_API_VERSION	0x0102
+#define SIPROXD_API_VERSION	0x0104
 
 
 /* The plugin must provide the following entry points */
@@ -100,6 +100,10 @@ typedef struct {
      If you want to change a field, first osip_malloc() new space,
      move the pointer in the osip structure to the new place and then
      osip_free() the old area.
+   - any manipulation of the SIP message must be flagged in
+     ticket->modified (SIP_MOD_* in siproxd.h, SIP_MOD_OTHER if
+     nothing else fits). Only flagged parts are re-rendered when the
+     message is sent (see sip_splice.c), unflagged changes are lost.
 */
 /* plugin_init must define the following fields of the plugin_def_t structure:
    - api_version	(= SIPROXD_API_VERSION)
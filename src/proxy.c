@@ -40,7 +40,8 @@
 /* configuration storage */
 extern struct siproxd_config configuration;	/* defined in siproxd.c */
 
-extern struct urlmap_s urlmap[];		/* URL mapping table     */
+extern struct urlmap_s *urlmap;		/* URL mapping table     */
+extern int urlmap_size;
 extern struct lcl_if_s local_addresses;
 
 
@@ -139,8 +140,9 @@ int proxy_request (sip_ticket_t *ticket) {
        */
       /* 'i' still holds the valid index into the URLMAP table */
 DEBUGC(DBCLASS_PROXY,"index i=%i",i);
-      if ((i>=0) && (i < URLMAP_SIZE)) {
+      if ((i>=0) && (i < urlmap_size)) {
          proxy_rewrite_request_uri(request, i);
+         ticket->modified |= SIP_MOD_STARTLINE;
       }
 
       /* if this is CANCEL/BYE request, stop RTP proxying */
@@ -289,6 +291,7 @@ sts=sip_obscure_callid(ticket);
       sprintf(mfwd, "%i", forwards_count);
       max_forwards->hvalue = osip_strdup(mfwd);
    }
+   ticket->modified |= SIP_MOD_MAXFWD;
 
    DEBUGC(DBCLASS_PROXY,"setting Max-Forwards=%s",mfwd);
    }
@@ -382,30 +385,16 @@ sts=sip_obscure_callid(ticket);
     * destination from SIP URI
     */
    } else {
-      /* get the destination from the SIP URI */
-
-      /* 1) try SRV record */
-/*&&&& Here, the SRV record lookup magic must go.
-In a first implementation we may just try to get the lowest priority,
-max weighted '_sip._udp.domain' entry and port number.
-No load balancing and no failover are supported with this.
-&&&*/
-
-      /* 2) if no SRV record found, resolve A record */
-      sts = get_ip_by_host(request->req_uri->host, &ticket->next_hop.sin_addr);
+      /* get the destination from the SIP URI (NAPTR, SRV, A) */
+      sts = dns_srv_resolve(request->req_uri->host, request->req_uri->port,
+                            ticket->protocol, &ticket->next_hop.sin_addr,
+                            &ticket->next_hop.sin_port);
       if (sts == STS_FAILURE) {
          DEBUGC(DBCLASS_PROXY, "proxy_request: cannot resolve URI [%s]",
                 request->req_uri->host);
          return STS_FAILURE;
       }
 
-      ticket->next_hop.sin_port=SIP_PORT;
-      if (request->req_uri->port) {
-         ticket->next_hop.sin_port=atoi(request->req_uri->port);
-         if (ticket->next_hop.sin_port == 0) {
-            ticket->next_hop.sin_port=SIP_PORT;
-         }
-      }
       DEBUGC(DBCLASS_PROXY, "proxy_request: have SIP URI to %s:%i",
              utils_inet_ntoa(ticket->next_hop.sin_addr), ticket->next_hop.sin_port);
    }
@@ -440,14 +429,16 @@ No load balancing and no failover are supported with this.
    * RFC 3261, Section 16.6 step 10
    * Proxy Behavior - Forward the new request
    */
-   sts = sip_message_to_str(request, &buffer, &buflen);
-   if (sts != 0) {
-      ERROR("proxy_request: sip_message_to_str failed");
+   sts = sip_splice_to_str(ticket, &buffer, &buflen);
+   if (sts != STS_SUCCESS) {
+      ERROR("proxy_request: sip_splice_to_str failed");
       return STS_FAILURE;
    }
 
    sipsock_send(ticket->next_hop.sin_addr, ticket->next_hop.sin_port, 
                 ticket->protocol, buffer, buflen);
+   sip_trans_store_request(ticket->next_hop.sin_addr, ticket->next_hop.sin_port,
+                           ticket->protocol, buffer, buflen);
    osip_free (buffer);
 
   /*
@@ -616,6 +607,7 @@ sts=sip_obscure_callid(ticket);
           (MSG_TEST_CODE(response, 202))) {
          DEBUGC(DBCLASS_PROXY, "proxy_response: Grandstream hack 202->404");
          response->status_code=404;
+         ticket->modified |= SIP_MOD_STARTLINE;
       }
 }
       break;
@@ -765,13 +757,16 @@ sts=sip_obscure_callid(ticket);
   /*
    * Proxy Behavior - Forward the response
    */
-   sts = sip_message_to_str(response, &buffer, &buflen);
-   if (sts != 0) {
-      ERROR("proxy_response: sip_message_to_str failed");
+   sts = sip_splice_to_str(ticket, &buffer, &buflen);
+   if (sts != STS_SUCCESS) {
+      ERROR("proxy_response: sip_splice_to_str failed");
       return STS_FAILURE;
    }
 
    sipsock_send(ticket->next_hop.sin_addr, ticket->next_hop.sin_port, ticket->protocol, buffer, buflen);
+   sip_trans_store_response(ticket, response->status_code,
+                            ticket->next_hop.sin_addr, ticket->next_hop.sin_port,
+                            ticket->protocol, buffer, buflen);
    osip_free (buffer);
    return STS_SUCCESS;
 }
@@ -1197,6 +1192,7 @@ if (configuration.debuglevel)
    mymsg->content_length=NULL;
    sprintf(clen,"%ld",(long)buflen);
    sts = osip_message_set_content_length(mymsg, clen);
+   ticket->modified |= SIP_MOD_BODY;
 
    /* free new body string*/
    osip_free(buff);
@@ -1235,7 +1231,7 @@ int proxy_rewrite_request_uri(osip_message_t *mymsg, int idx){
    char *tmp1=NULL;
    char *tmp2=NULL;
 
-   if ((idx >= URLMAP_SIZE) || (idx < 0)) {
+   if ((idx >= urlmap_size) || (idx < 0)) {
       WARN("proxy_rewrite_request_uri: called with invalid index");
       return STS_FAILURE;
    }
@@ -1296,12 +1292,14 @@ int proxy_rewrite_useragent(sip_ticket_t *ticket){
              ua_hdr->hvalue, configuration.ua_string);
       osip_free(ua_hdr->hvalue);
       ua_hdr->hvalue=osip_strdup(configuration.ua_string);
+      ticket->modified |= SIP_MOD_UA;
    /* if UA string configured an no header present, add one */
    } else if (configuration.ua_string) {
       DEBUGC(DBCLASS_PROXY,"proxy_rewrite_useragent: setting new UA NULL -> [%s]",
              configuration.ua_string);
       if (ua_hdr) { osip_free(ua_hdr); }
       osip_message_set_user_agent(ticket->sipmsg, osip_strdup(configuration.ua_string));
+      ticket->modified |= SIP_MOD_UA;
    }
    return STS_SUCCESS;
 }
@@ -0,0 +1,379 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Per source rate limiting
+ *
+ * Every received message is charged to a token bucket of its source
+ * IP address before anything else is done with it (no parsing, no
+ * plugins). There are separate budgets for REGISTER, INVITE and all
+ * other messages (ratelimit_register, _invite, _other messages per
+ * second, bursts of ratelimit_burst seconds). Messages over the
+ * budget are dropped. A source that keeps on sending although it
+ * is being limited can be banned for ratelimit_ban seconds.
+ *
+ * Responses are not charged, and neither are messages that have been
+ * parked for name resolution (dns_async.c) and are now processed
+ * again. Peers that carry many calls from one address (the outbound
+ * proxies and the hosts in ratelimit_exempt) are never limited.
+ *
+ * The sources are kept in a fixed size, 4-way set associative hash
+ * table (ratelimit_sources). If a set is full, the source that has
+ * been silent for the longest time is replaced.
+ */
+
+/* budgets */
+#define RL_REGISTER	0
+#define RL_INVITE	1
+#define RL_OTHER	2
+#define RL_CLASSES	3
+
+#define RL_WAYS		4	/* entries per hash set */
+#define RL_TOKEN	1000	/* one message, in milli-tokens */
+
+typedef struct {
+   struct in_addr addr;
+   int used;
+   long long last;		/* time of last refill (msec) */
+   long tokens[RL_CLASSES];	/* milli-tokens */
+   time_t banned_until;
+   unsigned long excess;	/* drops since last message passed */
+   unsigned long dropped;
+} rl_source_t;
+
+static rl_source_t *rl_table=NULL;
+static int rl_sets=0;		/* power of 2 */
+static int rl_rate[RL_CLASSES];	/* messages per second, 0=unlimited */
+static int rl_enabled=0;
+
+/* statistics */
+static ratelimit_stats_t rl_stats;
+
+/* local prototypes */
+static rl_source_t *rl_find(struct in_addr addr, long long now);
+static int rl_class(char *buf, size_t len);
+static int rl_exempt(struct in_addr addr);
+
+
+/*
+ * initialize the rate limiter
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int ratelimit_init(void) {
+   int size;
+
+   memset(&rl_stats, 0, sizeof(rl_stats));
+   rl_rate[RL_REGISTER]=configuration.ratelimit_register;
+   rl_rate[RL_INVITE]=configuration.ratelimit_invite;
+   rl_rate[RL_OTHER]=configuration.ratelimit_other;
+
+   if ((rl_rate[RL_REGISTER] <= 0) && (rl_rate[RL_INVITE] <= 0) &&
+       (rl_rate[RL_OTHER] <= 0)) {
+      DEBUGC(DBCLASS_ACCESS, "rate limiting disabled");
+      return STS_SUCCESS;
+   }
+
+   if (configuration.ratelimit_burst <= 0) {
+      configuration.ratelimit_burst=RATELIMIT_BURST;
+   }
+   size=configuration.ratelimit_sources;
+   if (size <= 0) size=RATELIMIT_SOURCES;
+   for (rl_sets=1; rl_sets * RL_WAYS < size; rl_sets <<= 1);
+
+   rl_table=calloc(rl_sets * RL_WAYS, sizeof(rl_source_t));
+   if (rl_table == NULL) {
+      ERROR("unable to allocate rate limiter (%i sources)", rl_sets * RL_WAYS);
+      return STS_FAILURE;
+   }
+   rl_stats.size=rl_sets * RL_WAYS;
+   rl_enabled=1;
+
+   INFO("rate limiting per source: REGISTER %i/s, INVITE %i/s, other %i/s, "
+        "burst %is, ban %is", rl_rate[RL_REGISTER], rl_rate[RL_INVITE],
+        rl_rate[RL_OTHER], configuration.ratelimit_burst,
+        configuration.ratelimit_ban);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * charge a received message to the budget of its source
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message may be processed
+ *	STS_FAILURE if the message is to be dropped
+ */
+int ratelimit_check(sip_ticket_t *ticket) {
+   struct timeval tv;
+   long long now;
+   rl_source_t *src;
+   long cap, elapsed;
+   int i, cls;
+
+   if (!rl_enabled) return STS_SUCCESS;
+
+   /* responses, and messages charged already before being parked */
+   if ((ticket->raw_buffer_len > 8) &&
+       (memcmp(ticket->raw_buffer, "SIP/2.0 ", 8) == 0)) {
+      return STS_SUCCESS;
+   }
+   if (dns_async_resumed() == STS_TRUE) return STS_SUCCESS;
+
+   gettimeofday(&tv, NULL);
+   now=(long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+   src=rl_find(ticket->from.sin_addr, now);
+
+   /* banned */
+   if (src->banned_until) {
+      if (src->banned_until > tv.tv_sec) {
+         src->dropped++;
+         rl_stats.dropped++;
+         return STS_FAILURE;
+      }
+      INFO("rate limit: ban of %s lifted", utils_inet_ntoa(src->addr));
+      src->banned_until=0;
+      src->excess=0;
+   }
+
+   /* refill the buckets */
+   elapsed=(long)(now - src->last);
+   if (elapsed > 0) {
+      for (i=0; i<RL_CLASSES; i++) {
+         if (rl_rate[i] <= 0) continue;
+         cap=(long)rl_rate[i] * configuration.ratelimit_burst * RL_TOKEN;
+         if (elapsed >= cap / rl_rate[i]) {
+            src->tokens[i]=cap;
+         } else {
+            src->tokens[i] += elapsed * rl_rate[i];
+            if (src->tokens[i] > cap) src->tokens[i]=cap;
+         }
+      }
+      src->last=now;
+   }
+
+   cls=rl_class(ticket->raw_buffer, ticket->raw_buffer_len);
+   if (rl_rate[cls] <= 0) {
+      rl_stats.passed++;
+      return STS_SUCCESS;
+   }
+
+   if (src->tokens[cls] >= RL_TOKEN) {
+      src->tokens[cls] -= RL_TOKEN;
+      src->excess=0;
+      rl_stats.passed++;
+      return STS_SUCCESS;
+   }
+
+   /* over the budget - trunks and outbound proxies are never limited */
+   if (rl_exempt(src->addr) == STS_TRUE) {
+      rl_stats.passed++;
+      return STS_SUCCESS;
+   }
+   src->excess++;
+   src->dropped++;
+   rl_stats.dropped++;
+   DEBUGC(DBCLASS_ACCESS, "rate limit: dropping message from %s:%u",
+          utils_inet_ntoa(ticket->from.sin_addr),
+          ntohs(ticket->from.sin_port));
+
+   /* flooding on: a burst worth of drops in a row */
+   if ((configuration.ratelimit_ban > 0) &&
+       (src->excess >= (unsigned long)rl_rate[cls] *
+                       configuration.ratelimit_burst)) {
+      src->banned_until=tv.tv_sec + configuration.ratelimit_ban;
+      rl_stats.banned++;
+      INFO("rate limit: banning %s for %is, %lu messages dropped",
+           utils_inet_ntoa(src->addr), configuration.ratelimit_ban,
+           src->dropped);
+   }
+   return STS_FAILURE;
+}
+
+
+/*
+ * get the rate limiter statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not enabled
+ */
+int ratelimit_get_stats(ratelimit_stats_t *stats) {
+   int i;
+
+   if (!rl_enabled || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &rl_stats, sizeof(ratelimit_stats_t));
+   stats->sources=0;
+   for (i=0; i<rl_sets * RL_WAYS; i++) {
+      if (rl_table[i].used) stats->sources++;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * get the sources with the most dropped messages
+ * list		returned sources, ordered by drops
+ * max		size of list
+ *
+ * RETURNS
+ *	number of sources returned
+ */
+int ratelimit_get_sources(ratelimit_source_t *list, int max) {
+   int i, k, n=0;
+   time_t now;
+
+   if (!rl_enabled || (list == NULL)) return 0;
+
+   time(&now);
+   for (i=0; i<rl_sets * RL_WAYS; i++) {
+      if (!rl_table[i].used || (rl_table[i].dropped == 0)) continue;
+
+      /* insert sorted */
+      for (k=n; k > 0; k--) {
+         if (list[k-1].dropped >= rl_table[i].dropped) break;
+         if (k < max) list[k]=list[k-1];
+      }
+      if (k >= max) continue;
+      list[k].addr=rl_table[i].addr;
+      list[k].dropped=rl_table[i].dropped;
+      list[k].banned=(rl_table[i].banned_until > now) ?
+                     rl_table[i].banned_until - now : 0;
+      if (n < max) n++;
+   }
+   return n;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * find the entry of a source, create it if not present
+ */
+static rl_source_t *rl_find(struct in_addr addr, long long now) {
+   unsigned int h;
+   rl_source_t *set, *victim=NULL;
+   int i;
+
+   /* multiplicative hash of the address */
+   h=ntohl(addr.s_addr) * 2654435761U;
+   h=(h ^ (h >> 15)) & (rl_sets - 1);
+   set=&rl_table[h * RL_WAYS];
+
+   for (i=0; i<RL_WAYS; i++) {
+      if (set[i].used && (set[i].addr.s_addr == addr.s_addr)) {
+         return &set[i];
+      }
+   }
+
+   for (i=0; i<RL_WAYS; i++) {
+      if (!set[i].used) {
+         victim=&set[i];
+         break;
+      }
+      if ((victim == NULL) ||
+          ((victim->banned_until != 0) > (set[i].banned_until != 0)) ||
+          (((victim->banned_until != 0) == (set[i].banned_until != 0)) &&
+           (set[i].last < victim->last))) {
+         victim=&set[i];
+      }
+   }
+
+   /* new source, replacing the one silent for the longest time
+    * (a banned source is only replaced if it is the only choice) */
+   if (victim->used) rl_stats.evicted++;
+   memset(victim, 0, sizeof(rl_source_t));
+   victim->used=1;
+   victim->addr=addr;
+   victim->last=now;
+   for (i=0; i<RL_CLASSES; i++) {
+      victim->tokens[i]=(long)rl_rate[i] * configuration.ratelimit_burst *
+                        RL_TOKEN;
+   }
+   return victim;
+}
+
+
+/*
+ * is a source exempt from rate limiting: one of the outbound proxies
+ * or in ratelimit_exempt
+ */
+static int rl_exempt(struct in_addr addr) {
+   struct sockaddr_in from;
+   struct in_addr proxy;
+   int i;
+
+   if (configuration.ratelimit_exempt) {
+      memset(&from, 0, sizeof(from));
+      from.sin_family=AF_INET;
+      from.sin_addr=addr;
+      if (process_aclist(configuration.ratelimit_exempt, from) == STS_SUCCESS) {
+         return STS_TRUE;
+      }
+   }
+
+   if (configuration.outbound_proxy_host &&
+       (get_ip_by_host(configuration.outbound_proxy_host, &proxy) == STS_SUCCESS) &&
+       (proxy.s_addr == addr.s_addr)) {
+      return STS_TRUE;
+   }
+
+   for (i=0; i<configuration.outbound_proxy_domain_host.used; i++) {
+      if ((get_ip_by_host(configuration.outbound_proxy_domain_host.string[i],
+                          &proxy) == STS_SUCCESS) &&
+          (proxy.s_addr == addr.s_addr)) {
+         return STS_TRUE;
+      }
+   }
+   return STS_FALSE;
+}
+
+
+/*
+ * budget of a message, by its method
+ */
+static int rl_class(char *buf, size_t len) {
+   if ((len > 9) && (memcmp(buf, "REGISTER ", 9) == 0)) return RL_REGISTER;
+   if ((len > 7) && (memcmp(buf, "INVITE ", 7) == 0)) return RL_INVITE;
+   return RL_OTHER;
+}
@@ -78,7 +78,10 @@ int add_to_redirected_cache(redirected_cache_element_t *redirected_cache, sip_ti
    /* populate element */
    e->next = NULL;
    e->ts   = time(NULL);
+   /* the cache entry outlives the message, allocate from heap */
+   sip_arena_suspend();
    osip_call_id_clone(ticket->sipmsg->call_id, &(e->call_id));
+   sip_arena_resume();
 
    /* add to head of queue */
    e->next = redirected_cache->next;
@@ -0,0 +1,535 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Registration journal
+ *
+ * The registration file is a snapshot of the registration table.
+ * Changes are appended as records to a journal (<file>.journal):
+ * the records are collected in memory and written on each call of
+ * reg_journal_sync(), the journal is fsync'ed every
+ * registration_sync seconds.
+ *
+ * Compaction writes a new snapshot and renames it over the old one.
+ * The journal is renamed to <file>.journal.old before, new records go
+ * to a new journal. The snapshot is built in memory by the caller,
+ * writing it to disk is done by a background thread. Once the new
+ * snapshot is in place, <file>.journal.old is removed.
+ *
+ * On startup the snapshot, <file>.journal.old (if present) and
+ * <file>.journal are read in this order. Replaying a record that is
+ * already contained in the snapshot does no harm, the last record
+ * of an entry always describes its latest state.
+ *
+ * All file operations that may block (fsync, writing the snapshot)
+ * are done in the background thread, the SIP thread only does
+ * appending write()s to the journal.
+ */
+
+static char *journal_name=NULL;		/* <file>.journal */
+static char *journal_old_name=NULL;	/* <file>.journal.old */
+static char *snapshot_tmp_name=NULL;	/* <file>.tmp */
+
+static int journal_fd=-1;
+static size_t journal_size=0;		/* bytes written to journal */
+static time_t last_sync=0;
+
+/* records not yet written */
+static char *pending=NULL;
+static size_t pending_len=0;
+static size_t pending_size=0;
+
+/* background thread and its job */
+static pthread_t journal_tid;
+static int journal_thread=0;		/* thread is running */
+static pthread_mutex_t journal_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond=PTHREAD_COND_INITIALIZER;
+static int job_sync=0;			/* fsync journal_fd */
+static char *job_snapshot=NULL;		/* snapshot to write */
+static size_t job_snapshot_len=0;
+static int job_old_fd=-1;		/* rotated journal to close */
+static int job_busy=0;			/* compaction in progress */
+static int job_exit=0;
+
+/* local prototypes */
+static void *reg_journal_main(void *arg);
+static int reg_journal_write_snapshot(char *buf, size_t len);
+static int reg_journal_write(int fd, char *buf, size_t len);
+static void reg_journal_sync_dir(void);
+static int reg_journal_names(void);
+
+
+/*
+ * open the journal and start the background thread
+ * valid: length of the complete records in the journal, an
+ *        incomplete record at its end (crash) is cut off
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int reg_journal_init(long valid) {
+   struct stat st;
+   pthread_attr_t attr;
+   int sts;
+
+   if (reg_journal_names() != STS_SUCCESS) return STS_FAILURE;
+
+   journal_fd=open(journal_name, O_WRONLY|O_CREAT|O_APPEND, 0644);
+   if (journal_fd < 0) {
+      ERROR("unable to open registration journal %s: %s", journal_name,
+            strerror(errno));
+      return STS_FAILURE;
+   }
+   if (fstat(journal_fd, &st) == 0) journal_size=st.st_size;
+   if ((valid >= 0) && (journal_size > valid)) {
+      WARN("registration journal: incomplete record at the end, "
+           "%lu bytes cut off", (unsigned long)(journal_size-valid));
+      if (ftruncate(journal_fd, valid) == 0) journal_size=valid;
+   }
+
+   /* thread stack size as for the RTP thread (thread_stack_size) */
+   pthread_attr_init(&attr);
+   if (configuration.thread_stack_size > 0) {
+      pthread_attr_setstacksize(&attr, configuration.thread_stack_size*1024);
+   }
+   sts=pthread_create(&journal_tid, &attr, reg_journal_main, NULL);
+   pthread_attr_destroy(&attr);
+   if (sts != 0) {
+      ERROR("unable to start registration journal thread: %s",
+            strerror(sts));
+      return STS_FAILURE;
+   }
+   journal_thread=1;
+   time(&last_sync);
+
+   DEBUGC(DBCLASS_REG, "registration journal %s, %lu bytes",
+          journal_name, (unsigned long)journal_size);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * get the names of the journal files for replay
+ * which: 0 = journal, 1 = rotated journal
+ *
+ * RETURNS
+ *	file name, NULL if not available
+ */
+char *reg_journal_name(int which) {
+   if (reg_journal_names() != STS_SUCCESS) return NULL;
+   return (which)? journal_old_name : journal_name;
+}
+
+
+/*
+ * queue a record for the journal
+ *
+ * RETURNS: -
+ */
+void reg_journal_append(const char *rec, size_t len) {
+   if (journal_fd < 0) return;
+
+   if (pending_len+len > pending_size) {
+      size_t size=(pending_size)? pending_size : 4096;
+      char *p;
+      while (size < pending_len+len) size *= 2;
+      p=realloc(pending, size);
+      if (p == NULL) {
+         ERROR("reg_journal_append: out of memory, record lost");
+         return;
+      }
+      pending=p;
+      pending_size=size;
+   }
+   memcpy(&pending[pending_len], rec, len);
+   pending_len+=len;
+
+   /* do not collect too much */
+   if (pending_len >= REG_JOURNAL_BATCH) reg_journal_sync(0);
+}
+
+
+/*
+ * write the queued records to the journal, have it fsync'ed
+ * if registration_sync seconds have passed
+ * force: fsync now
+ *
+ * RETURNS: -
+ */
+void reg_journal_sync(int force) {
+   time_t now;
+
+   if (journal_fd < 0) return;
+
+   if (pending_len > 0) {
+      if (reg_journal_write(journal_fd, pending, pending_len) != STS_SUCCESS) {
+         ERROR("unable to write registration journal: %s", strerror(errno));
+      } else {
+         journal_size+=pending_len;
+      }
+      pending_len=0;
+   }
+
+   time(&now);
+   if (force || ((last_sync + configuration.registration_sync) <= now)) {
+      pthread_mutex_lock(&journal_mutex);
+      job_sync=1;
+      pthread_cond_signal(&journal_cond);
+      pthread_mutex_unlock(&journal_mutex);
+      last_sync=now;
+   }
+}
+
+
+/*
+ * size of the journal
+ *
+ * RETURNS
+ *	number of bytes written to the journal since the last compaction
+ */
+size_t reg_journal_size(void) {
+   return journal_size;
+}
+
+
+/*
+ * compaction: have the snapshot written and the journal rotated
+ * snapshot: complete registration table in the format of the
+ *           registration file, malloc()'ed, is taken over
+ * wait:     wait until the snapshot is on disk
+ *
+ * RETURNS
+ *	STS_SUCCESS if the snapshot is being written
+ *	STS_FAILURE if a compaction is still in progress or on error
+ */
+int reg_journal_compact(char *snapshot, size_t len, int wait) {
+   int old_fd=-1;
+
+   if (!journal_thread) {
+      /* no journal - write it in place */
+      int sts=STS_FAILURE;
+      if (configuration.registrationfile) {
+         sts=reg_journal_write_snapshot(snapshot, len);
+      }
+      free(snapshot);
+      return sts;
+   }
+
+   pthread_mutex_lock(&journal_mutex);
+   if (job_busy && wait) {
+      while (job_busy) pthread_cond_wait(&journal_cond, &journal_mutex);
+   }
+   if (job_busy) {
+      pthread_mutex_unlock(&journal_mutex);
+      free(snapshot);
+      return STS_FAILURE;
+   }
+   pthread_mutex_unlock(&journal_mutex);
+
+   /* everything up to now is contained in the snapshot */
+   reg_journal_sync(0);
+
+   /* rotate the journal. If an old journal still exists (a previous
+    * compaction failed), keep it and continue with the current one,
+    * both are covered by the new snapshot. */
+   if (access(journal_old_name, F_OK) != 0) {
+      if (rename(journal_name, journal_old_name) == 0) {
+         int fd=open(journal_name, O_WRONLY|O_CREAT|O_APPEND, 0644);
+         if (fd >= 0) {
+            old_fd=journal_fd;
+            journal_size=0;
+            pthread_mutex_lock(&journal_mutex);
+            journal_fd=fd;
+            pthread_mutex_unlock(&journal_mutex);
+         } else {
+            ERROR("unable to open registration journal %s: %s",
+                  journal_name, strerror(errno));
+            /* continue with the current one */
+            rename(journal_old_name, journal_name);
+         }
+      } else {
+         ERROR("unable to rotate registration journal: %s",
+               strerror(errno));
+      }
+   }
+
+   pthread_mutex_lock(&journal_mutex);
+   job_snapshot=snapshot;
+   job_snapshot_len=len;
+   job_old_fd=old_fd;
+   job_busy=1;
+   pthread_cond_signal(&journal_cond);
+   if (wait) {
+      while (job_busy) pthread_cond_wait(&journal_cond, &journal_mutex);
+   }
+   pthread_mutex_unlock(&journal_mutex);
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * is a compaction in progress?
+ *
+ * RETURNS
+ *	STS_TRUE if busy
+ *	STS_FALSE if not
+ */
+int reg_journal_busy(void) {
+   int busy;
+
+   pthread_mutex_lock(&journal_mutex);
+   busy=job_busy;
+   pthread_mutex_unlock(&journal_mutex);
+   return (busy)? STS_TRUE : STS_FALSE;
+}
+
+
+/*
+ * stop the background thread, the journal is synced and closed
+ *
+ * RETURNS: -
+ */
+void reg_journal_shutdown(void) {
+   if (!journal_thread) return;
+
+   reg_journal_sync(1);
+
+   pthread_mutex_lock(&journal_mutex);
+   job_exit=1;
+   pthread_cond_signal(&journal_cond);
+   pthread_mutex_unlock(&journal_mutex);
+   pthread_join(journal_tid, NULL);
+   journal_thread=0;
+
+   close(journal_fd);
+   journal_fd=-1;
+   free(pending);
+   pending=NULL;
+   pending_len=pending_size=0;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * background thread: fsync the journal and write snapshots
+ */
+static void *reg_journal_main(void *arg) {
+   int sync_fd;
+   char *snapshot;
+   size_t len;
+   int old_fd;
+   int do_exit;
+
+   for (;;) {
+      pthread_mutex_lock(&journal_mutex);
+      while (!job_sync && !job_snapshot && !job_exit) {
+         pthread_cond_wait(&journal_cond, &journal_mutex);
+      }
+      sync_fd=(job_sync)? journal_fd : -1;
+      job_sync=0;
+      snapshot=job_snapshot;
+      len=job_snapshot_len;
+      old_fd=job_old_fd;
+      job_snapshot=NULL;
+      job_old_fd=-1;
+      do_exit=job_exit;
+      pthread_mutex_unlock(&journal_mutex);
+
+      if (sync_fd >= 0) {
+         if (fsync(sync_fd) != 0) {
+            ERROR("fsync of registration journal failed: %s",
+                  strerror(errno));
+         }
+      }
+
+      if (snapshot) {
+         /* the rotated journal must be durable until the snapshot is */
+         if (old_fd >= 0) {
+            fsync(old_fd);
+            close(old_fd);
+         }
+         if (reg_journal_write_snapshot(snapshot, len) == STS_SUCCESS) {
+            unlink(journal_old_name);
+         }
+         free(snapshot);
+
+         pthread_mutex_lock(&journal_mutex);
+         job_busy=0;
+         pthread_cond_broadcast(&journal_cond);
+         pthread_mutex_unlock(&journal_mutex);
+      }
+
+      if (do_exit) break;
+   }
+
+   /* final fsync of the journal */
+   if (journal_fd >= 0) fsync(journal_fd);
+   return NULL;
+}
+
+
+/*
+ * build the names of the journal files
+ */
+static int reg_journal_names(void) {
+   size_t len;
+
+   if (journal_name) return STS_SUCCESS;
+   if (configuration.registrationfile == NULL) return STS_FAILURE;
+
+   len=strlen(configuration.registrationfile)+sizeof(REG_JOURNAL_OLD_SUFFIX);
+   journal_name=malloc(len);
+   journal_old_name=malloc(len);
+   snapshot_tmp_name=malloc(len);
+   if ((journal_name == NULL) || (journal_old_name == NULL) ||
+       (snapshot_tmp_name == NULL)) {
+      ERROR("registration journal: out of memory");
+      free(journal_name);
+      free(journal_old_name);
+      free(snapshot_tmp_name);
+      journal_name=journal_old_name=snapshot_tmp_name=NULL;
+      return STS_FAILURE;
+   }
+   snprintf(journal_name, len, "%s"REG_JOURNAL_SUFFIX,
+            configuration.registrationfile);
+   snprintf(journal_old_name, len, "%s"REG_JOURNAL_OLD_SUFFIX,
+            configuration.registrationfile);
+   snprintf(snapshot_tmp_name, len, "%s.tmp",
+            configuration.registrationfile);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * write the snapshot to a temporary file and rename it
+ * over the registration file
+ */
+static int reg_journal_write_snapshot(char *buf, size_t len) {
+   char *tmp_name=snapshot_tmp_name;
+   char tmp_buf[PATH_STRING_SIZE];
+   int fd;
+
+   if (tmp_name == NULL) {
+      snprintf(tmp_buf, sizeof(tmp_buf), "%s.tmp",
+               configuration.registrationfile);
+      tmp_name=tmp_buf;
+   }
+
+   fd=open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if (fd < 0) {
+      ERROR("unable to write registration file %s: %s", tmp_name,
+            strerror(errno));
+      return STS_FAILURE;
+   }
+   if ((reg_journal_write(fd, buf, len) != STS_SUCCESS) ||
+       (fsync(fd) != 0)) {
+      ERROR("unable to write registration file %s: %s", tmp_name,
+            strerror(errno));
+      close(fd);
+      unlink(tmp_name);
+      return STS_FAILURE;
+   }
+   close(fd);
+
+   if (rename(tmp_name, configuration.registrationfile) != 0) {
+      ERROR("unable to rename %s to %s: %s", tmp_name,
+            configuration.registrationfile, strerror(errno));
+      unlink(tmp_name);
+      return STS_FAILURE;
+   }
+   reg_journal_sync_dir();
+
+   DEBUGC(DBCLASS_REG, "registration file written, %lu bytes",
+          (unsigned long)len);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * write() the whole buffer
+ */
+static int reg_journal_write(int fd, char *buf, size_t len) {
+   ssize_t n;
+
+   while (len > 0) {
+      n=write(fd, buf, len);
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         return STS_FAILURE;
+      }
+      buf+=n;
+      len-=n;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * fsync the directory of the registration file (makes the rename
+ * durable)
+ */
+static void reg_journal_sync_dir(void) {
+   char dir[PATH_STRING_SIZE];
+   char *p;
+   int fd;
+
+   snprintf(dir, sizeof(dir), "%s", configuration.registrationfile);
+   p=strrchr(dir, '/');
+   if (p == NULL) {
+      strcpy(dir, ".");
+   } else if (p == dir) {
+      dir[1]='\0';
+   } else {
+      *p='\0';
+   }
+
+   fd=open(dir, O_RDONLY);
+   if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+   }
+}
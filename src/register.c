@@ -38,91 +38,75 @@
 /* configuration storage */
 extern struct siproxd_config configuration;
 
-/* URL mapping table     */
-struct urlmap_s urlmap[URLMAP_SIZE];
+/* URL mapping table, grows on demand up to max_registrations entries */
+struct urlmap_s *urlmap=NULL;
+int urlmap_size=0;
 
 /* time of last save     */
 static time_t last_save=0;
 
+/* statistics */
+static register_stats_t register_stats;
+
 extern int errno;
 
+/* growing buffer for registration file and journal records */
+typedef struct {
+   char *buf;
+   size_t len;
+   size_t size;
+   int error;
+} regbuf_t;
+
+/* local prototypes */
+static int register_grow(void);
+static int register_load(char *name, int journal, long *valid);
+static int register_getline(FILE *stream, char *buff, int size);
+static osip_uri_t *register_parse_url(char *buff);
+static int register_find_reg(osip_uri_t *url);
+static void register_free_entry(int i);
+static void register_format_entry(regbuf_t *b, int i, int remove);
+static void register_journal(int i, int remove);
+static void register_compact(int wait);
+static void register_buf_add(regbuf_t *b, const char *str);
+static void register_buf_url(regbuf_t *b, osip_uri_t *url);
+
 
 /*
  * initialize the URL mapping table
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
  */
-void register_init(void) {
-   FILE *stream;
-   int sts, i;
-   char buff[128];
-   char *t;
-
-   memset(urlmap, 0, sizeof(urlmap));
+int register_init(void) {
+   if (configuration.max_registrations <= 0) {
+      configuration.max_registrations=URLMAP_SIZE;
+   }
+   if (register_grow() != STS_SUCCESS) {
+      return STS_FAILURE;
+   }
 
    if (configuration.registrationfile) {
-      stream = fopen(configuration.registrationfile, "r");
+      long valid=0;
 
-      if (!stream) {
-         /*
-          * the file does not exist, or the size was incorrect,
-          * delete it and start from scratch
-          */
-         unlink(configuration.registrationfile);
+      /* snapshot, then the changes since */
+      if (register_load(configuration.registrationfile, 0, NULL) != STS_SUCCESS) {
          WARN("registration file not found, starting with empty table");
-      } else {
-         /* read the url table from file */
-         DEBUGC(DBCLASS_REG,"loading registration table, size=%i",URLMAP_SIZE);
-         for (i=0;i < URLMAP_SIZE; i++) {
-            int a=0;
-            long long e=0;
-            t=fgets(buff, sizeof(buff), stream);
-            if (t==NULL) { break;}
-            sts=sscanf(buff, "****:%i:%lld", &a, &e);
-            urlmap[i].active=a;
-            urlmap[i].expires=(time_t)e;
-            if (sts == 0) break; /* format error */
-            if (urlmap[i].active) {
-               #define R(X) {\
-               sts=osip_uri_init(&X); \
-               if (sts == 0) { \
-                  t=fgets(buff, sizeof(buff), stream);\
-                  buff[sizeof(buff)-1]='\0';\
-                  if (strchr(buff, 10)) *strchr(buff, 10)='\0';\
-                  if (strchr(buff, 13)) *strchr(buff, 13)='\0';\
-                  if (strlen(buff) > 0) {\
-                     sts = osip_uri_parse(X, buff); \
-                     if (sts != 0) { \
-                        ERROR("Unable to parse URI: %s", buff); \
-                        osip_uri_free(X); \
-                        X = NULL; \
-                     } \
-                  } else { \
-                     DEBUGC(DBCLASS_BABBLE, "empty URI"); \
-                     osip_uri_free(X); \
-                     X = NULL; \
-                  } \
-               } else { \
-                  ERROR("Unable to initialize URI structure"); \
-               } \
-               }
-
-               R(urlmap[i].true_url);
-               R(urlmap[i].masq_url);
-               R(urlmap[i].reg_url);
-
-            }
-         }
-         fclose(stream);
+      }
+      register_load(reg_journal_name(1), 1, NULL);
+      register_load(reg_journal_name(0), 1, &valid);
 
-         /* check for premature abort of reading the registration file,
-            may happen if URLMAP_SIZE has been resized (bigger) */
-         if (i < URLMAP_SIZE) {
-            WARN("registration file may be corrupt or URLMAP_SIZE has been resized");
-         }
+      /* continue the journal after its last complete record */
+      if (reg_journal_init(valid) != STS_SUCCESS) {
+         WARN("registration journal not available, registrations "
+              "are only saved on exit");
       }
    }
+
    /* initialize save-timer */
    time(&last_save);
-   return;
+   return STS_SUCCESS;
 }
 
 
@@ -130,47 +114,38 @@ void register_init(void) {
  * shut down the URL mapping table
  */
 void register_save(void) {
-   int i;
-   FILE *stream;
-
    if (configuration.registrationfile) {
       DEBUGC(DBCLASS_REG,"saving registration table");
-      /* write urlmap back to file */
-      stream = fopen(configuration.registrationfile, "w+");
-      if (!stream) {
-         /* try to unlink it and open again */
-         unlink(configuration.registrationfile);
-         stream = fopen(configuration.registrationfile, "w+");
-
-         /* open file for write failed, complain */
-         if (!stream) {
-            ERROR("unable to write registration file");
-            return;
-         }
-      }
-
-      for (i=0;i < URLMAP_SIZE; i++) {
-         fprintf(stream, "****:%i:%lld\n", urlmap[i].active, (long long)urlmap[i].expires);
-         if (urlmap[i].active) {
-            #define W(X) { \
-            char *tmp=NULL; \
-            osip_uri_to_str(X, &tmp); \
-            fprintf(stream, "%s\n", (tmp)? tmp:""); \
-            if (tmp) osip_free(tmp); \
-            }
+      register_compact(1);
+      reg_journal_shutdown();
+   }
+}
 
-            // true_url
-            W(urlmap[i].true_url);
-            // masq_url
-            W(urlmap[i].masq_url);
-            // reg_url
-            W(urlmap[i].reg_url);
 
-         }
-      }
-      fclose(stream);
+/*
+ * get the registration table statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int register_get_stats(register_stats_t *stats) {
+   int i;
+   time_t now;
+
+   if (stats == NULL) return STS_FAILURE;
+   memcpy(stats, &register_stats, sizeof(register_stats_t));
+   stats->active=urlmap_index_count();
+   stats->size=urlmap_size;
+   stats->max=configuration.max_registrations;
+   stats->next_expiry=-1;
+   i=urlmap_index_next_expiry();
+   if (i >= 0) {
+      time(&now);
+      stats->next_expiry=(urlmap[i].expires > now) ?
+                         (long)(urlmap[i].expires - now) : 0;
    }
-   return;
+   return STS_SUCCESS;
 }
 
 
@@ -181,9 +156,11 @@ void register_save(void) {
  *    STS_SUCCESS : successfully registered
  *    STS_FAILURE : registration failed
  *    STS_NEED_AUTH : authentication needed
+ *    STS_STALE_AUTH : authentication needed, the nonce was stale
  */
 int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
-   int i, j, n, sts;
+   int i, j, k, n, nc, sts;
+   int *cand;
    int expires;
    time_t time_now;
    osip_contact_t *contact;
@@ -215,6 +192,12 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
                 ticket->sipmsg->to->url->username,
                 ticket->sipmsg->to->url->host);
          return STS_NEED_AUTH;
+      } else if (sts == STS_STALE_AUTH) {
+         /* valid credentials, but a fresh nonce is needed */
+         DEBUGC(DBCLASS_REG,"stale nonce used by %s@%s",
+                ticket->sipmsg->to->url->username,
+                ticket->sipmsg->to->url->host);
+         return STS_STALE_AUTH;
       }
    }
 
@@ -307,6 +290,7 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
       expires=configuration.default_expires;
       sprintf(tmp,"%i",expires);
       osip_message_set_expires(ticket->sipmsg, tmp);
+      ticket->modified |= SIP_MOD_EXPIRES;
    }
 
    url1_to=ticket->sipmsg->to->url;
@@ -328,12 +312,10 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
        * - not registered, then create a new record
        */
 
-      j=-1;
-      for (i=0; i<URLMAP_SIZE; i++) {
-         if (urlmap[i].active == 0) {
-            if (j < 0) j=i; /* remember first hole */
-            continue;
-         }
+      nc=urlmap_index_lookup(URLMAP_IDX_REG, url1_to, NULL, &cand);
+      for (k=0; k<nc; k++) {
+         i=cand[k];
+         if (urlmap[i].active == 0) continue;
 
          url2_to=urlmap[i].reg_url;
 
@@ -349,14 +331,27 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
             break;
          }
       }
+      if (k >= nc) i=-1;
 
-      if ( (j < 0) && (i >= URLMAP_SIZE) ) {
-         /* oops, no free entries left... */
-         ERROR("URLMAP is full - registration failed");
-         return STS_FAILURE;
+      /* not registered yet, get a free slot (grow the table if needed) */
+      j=-1;
+      if (i < 0) {
+         j=urlmap_index_freeslot();
+         if ((j < 0) && (register_grow() == STS_SUCCESS)) {
+            j=urlmap_index_freeslot();
+         }
+         if (j < 0) {
+            /* oops, no free entries left... */
+            ERROR("URLMAP is full (max_registrations=%i) - registration failed",
+                  configuration.max_registrations);
+            return STS_FAILURE;
+         }
       }
 
-      if (i >= URLMAP_SIZE) {
+      /* the urlmap entries outlive this message, allocate from heap */
+      sip_arena_suspend();
+
+      if (i < 0) {
          /* entry not existing, create new one */
          i=j;
 
@@ -432,6 +427,12 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
                          &urlmap[i].reg_url);
       }
 
+      sip_arena_resume();
+
+      /* (re-)index the new or updated entry */
+      urlmap[i].generation++;
+      urlmap_index_add(i);
+
       /*
        * for proxying: force device to be masqueraded
        * with the outbound IP (masq_url)
@@ -482,7 +483,9 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
       /* update registration timeout if we will give additional time */
       if (urlmap[i].expires < time_now+expires) {
          urlmap[i].expires=time_now+expires;
+         urlmap_index_update(i);
       }
+      register_journal(i, 0);
 
    /*
     * un-REGISTER
@@ -493,7 +496,9 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
        * Siproxd will ALWAYS remove ALL bindings for a given
        * address-of-record
        */
-      for (i=0; i<URLMAP_SIZE; i++) {
+      nc=urlmap_index_lookup(URLMAP_IDX_REG, url1_to, NULL, &cand);
+      for (k=0; k<nc; k++) {
+         i=cand[k];
          if (urlmap[i].active == 0) continue;
 
          url2_to=urlmap[i].reg_url;
@@ -503,6 +508,9 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
                    (url2_to->username) ? url2_to->username : "*NULL*",
                    (url2_to->host) ? url2_to->host : "*NULL*", i);
             urlmap[i].expires=time_now+EXPIRE_NULL;
+            urlmap_index_update(i);
+            register_journal(i, 0);
+            register_stats.unregistered++;
             break;
          }
       }
@@ -517,6 +525,9 @@ int register_client(sip_ticket_t *ticket, int force_lcl_masq) {
  * cyclically called to do the aging of the URL mapping table entries
  * and throw out expired entries.
  * Also we do the cyclic saving here - if required.
+ *
+ * The entries are taken from the expiry heap of the urlmap index,
+ * so only the entries that are actually due are looked at.
  */
 void register_agemap(void) {
    int i;
@@ -526,21 +537,25 @@ void register_agemap(void) {
    /* expire old entries */
    time(&t);
    DEBUGC(DBCLASS_BABBLE,"sip_agemap, t=%i",(int)t);
-   for (i=0; i<URLMAP_SIZE; i++) {
-      if ((urlmap[i].active == 1) && (urlmap[i].expires+REGISTER_GRACE < t)) {
-         DEBUGC(DBCLASS_REG,"cleaned entry:%i %s@%s", i,
-                urlmap[i].masq_url->username,  urlmap[i].masq_url->host);
-         urlmap[i].active=0;
-         osip_uri_free(urlmap[i].true_url);
-         osip_uri_free(urlmap[i].masq_url);
-         osip_uri_free(urlmap[i].reg_url);
+   while (((i=urlmap_index_next_expiry()) >= 0) &&
+          (urlmap[i].expires+REGISTER_GRACE < t)) {
+      DEBUGC(DBCLASS_REG,"cleaned entry:%i %s@%s", i,
+             urlmap[i].masq_url->username,  urlmap[i].masq_url->host);
+      if (urlmap[i].active == 1) {
+         register_journal(i, 1);
+         register_stats.expired++;
       }
+      register_free_entry(i);
    }
 
-   /* auto-save of registration table */
-   if ((configuration.autosave_registrations > 0) &&
-       ((last_save + configuration.autosave_registrations) < t)) {
-      register_save();
+   /* write the journal */
+   reg_journal_sync(0);
+
+   /* auto-save of registration table (compaction of the journal) */
+   if (((configuration.autosave_registrations > 0) &&
+        ((last_save + configuration.autosave_registrations) < t)) ||
+       (reg_journal_size() > REG_JOURNAL_COMPACT)) {
+      register_compact(0);
       last_save = t;
    }
    return;
@@ -552,6 +567,7 @@ void register_agemap(void) {
  *  flag = STS_SUCCESS    -> positive answer (200)
  *  flag = STS_FAILURE    -> negative answer (503)
  *  flag = STS_NEED_AUTH  -> proxy authentication needed (407)
+ *  flag = STS_STALE_AUTH -> same, with stale=true (407)
  *
  * RETURNS
  *      STS_SUCCESS on success
@@ -560,6 +576,7 @@ void register_agemap(void) {
 int register_response(sip_ticket_t *ticket, int flag) {
    osip_message_t *response;
    int code;
+   int stale=0;
    int sts;
    osip_via_t *via;
    int port;
@@ -567,6 +584,8 @@ int register_response(sip_ticket_t *ticket, int flag) {
    size_t buflen;
    struct in_addr addr;
    osip_header_t *expires_hdr;
+   char rawresp[BUFFER_SIZE];
+   char extra[512];
 
    /* ok -> 200, fail -> 503 */
    switch (flag) {
@@ -579,11 +598,36 @@ int register_response(sip_ticket_t *ticket, int flag) {
    case STS_NEED_AUTH:
       code = 407;       /* proxy authentication needed */
       break;
+   case STS_STALE_AUTH:
+      code = 407;       /* proxy authentication needed, new nonce */
+      stale = 1;
+      break;
    default:
       code = 503;       /* failed */
       break;
    }
 
+   /* fast path: render the response from the raw request, with the
+    * (possibly updated) expiration and the authentication header */
+   extra[0]='\0';
+   osip_message_get_expires(ticket->sipmsg, 0, &expires_hdr);
+   if (expires_hdr && expires_hdr->hvalue) {
+      snprintf(extra, sizeof(extra), "Expires: %s\r\n", expires_hdr->hvalue);
+   }
+   buflen=strlen(extra);
+   if (((code != 407) ||
+        (auth_render_authrq(extra+buflen, sizeof(extra)-buflen,
+                            stale) == STS_SUCCESS)) &&
+       (sip_raw_build_response(ticket, code, NULL, NULL, extra,
+                               rawresp, sizeof(rawresp), &buflen,
+                               &addr, &port) == STS_SUCCESS)) {
+      if (port == 0) port=configuration.sip_listen_port;
+      sipsock_send(addr, port, ticket->protocol, rawresp, buflen);
+      sip_trans_store_response(ticket, code, addr, port, ticket->protocol,
+                               rawresp, buflen);
+      return STS_SUCCESS;
+   }
+
    /* create the response template */
    if ((response=msg_make_template_reply(ticket, code))==NULL) {
       ERROR("register_response: error in msg_make_template_reply");
@@ -599,7 +643,7 @@ int register_response(sip_ticket_t *ticket, int flag) {
    /* if we send back an proxy authentication needed, 
       include the Proxy-Authenticate field */
    if (code == 407) {
-      auth_include_authrq(response);
+      auth_include_authrq(response, stale);
    }
 
    /* get the IP address from existing VIA header */
@@ -635,10 +679,12 @@ int register_response(sip_ticket_t *ticket, int flag) {
    }
 
    sipsock_send(addr, port, ticket->protocol, buffer, buflen);
+   sip_trans_store_response(ticket, code, addr, port, ticket->protocol,
+                            buffer, buflen);
 
    /* free the resources */
    osip_message_free(response);
-   free(buffer);
+   osip_free(buffer);
    return STS_SUCCESS;
 }
 
@@ -651,7 +697,8 @@ int register_response(sip_ticket_t *ticket, int flag) {
  *      STS_FAILURE on error
  */
 int register_set_expire(sip_ticket_t *ticket) {
-   int i, j;
+   int i, j, k, nc;
+   int *cand;
    int expires=-1;
    osip_contact_t *contact=NULL;
    time_t time_now;
@@ -717,17 +764,22 @@ int register_set_expire(sip_ticket_t *ticket) {
 
       if (expires > 0) {
          /* search for an entry */
-         for (i=0;i<URLMAP_SIZE;i++){
+         nc=urlmap_index_lookup(URLMAP_IDX_MASQ, contact->url, NULL, &cand);
+         for (k=0; k<nc; k++) {
+            i=cand[k];
             if (urlmap[i].active == 0) continue;
             if ((compare_url(contact->url, urlmap[i].masq_url)==STS_SUCCESS)) break;
-         } /* for i */
+         } /* for k */
+         if (k >= nc) i=urlmap_size;
 
          /* found a mapping entry */
-         if (i<URLMAP_SIZE) {
+         if (i<urlmap_size) {
             /* update registration timeout */
             DEBUGC(DBCLASS_REG,"changing registration timeout to %i"
                                " in entry [%i]", expires, i);
             urlmap[i].expires=time_now+expires;
+            urlmap_index_update(i);
+            register_journal(i, 0);
          } else {
             DEBUGC(DBCLASS_REG,"no urlmap entry found");
          }
@@ -735,3 +787,336 @@ int register_set_expire(sip_ticket_t *ticket) {
    } /* for j */
    return STS_SUCCESS;
 }
+
+
+/*
+ * grow the URL mapping table (double its size, limited by
+ * max_registrations) and rebuild the lookup indexes
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the table cannot grow any further
+ */
+static int register_grow(void) {
+   struct urlmap_s *new_map;
+   int new_size;
+
+   if (urlmap_size >= configuration.max_registrations) return STS_FAILURE;
+
+   new_size=(urlmap_size > 0)? 2*urlmap_size : URLMAP_INIT_SIZE;
+   if (new_size > configuration.max_registrations) {
+      new_size=configuration.max_registrations;
+   }
+
+   new_map=realloc(urlmap, new_size*sizeof(struct urlmap_s));
+   if (new_map == NULL) {
+      ERROR("unable to grow registration table to %i entries", new_size);
+      return STS_FAILURE;
+   }
+   memset(&new_map[urlmap_size], 0,
+          (new_size-urlmap_size)*sizeof(struct urlmap_s));
+   urlmap=new_map;
+   urlmap_size=new_size;
+
+   DEBUGC(DBCLASS_REG,"registration table grown to %i entries", urlmap_size);
+   return urlmap_index_init();
+}
+
+
+/*
+ * read a registration file (snapshot) or a journal into the table
+ * name:    file to read
+ * journal: file is a journal (may contain removal records)
+ * valid:   returns the length of the complete records read, may be NULL
+ *
+ * Entries are identified by their registered URL, a record for an
+ * existing entry replaces it. Reading stops at the first incomplete
+ * or malformed record (e.g. the end of a journal at a crash).
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the file cannot be opened
+ */
+static int register_load(char *name, int journal, long *valid) {
+   FILE *stream;
+   char buff[REG_LINE_SIZE];
+   osip_uri_t *url[3];
+   int sts, i, k, n, records=0;
+
+   if (name == NULL) return STS_FAILURE;
+   stream = fopen(name, "r");
+   if (!stream) return STS_FAILURE;
+
+   DEBUGC(DBCLASS_REG,"loading registrations from %s", name);
+   for (;;) {
+      int a=0;
+      long long e=0;
+
+      if (register_getline(stream, buff, sizeof(buff)) != STS_SUCCESS) break;
+
+      /* removal record */
+      if (journal && (strcmp(buff, "****-:") == 0)) {
+         if (register_getline(stream, buff, sizeof(buff)) != STS_SUCCESS) break;
+         url[2]=register_parse_url(buff);
+         if (url[2] == NULL) break;
+         i=register_find_reg(url[2]);
+         if (i >= 0) register_free_entry(i);
+         osip_uri_free(url[2]);
+         records++;
+         if (valid) *valid=ftell(stream);
+         continue;
+      }
+
+      sts=sscanf(buff, "****:%i:%lld", &a, &e);
+      if (sts != 2) break; /* format error */
+      /* files of older versions include the unused entries */
+      if (a == 0) {
+         if (valid) *valid=ftell(stream);
+         continue;
+      }
+
+      /* true_url, masq_url, reg_url */
+      for (k=0; k<3; k++) {
+         if (register_getline(stream, buff, sizeof(buff)) != STS_SUCCESS) break;
+         url[k]=register_parse_url(buff);
+      }
+      if (k < 3) {
+         while (--k >= 0) if (url[k]) osip_uri_free(url[k]);
+         break;
+      }
+      records++;
+      if (valid) *valid=ftell(stream);
+      if ((url[0] == NULL) || (url[1] == NULL) || (url[2] == NULL)) {
+         /* incomplete entry */
+         for (k=0; k<3; k++) if (url[k]) osip_uri_free(url[k]);
+         continue;
+      }
+
+      i=register_find_reg(url[2]);
+      if (i >= 0) {
+         /* newer state of an existing entry */
+         osip_uri_free(urlmap[i].true_url);
+         osip_uri_free(urlmap[i].masq_url);
+         osip_uri_free(urlmap[i].reg_url);
+      } else {
+         i=urlmap_index_freeslot();
+         if ((i < 0) && (register_grow() == STS_SUCCESS)) {
+            i=urlmap_index_freeslot();
+         }
+         if (i < 0) {
+            WARN("%s has more than %i entries (max_registrations), "
+                 "ignoring the remaining ones", name, urlmap_size);
+            for (k=0; k<3; k++) if (url[k]) osip_uri_free(url[k]);
+            break;
+         }
+      }
+      urlmap[i].active=a;
+      urlmap[i].expires=(time_t)e;
+      urlmap[i].true_url=url[0];
+      urlmap[i].masq_url=url[1];
+      urlmap[i].reg_url=url[2];
+      urlmap[i].generation++;
+      urlmap_index_add(i);
+   }
+   fclose(stream);
+
+   for (i=0, n=0; i<urlmap_size; i++) if (urlmap[i].active) n++;
+   DEBUGC(DBCLASS_REG,"read %i records from %s, %i registrations",
+          records, name, n);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * read one line, CR/LF are removed
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on EOF or if the line is incomplete/too long
+ */
+static int register_getline(FILE *stream, char *buff, int size) {
+   int len;
+
+   if (fgets(buff, size, stream) == NULL) return STS_FAILURE;
+   len=strlen(buff);
+   if ((len == 0) || (buff[len-1] != '\n')) return STS_FAILURE;
+   buff[--len]='\0';
+   if ((len > 0) && (buff[len-1] == '\r')) buff[--len]='\0';
+   return STS_SUCCESS;
+}
+
+
+/*
+ * parse an URL read from the registration file
+ *
+ * RETURNS
+ *	the URL, NULL if empty or not parseable
+ */
+static osip_uri_t *register_parse_url(char *buff) {
+   osip_uri_t *url=NULL;
+
+   if (strlen(buff) == 0) {
+      DEBUGC(DBCLASS_BABBLE, "empty URI");
+      return NULL;
+   }
+   if (osip_uri_init(&url) != 0) {
+      ERROR("Unable to initialize URI structure");
+      return NULL;
+   }
+   if (osip_uri_parse(url, buff) != 0) {
+      ERROR("Unable to parse URI: %s", buff);
+      osip_uri_free(url);
+      return NULL;
+   }
+   return url;
+}
+
+
+/*
+ * find an entry by its registered URL while loading. The URL must
+ * be identical (no name resolution is done as with compare_url()).
+ *
+ * RETURNS
+ *	index of the entry, -1 if not found
+ */
+static int register_find_reg(osip_uri_t *url) {
+   osip_uri_t *reg;
+   int *cand;
+   int i, k, nc;
+
+   nc=urlmap_index_lookup(URLMAP_IDX_REG, url, NULL, &cand);
+   for (k=0; k<nc; k++) {
+      i=cand[k];
+      if (urlmap[i].active == 0) continue;
+      reg=urlmap[i].reg_url;
+      #define STREQ(A,B) (((A)==NULL && (B)==NULL) || \
+                          ((A) && (B) && (osip_strcasecmp((A),(B)) == 0)))
+      if (STREQ(url->scheme, reg->scheme) &&
+          (((url->username == NULL) && (reg->username == NULL)) ||
+           (url->username && reg->username &&
+            (strcmp(url->username, reg->username) == 0))) &&
+          STREQ(url->host, reg->host) &&
+          STREQ(url->port, reg->port)) {
+         return i;
+      }
+      #undef STREQ
+   }
+   return -1;
+}
+
+
+/*
+ * remove an entry from the table
+ */
+static void register_free_entry(int i) {
+   urlmap_index_remove(i);
+   urlmap[i].active=0;
+   urlmap[i].generation++;
+   osip_uri_free(urlmap[i].true_url);
+   osip_uri_free(urlmap[i].masq_url);
+   osip_uri_free(urlmap[i].reg_url);
+   urlmap[i].true_url=NULL;
+   urlmap[i].masq_url=NULL;
+   urlmap[i].reg_url=NULL;
+}
+
+
+/*
+ * append an urlmap entry in the format of the registration file
+ * to a buffer
+ * remove: write a removal record (journal)
+ */
+static void register_format_entry(regbuf_t *b, int i, int remove) {
+   char tmp[64];
+
+   if (remove) {
+      register_buf_add(b, "****-:\n");
+   } else {
+      snprintf(tmp, sizeof(tmp), "****:%i:%lld\n", urlmap[i].active,
+               (long long)urlmap[i].expires);
+      register_buf_add(b, tmp);
+      register_buf_url(b, urlmap[i].true_url);
+      register_buf_url(b, urlmap[i].masq_url);
+   }
+   register_buf_url(b, urlmap[i].reg_url);
+}
+
+
+/*
+ * write a journal record for an urlmap entry
+ * remove: the entry is being removed
+ */
+static void register_journal(int i, int remove) {
+   regbuf_t b={NULL, 0, 0, 0};
+
+   if (!configuration.registrationfile) return;
+
+   register_format_entry(&b, i, remove);
+   if (b.error) {
+      ERROR("registration journal: out of memory, record lost");
+   } else if (b.buf) {
+      reg_journal_append(b.buf, b.len);
+      free(b.buf);
+   }
+}
+
+
+/*
+ * compaction: write all active entries as new registration file
+ * wait: wait until it is written
+ */
+static void register_compact(int wait) {
+   regbuf_t b={NULL, 0, 0, 0};
+   int i;
+
+   if ((reg_journal_busy() == STS_TRUE) && !wait) return;
+
+   /* only the active entries are written, the file does not
+      depend on the size of the table */
+   for (i=0; i<urlmap_size; i++) {
+      if (urlmap[i].active) register_format_entry(&b, i, 0);
+   }
+   if (b.buf == NULL) register_buf_add(&b, "");
+   if (b.error) {
+      ERROR("unable to save registrations: out of memory");
+      free(b.buf);
+      return;
+   }
+   reg_journal_compact(b.buf, b.len, wait);
+}
+
+
+/*
+ * append a string to a buffer
+ */
+static void register_buf_add(regbuf_t *b, const char *str) {
+   size_t len=strlen(str);
+
+   if (b->len+len+1 > b->size) {
+      size_t size=(b->size)? b->size : 4096;
+      char *p;
+      while (size < b->len+len+1) size *= 2;
+      p=realloc(b->buf, size);
+      if (p == NULL) {
+         b->error=1;
+         return;
+      }
+      b->buf=p;
+      b->size=size;
+   }
+   memcpy(&b->buf[b->len], str, len+1);
+   b->len+=len;
+}
+
+
+/*
+ * append an URL (and a newline) to a buffer
+ */
+static void register_buf_url(regbuf_t *b, osip_uri_t *url) {
+   char *tmp=NULL;
+
+   if (url) osip_uri_to_str(url, &tmp);
+   register_buf_add(b, (tmp)? tmp : "");
+   register_buf_add(b, "\n");
+   if (tmp) osip_free(tmp);
+}
@@ -30,16 +30,28 @@
 
 #include <stdio.h>
 #include <resolv.h>
+#include <netdb.h>
 #include <string.h>
 #include <sys/types.h>
 
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
 #include "log.h"
 
 #define USE_NAPTR	0
 
+/* configuration storage */
+extern struct siproxd_config configuration;
+
 /* local functions */
 static int _resolve(char *name, int class, int type,
                     char *dname, int dnamelen, int *port);
+static int _resolve_query(char *name, int type, unsigned char *msg,
+                          int msglen, unsigned char **answers, int *ancount);
+static int _resolve_rr(unsigned char *msg, unsigned char *eom,
+                       unsigned char **mptr, u_int16_t *ty, u_int32_t *ttl,
+                       u_int16_t *rdlen);
 
 /*
  * perform a SRV record lookup
@@ -74,6 +86,175 @@ int resolve_NAPTR(char *name, char *dname, int dnamelen) {
 }
 #endif
 
+/*
+ * resolve the A record of a name
+ *
+ * name		hostname
+ * addr		returns the address (first A record of the answer)
+ * ttl		returns the smallest TTL of the answer (incl. CNAMEs)
+ *		in seconds
+ *
+ * RETURNS
+ *	1 if an A record was found
+ *	0 if the name has no A record
+ *	-1 on temporary failure
+ */
+int resolve_A(char *name, struct in_addr *addr, int *ttl) {
+   unsigned char msg[PACKETSZ];
+   unsigned char *mptr, *eom;
+   int len, i, co;
+   u_int16_t ty, rdlen;
+   u_int32_t rttl;
+   int min_ttl=-1;
+   int found=0;
+
+   len=_resolve_query(name, T_A, msg, sizeof(msg), &mptr, &co);
+   if (len <= 0) return len;
+   eom=msg+len;
+
+   for (i=0; i<co; i++) {
+      if (_resolve_rr(msg, eom, &mptr, &ty, &rttl, &rdlen) != 0) break;
+
+      if ((ty == T_A) || (ty == T_CNAME)) {
+         if ((min_ttl < 0) || (rttl < (u_int32_t)min_ttl)) min_ttl=rttl;
+      }
+      if ((ty == T_A) && (rdlen == INADDRSZ) && !found) {
+         memcpy(&addr->s_addr, mptr, INADDRSZ);
+         found=1;
+      }
+      mptr += rdlen;
+   }
+
+   if (found) *ttl=min_ttl;
+   DEBUGC(DBCLASS_DNS, "resolve_A: name=[%s], found=%i, ttl=%i", name,
+          found, (found) ? min_ttl : -1);
+   return found;
+}
+
+
+/*
+ * get all SRV records of a name
+ *
+ * name		SRV name (_sip._udp.domain)
+ * rr		returned records
+ * max		size of rr
+ * ttl		returns the smallest TTL of the records, or the
+ *		time a negative answer may be cached
+ *
+ * RETURNS
+ *	number of records, 0 if there are none
+ *	-1 on temporary failure
+ */
+int resolve_SRV_records(char *name, dns_srv_t *rr, int max, int *ttl) {
+   unsigned char msg[PACKETSZ];
+   unsigned char *mptr, *eom;
+   int len, i, j, co, n=0;
+   u_int16_t ty, rdlen;
+   u_int32_t rttl;
+
+   *ttl=configuration.dns_negative_ttl;
+   len=_resolve_query(name, T_SRV, msg, sizeof(msg), &mptr, &co);
+   if (len <= 0) return len;
+   eom=msg+len;
+
+   for (i=0; (i<co) && (n<max); i++) {
+      if (_resolve_rr(msg, eom, &mptr, &ty, &rttl, &rdlen) != 0) break;
+
+      if ((ty == T_SRV) && (rdlen > 3*INT16SZ)) {
+         unsigned char *xptr=mptr;
+         GETSHORT(rr[n].prio, xptr);
+         GETSHORT(rr[n].weight, xptr);
+         GETSHORT(rr[n].port, xptr);
+         rr[n].protocol=0;
+         j=dn_expand(msg, eom, xptr, rr[n].target, sizeof(rr[n].target));
+         if ((j >= 0) && (rr[n].target[0] != '\0')) {
+            DEBUGC(DBCLASS_DNS, "resolve_SRV_records: [%s] prio=%i, "
+                   "weight=%i, port=%i name=[%s]", name, rr[n].prio,
+                   rr[n].weight, rr[n].port, rr[n].target);
+            if ((n == 0) || (rttl < (u_int32_t)*ttl)) *ttl=rttl;
+            n++;
+         }
+      }
+      mptr += rdlen;
+   }
+   return n;
+}
+
+
+/*
+ * get the NAPTR records of a domain that point to SIP services
+ * over UDP or TCP (RFC 3263)
+ *
+ * name		domain
+ * rr		returned records: prio=order, weight=preference,
+ *		protocol=PROTO_UDP/PROTO_TCP, target=SRV name
+ * max		size of rr
+ * ttl		returns the smallest TTL of the records, or the
+ *		time a negative answer may be cached
+ *
+ * RETURNS
+ *	number of records, 0 if there are none
+ *	-1 on temporary failure
+ */
+int resolve_NAPTR_records(char *name, dns_srv_t *rr, int max, int *ttl) {
+   unsigned char msg[PACKETSZ];
+   unsigned char *mptr, *eom, *xptr, *rdend;
+   int len, i, j, k, l, co, n=0;
+   u_int16_t ty, rdlen;
+   u_int32_t rttl;
+   char str[3][HOSTNAME_SIZE+1];	/* flags, services, regexp */
+
+   *ttl=configuration.dns_negative_ttl;
+   len=_resolve_query(name, T_NAPTR, msg, sizeof(msg), &mptr, &co);
+   if (len <= 0) return len;
+   eom=msg+len;
+
+   for (i=0; (i<co) && (n<max); i++) {
+      if (_resolve_rr(msg, eom, &mptr, &ty, &rttl, &rdlen) != 0) break;
+      xptr=mptr;
+      rdend=mptr+rdlen;
+      mptr += rdlen;
+
+      if ((ty != T_NAPTR) || (rdlen < 2*INT16SZ)) continue;
+      GETSHORT(rr[n].prio, xptr);
+      GETSHORT(rr[n].weight, xptr);
+
+      /* flags, services, regexp: <length><string> */
+      for (k=0; k<3; k++) {
+         if (xptr >= rdend) break;
+         l=*xptr++;
+         if (xptr+l > rdend) break;
+         j=(l > HOSTNAME_SIZE) ? HOSTNAME_SIZE : l;
+         memcpy(str[k], xptr, j);
+         str[k][j]='\0';
+         xptr += l;
+      }
+      if (k < 3) continue;
+
+      j=dn_expand(msg, eom, xptr, rr[n].target, sizeof(rr[n].target));
+      if ((j < 0) || (rr[n].target[0] == '\0')) continue;
+
+      DEBUGC(DBCLASS_DNS, "resolve_NAPTR_records: [%s] order=%i, pref=%i, "
+             "flags=%s, service=%s, replacement=[%s]", name, rr[n].prio,
+             rr[n].weight, str[0], str[1], rr[n].target);
+
+      /* only terminal records pointing to a SRV name are supported */
+      if (strcasecmp(str[0], "s") != 0) continue;
+      if (strcasecmp(str[1], "SIP+D2U") == 0) {
+         rr[n].protocol=PROTO_UDP;
+      } else if (strcasecmp(str[1], "SIP+D2T") == 0) {
+         rr[n].protocol=PROTO_TCP;
+      } else {
+         continue;
+      }
+      rr[n].port=0;
+      if ((n == 0) || (rttl < (u_int32_t)*ttl)) *ttl=rttl;
+      n++;
+   }
+   return n;
+}
+
+
 /*
  * query the DNS for a specific record type
  */
@@ -252,3 +433,77 @@ ERROR("_resolve: NAPTR lookup not yet supported.");
    return 0;
 }
 
+
+/*
+ * issue a query and skip the question section
+ *
+ * RETURNS
+ *	length of the answer, *answers points to the answer section
+ *	0 if the name or record does not exist
+ *	-1 on temporary failure
+ */
+static int _resolve_query(char *name, int type, unsigned char *msg,
+                          int msglen, unsigned char **answers, int *ancount) {
+   HEADER *res_header;
+   unsigned char *mptr, *eom;
+   char exp_dn[MAXDNAME];
+   int len, i, j, co;
+
+   len=res_query(name, C_IN, type, msg, msglen);
+   if (len < 0) {
+      if ((h_errno == HOST_NOT_FOUND) || (h_errno == NO_DATA)) {
+         DEBUGC(DBCLASS_DNS, "_resolve_query: no record [%s], type=%i",
+                name, type);
+         return 0;
+      }
+      DEBUGC(DBCLASS_DNS, "_resolve_query: query [%s], type=%i failed, "
+             "h_errno=%i", name, type, h_errno);
+      return -1;
+   }
+   if (len < (int)sizeof(HEADER)) return -1;
+   if (len > msglen) len=msglen;
+   eom=msg+len;
+
+   res_header = (HEADER *)msg;
+   mptr=msg+sizeof(HEADER);
+
+   co=ntohs(res_header->qdcount);
+   for (i=0; i<co; i++) {
+      j=dn_expand(msg, eom, mptr, exp_dn, sizeof(exp_dn));
+      if (j < 0) return -1;
+      mptr += j + QFIXEDSZ;
+   }
+   if (mptr > eom) return -1;
+
+   *answers=mptr;
+   *ancount=ntohs(res_header->ancount);
+   return len;
+}
+
+
+/*
+ * read the header of a resource record, *mptr is advanced to
+ * the record data
+ *
+ * RETURNS
+ *	0 on success, -1 if the message is malformed
+ */
+static int _resolve_rr(unsigned char *msg, unsigned char *eom,
+                       unsigned char **mptr, u_int16_t *ty, u_int32_t *ttl,
+                       u_int16_t *rdlen) {
+   char exp_dn[MAXDNAME];
+   unsigned char *p=*mptr;
+   int j;
+
+   j=dn_expand(msg, eom, p, exp_dn, sizeof(exp_dn));
+   if (j < 0) return -1;
+   p += j;
+   if (p + RRFIXEDSZ > eom) return -1;
+   GETSHORT(*ty, p);
+   p += INT16SZ;		/* class */
+   GETLONG(*ttl, p);
+   GETSHORT(*rdlen, p);
+   if (p + *rdlen > eom) return -1;
+   *mptr=p;
+   return 0;
+}
@@ -118,6 +118,7 @@ int route_preprocess(sip_ticket_t *ticket){
          /* remove from list */
          osip_list_remove(&(mymsg->routes), last);
          osip_route_free(route);
+         ticket->modified |= SIP_MOD_STARTLINE | SIP_MOD_ROUTE;
       }
    } else {
       WARN("cannot resolve host in Request URI [%s]", url->host);
@@ -145,6 +146,7 @@ int route_preprocess(sip_ticket_t *ticket){
                configuration.sip_listen_port == SIP_PORT)) {
          osip_list_remove(&(mymsg->routes), 0);
          osip_route_free(route);
+         ticket->modified |= SIP_MOD_ROUTE;
          DEBUGC(DBCLASS_PROXY, "removed Route header pointing to myself");
       }
    }
@@ -208,6 +210,7 @@ int route_postprocess(sip_ticket_t *ticket){
             osip_list_remove(&(mymsg->routes), 0);
             osip_route_free(route);
             route = NULL;
+            ticket->modified |= SIP_MOD_STARTLINE | SIP_MOD_ROUTE;
          }
       }
    }
@@ -287,6 +290,7 @@ int route_add_recordroute(sip_ticket_t *ticket){
 
          /* insert into record-route list*/
          osip_list_add (&(mymsg->record_routes), r_route, position);
+         ticket->modified |= SIP_MOD_RROUTE;
 
       } else {
           osip_record_route_free(r_route);
@@ -344,6 +348,7 @@ int route_purge_recordroute(sip_ticket_t *ticket){
 
             osip_list_remove(&(mymsg->record_routes), i);
             osip_record_route_free(r_route);
+            ticket->modified |= SIP_MOD_RROUTE;
             DEBUGC(DBCLASS_PROXY, "removed Record-Route header pointing "
                    "to myself");
          }
@@ -385,19 +390,13 @@ int route_determine_nexthop(sip_ticket_t *ticket,
          return STS_FAILURE;
       }
 
-      sts = get_ip_by_host(route->url->host, dest);
+      sts = dns_srv_resolve(route->url->host, route->url->port,
+                            ticket->protocol, dest, port);
       if (sts == STS_FAILURE) {
          DEBUGC(DBCLASS_PROXY, "route_determine_nexthop: cannot resolve "
                 "Route URI [%s]", route->url->host);
          return STS_FAILURE;
       }
-
-      if (route->url->port) {
-         *port=atoi(route->url->port);
-         if ((*port<=0) || (*port>65535)) *port=SIP_PORT;
-      } else {
-         *port=SIP_PORT;
-      }
    }
 
    return STS_SUCCESS;
@@ -0,0 +1,372 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Per message arena allocator for libosip2
+ *
+ * All memory that libosip2 (and siproxd via osip_malloc & friends)
+ * allocates while a SIP message is processed is taken from a simple
+ * bump allocator. osip_free() on such memory does nothing, the whole
+ * arena is released at once by sip_arena_end() when the processing
+ * of the message is done. This saves hundreds of malloc()/free() calls
+ * per message and avoids heap fragmentation over long uptimes.
+ * The message is still freed by osip_message_free(): parts that were
+ * taken from the heap (arena chunk allocation failed, realloc() of a
+ * heap pointer, arena suspended) are released that way.
+ *
+ * Objects that must outlive the message (e.g. the URIs kept in the
+ * urlmap) must be allocated between sip_arena_suspend() and
+ * sip_arena_resume() - they are then taken from the heap as usual.
+ * Outside of a message (between sip_arena_begin() and sip_arena_end())
+ * and for other threads (RTP relay) the heap is used, too.
+ *
+ * Memory layout of one allocation inside a chunk:
+ *   [size_t size, padded to ARENA_ALIGN][data ...]
+ * The size is required to support osip_realloc().
+ */
+
+#if defined(HAVE_OSIP_SET_ALLOCATORS)
+
+#define ARENA_ALIGN	16	/* alignment of returned pointers	*/
+#define ARENA_HDR	ARENA_ALIGN	/* header holding the size	*/
+
+typedef struct arena_chunk_s {
+   struct arena_chunk_s *next;
+   size_t size;			/* usable bytes in data[] */
+   size_t used;			/* allocated bytes in data[] */
+   size_t last;			/* offset of the last allocation */
+   char   *data;		/* aligned start of data */
+} arena_chunk_t;
+
+/* primary chunk (kept) and additional chunks (freed at end) */
+static arena_chunk_t *arena_first=NULL;
+static arena_chunk_t *arena_current=NULL;
+
+static int arena_active=0;		/* processing a message */
+static int arena_suspended=0;		/* nesting of sip_arena_suspend */
+static pthread_t arena_owner;		/* thread using the arena */
+
+/* statistics */
+static sip_arena_stats_t arena_stats;
+static unsigned long arena_msg_allocs=0;
+static size_t arena_msg_bytes=0;
+
+/* local prototypes */
+static arena_chunk_t *arena_chunk_new(size_t size);
+static int  arena_contains(void *ptr);
+static void *arena_malloc(size_t size);
+static void *arena_realloc(void *ptr, size_t size);
+static void arena_free(void *ptr);
+
+
+/*
+ * install the arena allocator into libosip2
+ * size: size of the primary arena chunk in bytes, 0 disables
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int sip_arena_init(int size) {
+   memset(&arena_stats, 0, sizeof(arena_stats));
+   if (size <= 0) return STS_SUCCESS;
+
+   arena_first=arena_chunk_new(size);
+   if (arena_first == NULL) {
+      ERROR("unable to allocate SIP message arena of %i bytes", size);
+      return STS_FAILURE;
+   }
+   arena_current=arena_first;
+   arena_stats.arena_size=arena_first->size;
+
+   osip_set_allocators(arena_malloc, arena_realloc, arena_free);
+   INFO("using SIP message arena of %i bytes", size);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * is the arena allocator in use?
+ *
+ * RETURNS
+ *	STS_TRUE if enabled
+ *	STS_FALSE if disabled
+ */
+int sip_arena_enabled(void) {
+   return (arena_first != NULL)? STS_TRUE : STS_FALSE;
+}
+
+
+/*
+ * start processing of a SIP message, from now on libosip2
+ * allocations are served from the arena
+ *
+ * RETURNS: -
+ */
+void sip_arena_begin(void) {
+   if (arena_first == NULL) return;
+
+   arena_owner=pthread_self();
+   arena_suspended=0;
+   arena_msg_allocs=0;
+   arena_msg_bytes=0;
+   arena_active=1;
+}
+
+
+/*
+ * end processing of a SIP message and release all memory
+ * allocated from the arena in one step
+ *
+ * RETURNS: -
+ */
+void sip_arena_end(void) {
+   arena_chunk_t *chunk, *next;
+
+   if ((arena_first == NULL) || (arena_active == 0)) return;
+   arena_active=0;
+
+   /* statistics */
+   arena_stats.messages++;
+   if (arena_msg_allocs > arena_stats.max_allocs) {
+      arena_stats.max_allocs=arena_msg_allocs;
+   }
+   if (arena_msg_bytes > arena_stats.high_water) {
+      arena_stats.high_water=arena_msg_bytes;
+   }
+
+   /* release additional chunks, keep the primary one */
+   for (chunk=arena_first->next; chunk; chunk=next) {
+      next=chunk->next;
+      free(chunk);
+   }
+   arena_first->next=NULL;
+   arena_first->used=0;
+   arena_first->last=0;
+   arena_current=arena_first;
+
+   DEBUGC(DBCLASS_BABBLE,"arena released: %lu allocations, %lu bytes",
+          arena_msg_allocs, (unsigned long)arena_msg_bytes);
+}
+
+
+/*
+ * temporarily allocate from the heap - for objects that must
+ * survive the processing of the current SIP message. May be nested.
+ *
+ * RETURNS: -
+ */
+void sip_arena_suspend(void) {
+   arena_suspended++;
+}
+
+void sip_arena_resume(void) {
+   if (arena_suspended > 0) arena_suspended--;
+}
+
+
+/*
+ * get the arena statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the arena is not enabled
+ */
+int sip_arena_get_stats(sip_arena_stats_t *stats) {
+   if ((arena_first == NULL) || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &arena_stats, sizeof(sip_arena_stats_t));
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * allocate a new arena chunk with (at least) size usable bytes
+ *
+ * RETURNS pointer to chunk or NULL on failure
+ */
+static arena_chunk_t *arena_chunk_new(size_t size) {
+   arena_chunk_t *chunk;
+   size_t hdrsize;
+
+   hdrsize=(sizeof(arena_chunk_t) + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1);
+   chunk=malloc(hdrsize + size);
+   if (chunk == NULL) return NULL;
+
+   chunk->next=NULL;
+   chunk->size=size;
+   chunk->used=0;
+   chunk->last=0;
+   chunk->data=(char*)chunk + hdrsize;
+   return chunk;
+}
+
+
+/*
+ * check if a pointer belongs to the arena
+ *
+ * RETURNS 1 if part of the arena, 0 otherwise
+ */
+static int arena_contains(void *ptr) {
+   arena_chunk_t *chunk;
+
+   for (chunk=arena_first; chunk; chunk=chunk->next) {
+      if (((char*)ptr >= chunk->data) &&
+          ((char*)ptr < chunk->data + chunk->size)) return 1;
+   }
+   return 0;
+}
+
+
+/*
+ * libosip2 malloc hook
+ */
+static void *arena_malloc(size_t size) {
+   arena_chunk_t *chunk;
+   size_t need;
+   char *ptr;
+
+   if (!arena_active || arena_suspended ||
+       !pthread_equal(arena_owner, pthread_self())) {
+      arena_stats.heap_allocs++;
+      return malloc(size);
+   }
+
+   need=ARENA_HDR + ((size + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1));
+
+   chunk=arena_current;
+   if (chunk->used + need > chunk->size) {
+      /* does not fit, add a new chunk (large enough for this one) */
+      chunk=arena_chunk_new((need > arena_first->size)?
+                            need : arena_first->size);
+      if (chunk == NULL) {
+         arena_stats.heap_allocs++;
+         return malloc(size);
+      }
+      arena_current->next=chunk;
+      arena_current=chunk;
+      arena_stats.extra_chunks++;
+   }
+
+   ptr=chunk->data + chunk->used;
+   *(size_t*)ptr=size;
+   chunk->last=chunk->used;
+   chunk->used+=need;
+
+   arena_stats.arena_allocs++;
+   arena_msg_allocs++;
+   arena_msg_bytes+=need;
+
+   return ptr + ARENA_HDR;
+}
+
+
+/*
+ * libosip2 realloc hook
+ */
+static void *arena_realloc(void *ptr, size_t size) {
+   arena_chunk_t *chunk;
+   size_t oldsize;
+   size_t need;
+   void *newptr;
+
+   if (ptr == NULL) return arena_malloc(size);
+   if (!arena_contains(ptr)) return realloc(ptr, size);
+
+   oldsize=*(size_t*)((char*)ptr - ARENA_HDR);
+
+   /* last allocation of the current chunk - grow/shrink in place */
+   chunk=arena_current;
+   need=ARENA_HDR + ((size + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1));
+   if (arena_active && ((char*)ptr == chunk->data + chunk->last + ARENA_HDR) &&
+       (chunk->last + need <= chunk->size)) {
+      arena_msg_bytes+=need;
+      arena_msg_bytes-=chunk->used - chunk->last;
+      chunk->used=chunk->last + need;
+      *(size_t*)((char*)ptr - ARENA_HDR)=size;
+      return ptr;
+   }
+
+   newptr=arena_malloc(size);
+   if (newptr == NULL) return NULL;
+   memcpy(newptr, ptr, (oldsize < size)? oldsize : size);
+   return newptr;
+}
+
+
+/*
+ * libosip2 free hook - memory in the arena is released by sip_arena_end()
+ */
+static void arena_free(void *ptr) {
+   if (ptr == NULL) return;
+   if (arena_contains(ptr)) return;
+   free(ptr);
+}
+
+#else /* HAVE_OSIP_SET_ALLOCATORS */
+
+int sip_arena_init(int size) {
+   if (size > 0) {
+      WARN("libosip2 does not support custom allocators, "
+           "sip_arena_size is ignored");
+   }
+   return STS_SUCCESS;
+}
+
+int sip_arena_enabled(void) {
+   return STS_FALSE;
+}
+
+void sip_arena_begin(void) {
+}
+
+void sip_arena_end(void) {
+}
+
+void sip_arena_suspend(void) {
+}
+
+void sip_arena_resume(void) {
+}
+
+int sip_arena_get_stats(sip_arena_stats_t *stats) {
+   return STS_FAILURE;
+}
+
+#endif /* HAVE_OSIP_SET_ALLOCATORS */
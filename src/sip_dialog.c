@@ -0,0 +1,446 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/* URL mapping table */
+extern struct urlmap_s *urlmap;
+extern int urlmap_size;
+
+/*
+ * Dialog table
+ *
+ * sip_find_direction() determines the direction of a SIP message by
+ * several passes over the urlmap (including name resolution of the
+ * registered hosts). For messages within an established dialog the
+ * result is always the same for a given sender, so it is remembered
+ * here: a dialog (Call-ID and the pair of tags) knows for each
+ * sending address whether its messages are outgoing and the urlmap
+ * entry involved. In-dialog messages are then classified by a hash
+ * lookup.
+ *
+ * A dialog is created by a 2xx response to INVITE or SUBSCRIBE (and
+ * by an ACK), senders are learned from the regular classification
+ * of later messages. If the same sender is classified differently
+ * (e.g. a call looped through siproxd twice), the dialog is flagged
+ * ambiguous and is not used any more. Dialogs are removed on the
+ * final response to a BYE or after DIALOG_IDLE_TO seconds without
+ * traffic.
+ */
+
+#define DIALOG_CALLID_SIZE	128
+#define DIALOG_TAG_SIZE		64
+#define DIALOG_SENDERS		4
+
+typedef struct {
+   int used;
+   int hash_next;			/* next dialog in hash chain, -1=end */
+   unsigned int hash;
+   time_t last_used;
+   int ambiguous;			/* do not use for classification */
+   char callid[DIALOG_CALLID_SIZE];
+   char tag1[DIALOG_TAG_SIZE];		/* tags, sorted */
+   char tag2[DIALOG_TAG_SIZE];
+   int num_senders;
+   struct {
+      struct in_addr addr;
+      int port;				/* network byte order */
+      int outgoing;			/* messages are outgoing */
+      int urlidx;			/* urlmap index, -1 if none */
+      unsigned int generation;		/* to validate the urlmap entry */
+   } sender[DIALOG_SENDERS];
+} dialog_t;
+
+static dialog_t *dialog_table=NULL;
+static int dialog_size=0;
+static int dialog_free=-1;		/* free list, chained via hash_next */
+static int *dialog_hash=NULL;
+static unsigned int dialog_hash_mask=0;
+
+/* statistics */
+static sip_dialog_stats_t dialog_stats;
+
+/* local prototypes */
+static int dialog_key(osip_message_t *sipmsg, char *callid,
+                      char *tag1, char *tag2, unsigned int *hash);
+static int dialog_find(const char *callid, const char *tag1,
+                       const char *tag2, unsigned int hash);
+static void dialog_remove(int idx);
+
+
+/*
+ * allocate the dialog table
+ * size: number of dialogs, 0 disables
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int sip_dialog_init(int size) {
+   int i;
+   int hashsize;
+
+   memset(&dialog_stats, 0, sizeof(dialog_stats));
+   if (size <= 0) return STS_SUCCESS;
+
+   for (hashsize=64; hashsize < size; hashsize <<= 1);
+   dialog_table=calloc(size, sizeof(dialog_t));
+   dialog_hash=malloc(hashsize*sizeof(int));
+   if ((dialog_table == NULL) || (dialog_hash == NULL)) {
+      ERROR("unable to allocate dialog table of %i entries", size);
+      free(dialog_table);
+      free(dialog_hash);
+      dialog_table=NULL;
+      dialog_hash=NULL;
+      return STS_FAILURE;
+   }
+   for (i=0; i<hashsize; i++) dialog_hash[i]=-1;
+   dialog_hash_mask=hashsize-1;
+   for (i=0; i<size; i++) {
+      dialog_table[i].hash_next=(i+1 < size)? i+1 : -1;
+   }
+   dialog_free=0;
+   dialog_size=size;
+
+   INFO("using dialog table of %i entries", size);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * classify an in-dialog message by the dialog table
+ *
+ * RETURNS
+ *	STS_SUCCESS if found, ticket->direction and *urlidx are set
+ *	STS_FAILURE if the regular classification must be done
+ */
+int sip_dialog_find_direction(sip_ticket_t *ticket, int *urlidx) {
+   osip_message_t *sipmsg=ticket->sipmsg;
+   char callid[DIALOG_CALLID_SIZE];
+   char tag1[DIALOG_TAG_SIZE];
+   char tag2[DIALOG_TAG_SIZE];
+   unsigned int hash;
+   dialog_t *d;
+   int i, j;
+   int idx;
+
+   if (dialog_table == NULL) return STS_FAILURE;
+   if (dialog_key(sipmsg, callid, tag1, tag2, &hash) != STS_SUCCESS) {
+      return STS_FAILURE;
+   }
+
+   i=dialog_find(callid, tag1, tag2, hash);
+   if ((i < 0) || dialog_table[i].ambiguous) {
+      dialog_stats.misses++;
+      return STS_FAILURE;
+   }
+   d=&dialog_table[i];
+
+   for (j=0; j<d->num_senders; j++) {
+      if ((d->sender[j].addr.s_addr == ticket->from.sin_addr.s_addr) &&
+          (d->sender[j].port == ticket->from.sin_port)) break;
+   }
+   if (j >= d->num_senders) {
+      dialog_stats.misses++;
+      return STS_FAILURE;
+   }
+
+   /* the urlmap entry must still be the same (and valid) */
+   idx=d->sender[j].urlidx;
+   if (idx >= 0) {
+      if ((urlmap[idx].active == 0) ||
+          (urlmap[idx].generation != d->sender[j].generation) ||
+          (!d->sender[j].outgoing && (urlmap[idx].expires < ticket->timestamp))) {
+         dialog_stats.misses++;
+         return STS_FAILURE;
+      }
+   }
+
+   if (MSG_IS_REQUEST(sipmsg)) {
+      ticket->direction=(d->sender[j].outgoing)? REQTYP_OUTGOING : REQTYP_INCOMING;
+   } else {
+      ticket->direction=(d->sender[j].outgoing)? RESTYP_OUTGOING : RESTYP_INCOMING;
+   }
+   if (urlidx) *urlidx=idx;
+   d->last_used=ticket->timestamp;
+   dialog_stats.hits++;
+
+   DEBUGC(DBCLASS_SIP, "sip_dialog_find_direction: dir=%i, urlmap %i "
+          "(dialog %i)", ticket->direction, idx, i);
+
+   /* dialog terminated */
+   if (MSG_IS_RESPONSE_FOR(sipmsg, "BYE") && (sipmsg->status_code >= 200)) {
+      DEBUGC(DBCLASS_SIP, "sip_dialog_find_direction: dialog %i ended", i);
+      dialog_remove(i);
+   }
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * learn from the regular classification of a message: create
+ * dialogs and remember the sender
+ * type:   direction found by sip_find_direction()
+ * urlidx: urlmap index found, -1 if none
+ *
+ * RETURNS: -
+ */
+void sip_dialog_learn(sip_ticket_t *ticket, int type, int urlidx) {
+   osip_message_t *sipmsg=ticket->sipmsg;
+   char callid[DIALOG_CALLID_SIZE];
+   char tag1[DIALOG_TAG_SIZE];
+   char tag2[DIALOG_TAG_SIZE];
+   unsigned int hash;
+   dialog_t *d;
+   int i, j;
+   int outgoing;
+
+   if (dialog_table == NULL) return;
+   if (dialog_key(sipmsg, callid, tag1, tag2, &hash) != STS_SUCCESS) return;
+
+   outgoing=((type == REQTYP_OUTGOING) || (type == RESTYP_OUTGOING));
+
+   i=dialog_find(callid, tag1, tag2, hash);
+   if (i < 0) {
+      /* dialog established? */
+      if (!(MSG_IS_STATUS_2XX(sipmsg) &&
+            (MSG_IS_RESPONSE_FOR(sipmsg, "INVITE") ||
+             MSG_IS_RESPONSE_FOR(sipmsg, "SUBSCRIBE"))) &&
+          !MSG_IS_ACK(sipmsg)) return;
+
+      if (dialog_free < 0) {
+         DEBUGC(DBCLASS_SIP, "sip_dialog_learn: dialog table full");
+         dialog_stats.full++;
+         return;
+      }
+      i=dialog_free;
+      d=&dialog_table[i];
+      dialog_free=d->hash_next;
+
+      memset(d, 0, sizeof(dialog_t));
+      d->used=1;
+      d->hash=hash;
+      strcpy(d->callid, callid);
+      strcpy(d->tag1, tag1);
+      strcpy(d->tag2, tag2);
+      d->hash_next=dialog_hash[hash & dialog_hash_mask];
+      dialog_hash[hash & dialog_hash_mask]=i;
+      dialog_stats.created++;
+      DEBUGC(DBCLASS_SIP, "sip_dialog_learn: new dialog %i [%s]", i, callid);
+   }
+   d=&dialog_table[i];
+   d->last_used=ticket->timestamp;
+
+   /* known sender? */
+   for (j=0; j<d->num_senders; j++) {
+      if ((d->sender[j].addr.s_addr == ticket->from.sin_addr.s_addr) &&
+          (d->sender[j].port == ticket->from.sin_port)) break;
+   }
+   if (j < d->num_senders) {
+      if ((d->sender[j].outgoing != outgoing) ||
+          (d->sender[j].urlidx != urlidx)) {
+         DEBUGC(DBCLASS_SIP, "sip_dialog_learn: dialog %i is ambiguous", i);
+         d->ambiguous=1;
+      } else if (urlidx >= 0) {
+         /* same registration, possibly refreshed meanwhile */
+         d->sender[j].generation=urlmap[urlidx].generation;
+      }
+   } else if (j < DIALOG_SENDERS) {
+      d->sender[j].addr=ticket->from.sin_addr;
+      d->sender[j].port=ticket->from.sin_port;
+      d->sender[j].outgoing=outgoing;
+      d->sender[j].urlidx=urlidx;
+      d->sender[j].generation=(urlidx >= 0)? urlmap[urlidx].generation : 0;
+      d->num_senders++;
+   }
+
+   /* dialog terminated */
+   if (MSG_IS_RESPONSE_FOR(sipmsg, "BYE") && (sipmsg->status_code >= 200)) {
+      DEBUGC(DBCLASS_SIP, "sip_dialog_learn: dialog %i ended", i);
+      dialog_remove(i);
+   }
+}
+
+
+/*
+ * remove dialogs without traffic for DIALOG_IDLE_TO seconds
+ *
+ * RETURNS: -
+ */
+void sip_dialog_expire(void) {
+   static time_t last_run=0;
+   time_t now;
+   int i;
+
+   if (dialog_table == NULL) return;
+
+   /* once per minute is plenty */
+   time(&now);
+   if (now - last_run < 60) return;
+   last_run=now;
+
+   for (i=0; i<dialog_size; i++) {
+      if (dialog_table[i].used &&
+          (dialog_table[i].last_used + DIALOG_IDLE_TO < now)) {
+         DEBUGC(DBCLASS_SIP, "sip_dialog_expire: dialog %i [%s] expired",
+                i, dialog_table[i].callid);
+         dialog_remove(i);
+         dialog_stats.expired++;
+      }
+   }
+}
+
+
+/*
+ * get the dialog table statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the dialog table is not enabled
+ */
+int sip_dialog_get_stats(sip_dialog_stats_t *stats) {
+   int i;
+
+   if ((dialog_table == NULL) || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &dialog_stats, sizeof(sip_dialog_stats_t));
+   stats->active=0;
+   for (i=0; i<dialog_size; i++) {
+      if (dialog_table[i].used) stats->active++;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * get the dialog key of a SIP message: Call-ID and both tags
+ * (sorted, so both directions give the same key)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not an in-dialog message
+ */
+static int dialog_key(osip_message_t *sipmsg, char *callid,
+                      char *tag1, char *tag2, unsigned int *hash) {
+   osip_call_id_t *cid;
+   osip_generic_param_t *fromtag=NULL;
+   osip_generic_param_t *totag=NULL;
+   char *t1, *t2, *p;
+   unsigned int h;
+
+   if ((sipmsg == NULL) || (sipmsg->from == NULL) || (sipmsg->to == NULL)) {
+      return STS_FAILURE;
+   }
+   if (MSG_IS_REGISTER(sipmsg) || MSG_IS_RESPONSE_FOR(sipmsg, "REGISTER")) {
+      return STS_FAILURE;
+   }
+
+   cid=osip_message_get_call_id(sipmsg);
+   if ((cid == NULL) || (cid->number == NULL)) return STS_FAILURE;
+
+   osip_from_get_tag(sipmsg->from, &fromtag);
+   osip_to_get_tag(sipmsg->to, &totag);
+   if ((fromtag == NULL) || (fromtag->gvalue == NULL) ||
+       (totag == NULL) || (totag->gvalue == NULL)) return STS_FAILURE;
+
+   if (strcmp(fromtag->gvalue, totag->gvalue) <= 0) {
+      t1=fromtag->gvalue;
+      t2=totag->gvalue;
+   } else {
+      t1=totag->gvalue;
+      t2=fromtag->gvalue;
+   }
+   if ((strlen(t1) >= DIALOG_TAG_SIZE) || (strlen(t2) >= DIALOG_TAG_SIZE)) {
+      return STS_FAILURE;
+   }
+   if (snprintf(callid, DIALOG_CALLID_SIZE, "%s%s%s", cid->number,
+                (cid->host)? "@" : "", (cid->host)? cid->host : "")
+       >= DIALOG_CALLID_SIZE) return STS_FAILURE;
+   strcpy(tag1, t1);
+   strcpy(tag2, t2);
+
+   h=2166136261U;		/* FNV-1a */
+   for (p=callid; *p; p++) h=(h ^ (unsigned char)*p) * 16777619U;
+   for (p=tag1; *p; p++) h=(h ^ (unsigned char)*p) * 16777619U;
+   h=(h ^ '|') * 16777619U;
+   for (p=tag2; *p; p++) h=(h ^ (unsigned char)*p) * 16777619U;
+   *hash=h;
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * find a dialog
+ *
+ * RETURNS: index into the dialog table or -1 if not found
+ */
+static int dialog_find(const char *callid, const char *tag1,
+                       const char *tag2, unsigned int hash) {
+   int i;
+
+   for (i=dialog_hash[hash & dialog_hash_mask]; i >= 0;
+        i=dialog_table[i].hash_next) {
+      if ((dialog_table[i].hash == hash) &&
+          (strcmp(dialog_table[i].callid, callid) == 0) &&
+          (strcmp(dialog_table[i].tag1, tag1) == 0) &&
+          (strcmp(dialog_table[i].tag2, tag2) == 0)) return i;
+   }
+   return -1;
+}
+
+
+/*
+ * remove a dialog and put it to the free list
+ *
+ * RETURNS: -
+ */
+static void dialog_remove(int idx) {
+   int *ip;
+
+   for (ip=&dialog_hash[dialog_table[idx].hash & dialog_hash_mask]; *ip >= 0;
+        ip=&dialog_table[*ip].hash_next) {
+      if (*ip == idx) {
+         *ip=dialog_table[idx].hash_next;
+         break;
+      }
+   }
+   dialog_table[idx].used=0;
+   dialog_table[idx].hash_next=dialog_free;
+   dialog_free=idx;
+}
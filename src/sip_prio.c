@@ -0,0 +1,336 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Priority scheduling of received SIP messages
+ *
+ * Received SIP messages are not processed strictly in arrival
+ * order. sipsock_waitfordata() moves all waiting UDP datagrams from
+ * the kernel and the complete messages received on TCP connections
+ * into this queue (sip_prio_queue messages) and delivers them by
+ * class:
+ *
+ *   SIP_PRIO_HIGH    responses, ACK, BYE, CANCEL and all other
+ *                    requests within a dialog (To tag present)
+ *   SIP_PRIO_INVITE  INVITE starting a new call
+ *   SIP_PRIO_LOW     REGISTER, OPTIONS, SUBSCRIBE and everything else
+ *
+ * So established calls keep working during a REGISTER storm. To
+ * avoid starvation of the lower classes, a message that has been
+ * waiting for longer than sip_prio_max_wait msec is delivered first
+ * (the one waiting longest, if several).
+ *
+ * TCP messages larger than a queue entry (BUFFER_SIZE) are not
+ * queued, they are processed as they come.
+ */
+
+typedef struct {
+   int next;			/* next in class FIFO / free list */
+   int len;
+   int protocol;		/* PROTO_UDP / PROTO_TCP */
+   struct sockaddr_in from;
+   long long arrival;		/* msec */
+   char buf[BUFFER_SIZE];
+} prio_entry_t;
+
+static prio_entry_t *prio_pool=NULL;
+static int prio_size=0;			/* 0 = disabled */
+static int prio_free=-1;		/* free list */
+static int prio_head[SIP_PRIO_CLASSES];
+static int prio_tail[SIP_PRIO_CLASSES];
+static int prio_count=0;
+static long prio_bytes=0;
+
+/* statistics */
+static sip_prio_stats_t prio_stats;
+
+/* local prototypes */
+static int prio_class(char *buf, size_t len);
+static long long prio_now(void);
+
+
+/*
+ * initialize the priority queue
+ * size		number of messages (0 = priority scheduling disabled)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int sip_prio_init(int size) {
+   int i;
+
+   memset(&prio_stats, 0, sizeof(prio_stats));
+   for (i=0; i<SIP_PRIO_CLASSES; i++) {
+      prio_head[i]=-1;
+      prio_tail[i]=-1;
+   }
+   if (size <= 0) return STS_SUCCESS;
+
+   prio_pool=malloc(size * sizeof(prio_entry_t));
+   if (prio_pool == NULL) {
+      ERROR("unable to allocate priority queue (%i messages)", size);
+      return STS_FAILURE;
+   }
+   for (i=0; i<size; i++) {
+      prio_pool[i].next=(i < size-1) ? i+1 : -1;
+   }
+   prio_free=0;
+   prio_size=size;
+   prio_stats.size=size;
+
+   if (configuration.sip_prio_max_wait <= 0) {
+      configuration.sip_prio_max_wait=SIP_PRIO_MAX_WAIT;
+   }
+
+   INFO("priority scheduling of SIP messages, queue %i, max. wait %i ms",
+        size, configuration.sip_prio_max_wait);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * is priority scheduling active
+ *
+ * RETURNS
+ *	STS_TRUE if it is
+ *	STS_FALSE if not
+ */
+int sip_prio_enabled(void) {
+   return (prio_size > 0) ? STS_TRUE : STS_FALSE;
+}
+
+
+/*
+ * number of messages waiting in the queue
+ *
+ * RETURNS
+ *	number of messages
+ */
+int sip_prio_count(void) {
+   return prio_count;
+}
+
+
+/*
+ * number of messages that can still be queued
+ *
+ * RETURNS
+ *	number of free slots
+ */
+int sip_prio_space(void) {
+   return prio_size - prio_count;
+}
+
+
+/*
+ * queue a received message
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the queue is full or the message too large
+ */
+int sip_prio_put(char *buf, int len, struct sockaddr_in *from,
+                 int protocol) {
+   prio_entry_t *e;
+   int idx, cls;
+
+   if ((prio_free < 0) || (len <= 0) ||
+       (len > (int)sizeof(prio_pool[0].buf))) {
+      prio_stats.rejected++;
+      return STS_FAILURE;
+   }
+
+   idx=prio_free;
+   e=&prio_pool[idx];
+   prio_free=e->next;
+
+   memcpy(e->buf, buf, len);
+   e->len=len;
+   e->protocol=protocol;
+   memcpy(&e->from, from, sizeof(struct sockaddr_in));
+   e->arrival=prio_now();
+   e->next=-1;
+
+   cls=prio_class(buf, len);
+   if (prio_tail[cls] >= 0) {
+      prio_pool[prio_tail[cls]].next=idx;
+   } else {
+      prio_head[cls]=idx;
+   }
+   prio_tail[cls]=idx;
+
+   prio_count++;
+   prio_bytes += len;
+   prio_stats.queued[cls]++;
+   prio_stats.depth[cls]++;
+   if (prio_stats.depth[cls] > prio_stats.max_depth[cls]) {
+      prio_stats.max_depth[cls]=prio_stats.depth[cls];
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * take the next message to be processed from the queue
+ *
+ * RETURNS number of bytes (=0 if the queue is empty)
+ *         from and protocol are modified to return the sender and
+ *         the transport it was received by
+ */
+int sip_prio_get(char *buf, size_t bufsize, struct sockaddr_in *from,
+                 int *protocol) {
+   prio_entry_t *e;
+   long long now, wait;
+   int i, cls=-1, aged=-1;
+   int idx, length;
+
+   if (prio_count <= 0) return 0;
+   now=prio_now();
+
+   for (i=0; i<SIP_PRIO_CLASSES; i++) {
+      if (prio_head[i] < 0) continue;
+      if (cls < 0) cls=i;
+      /* starvation protection: the longest waiting message first */
+      if ((now - prio_pool[prio_head[i]].arrival >=
+           configuration.sip_prio_max_wait) &&
+          ((aged < 0) || (prio_pool[prio_head[i]].arrival <
+                          prio_pool[prio_head[aged]].arrival))) {
+         aged=i;
+      }
+   }
+   if ((aged >= 0) && (aged != cls)) {
+      cls=aged;
+      prio_stats.aged[cls]++;
+   }
+
+   idx=prio_head[cls];
+   e=&prio_pool[idx];
+   prio_head[cls]=e->next;
+   if (prio_head[cls] < 0) prio_tail[cls]=-1;
+
+   length=e->len;
+   if (length > bufsize) length=bufsize;
+   memcpy(buf, e->buf, length);
+   memcpy(from, &e->from, sizeof(struct sockaddr_in));
+   *protocol=e->protocol;
+
+   wait=now - e->arrival;
+   if (wait > prio_stats.max_wait[cls]) prio_stats.max_wait[cls]=wait;
+
+   prio_count--;
+   prio_bytes -= e->len;
+   prio_stats.delivered[cls]++;
+   prio_stats.depth[cls]--;
+
+   e->next=prio_free;
+   prio_free=idx;
+
+   DEBUGC(DBCLASS_NET,"delivering queued %s message from [%s:%i] "
+          "count=%i class=%i waited=%lli ms",
+          (e->protocol == PROTO_TCP) ? "TCP" : "UDP",
+          utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+          length, cls, wait);
+   return length;
+}
+
+
+/*
+ * get the priority queue statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not enabled
+ */
+int sip_prio_get_stats(sip_prio_stats_t *stats) {
+   if ((prio_size <= 0) || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &prio_stats, sizeof(sip_prio_stats_t));
+   stats->bytes=prio_bytes;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * scheduling class of a message
+ */
+static int prio_class(char *buf, size_t len) {
+   static const struct {
+      const char *method;
+      size_t len;
+      int cls;
+   } methods[]={
+      {"ACK ",      4, SIP_PRIO_HIGH},
+      {"BYE ",      4, SIP_PRIO_HIGH},
+      {"CANCEL ",   7, SIP_PRIO_HIGH},
+      {"REGISTER ", 9, SIP_PRIO_LOW },
+      {"OPTIONS ",  8, SIP_PRIO_LOW }
+   };
+   size_t i;
+
+   /* responses */
+   if ((len > 8) && (memcmp(buf, "SIP/2.0 ", 8) == 0)) return SIP_PRIO_HIGH;
+
+   for (i=0; i < sizeof(methods)/sizeof(methods[0]); i++) {
+      if ((len > methods[i].len) &&
+          (memcmp(buf, methods[i].method, methods[i].len) == 0)) {
+         return methods[i].cls;
+      }
+   }
+
+   /* requests within a dialog: re-INVITE, NOTIFY, UPDATE, ... */
+   if (sip_raw_has_to_tag(buf, len) == STS_TRUE) return SIP_PRIO_HIGH;
+
+   if ((len > 7) && (memcmp(buf, "INVITE ", 7) == 0)) return SIP_PRIO_INVITE;
+
+   return SIP_PRIO_LOW;
+}
+
+
+/*
+ * current time in msec
+ */
+static long long prio_now(void) {
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
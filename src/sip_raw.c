@@ -0,0 +1,594 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Pre-parse fast path
+ *
+ * Classifies a received message on the raw buffer, before any
+ * parsing by libosip2 is done:
+ *  - CRLF keepalives are answered on TCP (RFC5626 "ping" -> "pong"),
+ *    any other keepalive (and all of them on UDP) is silently eaten
+ *  - messages that do not start with a SIP Request-Line or
+ *    Status-Line are dropped
+ *  - OPTIONS requests with Max-Forwards: 0 (directed to us, the
+ *    usual NAT keepalive "ping") are answered with a 200 OK that
+ *    is assembled from the raw header lines
+ * Everything else continues through the normal processing path.
+ *
+ * Locally generated responses (sip_gen_response(), register_response()
+ * and the 503 of the overload control) are rendered the same way,
+ * from the raw request and pre-rendered status lines.
+ */
+
+/* pre-built answer to a CRLF keepalive ping (RFC5626, 4.4.1) */
+static const char raw_pong[]="\r\n";
+
+/* pre-rendered status lines of locally generated responses */
+#define RAW_STATUS(code, line) {code, line, sizeof(line)-1}
+static const struct {
+   int code;
+   const char *line;
+   size_t len;
+} raw_status[]={
+   RAW_STATUS(200, "SIP/2.0 200 OK\r\n"),
+   RAW_STATUS(401, "SIP/2.0 401 Unauthorized\r\n"),
+   RAW_STATUS(403, "SIP/2.0 403 Forbidden\r\n"),
+   RAW_STATUS(407, "SIP/2.0 407 Proxy Authentication Required\r\n"),
+   RAW_STATUS(408, "SIP/2.0 408 Request Timeout\r\n"),
+   RAW_STATUS(482, "SIP/2.0 482 Loop Detected\r\n"),
+   RAW_STATUS(483, "SIP/2.0 483 Too Many Hops\r\n"),
+   RAW_STATUS(503, "SIP/2.0 503 Service Unavailable\r\n")
+};
+#undef RAW_STATUS
+
+/* statistics */
+static sip_raw_stats_t raw_stats;
+
+/* local prototypes */
+static int  raw_check_startline(char *buf, size_t size);
+static int  raw_answer_options(sip_ticket_t *ticket);
+static int  raw_has_tag(char *line, size_t len);
+static int  raw_has_param(const char *params, const char *name, size_t len);
+
+
+/*
+ * run the pre-parse classifier on a received message
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message needs regular processing
+ *	STS_SIP_SENT if the message has been answered
+ *	STS_FAILURE if the message is to be dropped
+ */
+int sip_raw_fastpath(sip_ticket_t *ticket) {
+   char *buf=ticket->raw_buffer;
+   size_t size=ticket->raw_buffer_len;
+   size_t i;
+
+   /*
+    * keepalive - consists of CR, LF (and some implementations
+    * send spaces or NUL bytes)
+    */
+   for (i=0; i<size; i++) {
+      if ((buf[i] != '\r') && (buf[i] != '\n') &&
+          (buf[i] != ' ') && (buf[i] != '\0')) break;
+   }
+   if (i >= size) {
+      raw_stats.keepalives++;
+      /* RFC5626 ping/pong is defined for connection-oriented transports */
+      if ((ticket->protocol == PROTO_TCP) &&
+          (size == 4) && (memcmp(buf, "\r\n\r\n", 4) == 0)) {
+         DEBUGC(DBCLASS_SIP,"CRLF keepalive ping from %s:%u -> pong",
+                utils_inet_ntoa(ticket->from.sin_addr),
+                ntohs(ticket->from.sin_port));
+         sipsock_send(ticket->from.sin_addr, ntohs(ticket->from.sin_port),
+                      ticket->protocol, (char*)raw_pong, strlen(raw_pong));
+         raw_stats.pongs++;
+         return STS_SIP_SENT;
+      }
+      DEBUGC(DBCLASS_SIP,"keepalive (%zd bytes) from %s:%u",
+             size, utils_inet_ntoa(ticket->from.sin_addr),
+             ntohs(ticket->from.sin_port));
+      return STS_FAILURE;
+   }
+
+   /*
+    * must start with a Request-Line or Status-Line
+    */
+   if (raw_check_startline(buf, size) != STS_SUCCESS) {
+      DEBUGC(DBCLASS_SIP,"dropping non-SIP message (%zd bytes) from %s:%u",
+             size, utils_inet_ntoa(ticket->from.sin_addr),
+             ntohs(ticket->from.sin_port));
+      raw_stats.dropped++;
+      return STS_FAILURE;
+   }
+
+   /*
+    * OPTIONS with Max-Forwards: 0
+    */
+   if ((size > 8) && (strncmp(buf, "OPTIONS ", 8) == 0)) {
+      if (raw_answer_options(ticket) == STS_SUCCESS) {
+         raw_stats.options++;
+         return STS_SIP_SENT;
+      }
+   }
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * get the fast path statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int sip_raw_get_stats(sip_raw_stats_t *stats) {
+   if (stats == NULL) return STS_FAILURE;
+   memcpy(stats, &raw_stats, sizeof(sip_raw_stats_t));
+   return STS_SUCCESS;
+}
+
+
+/*
+ * find the next header line with the given name (or its compact
+ * form, 0 if there is none) in the raw header section.
+ * pos must point to the beginning of a line. Continuation lines
+ * are included in the returned line.
+ *
+ * RETURNS
+ *	pointer to the start of the header line, *len holds the
+ *	length including the line terminator
+ *	NULL if not found
+ */
+char *sip_raw_get_header(char *pos, char *end, const char *name,
+                         char compact, size_t *len) {
+   char *line, *eol, *p;
+   size_t namelen=strlen(name);
+
+   for (line=pos; line < end; line=eol) {
+      eol=memchr(line, '\n', end-line);
+      eol=(eol)? eol+1 : end;
+
+      /* empty line - end of headers */
+      if ((line[0] == '\r') || (line[0] == '\n')) return NULL;
+      /* continuation of the previous line */
+      if ((line[0] == ' ') || (line[0] == '\t')) continue;
+
+      p=NULL;
+      if (((size_t)(eol-line) > namelen) &&
+          (strncasecmp(line, name, namelen) == 0)) {
+         p=line+namelen;
+      } else if (compact && (tolower((int)line[0]) == compact)) {
+         p=line+1;
+      }
+      if (p == NULL) continue;
+
+      while ((p < eol) && ((*p == ' ') || (*p == '\t'))) p++;
+      if ((p >= eol) || (*p != ':')) continue;
+
+      /* include continuation lines */
+      while ((eol < end) && ((*eol == ' ') || (*eol == '\t'))) {
+         p=memchr(eol, '\n', end-eol);
+         eol=(p)? p+1 : end;
+      }
+
+      *len=eol-line;
+      return line;
+   }
+   return NULL;
+}
+
+
+/*
+ * get the value of a header line (leading and trailing
+ * whitespace removed)
+ *
+ * RETURNS pointer to the value, *vlen holds its length
+ */
+char *sip_raw_get_value(char *line, size_t len, size_t *vlen) {
+   char *p, *e;
+
+   p=memchr(line, ':', len);
+   e=line+len;
+   p=(p)? p+1 : e;
+   while ((p < e) && isspace((int)*p)) p++;
+   while ((e > p) && isspace((int)*(e-1))) e--;
+   *vlen=e-p;
+   return p;
+}
+
+
+/*
+ * render a response to a request directly from the raw message,
+ * without building an osip tree. The response holds the Via, From,
+ * To, Call-ID and CSeq headers of the request copied verbatim (no To
+ * tag is added, like msg_make_template_reply()), for 200 also the
+ * Contact, and the given extra header lines. The destination is the address given in
+ * the topmost Via (same as sip_gen_response() uses).
+ * reason	reason phrase, NULL for the default of code
+ * via_params	appended to the topmost Via (replacing parameters of
+ *		the same name), may be NULL
+ * extra	header lines incl. CRLF, may be NULL
+ * resp, size	buffer for the response
+ * resplen	returns the length of the response
+ * addr, port	return the destination (port 0 if none in the Via)
+ *
+ * If the Via host is not a numeric IP address, anything required is
+ * missing or the result would differ from the osip rendered response
+ * (copied headers modified in ticket->sipmsg, several Contacts), the
+ * caller has to use the regular way.
+ *
+ * RETURNS
+ *	STS_SUCCESS if the response has been rendered
+ *	STS_FAILURE if it could not be rendered
+ */
+int sip_raw_build_response(sip_ticket_t *ticket, int code, const char *reason,
+                           const char *via_params, const char *extra,
+                           char *resp, size_t size, size_t *resplen,
+                           struct in_addr *addr, int *port) {
+   char *buf=ticket->raw_buffer;
+   char *end=ticket->raw_buffer+ticket->raw_buffer_len;
+   char *hdrs;
+   char *line, *value;
+   size_t len, vlen;
+   char host[IPSTRING_SIZE];
+   char tmp[64];
+   int first;
+   size_t i;
+   static const struct {
+      const char *name;
+      char compact;
+   } copy_hdrs[]={
+      {"From",    'f'},
+      {"To",      't'},
+      {"Call-ID", 'i'},
+      {"CSeq",    0  }
+   };
+
+   /* requests only */
+   if ((buf == NULL) || (ticket->raw_buffer_len < 8) ||
+       (memcmp(buf, "SIP/2.0 ", 8) == 0)) {
+      return STS_FAILURE;
+   }
+   /* copied headers have been changed in the parsed request */
+   if (ticket->modified &
+       (SIP_MOD_VIA | SIP_MOD_CONTACT | SIP_MOD_CALLID | SIP_MOD_OTHER)) {
+      return STS_FAILURE;
+   }
+
+   hdrs=memchr(buf, '\n', end-buf);
+   if (hdrs == NULL) return STS_FAILURE;
+   hdrs++;
+
+   /* response destination from topmost Via (sent-by) */
+   line=sip_raw_get_header(hdrs, end, "Via", 'v', &len);
+   if (line == NULL) return STS_FAILURE;
+   value=sip_raw_get_value(line, len, &vlen);
+   /* skip sent-protocol */
+   for (i=0; (i<vlen) && !isspace((int)value[i]); i++);
+   for (; (i<vlen) && isspace((int)value[i]); i++);
+   value+=i;
+   vlen-=i;
+   len=strcspn(value, ":;, \t\r\n");
+   if ((len == 0) || (len > vlen) || (len >= sizeof(host))) {
+      return STS_FAILURE;
+   }
+   memcpy(host, value, len);
+   host[len]='\0';
+   if (utils_inet_aton(host, addr) == 0) return STS_FAILURE;
+   *port=0;
+   if (value[len] == ':') {
+      *port=atoi(&value[len+1]);
+      if ((*port<=0) || (*port>65535)) *port=0;
+   }
+
+   /* assemble response */
+   *resplen=0;
+#define RAW_APPEND(p, l) \
+   do { \
+      if (*resplen + (l) >= size) return STS_FAILURE; \
+      memcpy(&resp[*resplen], (p), (l)); \
+      *resplen+=(l); \
+   } while (0)
+
+   /* status line, pre-rendered for the usual ones */
+   for (i=0; i < sizeof(raw_status)/sizeof(raw_status[0]); i++) {
+      if (raw_status[i].code == code) break;
+   }
+   if ((reason == NULL) && (i < sizeof(raw_status)/sizeof(raw_status[0]))) {
+      RAW_APPEND(raw_status[i].line, raw_status[i].len);
+   } else {
+      if (reason == NULL) reason=osip_message_get_reason(code);
+      if (reason == NULL) return STS_FAILURE;
+      snprintf(tmp, sizeof(tmp), "SIP/2.0 %i %s\r\n", code, reason);
+      RAW_APPEND(tmp, strlen(tmp));
+   }
+
+   /* all Via headers, in order */
+   first=1;
+   for (line=hdrs; (line=sip_raw_get_header(line, end, "Via", 'v', &len)) != NULL;
+        line+=len) {
+      vlen=len;
+      while ((vlen > 0) &&
+             ((line[vlen-1] == '\r') || (line[vlen-1] == '\n'))) vlen--;
+      /* the topmost Via (if it is a single value) gets the parameters,
+       * they replace existing parameters of the same name */
+      if (first && via_params && (memchr(line, ',', vlen) == NULL)) {
+         char *p=line, *seg;
+         size_t seglen;
+         while (p < line+vlen) {
+            seg=p;
+            p=memchr(seg+1, ';', line+vlen-seg-1);
+            if (p == NULL) p=line+vlen;
+            seglen=p-seg;
+            if ((seg[0] == ';') &&
+                (raw_has_param(via_params, seg+1,
+                               strcspn(seg+1, "=;\r\n")) == STS_TRUE)) {
+               continue;
+            }
+            RAW_APPEND(seg, seglen);
+         }
+         RAW_APPEND(via_params, strlen(via_params));
+      } else {
+         RAW_APPEND(line, vlen);
+      }
+      RAW_APPEND("\r\n", 2);
+      first=0;
+   }
+
+   for (i=0; i < sizeof(copy_hdrs)/sizeof(copy_hdrs[0]); i++) {
+      line=sip_raw_get_header(hdrs, end, copy_hdrs[i].name,
+                          copy_hdrs[i].compact, &len);
+      if (line == NULL) return STS_FAILURE;
+      vlen=len;
+      while ((vlen > 0) &&
+             ((line[vlen-1] == '\r') || (line[vlen-1] == '\n'))) vlen--;
+      RAW_APPEND(line, vlen);
+      RAW_APPEND("\r\n", 2);
+   }
+
+   /* 200 carries the first Contact (as msg_make_template_reply() does) */
+   if (code == 200) {
+      line=sip_raw_get_header(hdrs, end, "Contact", 'm', &len);
+      if (line) {
+         vlen=len;
+         while ((vlen > 0) &&
+                ((line[vlen-1] == '\r') || (line[vlen-1] == '\n'))) vlen--;
+         /* more than one Contact - leave this to libosip2 */
+         if (memchr(line, ',', vlen) ||
+             sip_raw_get_header(line+len, end, "Contact", 'm', &len)) {
+            return STS_FAILURE;
+         }
+         RAW_APPEND(line, vlen);
+         RAW_APPEND("\r\n", 2);
+      }
+   }
+
+   if (extra) RAW_APPEND(extra, strlen(extra));
+   RAW_APPEND("Content-Length: 0\r\n\r\n", 21);
+#undef RAW_APPEND
+
+   raw_stats.responses++;
+   return STS_SUCCESS;
+}
+
+
+/*
+ * answer a request directly from the raw message, see
+ * sip_raw_build_response(). If no port is given in the Via,
+ * the response goes to port 5060.
+ *
+ * RETURNS
+ *	STS_SUCCESS if the response has been sent
+ *	STS_FAILURE if no response could be sent
+ */
+int sip_raw_respond(sip_ticket_t *ticket, int code, const char *reason,
+                    const char *via_params, const char *extra) {
+   char resp[BUFFER_SIZE];
+   size_t resplen;
+   struct in_addr addr;
+   int port;
+
+   if (sip_raw_build_response(ticket, code, reason, via_params, extra,
+                              resp, sizeof(resp), &resplen,
+                              &addr, &port) != STS_SUCCESS) {
+      return STS_FAILURE;
+   }
+   if (port == 0) port=SIP_PORT;
+
+   DEBUGC(DBCLASS_SIP,"%i response (fast path) to %s:%i", code,
+          utils_inet_ntoa(addr), port);
+   sipsock_send(addr, port, ticket->protocol, resp, resplen);
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * is this a request that starts a new dialog or registration:
+ * INVITE or REGISTER without To tag
+ *
+ * RETURNS
+ *	STS_TRUE if it is
+ *	STS_FALSE if not
+ */
+int sip_raw_is_initial(sip_ticket_t *ticket) {
+   char *buf=ticket->raw_buffer;
+   size_t len=ticket->raw_buffer_len;
+
+   if (!(((len > 7) && (memcmp(buf, "INVITE ", 7) == 0)) ||
+         ((len > 9) && (memcmp(buf, "REGISTER ", 9) == 0)))) {
+      return STS_FALSE;
+   }
+   return (sip_raw_has_to_tag(buf, len) == STS_TRUE) ? STS_FALSE : STS_TRUE;
+}
+
+
+/*
+ * does the To header of a raw message carry a tag
+ * (request within a dialog)
+ *
+ * RETURNS
+ *	STS_TRUE if it does
+ *	STS_FALSE if not (or no To header)
+ */
+int sip_raw_has_to_tag(char *buf, size_t size) {
+   char *end=buf+size;
+   char *hdrs, *line;
+   size_t len;
+
+   hdrs=memchr(buf, '\n', size);
+   if (hdrs == NULL) return STS_FALSE;
+   line=sip_raw_get_header(hdrs+1, end, "To", 't', &len);
+   if (line == NULL) return STS_FALSE;
+   return raw_has_tag(line, len);
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * check the first line of the message, it must be either a
+ *   Status-Line:  SIP/2.0 SP 3DIGIT SP Reason-Phrase
+ *   Request-Line: Method SP Request-URI SP SIP/2.0
+ *
+ * RETURNS
+ *	STS_SUCCESS if the line looks like SIP
+ *	STS_FAILURE otherwise
+ */
+static int raw_check_startline(char *buf, size_t size) {
+   char *eol;
+   size_t len;
+   size_t i;
+
+   eol=memchr(buf, '\n', size);
+   if (eol == NULL) return STS_FAILURE;
+   len=eol-buf;
+   if ((len > 0) && (buf[len-1] == '\r')) len--;
+
+   /* Status-Line */
+   if ((len >= 12) && (strncmp(buf, "SIP/2.0 ", 8) == 0)) {
+      if (isdigit((int)buf[8]) && isdigit((int)buf[9]) &&
+          isdigit((int)buf[10]) && (buf[11] == ' ')) return STS_SUCCESS;
+      return STS_FAILURE;
+   }
+
+   /* Request-Line, Method is a token */
+   for (i=0; i<len; i++) {
+      if (!isalnum((int)buf[i]) && (strchr("-.!%*_+`'~", buf[i]) == NULL))
+         break;
+   }
+   if ((i == 0) || (i >= len) || (buf[i] != ' ')) return STS_FAILURE;
+
+   /* at least one character of Request-URI and the SIP-Version */
+   if (len < i + 2 + 8) return STS_FAILURE;
+   if (strncasecmp(&buf[len-8], " SIP/2.0", 8) != 0) return STS_FAILURE;
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * answer an OPTIONS request with Max-Forwards: 0 directly from the
+ * raw message (RFC3261, 11.2 and 16.3 step 3).
+ *
+ * RETURNS
+ *	STS_SUCCESS if the response has been sent
+ *	STS_FAILURE if the request needs regular processing
+ */
+static int raw_answer_options(sip_ticket_t *ticket) {
+   char *buf=ticket->raw_buffer;
+   char *end=ticket->raw_buffer+ticket->raw_buffer_len;
+   char *hdrs;
+   char *line, *value;
+   size_t len, vlen;
+
+   hdrs=memchr(buf, '\n', end-buf);
+   if (hdrs == NULL) return STS_FAILURE;
+   hdrs++;
+
+   /* Max-Forwards must be present and 0 */
+   line=sip_raw_get_header(hdrs, end, "Max-Forwards", 0, &len);
+   if (line == NULL) return STS_FAILURE;
+   value=sip_raw_get_value(line, len, &vlen);
+   if ((vlen == 0) || (strspn(value, "0") != vlen)) return STS_FAILURE;
+
+   return sip_raw_respond(ticket, 200, "OK", NULL, NULL);
+}
+
+
+/*
+ * does a From/To header line carry a tag parameter
+ *
+ * RETURNS
+ *	STS_TRUE if it does
+ *	STS_FALSE if not
+ */
+static int raw_has_tag(char *line, size_t len) {
+   size_t i;
+
+   for (i=0; i+5 <= len; i++) {
+      if ((line[i] == ';') && (strncasecmp(&line[i+1], "tag=", 4) == 0)) {
+         return STS_TRUE;
+      }
+   }
+   return STS_FALSE;
+}
+
+
+/*
+ * is a parameter with the given name in a ";name=value;..." list
+ *
+ * RETURNS
+ *	STS_TRUE if it is
+ *	STS_FALSE if not
+ */
+static int raw_has_param(const char *params, const char *name, size_t len) {
+   const char *p;
+
+   if (len == 0) return STS_FALSE;
+   for (p=strchr(params, ';'); p; p=strchr(p+1, ';')) {
+      if ((strncasecmp(p+1, name, len) == 0) &&
+          ((p[len+1] == '\0') || (p[len+1] == '=') || (p[len+1] == ';'))) {
+         return STS_TRUE;
+      }
+   }
+   return STS_FALSE;
+}
@@ -0,0 +1,448 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * Incremental re-serialization of proxied SIP messages
+ *
+ * Instead of printing the whole osip message structure again, the
+ * outgoing message is built from the received raw buffer: header
+ * lines that have not been touched are copied byte by byte, only the
+ * header classes that have been flagged in ticket->modified (SIP_MOD_*)
+ * are rendered from the osip structure. All values of a modified class
+ * are rendered at the position of its first occurrence in the raw
+ * message, classes that did not exist before are appended to the end
+ * of the header section.
+ *
+ * Whoever modifies a SIP message (siproxd itself or a plugin) must
+ * set the corresponding SIP_MOD_* flag, SIP_MOD_ALL if the change
+ * does not fit into one of the classes below. In this case the full
+ * message is printed by libosip2 as before.
+ */
+
+/* header classes that can be re-rendered individually */
+static const struct {
+   const char *name;	/* header name */
+   char compact;	/* compact form, 0 if none */
+   int  flag;		/* SIP_MOD_* */
+} splice_hdrs[]={
+   {"Via",		'v',	SIP_MOD_VIA},
+   {"Route",		0,	SIP_MOD_ROUTE},
+   {"Record-Route",	0,	SIP_MOD_RROUTE},
+   {"Contact",		'm',	SIP_MOD_CONTACT},
+   {"Call-ID",		'i',	SIP_MOD_CALLID},
+   {"Max-Forwards",	0,	SIP_MOD_MAXFWD},
+   {"User-Agent",	0,	SIP_MOD_UA},
+   {"Expires",		0,	SIP_MOD_EXPIRES},
+   {"Content-Length",	'l',	SIP_MOD_BODY},
+   {NULL,		0,	0}
+};
+
+/* growing output buffer */
+typedef struct {
+   char *buf;
+   size_t len;
+   size_t size;
+} splice_buf_t;
+
+/* statistics */
+static sip_splice_stats_t splice_stats;
+
+/* local prototypes */
+static int splice_message(sip_ticket_t *ticket, splice_buf_t *out);
+static int splice_classify(char *line, char *eol);
+static int splice_render(splice_buf_t *out, osip_message_t *msg,
+                         int idx, size_t bodylen);
+static int splice_render_startline(splice_buf_t *out, osip_message_t *msg);
+static int splice_header(splice_buf_t *out, const char *name, char *value);
+static int splice_append(splice_buf_t *out, const char *data, size_t len);
+
+
+/*
+ * convert the SIP message of a ticket into a string for sending
+ *
+ * If enabled (sip_splice) and possible, the message is spliced
+ * together from the received raw buffer and the modified parts,
+ * otherwise libosip2 prints the complete message.
+ * The returned buffer must be released with osip_free().
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int sip_splice_to_str(sip_ticket_t *ticket, char **dest, size_t *len) {
+   splice_buf_t out;
+
+   if ((ticket == NULL) || (ticket->sipmsg == NULL) ||
+       (dest == NULL) || (len == NULL)) return STS_FAILURE;
+
+   if (configuration.sip_splice && (ticket->raw_buffer != NULL) &&
+       ((ticket->modified & SIP_MOD_OTHER) == 0)) {
+      memset(&out, 0, sizeof(out));
+      if (splice_message(ticket, &out) == STS_SUCCESS) {
+         DEBUGC(DBCLASS_SIP, "sip_splice_to_str: spliced %zd bytes, "
+                "modified=0x%x", out.len, ticket->modified);
+         *dest=out.buf;
+         *len=out.len;
+         splice_stats.spliced++;
+         return STS_SUCCESS;
+      }
+      if (out.buf) osip_free(out.buf);
+      DEBUGC(DBCLASS_SIP, "sip_splice_to_str: cannot splice, "
+             "printing full message");
+   }
+
+   splice_stats.full++;
+   if (sip_message_to_str(ticket->sipmsg, dest, len) != 0) {
+      return STS_FAILURE;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * get the splicing statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if splicing is not enabled
+ */
+int sip_splice_get_stats(sip_splice_stats_t *stats) {
+   if (!configuration.sip_splice || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &splice_stats, sizeof(sip_splice_stats_t));
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * build the outgoing message from the raw buffer and
+ * the modified header classes
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the message cannot be spliced
+ */
+static int splice_message(sip_ticket_t *ticket, splice_buf_t *out) {
+   osip_message_t *msg=ticket->sipmsg;
+   int modified=ticket->modified;
+   int emitted=0;
+   char *raw=ticket->raw_buffer;
+   char *end=ticket->raw_buffer+ticket->raw_buffer_len;
+   char *line, *eol, *p;
+   char *rawbody=NULL;
+   char *body=NULL;
+   size_t bodylen=0;
+   osip_body_t *b;
+   int flag;
+   int i;
+
+   out->size=ticket->raw_buffer_len + 256;
+   out->buf=osip_malloc(out->size);
+   if (out->buf == NULL) return STS_FAILURE;
+   out->len=0;
+
+   /* new body (single part only) */
+   if (modified & SIP_MOD_BODY) {
+      if ((msg->mime_version != NULL) ||
+          (osip_list_size(&(msg->bodies)) > 1)) return STS_FAILURE;
+      b=(osip_body_t *)osip_list_get(&(msg->bodies), 0);
+      if (b && (sip_body_to_str(b, &body, &bodylen) != 0)) return STS_FAILURE;
+   }
+
+   /* Request-Line / Status-Line */
+   eol=memchr(raw, '\n', end-raw);
+   if (eol == NULL) goto error;
+   eol++;
+   if (modified & SIP_MOD_STARTLINE) {
+      if (splice_render_startline(out, msg) != STS_SUCCESS) goto error;
+   } else {
+      if (splice_append(out, raw, eol-raw) != STS_SUCCESS) goto error;
+   }
+
+   /* header lines */
+   for (line=eol; line < end; line=eol) {
+      eol=memchr(line, '\n', end-line);
+      eol=(eol)? eol+1 : end;
+
+      /* empty line - start of body */
+      if ((line[0] == '\r') || (line[0] == '\n')) {
+         rawbody=eol;
+         break;
+      }
+
+      /* continuation lines belong to this header */
+      while ((eol < end) && ((*eol == ' ') || (*eol == '\t'))) {
+         p=memchr(eol, '\n', end-eol);
+         eol=(p)? p+1 : end;
+      }
+
+      i=splice_classify(line, eol);
+      flag=(i >= 0)? splice_hdrs[i].flag : 0;
+      if (flag & modified) {
+         /* render all values of this class at its first occurrence */
+         if ((emitted & flag) == 0) {
+            if (splice_render(out, msg, i, bodylen) != STS_SUCCESS) goto error;
+            emitted |= flag;
+         }
+         continue;
+      }
+
+      if (splice_append(out, line, eol-line) != STS_SUCCESS) goto error;
+   }
+
+   /* incomplete message (no end of headers) */
+   if (rawbody == NULL) goto error;
+
+   /* modified classes not present in the received message */
+   for (i=0; splice_hdrs[i].name; i++) {
+      flag=splice_hdrs[i].flag;
+      if ((modified & flag) && ((emitted & flag) == 0)) {
+         if (splice_render(out, msg, i, bodylen) != STS_SUCCESS) goto error;
+         emitted |= flag;
+      }
+   }
+   if (splice_append(out, "\r\n", 2) != STS_SUCCESS) goto error;
+
+   /* body */
+   if (modified & SIP_MOD_BODY) {
+      if (body && (splice_append(out, body, bodylen) != STS_SUCCESS)) goto error;
+   } else {
+      if (splice_append(out, rawbody, end-rawbody) != STS_SUCCESS) goto error;
+   }
+
+   if (body) osip_free(body);
+   out->buf[out->len]='\0';
+   return STS_SUCCESS;
+
+error:
+   if (body) osip_free(body);
+   return STS_FAILURE;
+}
+
+
+/*
+ * find the header class of a raw header line
+ *
+ * RETURNS index into splice_hdrs[] or -1 if not a known class
+ */
+static int splice_classify(char *line, char *eol) {
+   char *p;
+   size_t namelen;
+   int i;
+
+   for (i=0; splice_hdrs[i].name; i++) {
+      namelen=strlen(splice_hdrs[i].name);
+      p=NULL;
+      if (((size_t)(eol-line) > namelen) &&
+          (strncasecmp(line, splice_hdrs[i].name, namelen) == 0)) {
+         p=line+namelen;
+      } else if (splice_hdrs[i].compact &&
+                 (tolower((int)line[0]) == splice_hdrs[i].compact)) {
+         p=line+1;
+      }
+      if (p == NULL) continue;
+
+      while ((p < eol) && ((*p == ' ') || (*p == '\t'))) p++;
+      if ((p < eol) && (*p == ':')) return i;
+   }
+   return -1;
+}
+
+
+/*
+ * render all values of a header class from the osip structure
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int splice_render(splice_buf_t *out, osip_message_t *msg,
+                         int idx, size_t bodylen) {
+   const char *name=splice_hdrs[idx].name;
+   osip_list_t *list=NULL;
+   osip_header_t *hdr;
+   void *elem;
+   char *tmp;
+   int sts;
+   int i;
+
+   switch (splice_hdrs[idx].flag) {
+   case SIP_MOD_VIA:
+      list=&(msg->vias);
+      break;
+   case SIP_MOD_ROUTE:
+      list=&(msg->routes);
+      break;
+   case SIP_MOD_RROUTE:
+      list=&(msg->record_routes);
+      break;
+   case SIP_MOD_CONTACT:
+      list=&(msg->contacts);
+      break;
+
+   case SIP_MOD_CALLID:
+      if (msg->call_id == NULL) return STS_SUCCESS;
+      if (osip_call_id_to_str(msg->call_id, &tmp) != 0) return STS_FAILURE;
+      return splice_header(out, name, tmp);
+
+   case SIP_MOD_BODY:
+      tmp=osip_malloc(24);
+      if (tmp == NULL) return STS_FAILURE;
+      snprintf(tmp, 24, "%lu", (unsigned long)bodylen);
+      return splice_header(out, name, tmp);
+
+   default:
+      /* stored in the list of generic headers */
+      for (i=0; (hdr=osip_list_get(&(msg->headers), i)) != NULL; i++) {
+         if ((hdr->hname == NULL) || (hdr->hvalue == NULL)) continue;
+         if (osip_strcasecmp(hdr->hname, name) != 0) continue;
+         sts=splice_header(out, name, osip_strdup(hdr->hvalue));
+         if (sts != STS_SUCCESS) return sts;
+      }
+      return STS_SUCCESS;
+   }
+
+   for (i=0; (elem=osip_list_get(list, i)) != NULL; i++) {
+      tmp=NULL;
+      switch (splice_hdrs[idx].flag) {
+      case SIP_MOD_VIA:
+         sts=osip_via_to_str((osip_via_t *)elem, &tmp);
+         break;
+      case SIP_MOD_ROUTE:
+         sts=osip_route_to_str((osip_route_t *)elem, &tmp);
+         break;
+      case SIP_MOD_RROUTE:
+         sts=osip_record_route_to_str((osip_record_route_t *)elem, &tmp);
+         break;
+      default:
+         sts=osip_contact_to_str((osip_contact_t *)elem, &tmp);
+         break;
+      }
+      if (sts != 0) return STS_FAILURE;
+      sts=splice_header(out, name, tmp);
+      if (sts != STS_SUCCESS) return sts;
+   }
+   return STS_SUCCESS;
+}
+
+
+/*
+ * render the Request-Line or Status-Line
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int splice_render_startline(splice_buf_t *out, osip_message_t *msg) {
+   char *uri=NULL;
+   char line[64];
+   int sts;
+
+   if (msg->sip_version == NULL) return STS_FAILURE;
+
+   if (MSG_IS_REQUEST(msg)) {
+      if ((msg->sip_method == NULL) || (msg->req_uri == NULL)) {
+         return STS_FAILURE;
+      }
+      if (osip_uri_to_str(msg->req_uri, &uri) != 0) return STS_FAILURE;
+      sts=splice_append(out, msg->sip_method, strlen(msg->sip_method));
+      if (sts == STS_SUCCESS) sts=splice_append(out, " ", 1);
+      if (sts == STS_SUCCESS) sts=splice_append(out, uri, strlen(uri));
+      if (sts == STS_SUCCESS) sts=splice_append(out, " ", 1);
+      if (sts == STS_SUCCESS) sts=splice_append(out, msg->sip_version,
+                                                strlen(msg->sip_version));
+      osip_free(uri);
+   } else {
+      snprintf(line, sizeof(line), "%s %i ", msg->sip_version,
+               msg->status_code);
+      sts=splice_append(out, line, strlen(line));
+      if ((sts == STS_SUCCESS) && msg->reason_phrase) {
+         sts=splice_append(out, msg->reason_phrase,
+                           strlen(msg->reason_phrase));
+      }
+   }
+   if (sts == STS_SUCCESS) sts=splice_append(out, "\r\n", 2);
+   return sts;
+}
+
+
+/*
+ * append a header line "name: value" and release value
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int splice_header(splice_buf_t *out, const char *name, char *value) {
+   int sts;
+
+   if (value == NULL) return STS_FAILURE;
+   sts=splice_append(out, name, strlen(name));
+   if (sts == STS_SUCCESS) sts=splice_append(out, ": ", 2);
+   if (sts == STS_SUCCESS) sts=splice_append(out, value, strlen(value));
+   if (sts == STS_SUCCESS) sts=splice_append(out, "\r\n", 2);
+   osip_free(value);
+   return sts;
+}
+
+
+/*
+ * append data to the output buffer (one byte is always kept
+ * free for the terminating \0)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int splice_append(splice_buf_t *out, const char *data, size_t len) {
+   char *newbuf;
+   size_t newsize;
+
+   if (out->len + len + 1 > out->size) {
+      newsize=out->size * 2;
+      if (newsize < out->len + len + 1) newsize=out->len + len + 1;
+      newbuf=osip_realloc(out->buf, newsize);
+      if (newbuf == NULL) return STS_FAILURE;
+      out->buf=newbuf;
+      out->size=newsize;
+   }
+   memcpy(&out->buf[out->len], data, len);
+   out->len+=len;
+   return STS_SUCCESS;
+}
@@ -0,0 +1,463 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* configuration storage */
+extern struct siproxd_config configuration;
+
+/*
+ * UDP retransmission absorption
+ *
+ * siproxd is stateless - a retransmitted request would be processed
+ * completely again (parsing, authentication, plugins, SDP rewriting)
+ * and forwarded. This short-lived transaction cache remembers for
+ * each request received via UDP (key: top Via branch, CSeq number
+ * and method) the forwarded copy and the final response. A
+ * retransmission is then answered with the cached final response
+ * or the cached copy is forwarded once more, without processing.
+ *
+ * Entries live SIP_TRANS_LIFETIME msecs. As this is the same for all
+ * entries, the table is used as ring buffer - the oldest entry is
+ * reused for a new transaction. Only requests with a RFC3261 branch
+ * (magic cookie) are cached.
+ */
+
+#define TRANS_BRANCH_SIZE	64
+#define TRANS_METHOD_SIZE	16
+
+typedef struct {
+   int used;
+   int hash_next;			/* next entry in hash chain, -1=end */
+   unsigned int hash;
+   struct timeval expires;
+   struct in_addr client;		/* source of the request */
+   unsigned long cseq;
+   char method[TRANS_METHOD_SIZE];
+   char branch[TRANS_BRANCH_SIZE];
+   /* forwarded request */
+   char *req;
+   size_t req_len;
+   struct in_addr req_addr;
+   int req_port;
+   int req_proto;
+   /* final response */
+   char *resp;
+   size_t resp_len;
+   struct in_addr resp_addr;
+   int resp_port;
+   int resp_proto;
+} trans_entry_t;
+
+static trans_entry_t *trans_table=NULL;
+static int trans_size=0;
+static int trans_next=0;		/* ring: next entry to use */
+static int *trans_hash=NULL;
+static unsigned int trans_hash_mask=0;
+
+/* transaction of the request currently processed, -1=none */
+static int trans_current=-1;
+
+/* statistics */
+static sip_trans_stats_t trans_stats;
+
+/* local prototypes */
+static int trans_key_raw(sip_ticket_t *ticket, char *branch,
+                         unsigned long *cseq, char *method);
+static unsigned int trans_hash_key(const char *branch, unsigned long cseq,
+                                   const char *method);
+static int trans_find(const char *branch, unsigned long cseq,
+                      const char *method);
+static int trans_new(const char *branch, unsigned long cseq,
+                     const char *method, struct in_addr client);
+static int trans_copy(char **dest, size_t *dest_len, char *buf, size_t len);
+
+
+/*
+ * allocate the transaction cache
+ * size: number of entries, 0 disables
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int sip_trans_init(int size) {
+   int i;
+   int hashsize;
+
+   memset(&trans_stats, 0, sizeof(trans_stats));
+   if (size <= 0) return STS_SUCCESS;
+
+   for (hashsize=64; hashsize < size; hashsize <<= 1);
+   trans_table=calloc(size, sizeof(trans_entry_t));
+   trans_hash=malloc(hashsize*sizeof(int));
+   if ((trans_table == NULL) || (trans_hash == NULL)) {
+      ERROR("unable to allocate transaction cache of %i entries", size);
+      free(trans_table);
+      free(trans_hash);
+      trans_table=NULL;
+      trans_hash=NULL;
+      return STS_FAILURE;
+   }
+   for (i=0; i<hashsize; i++) trans_hash[i]=-1;
+   trans_hash_mask=hashsize-1;
+   trans_size=size;
+   trans_next=0;
+
+   INFO("using UDP transaction cache of %i entries", size);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * look up a received request in the transaction cache (before
+ * parsing). A retransmission is answered with the cached final
+ * response or the cached forwarded request is sent again. Any other
+ * request gets a new entry, the results of its processing are
+ * stored by sip_trans_store_request() and sip_trans_store_response().
+ *
+ * RETURNS
+ *	STS_SUCCESS if the message needs regular processing
+ *	STS_SIP_SENT if the retransmission has been handled
+ */
+int sip_trans_lookup(sip_ticket_t *ticket) {
+   char branch[TRANS_BRANCH_SIZE];
+   char method[TRANS_METHOD_SIZE];
+   unsigned long cseq;
+   trans_entry_t *t;
+   int i;
+
+   trans_current=-1;
+   if (trans_table == NULL) return STS_SUCCESS;
+
+   /* only requests via UDP are retransmitted */
+   if (ticket->protocol != PROTO_UDP) return STS_SUCCESS;
+   if (trans_key_raw(ticket, branch, &cseq, method) != STS_SUCCESS) {
+      return STS_SUCCESS;
+   }
+   /* ACK has no response, do not bother */
+   if (strcmp(method, "ACK") == 0) return STS_SUCCESS;
+
+   trans_stats.lookups++;
+
+   i=trans_find(branch, cseq, method);
+   if ((i >= 0) &&
+       (trans_table[i].client.s_addr == ticket->from.sin_addr.s_addr)) {
+      t=&trans_table[i];
+      if (t->resp) {
+         DEBUGC(DBCLASS_PROXY,"retransmitted %s from %s: answered from "
+                "transaction cache", method,
+                utils_inet_ntoa(ticket->from.sin_addr));
+         sipsock_send(t->resp_addr, t->resp_port, t->resp_proto,
+                      t->resp, t->resp_len);
+         trans_stats.resp_hits++;
+         return STS_SIP_SENT;
+      }
+      if (t->req) {
+         DEBUGC(DBCLASS_PROXY,"retransmitted %s from %s: forwarded from "
+                "transaction cache", method,
+                utils_inet_ntoa(ticket->from.sin_addr));
+         sipsock_send(t->req_addr, t->req_port, t->req_proto,
+                      t->req, t->req_len);
+         trans_stats.req_hits++;
+         return STS_SIP_SENT;
+      }
+      /* nothing has been sent for this request, process again */
+      trans_current=i;
+      return STS_SUCCESS;
+   }
+
+   trans_current=trans_new(branch, cseq, method, ticket->from.sin_addr);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * remember the forwarded copy of the request currently processed
+ *
+ * RETURNS: -
+ */
+void sip_trans_store_request(struct in_addr addr, int port, int protocol,
+                             char *buffer, size_t len) {
+   trans_entry_t *t;
+
+   if (trans_current < 0) return;
+   t=&trans_table[trans_current];
+
+   if (trans_copy(&t->req, &t->req_len, buffer, len) != STS_SUCCESS) return;
+   t->req_addr=addr;
+   t->req_port=port;
+   t->req_proto=protocol;
+   trans_stats.stored++;
+}
+
+
+/*
+ * remember a final response. For a locally generated response
+ * (ticket holds the request) it belongs to the request currently
+ * processed, a proxied response (ticket holds the response) is
+ * assigned by its topmost Via branch and CSeq - this must be called
+ * after siproxd's own Via has been removed.
+ *
+ * RETURNS: -
+ */
+void sip_trans_store_response(sip_ticket_t *ticket, int code,
+                              struct in_addr addr, int port, int protocol,
+                              char *buffer, size_t len) {
+   osip_message_t *resp=ticket->sipmsg;
+   osip_via_t *via;
+   osip_generic_param_t *param=NULL;
+   osip_cseq_t *cseq;
+   trans_entry_t *t;
+   int i;
+
+   if (trans_table == NULL) return;
+   if (code < 200) return;
+
+   if (MSG_IS_REQUEST(resp)) {
+      i=trans_current;
+   } else {
+      /* proxied response, find the transaction */
+      via=osip_list_get(&(resp->vias), 0);
+      cseq=resp->cseq;
+      if ((via == NULL) || (cseq == NULL) ||
+          (cseq->number == NULL) || (cseq->method == NULL)) return;
+      osip_via_param_get_byname(via, "branch", &param);
+      if ((param == NULL) || (param->gvalue == NULL)) return;
+      i=trans_find(param->gvalue, strtoul(cseq->number, NULL, 10),
+                   cseq->method);
+   }
+   if (i < 0) return;
+   t=&trans_table[i];
+
+   if (trans_copy(&t->resp, &t->resp_len, buffer, len) != STS_SUCCESS) return;
+   t->resp_addr=addr;
+   t->resp_port=port;
+   t->resp_proto=protocol;
+   trans_stats.stored++;
+}
+
+
+/*
+ * get the transaction cache statistics
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the cache is not enabled
+ */
+int sip_trans_get_stats(sip_trans_stats_t *stats) {
+   if ((trans_table == NULL) || (stats == NULL)) return STS_FAILURE;
+   memcpy(stats, &trans_stats, sizeof(sip_trans_stats_t));
+   return STS_SUCCESS;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * extract the transaction key from a raw request:
+ * branch of the topmost Via, CSeq number and method
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if not a request or no usable key
+ */
+static int trans_key_raw(sip_ticket_t *ticket, char *branch,
+                         unsigned long *cseq, char *method) {
+   char *buf=ticket->raw_buffer;
+   char *end=ticket->raw_buffer+ticket->raw_buffer_len;
+   char *hdrs, *line, *value, *p, *e;
+   size_t len, vlen;
+   char *endp;
+
+   if ((ticket->raw_buffer_len < 8) || (strncmp(buf, "SIP/2.0 ", 8) == 0)) {
+      return STS_FAILURE;
+   }
+   hdrs=memchr(buf, '\n', end-buf);
+   if (hdrs == NULL) return STS_FAILURE;
+   hdrs++;
+
+   /* CSeq: number method */
+   line=sip_raw_get_header(hdrs, end, "CSeq", 0, &len);
+   if (line == NULL) return STS_FAILURE;
+   value=sip_raw_get_value(line, len, &vlen);
+   *cseq=strtoul(value, &endp, 10);
+   if ((endp == value) || (endp >= value+vlen)) return STS_FAILURE;
+   for (p=endp; (p < value+vlen) && isspace((int)*p); p++);
+   len=value+vlen-p;
+   if ((len == 0) || (len >= TRANS_METHOD_SIZE)) return STS_FAILURE;
+   memcpy(method, p, len);
+   method[len]='\0';
+
+   /* branch parameter of the topmost Via (first via-parm only) */
+   line=sip_raw_get_header(hdrs, end, "Via", 'v', &len);
+   if (line == NULL) return STS_FAILURE;
+   value=sip_raw_get_value(line, len, &vlen);
+   e=memchr(value, ',', vlen);
+   if (e == NULL) e=value+vlen;
+   for (p=value; p+8 < e; p++) {
+      if ((*p == ';') && (strncasecmp(p+1, "branch", 6) == 0)) break;
+   }
+   if (p+8 >= e) return STS_FAILURE;
+   p+=7;
+   while ((p < e) && isspace((int)*p)) p++;
+   if ((p >= e) || (*p != '=')) return STS_FAILURE;
+   p++;
+   while ((p < e) && isspace((int)*p)) p++;
+   len=strcspn(p, ";, \t\r\n");
+   if (p+len > e) len=e-p;
+   if ((len <= 7) || (len >= TRANS_BRANCH_SIZE)) return STS_FAILURE;
+   /* RFC3261 magic cookie, older branches are not unique */
+   if (strncmp(p, "z9hG4bK", 7) != 0) return STS_FAILURE;
+   memcpy(branch, p, len);
+   branch[len]='\0';
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * hash of a transaction key
+ *
+ * RETURNS: hash value
+ */
+static unsigned int trans_hash_key(const char *branch, unsigned long cseq,
+                                   const char *method) {
+   unsigned int h=2166136261U;		/* FNV-1a */
+   const char *p;
+
+   for (p=branch; *p; p++) h=(h ^ (unsigned char)*p) * 16777619U;
+   for (p=method; *p; p++) h=(h ^ (unsigned char)*p) * 16777619U;
+   h=(h ^ (unsigned int)cseq) * 16777619U;
+   return h;
+}
+
+
+/*
+ * find a not yet expired transaction
+ *
+ * RETURNS: index into the table or -1 if not found
+ */
+static int trans_find(const char *branch, unsigned long cseq,
+                      const char *method) {
+   struct timeval now;
+   unsigned int h;
+   int i;
+
+   if (trans_table == NULL) return -1;
+
+   gettimeofday(&now, NULL);
+   h=trans_hash_key(branch, cseq, method);
+   for (i=trans_hash[h & trans_hash_mask]; i >= 0;
+        i=trans_table[i].hash_next) {
+      if ((trans_table[i].hash == h) && (trans_table[i].cseq == cseq) &&
+          (strcmp(trans_table[i].branch, branch) == 0) &&
+          (strcmp(trans_table[i].method, method) == 0)) {
+         /* newest entries are first in the chain */
+         if (timercmp(&now, &trans_table[i].expires, >)) return -1;
+         return i;
+      }
+   }
+   return -1;
+}
+
+
+/*
+ * create a new transaction, reusing the oldest entry
+ *
+ * RETURNS: index into the table
+ */
+static int trans_new(const char *branch, unsigned long cseq,
+                     const char *method, struct in_addr client) {
+   trans_entry_t *t;
+   int i;
+   int *ip;
+
+   i=trans_next;
+   trans_next=(trans_next+1) % trans_size;
+   t=&trans_table[i];
+
+   /* release the old entry */
+   if (t->used) {
+      for (ip=&trans_hash[t->hash & trans_hash_mask]; *ip >= 0;
+           ip=&trans_table[*ip].hash_next) {
+         if (*ip == i) {
+            *ip=t->hash_next;
+            break;
+         }
+      }
+      free(t->req);
+      free(t->resp);
+   }
+   memset(t, 0, sizeof(trans_entry_t));
+
+   t->used=1;
+   t->hash=trans_hash_key(branch, cseq, method);
+   gettimeofday(&t->expires, NULL);
+   t->expires.tv_sec += SIP_TRANS_LIFETIME/1000;
+   t->expires.tv_usec += (SIP_TRANS_LIFETIME%1000)*1000;
+   if (t->expires.tv_usec >= 1000000) {
+      t->expires.tv_sec++;
+      t->expires.tv_usec -= 1000000;
+   }
+   t->client=client;
+   t->cseq=cseq;
+   strcpy(t->method, method);
+   strcpy(t->branch, branch);
+
+   t->hash_next=trans_hash[t->hash & trans_hash_mask];
+   trans_hash[t->hash & trans_hash_mask]=i;
+
+   return i;
+}
+
+
+/*
+ * store a copy of a message buffer (replaces a previous one)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int trans_copy(char **dest, size_t *dest_len, char *buf, size_t len) {
+   char *copy;
+
+   copy=malloc(len);
+   if (copy == NULL) return STS_FAILURE;
+   memcpy(copy, buf, len);
+   free(*dest);
+   *dest=copy;
+   *dest_len=len;
+   return STS_SUCCESS;
+}
@@ -47,7 +47,8 @@ extern struct siproxd_config configuration;
 
 extern int h_errno;
 
-extern struct urlmap_s urlmap[];		/* URL mapping table     */
+extern struct urlmap_s *urlmap;		/* URL mapping table     */
+extern int urlmap_size;
 
 
 /*
@@ -539,6 +540,20 @@ int sip_gen_response(sip_ticket_t *ticket, int code) {
    char *buffer;
    size_t buflen;
    struct in_addr addr;
+   char rawresp[BUFFER_SIZE];
+
+   /* fast path: render the response from the raw request. 3xx
+    * responses carry the Contacts set up by plugins, no fast path */
+   if (((code < 300) || (code >= 400)) &&
+       (sip_raw_build_response(ticket, code, NULL, NULL, NULL,
+                               rawresp, sizeof(rawresp), &buflen,
+                               &addr, &port) == STS_SUCCESS)) {
+      if (port == 0) port=SIP_PORT;
+      sipsock_send(addr, port, ticket->protocol, rawresp, buflen);
+      sip_trans_store_response(ticket, code, addr, port, ticket->protocol,
+                               rawresp, buflen);
+      return STS_SUCCESS;
+   }
 
    /* create the response template */
    if ((response=msg_make_template_reply(ticket, code))==NULL) {
@@ -587,6 +602,8 @@ int sip_gen_response(sip_ticket_t *ticket, int code) {
 
    /* send to destination */
    sipsock_send(addr, port, ticket->protocol, buffer, buflen);
+   sip_trans_store_response(ticket, code, addr, port, ticket->protocol,
+                            buffer, buflen);
 
    /* free the resources */
    osip_message_free(response);
@@ -654,6 +671,7 @@ int sip_add_myvia (sip_ticket_t *ticket, int interface) {
    if (sts!=0) return STS_FAILURE;
 
    osip_list_add(&(ticket->sipmsg->vias),via,0);
+   ticket->modified |= SIP_MOD_VIA;
 
    return STS_SUCCESS;
 }
@@ -684,6 +702,7 @@ int sip_del_myvia (sip_ticket_t *ticket) {
 
    osip_list_remove(&(ticket->sipmsg->vias), 0);
    osip_via_free (via);
+   ticket->modified |= SIP_MOD_VIA;
    return STS_SUCCESS;
 }
 
@@ -700,7 +719,8 @@ int sip_del_myvia (sip_ticket_t *ticket) {
 int sip_rewrite_contact (sip_ticket_t *ticket, int direction) {
    osip_message_t *sip_msg=ticket->sipmsg;
    osip_contact_t *contact;
-   int i, j;
+   int i, j, k, nc;
+   int *cand;
    int replaced=0;
 
    if (sip_msg == NULL) return STS_FAILURE;
@@ -720,16 +740,20 @@ int sip_rewrite_contact (sip_ticket_t *ticket, int direction) {
              (contact->url->host)? contact->url->host : "*NULL*");
 
       /* search for an entry */
-      for (i=0;i<URLMAP_SIZE;i++){
+      nc=urlmap_index_lookup((direction == DIR_OUTGOING)? URLMAP_IDX_TRUE :
+                             URLMAP_IDX_MASQ, contact->url, NULL, &cand);
+      for (k=0; k<nc; k++) {
+         i=cand[k];
          if (urlmap[i].active == 0) continue;
          if ((direction == DIR_OUTGOING) &&
              (compare_url(contact->url, urlmap[i].true_url)==STS_SUCCESS)) break;
          if ((direction == DIR_INCOMING) &&
              (compare_url(contact->url, urlmap[i].masq_url)==STS_SUCCESS)) break;
       }
+      if (k >= nc) i=urlmap_size;
 
       /* found a mapping entry */
-      if (i<URLMAP_SIZE) {
+      if (i<urlmap_size) {
          char *tmp;
 
          if (direction == DIR_OUTGOING) {
@@ -788,7 +812,7 @@ int sip_rewrite_contact (sip_ticket_t *ticket, int direction) {
                osip_free(contact->url->host);
                contact->url->host = osip_strdup(myaddr);
                /* Port */
-               contact->url->port=realloc(contact->url->port, 16);
+               contact->url->port=osip_realloc(contact->url->port, 16);
                sprintf(contact->url->port, "%i", configuration.sip_listen_port);
 
                replaced=1;
@@ -803,6 +827,7 @@ int sip_rewrite_contact (sip_ticket_t *ticket, int direction) {
       DEBUGC(DBCLASS_PROXY, "no Contact header rewritten!");
       return STS_FAILURE;
    }
+   ticket->modified |= SIP_MOD_CONTACT;
 
    return STS_SUCCESS;
 }
@@ -1062,7 +1087,8 @@ int  sip_find_outbound_proxy(sip_ticket_t *ticket, struct in_addr *addr,
  */
 int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
    int type;
-   int i, sts;
+   int i, k, nc, sts;
+   int *cand;
    struct sockaddr_in *from;
    osip_message_t *request;
    osip_message_t *response;
@@ -1075,6 +1101,11 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
 
    ticket->direction = DIRTYP_UNKNOWN;
 
+   /* in-dialog message of a known dialog? */
+   if (sip_dialog_find_direction(ticket, urlidx) == STS_SUCCESS) {
+      return STS_SUCCESS;
+   }
+
    DEBUGC(DBCLASS_SIP, "sip_find_direction: beginning search");
 
    /* Search order is as follows:
@@ -1099,7 +1130,9 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
     * did I receive the telegram from a REGISTERED host?
     * -> it must be an OUTGOING request/response
     */
-   for (i=0; i<URLMAP_SIZE; i++) {
+   nc=urlmap_index_lookup(URLMAP_IDX_ADDR, NULL, &from->sin_addr, &cand);
+   for (k=0; k<nc; k++) {
+      i=cand[k];
       if (urlmap[i].active == 0) continue;
       /* outgoing requests may include the grace period, do
        * not filter for  urlmap[].expires */
@@ -1123,6 +1156,7 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
          }
       }
    }
+   if (k >= nc) i=urlmap_size;
    if (type == DIRTYP_UNKNOWN) {
       DEBUGC(DBCLASS_SIP, "sip_find_direction: no OUTGOING found");
    }
@@ -1134,7 +1168,12 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
     * check for a match on the To: header  first
     */
    if (type == DIRTYP_UNKNOWN) {
-      for (i=0; i<URLMAP_SIZE; i++) {
+      nc=urlmap_index_lookup(URLMAP_IDX_MASQ|URLMAP_IDX_REG,
+                             (MSG_IS_REQUEST(ticket->sipmsg))?
+                             request->to->url : response->from->url,
+                             NULL, &cand);
+      for (k=0; k<nc; k++) {
+         i=cand[k];
          if (urlmap[i].active == 0) continue;
          /* an incoming REGISTER RESPONSE may be processed withing 
           * the grace period, but no other incoming request/response */
@@ -1173,7 +1212,8 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
                break;
             }
          } /* is request */
-      } /* for i */
+      } /* for k */
+      if (k >= nc) i=urlmap_size;
    } /* if type == DIRTYP_UNKNOWN */
    if (type == DIRTYP_UNKNOWN) {
       DEBUGC(DBCLASS_SIP, "sip_find_direction: no INCOMING (To:/From:) found");
@@ -1186,7 +1226,10 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
     * check for a match on the SIP URI (requests only)
     */
    if ((type == DIRTYP_UNKNOWN) && (MSG_IS_REQUEST(ticket->sipmsg))) {
-      for (i=0; i<URLMAP_SIZE; i++) {
+      nc=urlmap_index_lookup(URLMAP_IDX_MASQ|URLMAP_IDX_REG,
+                             request->req_uri, NULL, &cand);
+      for (k=0; k<nc; k++) {
+         i=cand[k];
          if (urlmap[i].active == 0) continue;
          /* an incoming REGISTER RESPONSE may be processed withing 
           * the grace period, but no other incoming request/response */
@@ -1199,7 +1242,8 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
             type=REQTYP_INCOMING;
             break;
          }
-      } /* for i */
+      } /* for k */
+      if (k >= nc) i=urlmap_size;
    } /* if type == DIRTYP_UNKNOWN */
    if (type == DIRTYP_UNKNOWN) {
       DEBUGC(DBCLASS_SIP, "sip_find_direction: no INCOMING RQ (SIP URI) found");
@@ -1211,7 +1255,12 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
     * match the local IP nor the registered host part. :-/
     */
    if (type == DIRTYP_UNKNOWN) {
-      for (i=0; i<URLMAP_SIZE; i++) {
+      nc=urlmap_index_lookup(URLMAP_IDX_MASQ|URLMAP_IDX_REG,
+                             (MSG_IS_REQUEST(ticket->sipmsg))?
+                             request->to->url : response->from->url,
+                             NULL, &cand);
+      for (k=0; k<nc; k++) {
+         i=cand[k];
          if (urlmap[i].active == 0) continue;
 
          if (MSG_IS_REQUEST(ticket->sipmsg)) {
@@ -1234,7 +1283,8 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
                break;
             }
          } /* is request */
-      } /* for i */
+      } /* for k */
+      if (k >= nc) i=urlmap_size;
    } /* if type == DIRTYP_UNKNOWN */
    if (type == DIRTYP_UNKNOWN) {
       DEBUGC(DBCLASS_SIP, "sip_find_direction: no INCOMING (To:/From: useronly) found");
@@ -1276,7 +1326,9 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
 
 
          if (sts == STS_SUCCESS) {
-            for (i=0; i<URLMAP_SIZE; i++) {
+            nc=urlmap_index_lookup(URLMAP_IDX_ADDR, NULL, &addr_via, &cand);
+            for (k=0; k<nc; k++) {
+               i=cand[k];
                if (urlmap[i].active == 0) continue;
                /* an incoming REGISTER RESPONSE may be processed withing 
                 * the grace period, but no other incoming request/response */
@@ -1309,7 +1361,8 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
                   type=RESTYP_INCOMING;
                   break;
                }
-            } /* for i */
+            } /* for k */
+            if (k >= nc) i=urlmap_size;
          }
       } /* is response */
    } /* if type == DIRTYP_UNKNOWN */
@@ -1355,7 +1408,7 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
 
    ticket->direction=type;
 
-   if (i < URLMAP_SIZE) {
+   if (i < urlmap_size) {
       if (urlidx) *urlidx=i;
       DEBUGC(DBCLASS_SIP, "sip_find_direction: dir=%i, urlmap %i, "
                           "trueurl [%s@%s:%s] / masqurl [%s@%s:%s] / regurl [%s@%s:%s]",
@@ -1373,6 +1426,10 @@ int  sip_find_direction(sip_ticket_t *ticket, int *urlidx) {
       if (urlidx) *urlidx=-1;
       DEBUGC(DBCLASS_SIP, "sip_find_direction: dir=%i, not found in URLMAP", type);
    }
+
+   /* remember for the following messages of this dialog */
+   sip_dialog_learn(ticket, type, (i < urlmap_size)? i : -1);
+
    return STS_SUCCESS;
 }
 
@@ -1490,6 +1547,7 @@ int  sip_obscure_callid(sip_ticket_t *ticket) {
 
    DEBUGC(DBCLASS_PROXY, "sip_obscure_callid: current Callid#=%s Direction=%i",
                          CID->number, ticket->direction);
+   ticket->modified |= SIP_MOD_CALLID;
 
    switch (ticket->direction) {
 
@@ -1600,6 +1658,7 @@ int sip_add_received_param(sip_ticket_t *ticket){
 
    osip_via_param_add(via,osip_strdup("received"),
                       osip_strdup(utils_inet_ntoa(ticket->from.sin_addr)));
+   ticket->modified |= SIP_MOD_VIA;
 
    return STS_SUCCESS;
 }
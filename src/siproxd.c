@@ -65,9 +65,11 @@ static cfgopts_t main_cfg_opts[] = {
    { "hosts_allow_reg",     TYP_STRING, &configuration.hosts_allow_reg,		{0, NULL} },
    { "hosts_allow_sip",     TYP_STRING, &configuration.hosts_allow_sip,		{0, NULL} },
    { "hosts_deny_sip",      TYP_STRING, &configuration.hosts_deny_sip,		{0, NULL} },
+   { "acl_file",            TYP_STRING, &configuration.acl_file,		{0, NULL} },
    { "proxy_auth_realm",    TYP_STRING, &configuration.proxy_auth_realm,	{0, NULL} },
    { "proxy_auth_passwd",   TYP_STRING, &configuration.proxy_auth_passwd,	{0, NULL} },
    { "proxy_auth_pwfile",   TYP_STRING, &configuration.proxy_auth_pwfile,	{0, NULL} },
+   { "proxy_auth_nonce_ttl",TYP_INT4,   &configuration.proxy_auth_nonce_ttl,	{AUTH_NONCE_TTL, NULL} },
    { "mask_host",           TYP_STRINGA,&configuration.mask_host,		{0, NULL} },
    { "masked_host",         TYP_STRINGA,&configuration.masked_host,		{0, NULL} },
    { "outbound_proxy_host", TYP_STRING, &configuration.outbound_proxy_host,	{0, NULL} },
@@ -79,6 +81,8 @@ static cfgopts_t main_cfg_opts[] = {
    { "pid_file",            TYP_STRING, &configuration.pid_file,		{0, NULL} },
    { "default_expires",     TYP_INT4,   &configuration.default_expires,		{DEFAULT_EXPIRES, NULL} },
    { "autosave_registrations",TYP_INT4, &configuration.autosave_registrations,	{0, NULL} },
+   { "max_registrations",   TYP_INT4,   &configuration.max_registrations,	{URLMAP_SIZE, NULL} },
+   { "registration_sync",   TYP_INT4,   &configuration.registration_sync,	{REG_JOURNAL_SYNC, NULL} },
    { "ua_string",           TYP_STRING, &configuration.ua_string,		{0, NULL} },
    { "use_rport",           TYP_INT4,   &configuration.use_rport,		{0, NULL} },
    { "obscure_loops",       TYP_INT4,   &configuration.obscure_loops,		{0, NULL} },
@@ -88,7 +92,32 @@ static cfgopts_t main_cfg_opts[] = {
    { "tcp_timeout",         TYP_INT4,   &configuration.tcp_timeout,		{TCP_IDLE_TO, NULL} },
    { "tcp_connect_timeout", TYP_INT4,   &configuration.tcp_connect_timeout,	{TCP_CONNECT_TO, NULL} },
    { "tcp_keepalive",       TYP_INT4,   &configuration.tcp_keepalive,		{0, NULL} },
+   { "tcp_max_connections", TYP_INT4,   &configuration.tcp_max_connections,	{TCP_CACHE_SIZE, NULL} },
    { "thread_stack_size",   TYP_INT4,   &configuration.thread_stack_size,	{0, NULL} },
+   { "sip_udp_sockets",     TYP_INT4,   &configuration.sip_udp_sockets,		{1, NULL} },
+   { "sip_udp_rcvbuf",      TYP_INT4,   &configuration.sip_udp_rcvbuf,		{0, NULL} },
+   { "sip_udp_steering",    TYP_INT4,   &configuration.sip_udp_steering,	{0, NULL} },
+   { "sip_udp_batch",       TYP_INT4,   &configuration.sip_udp_batch,		{1, NULL} },
+   { "sip_arena_size",      TYP_INT4,   &configuration.sip_arena_size,		{0, NULL} },
+   { "sip_splice",          TYP_INT4,   &configuration.sip_splice,		{0, NULL} },
+   { "sip_trans_cache",     TYP_INT4,   &configuration.sip_trans_cache,		{0, NULL} },
+   { "sip_dialogs",         TYP_INT4,   &configuration.sip_dialogs,		{0, NULL} },
+   { "dns_threads",         TYP_INT4,   &configuration.dns_threads,		{DNS_THREADS, NULL} },
+   { "dns_cache_size",      TYP_INT4,   &configuration.dns_cache_size,		{DNS_CACHE_SIZE, NULL} },
+   { "dns_negative_ttl",    TYP_INT4,   &configuration.dns_negative_ttl,	{DNS_NEG_TTL, NULL} },
+   { "ratelimit_register",  TYP_INT4,   &configuration.ratelimit_register,	{0, NULL} },
+   { "ratelimit_invite",    TYP_INT4,   &configuration.ratelimit_invite,	{0, NULL} },
+   { "ratelimit_other",     TYP_INT4,   &configuration.ratelimit_other,	{0, NULL} },
+   { "ratelimit_burst",     TYP_INT4,   &configuration.ratelimit_burst,	{RATELIMIT_BURST, NULL} },
+   { "ratelimit_ban",       TYP_INT4,   &configuration.ratelimit_ban,		{0, NULL} },
+   { "ratelimit_sources",   TYP_INT4,   &configuration.ratelimit_sources,	{RATELIMIT_SOURCES, NULL} },
+   { "ratelimit_exempt",    TYP_STRING, &configuration.ratelimit_exempt,	{0, NULL} },
+   { "overload_queue",      TYP_INT4,   &configuration.overload_queue,	{0, NULL} },
+   { "overload_lag",        TYP_INT4,   &configuration.overload_lag,		{0, NULL} },
+   { "overload_retry_after", TYP_INT4,  &configuration.overload_retry_after,	{OVERLOAD_RETRY, NULL} },
+   { "overload_oc",         TYP_INT4,   &configuration.overload_oc,		{0, NULL} },
+   { "sip_prio_queue",      TYP_INT4,   &configuration.sip_prio_queue,		{0, NULL} },
+   { "sip_prio_max_wait",   TYP_INT4,   &configuration.sip_prio_max_wait,	{SIP_PRIO_MAX_WAIT, NULL} },
    {0, 0, 0}
 };
 
@@ -123,11 +152,13 @@ PACKAGE "-" VERSION "-" BUILDSTR "\n" \
  */
 static  int dmalloc_dump=0;
 static  int exit_program=0;
+static  int reload_pwfile=0;
 
 /*
  * local prototypes
  */
 static void sighandler(int sig);
+static void check_reload_pwfile(void);
 
 
 int main (int argc, char *argv[]) 
@@ -137,6 +168,7 @@ int main (int argc, char *argv[])
    size_t buflen;
    int access;
    char buff[BUFFER_SIZE];
+   char *rawbuf=buff;
    sip_ticket_t ticket;
 
    extern char *optarg;         /* Defined in libc getopt and unistd.h */
@@ -264,6 +296,7 @@ int main (int argc, char *argv[])
  */
    if (configuration.proxy_auth_pwfile) {
       siproxd_passwordfile = fopen(configuration.proxy_auth_pwfile, "r");
+      auth_load_pwfile(0);
    } else {
       siproxd_passwordfile = NULL;
    }
@@ -272,6 +305,12 @@ int main (int argc, char *argv[])
    log_set_pattern(configuration.debuglevel);
    log_set_listen_port(configuration.debugport);
 
+   /* compile the access lists (the ACL file may be outside of
+    * the chroot jail) */
+   if (accesslist_init() != STS_SUCCESS) {
+      ERROR("unable to load access lists - aborting");
+      exit(1);
+   }
 
    /* daemonize if requested to */
    if (configuration.daemonize) {
@@ -337,6 +376,60 @@ int main (int argc, char *argv[])
    /* init the oSIP parser */
    parser_init();
 
+   /* per message memory arena for libosip2 */
+   sts=sip_arena_init(configuration.sip_arena_size);
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize SIP message arena - aborting"); 
+      exit(1);
+   }
+
+   /* UDP retransmission absorption */
+   sts=sip_trans_init(configuration.sip_trans_cache);
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize transaction cache - aborting"); 
+      exit(1);
+   }
+
+   /* dialog table for in-dialog direction lookups */
+   sts=sip_dialog_init(configuration.sip_dialogs);
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize dialog table - aborting"); 
+      exit(1);
+   }
+
+   /* DNS cache */
+   sts=dns_cache_init(configuration.dns_cache_size);
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize DNS cache - aborting"); 
+      exit(1);
+   }
+
+   /* per source rate limiting */
+   sts=ratelimit_init();
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize rate limiter - aborting");
+      exit(1);
+   }
+
+   /* track interface addresses */
+   sts=if_watch_init();
+   if (sts != STS_SUCCESS) {
+      WARN("unable to track interface changes, polling interfaces");
+   }
+
+   /* asynchronous DNS resolution */
+   sts=dns_async_init(configuration.dns_threads);
+   if (sts != STS_SUCCESS) {
+      WARN("unable to start DNS resolver threads, resolving synchronously");
+   }
+
+   /* priority scheduling of received messages */
+   sts=sip_prio_init(configuration.sip_prio_queue);
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize priority queue - aborting");
+      exit(1);
+   }
+
    /* listen for incoming messages */
    sts=sipsock_listen();
    if (sts == STS_FAILURE) {
@@ -346,7 +439,14 @@ int main (int argc, char *argv[])
    }
 
    /* initialize the registration facility */
-   register_init();
+   sts=register_init();
+   if (sts != STS_SUCCESS) {
+      ERROR("unable to initialize registration table - aborting"); 
+      exit(1);
+   }
+
+   /* resolve the configured names and registered hosts in advance */
+   dns_async_refresh();
 
    INFO(PACKAGE"-"VERSION"-"BUILDSTR" "BUILDDATE" "UNAME" started");
 
@@ -355,9 +455,16 @@ int main (int argc, char *argv[])
  *****************************/
    while (!exit_program) {
 
+      /* previous message is done (whatever way) */
+      overload_end();
+
+      /* SIGHUP - reload the password file */
+      check_reload_pwfile();
+
       memset(&ticket, 0, sizeof(sip_ticket_t));
       while ((sts = sipsock_waitfordata(buff, sizeof(buff)-1,
-                                    &ticket.from, &ticket.protocol)) <=0 ) {
+                                    &ticket.from, &ticket.protocol,
+                                    &rawbuf)) <=0 ) {
 
          /* allow exit, even if there is no activity... */
          if (exit_program) goto exit_prg;
@@ -365,6 +472,9 @@ int main (int argc, char *argv[])
          if (sts < 0) {
             /* got no input, here by timeout. do aging */
             register_agemap();
+            sip_dialog_expire();
+            dns_async_expire();
+            dns_async_refresh();
 
             /* TCP log: check for a connection */
             log_tcp_connect();
@@ -381,6 +491,9 @@ int main (int argc, char *argv[])
 #endif
             } /* if dmalloc */
 
+            /* SIGHUP - also when idle */
+            check_reload_pwfile();
+
             /* Timer activation of plugins */
             sts = call_plugins(PLUGIN_TIMER, NULL);
 
@@ -396,11 +509,17 @@ int main (int argc, char *argv[])
       ticket.direction=0;
       ticket.timestamp=time(NULL);
       memset(&ticket.next_hop, 0, sizeof(ticket.next_hop));
-      buff[buflen]='\0';
+      rawbuf[buflen]='\0';
 
-      /* pointers in ticket to raw message */
-      ticket.raw_buffer=buff;
+      /* pointers in ticket to raw message (in buff for UDP,
+       * in the receive buffer of the connection for TCP) */
+      ticket.raw_buffer=rawbuf;
       ticket.raw_buffer_len=buflen;
+      overload_begin(buflen);
+
+      /* per source rate limit, before any work is spent on it */
+      sts=ratelimit_check(&ticket);
+      if (sts != STS_SUCCESS) continue;
 
       /* Call Plugins for stage: PLUGIN_PROCESS_RAW */
       sts = call_plugins(PLUGIN_PROCESS_RAW, &ticket);
@@ -415,6 +534,23 @@ int main (int argc, char *argv[])
          continue; /* there are no resources to free */
       }
 
+      /*
+       * pre-parse fast path: keepalives, OPTIONS pings and
+       * non-SIP garbage are handled without parsing
+       */
+      sts=sip_raw_fastpath(&ticket);
+      if (sts != STS_SUCCESS) {
+         continue; /* there are no resources to free */
+      }
+
+      /*
+       * overload: refuse new calls and registrations early
+       */
+      sts=overload_check(&ticket);
+      if (sts != STS_SUCCESS) {
+         continue; /* there are no resources to free */
+      }
+
       /*
        * integrity checks
        */
@@ -424,20 +560,31 @@ int main (int argc, char *argv[])
          continue; /* there are no resources to free */
       }
 
+      /*
+       * UDP retransmissions of already processed requests
+       */
+      sts=sip_trans_lookup(&ticket);
+      if (sts != STS_SUCCESS) {
+         continue; /* there are no resources to free */
+      }
+
       /*
        * Hacks to fix-up some broken headers
        */
       sts=sip_fixup_asterisk(ticket.raw_buffer, &ticket.raw_buffer_len);
 
       /*
-       * init sip_msg
+       * init sip_msg - from here on libosip2 allocates from the
+       * message arena (if enabled)
        */
+      sip_arena_begin();
       sts=osip_message_init(&ticket.sipmsg);
-      ticket.sipmsg->message=NULL;
       if (sts != 0) {
          ERROR("osip_message_init() failed, sts=%i... this is not good", sts);
+         sip_arena_end();
          continue; /* skip, there are no resources to free */
       }
+      ticket.sipmsg->message=NULL;
 
       /*
        * RFC 3261, Section 16.3 step 1
@@ -461,6 +608,15 @@ int main (int argc, char *argv[])
          goto end_loop; /* skip and free resources */
       }
 
+      /*
+       * names that are not yet resolved: the message waits until
+       * the lookups have completed and is processed again then
+       */
+      sts=dns_async_park(&ticket);
+      if (sts != STS_SUCCESS) {
+         goto end_loop; /* skip and free resources */
+      }
+
       /*
        * RFC 3261, Section 16.3 step 2
        * Proxy Behavior - Request Validation - URI scheme
@@ -666,7 +822,9 @@ int main (int argc, char *argv[])
  * free the SIP message buffers
  */
       end_loop:
+      /* arena memory is ignored here, only heap fallbacks are freed */
       osip_message_free(ticket.sipmsg);
+      sip_arena_end();
 
    } /* while TRUE */
    exit_prg:
@@ -703,5 +861,17 @@ static void sighandler(int sig) {
    if (sig==SIGTERM) exit_program=1;
    if (sig==SIGINT)  exit_program=1;
    if (sig==SIGUSR2) dmalloc_dump=1;
+   if (sig==SIGHUP)  reload_pwfile=1;
    return;
 }
+
+/*
+ * reload the password file if requested by SIGHUP
+ */
+static void check_reload_pwfile(void) {
+   if (reload_pwfile) {
+      reload_pwfile=0;
+      INFO("SIGHUP - reloading password file");
+      auth_load_pwfile(1);
+   }
+}
@@ -34,6 +34,7 @@ struct urlmap_s {
    osip_uri_t *true_url;	// true URL of UA  (inbound URL)
    osip_uri_t *masq_url;	// masqueraded URL (outbound URL)
    osip_uri_t *reg_url;		// registered URL  (masq URL as wished by UA)
+   unsigned int generation;	// changed on every (un)registration
 };
 /*
  * the difference between masq_url and reg_url is, 
@@ -80,9 +81,11 @@ struct siproxd_config {
    char *hosts_allow_reg;
    char *hosts_allow_sip;
    char *hosts_deny_sip;
+   char *acl_file;
    char *proxy_auth_realm;
    char *proxy_auth_passwd;
    char *proxy_auth_pwfile;
+   int  proxy_auth_nonce_ttl;
    stringa_t mask_host;
    stringa_t masked_host;
    char *outbound_proxy_host;
@@ -94,6 +97,8 @@ struct siproxd_config {
    char *pid_file;
    int  default_expires;
    int  autosave_registrations;
+   int  max_registrations;
+   int  registration_sync;
    char *ua_string;
    int   use_rport;
    int   obscure_loops;
@@ -103,7 +108,32 @@ struct siproxd_config {
    int   tcp_timeout;
    int   tcp_connect_timeout;
    int   tcp_keepalive;
+   int   tcp_max_connections;
    int   thread_stack_size;
+   int   sip_udp_sockets;
+   int   sip_udp_rcvbuf;
+   int   sip_udp_steering;
+   int   sip_udp_batch;
+   int   sip_arena_size;
+   int   sip_splice;
+   int   sip_trans_cache;
+   int   sip_dialogs;
+   int   dns_threads;
+   int   dns_cache_size;
+   int   dns_negative_ttl;
+   int   ratelimit_register;
+   int   ratelimit_invite;
+   int   ratelimit_other;
+   int   ratelimit_burst;
+   int   ratelimit_ban;
+   int   ratelimit_sources;
+   char *ratelimit_exempt;
+   int   overload_queue;
+   int   overload_lag;
+   int   overload_retry_after;
+   int   overload_oc;
+   int   sip_prio_queue;
+   int   sip_prio_max_wait;
 };
 
 /*
@@ -140,9 +170,197 @@ typedef struct {
 #define RESTYP_OUTGOING		4
    int direction;		/* direction as determined by proxy */
    struct sockaddr_in next_hop;	/* next hop as determined by plugin or proxy */
+#define SIP_MOD_STARTLINE	0x0001	/* Request-URI or status code */
+#define SIP_MOD_VIA		0x0002
+#define SIP_MOD_ROUTE		0x0004
+#define SIP_MOD_RROUTE		0x0008
+#define SIP_MOD_CONTACT		0x0010
+#define SIP_MOD_CALLID		0x0020
+#define SIP_MOD_MAXFWD		0x0040
+#define SIP_MOD_UA		0x0080	/* User-Agent */
+#define SIP_MOD_EXPIRES		0x0100
+#define SIP_MOD_BODY		0x0200	/* body and Content-Length */
+#define SIP_MOD_OTHER		0x8000	/* anything else */
+#define SIP_MOD_ALL		0xffff
+   int modified;		/* parts of sipmsg that have been modified */
 } sip_ticket_t;
 
 
+/*
+ * statistics of a SIP UDP listen socket, see sipsock_udp_stats()
+ */
+typedef struct {
+   int fd;			/* socket */
+   unsigned long rx_count;	/* datagrams received by siproxd */
+   int rx_queued;		/* bytes waiting in kernel queue, -1=n/a */
+   int rcvbuf;			/* kernel receive buffer size, -1=n/a */
+   int drops;			/* datagrams dropped by kernel, -1=n/a */
+} sipsock_stats_t;
+
+
+/*
+ * statistics of the SIP message arena, see sip_arena_get_stats()
+ */
+typedef struct {
+   unsigned long messages;	/* messages processed using the arena */
+   unsigned long arena_allocs;	/* allocations served from the arena */
+   unsigned long heap_allocs;	/* allocations passed to the heap */
+   unsigned long max_allocs;	/* max allocations for one message */
+   unsigned long extra_chunks;	/* chunks added for large messages */
+   size_t arena_size;		/* size of the primary arena chunk */
+   size_t high_water;		/* max arena bytes used by one message */
+} sip_arena_stats_t;
+
+/*
+ * statistics of the pre-parse fast path, see sip_raw_get_stats()
+ */
+typedef struct {
+   unsigned long keepalives;	/* CRLF keepalives received */
+   unsigned long pongs;		/* CRLF keepalives answered */
+   unsigned long options;	/* OPTIONS pings answered */
+   unsigned long dropped;	/* non-SIP messages dropped */
+   unsigned long responses;	/* responses rendered from raw requests */
+} sip_raw_stats_t;
+
+/*
+ * statistics of the message splicing, see sip_splice_get_stats()
+ */
+typedef struct {
+   unsigned long spliced;	/* messages built from the raw buffer */
+   unsigned long full;		/* messages printed by libosip2 */
+} sip_splice_stats_t;
+
+/*
+ * statistics of the priority queue, see sip_prio_get_stats()
+ * (per class SIP_PRIO_HIGH, SIP_PRIO_INVITE, SIP_PRIO_LOW)
+ */
+#define SIP_PRIO_HIGH	0	/* responses, ACK, BYE, CANCEL, in-dialog */
+#define SIP_PRIO_INVITE	1	/* INVITE starting a new call		*/
+#define SIP_PRIO_LOW	2	/* REGISTER, OPTIONS, SUBSCRIBE, ...	*/
+#define SIP_PRIO_CLASSES 3
+typedef struct {
+   unsigned long queued[SIP_PRIO_CLASSES];	/* messages queued */
+   unsigned long delivered[SIP_PRIO_CLASSES];	/* messages delivered */
+   unsigned long aged[SIP_PRIO_CLASSES];	/* delivered early, waited
+						   too long */
+   int depth[SIP_PRIO_CLASSES];			/* messages waiting */
+   int max_depth[SIP_PRIO_CLASSES];		/* max messages waiting */
+   long max_wait[SIP_PRIO_CLASSES];		/* max waiting time (msec) */
+   unsigned long rejected;	/* not queued, queue full */
+   long bytes;			/* bytes waiting */
+   int size;			/* size of queue (messages) */
+} sip_prio_stats_t;
+
+/*
+ * statistics of the transaction cache, see sip_trans_get_stats()
+ */
+typedef struct {
+   unsigned long lookups;	/* requests looked up */
+   unsigned long req_hits;	/* retransmissions forwarded from cache */
+   unsigned long resp_hits;	/* retransmissions answered from cache */
+   unsigned long stored;	/* messages stored */
+} sip_trans_stats_t;
+
+/*
+ * statistics of the dialog table, see sip_dialog_get_stats()
+ */
+typedef struct {
+   unsigned long hits;		/* direction found in dialog table */
+   unsigned long misses;	/* in-dialog messages not found */
+   unsigned long created;	/* dialogs created */
+   unsigned long expired;	/* dialogs removed by idle timeout */
+   unsigned long full;		/* dialogs not created, table full */
+   unsigned long active;	/* dialogs currently in table */
+} sip_dialog_stats_t;
+
+/*
+ * statistics of the registration table, see register_get_stats()
+ */
+typedef struct {
+   unsigned long active;	/* entries currently in table */
+   unsigned long size;		/* current size of table */
+   unsigned long max;		/* max_registrations */
+   unsigned long unregistered;	/* un-REGISTER requests processed */
+   unsigned long expired;	/* entries removed by aging */
+   long next_expiry;		/* seconds until next expiry, -1=none */
+} register_stats_t;
+
+/*
+ * statistics of the rate limiter, see ratelimit_get_stats()
+ */
+typedef struct {
+   unsigned long passed;	/* messages within the budget */
+   unsigned long dropped;	/* messages dropped */
+   unsigned long banned;	/* sources banned */
+   unsigned long evicted;	/* sources replaced, table full */
+   unsigned long sources;	/* sources currently tracked */
+   unsigned long size;		/* size of source table */
+} ratelimit_stats_t;
+
+/*
+ * a limited source, see ratelimit_get_sources()
+ */
+typedef struct {
+   struct in_addr addr;
+   unsigned long dropped;	/* messages dropped */
+   long banned;			/* seconds of ban left, 0 = not banned */
+} ratelimit_source_t;
+
+/*
+ * state of the overload control, see overload_get_stats()
+ */
+typedef struct {
+   int overloaded;		/* currently in overload state */
+   int queue_fill;		/* receive queue fill level (%) */
+   long lag;			/* estimated processing lag (msec) */
+   long max_lag;		/* max estimated lag (msec) */
+   long avg_service;		/* avg. service time per message (usec) */
+   unsigned long episodes;	/* times overload has been entered */
+   unsigned long rejected;	/* requests rejected with 503 */
+} overload_stats_t;
+
+/*
+ * statistics of the DNS cache, see dns_cache_get_stats()
+ */
+typedef struct {
+   unsigned long hits;		/* resolved from cache */
+   unsigned long stale;		/* expired entries used while refreshing */
+   unsigned long negative;	/* failures answered from cache */
+   unsigned long misses;	/* not in cache or to be retried */
+   unsigned long expired;	/* entries removed by TTL */
+   unsigned long evicted;	/* entries replaced, cache full */
+   unsigned long entries;	/* entries currently in cache */
+   unsigned long size;		/* size of cache */
+} dns_cache_stats_t;
+
+/*
+ * statistics of the asynchronous resolver, see dns_async_get_stats()
+ */
+typedef struct {
+   unsigned long lookups;	/* lookups started */
+   unsigned long merged;	/* requests merged into running lookups */
+   unsigned long full;		/* lookups or messages rejected, no room */
+   unsigned long parked;	/* messages parked */
+   unsigned long resumed;	/* parked messages resumed */
+   unsigned long dropped;	/* parked messages dropped */
+   unsigned long pending;	/* lookups currently in progress */
+   unsigned long waiting;	/* messages currently parked */
+} dns_async_stats_t;
+
+/*
+ * NAPTR or SRV record, see resolve_SRV_records() and
+ * resolve_NAPTR_records()
+ */
+#define DNS_TARGET_SIZE	128	/* = HOSTNAME_SIZE */
+typedef struct {
+   unsigned short prio;		/* SRV priority / NAPTR order */
+   unsigned short weight;	/* SRV weight / NAPTR preference */
+   unsigned short port;		/* SRV port */
+   int protocol;		/* NAPTR service: PROTO_UDP / PROTO_TCP */
+   char target[DNS_TARGET_SIZE+1];/* SRV target / NAPTR replacement */
+} dns_srv_t;
+
+
 /*
  * Client_ID - used to identify the two sides of a Call when one
  * call is routed twice (in->out and back out->in) through siproxd
@@ -166,19 +384,22 @@ typedef struct {
 int sipsock_listen(void);						/*X*/
 //int sipsock_wait(void);
 int sipsock_waitfordata(char *buf, size_t bufsize,
-                        struct sockaddr_in *from, int *protocol);
+                        struct sockaddr_in *from, int *protocol,
+                        char **data);
 int sipsock_send(struct in_addr addr, int port,	int protocol,		/*X*/
                  char *buffer, size_t size);
+int sipsock_udp_stats(int idx, sipsock_stats_t *stats);		/*X*/
 int sockbind(struct in_addr ipaddr, int localport, int protocol, int errflg);
 int tcp_find(struct sockaddr_in dst_addr);
 
 /* register.c */
-void register_init(void);
+int  register_init(void);						/*X*/
 void register_save(void);
 int  register_client(sip_ticket_t *ticket, int force_lcl_masq);		/*X*/
 void register_agemap(void);
 int  register_response(sip_ticket_t *ticket, int flag);			/*X*/
 int  register_set_expire(sip_ticket_t *ticket);				/*X*/
+int  register_get_stats(register_stats_t *stats);			/*X*/
 
 /* proxy.c */
 int proxy_request (sip_ticket_t *ticket);				/*X*/
@@ -197,6 +418,7 @@ int route_determine_nexthop(sip_ticket_t *ticket,
 
 /* utils.c */
 int  get_ip_by_host(char *hostname, struct in_addr *addr);		/*X*/
+int  dns_resolve_host(char *hostname, struct in_addr *addr, int *ttl);	/*X*/
 void secure_enviroment (void);
 int  get_ip_by_ifname(char *ifname, struct in_addr *retaddr);		/*X*/
 int  get_interface_ip(int interface, struct in_addr *retaddr);		/*X*/
@@ -242,6 +464,7 @@ int  rtp_start_fwd (osip_call_id_t *callid, client_id_t client_id,	/*X*/
 int  rtp_stop_fwd (osip_call_id_t *callid, int direction, int cseq);	/*X*/
 
 /* accessctl.c */
+int  accesslist_init(void);						/*X*/
 int  accesslist_check(struct sockaddr_in from);
 int  process_aclist (char *aclist, struct sockaddr_in from);
 
@@ -251,7 +474,9 @@ int  security_check_sip(sip_ticket_t *ticket);				/*X*/
 
 /* auth.c */
 int  authenticate_proxy(osip_message_t *sipmsg);			/*X*/
-int  auth_include_authrq(osip_message_t *sipmsg);			/*X*/
+int  auth_include_authrq(osip_message_t *sipmsg, int stale);		/*X*/
+int  auth_render_authrq(char *buf, size_t size, int stale);		/*X*/
+int  auth_load_pwfile(int reopen);					/*X*/
 void CvtHex(unsigned char *hash, unsigned char *hashstring);
 
 /* fwapi.c */
@@ -268,6 +493,137 @@ int sip_message_to_str(osip_message_t * sip,   char **dest,     size_t *len);
 int sip_body_to_str(const osip_body_t * body,  char **dest,     size_t *len);
 int sip_message_set_body(osip_message_t * sip, const char *buf, size_t len);
 
+/* sip_arena.c */
+int  sip_arena_init(int size);						/*X*/
+int  sip_arena_enabled(void);						/*X*/
+void sip_arena_begin(void);
+void sip_arena_end(void);
+void sip_arena_suspend(void);
+void sip_arena_resume(void);
+int  sip_arena_get_stats(sip_arena_stats_t *stats);			/*X*/
+
+/* sip_raw.c */
+int  sip_raw_fastpath(sip_ticket_t *ticket);				/*X*/
+int  sip_raw_get_stats(sip_raw_stats_t *stats);				/*X*/
+char *sip_raw_get_header(char *pos, char *end, const char *name,
+                         char compact, size_t *len);
+char *sip_raw_get_value(char *line, size_t len, size_t *vlen);
+int  sip_raw_build_response(sip_ticket_t *ticket, int code,		/*X*/
+                            const char *reason, const char *via_params,
+                            const char *extra, char *resp, size_t size,
+                            size_t *resplen, struct in_addr *addr, int *port);
+int  sip_raw_respond(sip_ticket_t *ticket, int code, const char *reason,	/*X*/
+                     const char *via_params, const char *extra);
+int  sip_raw_is_initial(sip_ticket_t *ticket);				/*X*/
+int  sip_raw_has_to_tag(char *buf, size_t size);			/*X*/
+
+/* sip_splice.c */
+int  sip_splice_to_str(sip_ticket_t *ticket, char **dest, size_t *len);	/*X*/
+int  sip_splice_get_stats(sip_splice_stats_t *stats);			/*X*/
+
+/* sip_prio.c */
+int  sip_prio_init(int size);						/*X*/
+int  sip_prio_enabled(void);						/*X*/
+int  sip_prio_count(void);
+int  sip_prio_space(void);
+int  sip_prio_put(char *buf, int len, struct sockaddr_in *from,	/*X*/
+                  int protocol);
+int  sip_prio_get(char *buf, size_t bufsize, struct sockaddr_in *from,
+                  int *protocol);
+int  sip_prio_get_stats(sip_prio_stats_t *stats);			/*X*/
+
+/* sip_trans.c */
+int  sip_trans_init(int size);						/*X*/
+int  sip_trans_lookup(sip_ticket_t *ticket);				/*X*/
+void sip_trans_store_request(struct in_addr addr, int port, int protocol,
+                             char *buffer, size_t len);
+void sip_trans_store_response(sip_ticket_t *ticket, int code,
+                              struct in_addr addr, int port, int protocol,
+                              char *buffer, size_t len);
+int  sip_trans_get_stats(sip_trans_stats_t *stats);			/*X*/
+
+/* sip_dialog.c */
+int  sip_dialog_init(int size);						/*X*/
+int  sip_dialog_find_direction(sip_ticket_t *ticket, int *urlidx);	/*X*/
+void sip_dialog_learn(sip_ticket_t *ticket, int type, int urlidx);
+void sip_dialog_expire(void);
+int  sip_dialog_get_stats(sip_dialog_stats_t *stats);			/*X*/
+
+/* urlmap_index.c */
+int  urlmap_index_init(void);						/*X*/
+void urlmap_index_add(int idx);
+void urlmap_index_remove(int idx);
+int  urlmap_index_freeslot(void);
+void urlmap_index_update(int idx);
+int  urlmap_index_count(void);
+int  urlmap_index_next_expiry(void);
+int  urlmap_index_lookup(int keys, osip_uri_t *url, struct in_addr *addr,
+                         int **list);
+
+/* reg_journal.c */
+int  reg_journal_init(long valid);					/*X*/
+char *reg_journal_name(int which);
+void reg_journal_append(const char *rec, size_t len);
+void reg_journal_sync(int force);
+size_t reg_journal_size(void);
+int  reg_journal_compact(char *snapshot, size_t len, int wait);	/*X*/
+int  reg_journal_busy(void);						/*X*/
+void reg_journal_shutdown(void);
+
+/* dns_cache.c */
+int  dns_cache_init(int size);						/*X*/
+int  dns_cache_lookup(char *hostname, struct in_addr *addr);
+int  dns_cache_known(char *hostname);					/*X*/
+int  dns_cache_due(char *hostname);					/*X*/
+void dns_cache_store(char *hostname, struct in_addr *addr, int ttl);
+int  dns_cache_get_stats(dns_cache_stats_t *stats);			/*X*/
+
+/* resolve.c */
+int  resolve_A(char *name, struct in_addr *addr, int *ttl);
+int  resolve_SRV_records(char *name, dns_srv_t *rr, int max, int *ttl);
+int  resolve_NAPTR_records(char *name, dns_srv_t *rr, int max, int *ttl);
+
+/* dns_srv.c */
+int  dns_srv_resolve(char *host, char *portstr, int protocol,
+                     struct in_addr *addr, in_port_t *port);		/*X*/
+int  dns_srv_pending(char *host, char *portstr, int protocol,
+                     int *type, char *name, int len);			/*X*/
+void dns_srv_store(int type, char *name, dns_srv_t *rr, int count, int ttl);
+
+/* dns_async.c */
+int  dns_async_init(int threads);					/*X*/
+int  dns_async_running(void);						/*X*/
+int  dns_async_fd(void);
+int  dns_async_lookup(char *hostname);					/*X*/
+int  dns_async_query(int type, char *name);				/*X*/
+void dns_async_complete(void);
+int  dns_async_park(sip_ticket_t *ticket);				/*X*/
+int  dns_async_resume(char *buf, size_t bufsize,
+                      struct sockaddr_in *from, int *protocol);
+int  dns_async_resumed(void);						/*X*/
+void dns_async_expire(void);
+int  dns_async_keep(char *hostname);					/*X*/
+void dns_async_refresh(void);
+int  dns_async_get_stats(dns_async_stats_t *stats);			/*X*/
+
+/* if_watch.c */
+int  if_watch_init(void);						/*X*/
+int  if_watch_fd(void);
+void if_watch_process(void);
+int  if_watch_lookup(char *ifname, struct in_addr *addr, int *isup);	/*X*/
+
+/* ratelimit.c */
+int  ratelimit_init(void);						/*X*/
+int  ratelimit_check(sip_ticket_t *ticket);				/*X*/
+int  ratelimit_get_stats(ratelimit_stats_t *stats);			/*X*/
+int  ratelimit_get_sources(ratelimit_source_t *list, int max);
+
+/* overload.c */
+void overload_begin(size_t size);
+void overload_end(void);
+int  overload_check(sip_ticket_t *ticket);				/*X*/
+int  overload_get_stats(overload_stats_t *stats);			/*X*/
+
 /* plugins.c */
 int load_plugins (void);
 int call_plugins(int stage, sip_ticket_t *ticket);
@@ -282,9 +638,30 @@ int unload_plugins(void);
 
 #define TCP_IDLE_TO	300	/* TCP connection idle timeout in seconds */
 #define TCP_CONNECT_TO	500	/* TCP connect() timeout in msec */
-
-#define URLMAP_SIZE	512	/* number of URL mapping table entries	*/
-				/* this limits the number of clients!	*/
+#define TCP_RXBUF_MAX	65536	/* max size of a SIP message via TCP	*/
+#define TCP_TXBUF_MAX	262144	/* max queued output per TCP connection */
+#define TCP_CACHE_SIZE	1024	/* default number of TCP connections	*/
+#define SIP_UDP_SOCKETS_MAX 16	/* max number of SIP UDP listen sockets */
+#define SIP_UDP_BATCH_MAX 32	/* max datagrams per recvmmsg()/sendmmsg() */
+#define SIP_PRIO_MAX_WAIT 200	/* default max wait in priority queue, msec */
+#define SIP_ARENA_SIZE	65536	/* suggested size of the SIP message arena */
+#define SIP_T1		500	/* RFC3261 timer T1 (RTT estimate) in msec */
+#define SIP_TRANS_LIFETIME (64*SIP_T1) /* transaction cache lifetime, msec */
+#define DIALOG_IDLE_TO	7200	/* dialog table idle timeout in seconds	*/
+
+#define URLMAP_SIZE	512	/* default max. number of URL mapping	*/
+				/* table entries (max_registrations)	*/
+#define URLMAP_INIT_SIZE 64	/* initial size of the URL mapping table */
+#define REG_JOURNAL_SUFFIX ".journal"	/* registration journal file	*/
+#define REG_JOURNAL_OLD_SUFFIX ".journal.old" /* journal being compacted */
+#define REG_JOURNAL_SYNC 5	/* default fsync interval of the journal, sec */
+#define REG_JOURNAL_BATCH 65536	/* max. journal bytes kept in memory	*/
+#define REG_JOURNAL_COMPACT 1048576 /* journal size that forces compaction */
+#define REG_LINE_SIZE	1024	/* max. line length in registration file */
+#define URLMAP_IDX_TRUE	0x01	/* urlmap index: user of true_url	*/
+#define URLMAP_IDX_MASQ	0x02	/* urlmap index: user of masq_url	*/
+#define URLMAP_IDX_REG	0x04	/* urlmap index: user of reg_url	*/
+#define URLMAP_IDX_ADDR	0x08	/* urlmap index: IP of true_url host	*/
 
 #define SOURCECACHE_SIZE 256	/* number of return addresses		*/
 #define DEJITTERLIMIT	1500000	/* max value for dejitter configuration */
@@ -299,17 +676,45 @@ int unload_plugins(void);
 #define PATH_STRING_SIZE 256	/* max size of an file path		*/
 #define URL_STRING_SIZE	128	/* max size of an URL/URI string	*/
 #define STATUSCODE_SIZE	5	/* size of string representation of status */
-#define DNS_CACHE_SIZE	256	/* number of entries in internal DNS cache */
+#define DNS_CACHE_SIZE	1024	/* default number of DNS cache entries	*/
 #define DNS_ATTEMPTS	3	/* number of attempts to resolve a name
 				   before it is marked as bad */
-#define DNS_GOOD_AGE	60	/* maximum age of a good cache entry (sec) */
+#define DNS_GOOD_AGE	60	/* age of a good cache entry without TTL (sec) */
 #define DNS_BAD_AGE	600	/* maximum age of a bad cache entry (sec) */
+#define DNS_NEG_TTL	60	/* default age of a negative entry (sec) */
+#define DNS_MIN_TTL	5	/* min. age of a good cache entry (sec)	*/
+#define DNS_MAX_TTL	3600	/* max. age of a good cache entry (sec)	*/
+#define DNS_STALE_AGE	60	/* expired entries used while refreshing */
+#define DNS_CACHE_MISS	0	/* dns_cache_lookup(): not in cache	*/
+#define DNS_CACHE_HIT	1	/*   resolved				*/
+#define DNS_CACHE_STALE	2	/*   resolved, but expired		*/
+#define DNS_CACHE_NEGATIVE 3	/*   cannot be resolved			*/
+#define DNS_CACHE_FAILED 4	/*   last attempt failed, retry		*/
+#define DNS_THREADS	0	/* default number of DNS resolver threads */
+#define DNS_ASYNC_MAX	64	/* max. number of lookups in progress	*/
+#define DNS_PARK_SIZE	256	/* max. number of messages waiting for DNS */
+#define DNS_PARK_NAMES	16	/* max. names a parked message waits for */
+#define DNS_PARK_TIMEOUT 32	/* max. time a message waits for DNS (sec) */
+#define DNS_PARK_ROUNDS	3	/* max. times a message is parked (NAPTR,
+				   SRV, A) */
+#define DNS_KEEP_SIZE	64	/* max. configured names kept resolved	*/
+#define DNS_QUERY_A	1	/* DNS lookup types			*/
+#define DNS_QUERY_SRV	2
+#define DNS_QUERY_NAPTR	3
+#define DNS_SRV_RECORDS	8	/* max. records of a NAPTR/SRV rrset	*/
+#define DNS_SRV_CACHE_SIZE 128	/* number of cached NAPTR/SRV rrsets (2^n) */
+#define DNS_PREFETCH_HITS 3	/* uses of a cache entry to be prefetched */
+#define DNS_PREFETCH_TIME 10	/* prefetch that long before expiry (sec) */
 #define IFADR_CACHE_SIZE 32	/* number of entries in internal IFADR cache */
 #define IFADR_MAX_AGE	5	/* max. age of the IF address cache (sec) */
+#define IFADR_WATCH_SIZE 64	/* number of tracked interface addresses */
 #define IFNAME_SIZE	16	/* max string length of a interface name */
 #define HOSTNAME_SIZE	128	/* max string length of a hostname	*/
 #define USERNAME_SIZE	128	/* max string length of a username (auth) */
 #define PASSWORD_SIZE	128	/* max string length of a password (auth) */
+#define AUTH_PW_GROW	64	/* password file entries allocated at once */
+#define AUTH_NONCE_TTL	300	/* default lifetime of a nonce (sec)	*/
+#define AUTH_NC_CACHE	16384	/* nonces tracked for replay protection	*/
 #define IPSTRING_SIZE	16	/* stringsize of IP address xxx.xxx.xxx.xxx\0 */
 #define PORTSTRING_SIZE	6	/* stringsize of port number xxxxx\0 */
 #define VIA_BRANCH_SIZE	64	/* max string length for via branch param */
@@ -331,6 +736,13 @@ int unload_plugins(void);
 /* symbols for access control */
 #define ACCESSCTL_SIP	1	/* for access control - SIP allowed	*/
 #define ACCESSCTL_REG	2	/* --"--              - registr. allowed */
+#define ACL_CACHE_SIZE	8	/* compiled lists of process_aclist()	*/
+#define ACL_GROW	256	/* ranges allocated at once		*/
+#define RATELIMIT_BURST	2	/* default burst, seconds of budget	*/
+#define RATELIMIT_SOURCES 4096	/* default number of tracked sources	*/
+#define RATELIMIT_REPORT 16	/* sources listed by plugin_stats	*/
+#define OVERLOAD_SAMPLE	100	/* msec between overload samples	*/
+#define OVERLOAD_RETRY	10	/* default Retry-After of 503 (sec)	*/
 
 /* symbolic return stati */
 #define STS_SUCCESS	0	/* SUCCESS				*/
@@ -338,6 +750,7 @@ int unload_plugins(void);
 #define STS_FAILURE	1	/* FAILURE				*/
 #define STS_FALSE	1	/* FALSE				*/
 #define STS_NEED_AUTH	1001	/* need authentication			*/
+#define STS_STALE_AUTH	1002	/* authentication with stale nonce	*/
 #define STS_SIP_SENT	2001	/* SIP packet is already sent, end of dialog */
 
 /* symbolic direction of data */
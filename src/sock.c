@@ -33,6 +33,14 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+#ifdef HAVE_LINUX_SOCK_DIAG_H
+#include <linux/sock_diag.h>
+#endif
 
 #include <osipparser2/osip_parser.h>
 
@@ -44,29 +52,121 @@ extern struct siproxd_config configuration;
 
 
 /* static functions */
+static int udp_bind(struct in_addr ipaddr, int localport, int reuseport);
+static void udp_attach_steering(void);
+static void udp_rx_queue(int idx);
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+static void udp_rx_batch(int idx);
+static int udp_rx_next(char *buf, size_t bufsize,
+                       struct sockaddr_in *from, int *protocol);
+static int udp_tx_queue(struct sockaddr_in *dst_addr,
+                        char *buffer, size_t size);
+static void udp_tx_flush(void);
+#endif
 static void tcp_expire(void);
 static int tcp_add(struct sockaddr_in addr, int fd);
 static int tcp_connect(struct sockaddr_in dst_addr);
+static int tcp_cache_init(void);
+static unsigned int tcp_hash_key(struct sockaddr_in *addr);
+static void tcp_list_unlink(int list, int idx);
+static void tcp_list_append(int list, int idx);
+static void tcp_touch(int idx);
 static int tcp_remove(int idx);
+static int tcp_rx_read(int idx);
+static int tcp_rx_ready(int idx);
+static int tcp_rx_frame(int idx, char **data);
+static int tcp_rx_queue(int idx, char **data);
+static void tcp_rx_release(int idx);
+static int tcp_content_length(char *hdr, int hdrlen);
+static int tcp_tx(int idx, char *buffer, size_t size);
+static int tcp_tx_flush(int idx);
+static void tcp_connect_done(int idx);
+static void tcp_connect_expire(void);
 
 /* module local variables */
 
-/* UDP socket used for SIP datagrams */
+/* UDP socket used for SIP datagrams (sending, first of the group) */
 int sip_udp_socket=0;
 
+/* UDP sockets used for receiving SIP datagrams (SO_REUSEPORT group) */
+static struct {
+   int fd;				/* file descriptor, 0=unused */
+   unsigned long rx_count;		/* datagrams read from this socket */
+} sip_udp_group[SIP_UDP_SOCKETS_MAX];
+static int sip_udp_num=0;
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+/* number of datagrams to read with one recvmmsg() call, 1=no batching */
+static int udp_batch=1;
+
+/* datagrams received by the last recvmmsg() call, delivered
+ * one by one by sipsock_waitfordata() */
+static struct {
+   char   buf[BUFFER_SIZE];
+   int    len;
+   struct sockaddr_in from;
+} udp_rx_ring[SIP_UDP_BATCH_MAX];
+static int udp_rx_head=0;
+static int udp_rx_count=0;
+
+/* datagrams to be sent while processing a batch, sent out with
+ * one sendmmsg() call as soon as the whole batch is processed */
+static struct {
+   char   buf[BUFFER_SIZE];
+   size_t len;
+   struct sockaddr_in dst_addr;
+} udp_tx_ring[SIP_UDP_BATCH_MAX];
+static int udp_tx_count=0;
+static int udp_tx_batching=0;
+#endif
+
 /* TCP listen socket used for SIP */
 int sip_tcp_socket=0;
 
-/* TCP sockets used for SIP connections (twice the max number of clients) */
-struct {
+/* TCP sockets used for SIP connections (tcp_max_connections entries).
+ * Used entries are found via a hash of the remote address and are
+ * kept in two lists: ordered by last traffic (LRU - idle expiry and
+ * eviction) and by last keepalive. Entries with a pending connect()
+ * are also in a third list, ordered by their deadline (the timeout
+ * is the same for all). Free entries are chained via hash_next. */
+#define TCP_LIST_TRAFFIC	0
+#define TCP_LIST_KEEPALIVE	1
+#define TCP_LIST_CONNECT	2
+#define TCP_LISTS		3
+static struct {
    int fd;				/* file descriptor, 0=unused */
    struct sockaddr_in dst_addr;		/* remote target of TCP connection */
    time_t traffic_ts;			/* last 'alive' TS (real SIP traffic) */
    time_t keepalive_ts;			/* last 'alive' TS */
-   int    rxbuf_size;
-   int    rxbuf_len;
+   int    rxbuf_size;			/* allocated size of rx_buffer */
+   int    rxbuf_len;			/* bytes received into rx_buffer */
+   int    rxbuf_start;			/* start of not yet processed data */
+   int    rxbuf_term;			/* position of the \0 terminating the
+					   last delivered message, -1=none */
+   char   rxbuf_saved;			/* byte overwritten by this \0 */
    char   *rx_buffer;
-} sip_tcp_cache[2*URLMAP_SIZE];
+   int    connecting;			/* non-blocking connect() pending */
+   struct timeval connect_to;		/* deadline for connect() */
+   int    txbuf_size;			/* allocated size of tx_buffer */
+   int    txbuf_len;			/* bytes waiting to be sent */
+   char   *tx_buffer;
+   int    hash_next;			/* next entry in hash chain/free list */
+   int    list_prev[TCP_LISTS];		/* TCP_LIST_xxx neighbours */
+   int    list_next[TCP_LISTS];
+} *sip_tcp_cache=NULL;
+static int tcp_cache_size=0;
+static int *tcp_hash=NULL;		/* hash table: first entry, -1=none */
+static unsigned int tcp_hash_mask=0;
+static int tcp_free=-1;			/* first free entry */
+static int tcp_list_head[TCP_LISTS]={-1,-1,-1};	/* oldest entry */
+static int tcp_list_tail[TCP_LISTS]={-1,-1,-1};	/* most recent entry */
+
+/* number of TCP connections with a pending connect() */
+static int tcp_connecting=0;
+
+/* TCP connection that has delivered the last message (more
+ * pipelined messages may be waiting in its receive buffer) */
+static int tcp_rx_last=-1;
 
 
 /*
@@ -78,12 +178,55 @@ struct {
  */
 int sipsock_listen (void) {
    struct in_addr ipaddr;
+   int i, num;
+
+   /* number of UDP sockets to open - more than one requires SO_REUSEPORT */
+   num=configuration.sip_udp_sockets;
+   if (num < 1) num=1;
+   if (num > SIP_UDP_SOCKETS_MAX) {
+      WARN("sip_udp_sockets=%i too large, limiting to %i",
+           num, SIP_UDP_SOCKETS_MAX);
+      num=SIP_UDP_SOCKETS_MAX;
+   }
+#ifndef SO_REUSEPORT
+   if (num > 1) {
+      WARN("SO_REUSEPORT not supported on this platform, "
+           "using one single UDP socket");
+      num=1;
+   }
+#endif
 
    /* listen on UDP port */
+   memset(&sip_udp_group, 0, sizeof(sip_udp_group));
    memset(&ipaddr, 0, sizeof(ipaddr));
-   sip_udp_socket=sockbind(ipaddr, configuration.sip_listen_port,
-                           PROTO_UDP, 1);
-   if (sip_udp_socket == 0) return STS_FAILURE; /* failure */
+   for (i=0; i<num; i++) {
+      sip_udp_group[i].fd=udp_bind(ipaddr, configuration.sip_listen_port,
+                                   (num > 1));
+      if (sip_udp_group[i].fd == 0) return STS_FAILURE; /* failure */
+   }
+   sip_udp_num=num;
+   sip_udp_socket=sip_udp_group[0].fd;
+
+   /* distribute incoming datagrams by source address */
+   if ((num > 1) && configuration.sip_udp_steering) {
+      udp_attach_steering();
+   }
+
+   /* batched receive / send */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+   udp_batch=configuration.sip_udp_batch;
+   if (udp_batch < 1) udp_batch=1;
+   if (udp_batch > SIP_UDP_BATCH_MAX) {
+      WARN("sip_udp_batch=%i too large, limiting to %i",
+           udp_batch, SIP_UDP_BATCH_MAX);
+      udp_batch=SIP_UDP_BATCH_MAX;
+   }
+#else
+   if (configuration.sip_udp_batch > 1) {
+      WARN("recvmmsg()/sendmmsg() not supported on this platform, "
+           "sip_udp_batch is ignored");
+   }
+#endif
 
    /* set DSCP value, need to be ROOT */
    if (configuration.sip_dscp) {
@@ -102,9 +245,12 @@ int sipsock_listen (void) {
          /* now I'm root */
          if (!(configuration.sip_dscp & ~0x3f)) {
             tos = (configuration.sip_dscp << 2) & 0xff;
-            if(setsockopt(sip_udp_socket, SOL_IP, IP_TOS, &tos, sizeof(tos))) {
-               ERROR("sipsock_listen: setsockopt() failed while "
-                     "setting DSCP value: %s", strerror(errno));
+            for (i=0; i<sip_udp_num; i++) {
+               if(setsockopt(sip_udp_group[i].fd, SOL_IP, IP_TOS,
+                             &tos, sizeof(tos))) {
+                  ERROR("sipsock_listen: setsockopt() failed while "
+                        "setting DSCP value: %s", strerror(errno));
+               }
             }
          } else {
             ERROR("sipsock_listen: Invalid DSCP value %d",
@@ -136,33 +282,92 @@ int sipsock_listen (void) {
       return STS_FAILURE;
    }
 
-   INFO("bound to port %i", configuration.sip_listen_port);
+   INFO("bound to port %i (%i UDP socket%s)", configuration.sip_listen_port,
+        sip_udp_num, (sip_udp_num > 1)? "s" : "");
    DEBUGC(DBCLASS_NET,"bound UDP socket=%i, TCP socket=%i",
           sip_udp_socket, sip_tcp_socket);
 
-   /* initialize the TCP connection cache array */
-   memset(&sip_tcp_cache, 0, sizeof(sip_tcp_cache));
+   /* initialize the TCP connection cache */
+   if (tcp_cache_init() != STS_SUCCESS) return STS_FAILURE;
 
    return STS_SUCCESS;
 }
 
 
 /*
- * read a message from SIP listen socket (UDP datagram)
+ * read a message from SIP listen socket (UDP datagram) or
+ * a SIP TCP connection
+ *
+ * UDP datagrams are read into buf. Messages received via TCP are
+ * left in place in the receive buffer of the connection. *data
+ * points to the message in any case, it is \0 terminated and
+ * valid until the next call of sipsock_waitfordata().
  *
  * RETURNS number of bytes read (=0 if nothing read, <0 timeout)
  *         from is modified to return the sockaddr_in of the sender
  */
 int sipsock_waitfordata(char *buf, size_t bufsize,
-                        struct sockaddr_in *from, int *protocol) {
-   int i, fd;
-   fd_set fdset;
-   int highest_fd, num_fd_active;
+                        struct sockaddr_in *from, int *protocol,
+                        char **data) {
+   int i, j, k, fd;
+   fd_set fdset, wrset;
+   int highest_fd, num_fd_active, num_wr;
+   int next;
    static struct timeval timeout={0,0};
+   struct timeval connect_wait, poll_wait, *wait;
+   static int udp_next=0;
+   static time_t last_cycle=0;
+   time_t now;
    int length;
    socklen_t fromlen;
 
    DEBUGC(DBCLASS_BABBLE,"entered sipsock_waitfordata");
+   *data=buf;
+
+   /* deliver messages that have been waiting for DNS lookups */
+   length=dns_async_resume(buf, bufsize, from, protocol);
+   if (length > 0) return length;
+
+   /* deliver messages remaining from the last TCP read */
+   if (tcp_rx_last >= 0) {
+      i=tcp_rx_last;
+      tcp_rx_last=-1;
+      if (sip_tcp_cache[i].fd) {
+         tcp_rx_release(i);
+         /* with priority scheduling, the rest goes to the queue */
+         if (sip_prio_enabled() == STS_TRUE) {
+            length=tcp_rx_queue(i, data);
+         } else {
+            length=tcp_rx_frame(i, data);
+         }
+         if (length > 0) {
+            DEBUGC(DBCLASS_NET,"delivering pipelined TCP message from "
+                   "[%s:%i] count=%i fd=%i",
+                   utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
+                   ntohs(sip_tcp_cache[i].dst_addr.sin_port),
+                   length, sip_tcp_cache[i].fd);
+            *protocol = PROTO_TCP;
+            memcpy(from, &sip_tcp_cache[i].dst_addr, sizeof(struct sockaddr_in));
+            tcp_rx_last=i;
+            return length;
+         }
+         *data=buf;
+      }
+   }
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+   /* deliver datagrams remaining from the last receive batch */
+   if (udp_rx_count > 0) {
+      return udp_rx_next(buf, bufsize, from, protocol);
+   }
+
+   /* batch (and the priority queue) is completely processed,
+    * send what has been queued */
+   if (sip_prio_count() == 0) {
+      udp_tx_flush();
+      udp_tx_batching=0;
+   }
+#endif
 
    /* we keep the select() timeout running acrosse multiple calls to
     * select(). This avoids missing select() timeouts if the system
@@ -181,28 +386,98 @@ int sipsock_waitfordata(char *buf, size_t bufsize,
 
    /* prepare FD set: UDP, TCP listen */
    FD_ZERO(&fdset);
-   FD_SET (sip_udp_socket, &fdset);
    FD_SET (sip_tcp_socket, &fdset);
-   if (sip_udp_socket > sip_tcp_socket) {
-      highest_fd = sip_udp_socket;
-   } else {
-      highest_fd = sip_tcp_socket;
+   highest_fd = sip_tcp_socket;
+   for (i=0; i<sip_udp_num; i++) {
+      FD_SET (sip_udp_group[i].fd, &fdset);
+      if (sip_udp_group[i].fd > highest_fd) {
+         highest_fd = sip_udp_group[i].fd;
+      }
    }
 
-   /* prepare FD set: TCP connections */
-   for (i=0; i<(sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0])); i++) {
+   /* completion of asynchronous DNS lookups */
+   fd=dns_async_fd();
+   if (fd >= 0) {
+      FD_SET (fd, &fdset);
+      if (fd > highest_fd) highest_fd = fd;
+   }
+
+   /* interface events */
+   fd=if_watch_fd();
+   if (fd >= 0) {
+      FD_SET (fd, &fdset);
+      if (fd > highest_fd) highest_fd = fd;
+   }
+
+   /* prepare FD sets: TCP connections. Pending connect()s and
+    * connections with queued output wait for writeability */
+   FD_ZERO(&wrset);
+   num_wr=0;
+   for (i=tcp_list_head[TCP_LIST_TRAFFIC]; i >= 0;
+        i=sip_tcp_cache[i].list_next[TCP_LIST_TRAFFIC]) {
       /* active TCP conenction? */
       if (sip_tcp_cache[i].fd) {
          /* add to FD set */
-         FD_SET(sip_tcp_cache[i].fd, &fdset);
+         if (!sip_tcp_cache[i].connecting) {
+            FD_SET(sip_tcp_cache[i].fd, &fdset);
+         }
+         if (sip_tcp_cache[i].connecting || sip_tcp_cache[i].txbuf_len) {
+            FD_SET(sip_tcp_cache[i].fd, &wrset);
+            num_wr++;
+         }
          if (sip_tcp_cache[i].fd > highest_fd) {
             highest_fd = sip_tcp_cache[i].fd;
          }
       } /* if fd > 0 */
    }
 
+   /* with pending connect()s do not sleep longer than the connect
+    * timeout, so they can be expired in time. The time spent is
+    * accounted to the running timeout. */
+   wait=&timeout;
+   if ((tcp_connecting > 0) &&
+       ((timeout.tv_sec*1000 + timeout.tv_usec/1000) >
+        configuration.tcp_connect_timeout)) {
+      connect_wait.tv_sec  = (configuration.tcp_connect_timeout/1000);
+      connect_wait.tv_usec = (configuration.tcp_connect_timeout%1000)*1000;
+      wait=&connect_wait;
+   }
+
+   /* messages are waiting in the priority queue: select() only polls
+    * for more. The cyclic tasks still get their timeout every 5s. */
+   if (sip_prio_count() > 0) {
+      time(&now);
+      if (now - last_cycle >= 5) {
+         last_cycle=now;
+         tcp_expire();
+         return -1;
+      }
+      poll_wait.tv_sec=0;
+      poll_wait.tv_usec=0;
+      wait=&poll_wait;
+   }
+
    /* select() on all FD's with timeout */
-   num_fd_active=select (highest_fd+1, &fdset, NULL, NULL, &timeout);
+   num_fd_active=select (highest_fd+1, &fdset, (num_wr)? &wrset : NULL,
+                         NULL, wait);
+
+   if (wait == &connect_wait) {
+      k=(configuration.tcp_connect_timeout
+         - connect_wait.tv_sec*1000 - connect_wait.tv_usec/1000);
+      timeout.tv_sec  -= k/1000;
+      timeout.tv_usec -= (k%1000)*1000;
+      if (timeout.tv_usec < 0) {
+         timeout.tv_sec--;
+         timeout.tv_usec += 1000000;
+      }
+      if (timeout.tv_sec < 0) {
+         timeout.tv_sec=0;
+         timeout.tv_usec=0;
+      }
+   }
+
+   /* expire connect()s that did not succeed in time */
+   if (tcp_connecting > 0) tcp_connect_expire();
 
    /* WARN on failures */
    if (num_fd_active < 0) {
@@ -216,10 +491,16 @@ int sipsock_waitfordata(char *buf, size_t bufsize,
       }
    }
 
+   /* nothing new, continue with the priority queue */
+   if ((num_fd_active <= 0) && (wait == &poll_wait)) {
+      return sip_prio_get(buf, bufsize, from, protocol);
+   }
+
    /* nothing here = timeout condition */
    if (num_fd_active <= 0) {
       /* process the active TCP connection list - expire old entries */
       tcp_expire();
+      time(&last_cycle);
       return -1;
    }
 
@@ -228,6 +509,51 @@ for (i=0; i< highest_fd; i++) {
    if (FD_ISSET(i, &fdset)) DEBUGC(DBCLASS_BABBLE, "FD %i = active", i);
 }
 
+   /*
+    * TCP connections that have become writeable: complete the
+    * pending connect() or send the queued output
+    */
+   for (i=tcp_list_head[TCP_LIST_TRAFFIC];
+        (i >= 0) && (num_wr > 0) && (num_fd_active > 0); i=next) {
+      next=sip_tcp_cache[i].list_next[TCP_LIST_TRAFFIC];
+      if (!FD_ISSET(sip_tcp_cache[i].fd, &wrset)) continue;
+      num_wr--;
+      num_fd_active--;
+
+      if (sip_tcp_cache[i].connecting) {
+         tcp_connect_done(i);
+      } else if (tcp_tx_flush(i) != STS_SUCCESS) {
+         WARN("send() returned error [%s], disconnecting TCP [%s:%i] fd=%i",
+              strerror(errno),
+              utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
+              ntohs(sip_tcp_cache[i].dst_addr.sin_port),
+              sip_tcp_cache[i].fd);
+         tcp_remove(i);
+      }
+   }
+   if (num_fd_active <= 0) return 0;
+
+   /* interfaces or addresses have changed */
+   fd=if_watch_fd();
+   if ((fd >= 0) && FD_ISSET(fd, &fdset)) {
+      if_watch_process();
+      num_fd_active--;
+      if (num_fd_active <= 0) return 0;
+   }
+
+   /*
+    * DNS lookups have completed, deliver a message that has been
+    * waiting for them
+    */
+   fd=dns_async_fd();
+   if ((fd >= 0) && FD_ISSET(fd, &fdset)) {
+      dns_async_complete();
+      length=dns_async_resume(buf, bufsize, from, protocol);
+      if (length > 0) return length;
+      num_fd_active--;
+      if (num_fd_active <= 0) return 0;
+   }
+
    /*
     * Some FD's have signalled that data is available (fdset)
     * Process them:
@@ -271,22 +597,81 @@ for (i=0; i< highest_fd; i++) {
    }
 
    /*
-    * Check UDP socket
+    * priority scheduling: move the datagrams of all UDP sockets and
+    * the complete messages of all readable TCP connections into the
+    * priority queue and deliver the most urgent one. So TCP is not
+    * starved by a busy queue and is classified like UDP.
     */
-   if (FD_ISSET(sip_udp_socket, &fdset)) {
+   if (sip_prio_enabled() == STS_TRUE) {
+      for (k=0; k<sip_udp_num; k++) {
+         if (!FD_ISSET(sip_udp_group[k].fd, &fdset)) continue;
+         udp_rx_queue(k);
+         FD_CLR(sip_udp_group[k].fd, &fdset);
+         num_fd_active--;
+      }
+      for (i=tcp_list_head[TCP_LIST_TRAFFIC];
+           (i >= 0) && (num_fd_active > 0); i=next) {
+         next=sip_tcp_cache[i].list_next[TCP_LIST_TRAFFIC];
+         if (!FD_ISSET(sip_tcp_cache[i].fd, &fdset)) continue;
+         /* tcp_touch() moves it to the end of the list */
+         FD_CLR(sip_tcp_cache[i].fd, &fdset);
+         num_fd_active--;
+
+         if (tcp_rx_ready(i) <= 0) continue;
+         length=tcp_rx_queue(i, data);
+         if (length < 0) {
+            WARN("invalid or too large SIP message, disconnecting TCP "
+                 "[%s:%i] fd=%i",
+                 utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
+                 ntohs(sip_tcp_cache[i].dst_addr.sin_port),
+                 sip_tcp_cache[i].fd);
+            tcp_remove(i);
+         } else if (length > 0) {
+            /* does not fit into the queue, process it directly */
+            *protocol = PROTO_TCP;
+            memcpy(from, &sip_tcp_cache[i].dst_addr, sizeof(struct sockaddr_in));
+            tcp_rx_last=i;
+            return length;
+         }
+         *data=buf;
+      }
+      if (sip_prio_count() > 0) {
+         return sip_prio_get(buf, bufsize, from, protocol);
+      }
+      if (num_fd_active <= 0) return 0;
+   }
+
+   /*
+    * Check UDP sockets. Start with the socket following the one
+    * served last, so no socket of the group can starve the others.
+    */
+   for (j=0; j<sip_udp_num; j++) {
+      k=(udp_next + j) % sip_udp_num;
+      if (!FD_ISSET(sip_udp_group[k].fd, &fdset)) continue;
+
+      udp_next=(k + 1) % sip_udp_num;
       *protocol = PROTO_UDP;
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+      if (udp_batch > 1) {
+         udp_rx_batch(k);
+         return udp_rx_next(buf, bufsize, from, protocol);
+      }
+#endif
+
       fromlen=sizeof(struct sockaddr_in);
-      length=recvfrom(sip_udp_socket, buf, bufsize, 0,
+      length=recvfrom(sip_udp_group[k].fd, buf, bufsize, 0,
                       (struct sockaddr *)from, &fromlen);
 
       if (length < 0) {
          WARN("recvfrom() returned error [%s]",strerror(errno));
          length=0;
+      } else {
+         sip_udp_group[k].rx_count++;
       }
 
-      DEBUGC(DBCLASS_NET,"received UDP packet from [%s:%i] count=%i",
-             utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port), length);
+      DEBUGC(DBCLASS_NET,"received UDP packet from [%s:%i] count=%i sock=%i",
+             utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port), length, k);
       DUMP_BUFFER(DBCLASS_NETTRAF, buf, length);
 
       return length;
@@ -294,10 +679,10 @@ for (i=0; i< highest_fd; i++) {
 
 
    /*
-    * Check active TCP sockets
+    * Check active TCP sockets, least recently served first
     */
-   for (i=0; i<(sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0])); i++) {
-      if (sip_tcp_cache[i].fd == 0) continue;
+   for (i=tcp_list_head[TCP_LIST_TRAFFIC]; i >= 0; i=next) {
+      next=sip_tcp_cache[i].list_next[TCP_LIST_TRAFFIC];
 
       /* no more active FD's to be expected, exit the loop */
       if (num_fd_active <= 0) break;
@@ -311,94 +696,29 @@ for (i=0; i< highest_fd; i++) {
          *protocol = PROTO_TCP;
          memcpy(from, &sip_tcp_cache[i].dst_addr, sizeof(struct sockaddr_in));
 
-         length = recv(sip_tcp_cache[i].fd, buf, bufsize, 0);
+         if (tcp_rx_ready(i) <= 0) continue;
+
+         /* RFC3261, 18.3 framing: headers and Content-Length */
+         length=tcp_rx_frame(i, data);
          if (length < 0) {
-            WARN("recv() returned error [%s], disconnecting TCP [%s] fd=%i",
-                 strerror(errno), utils_inet_ntoa(from->sin_addr),
-                 sip_tcp_cache[i].fd);
-            length=0;
-            tcp_remove(i);
-         }
-         if (length == 0) {
-            /* length=0 indicates a disconnect from remote side */
-            DEBUGC(DBCLASS_NET, "received TCP disconnect [%s:%i] fd=%i",
-                   utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port),
-                   sip_tcp_cache[i].fd);
+            WARN("invalid or too large SIP message, disconnecting TCP "
+                 "[%s:%i] fd=%i", utils_inet_ntoa(from->sin_addr),
+                 ntohs(from->sin_port), sip_tcp_cache[i].fd);
             tcp_remove(i);
+            *data=buf;
             continue;
          }
-
-         /* prematurely check for <CR><LF> keepalives, no need to do any
-            work on them... Set length = 0 and done. */
-         if (length == 2 && (memcmp(buf, "\x0d\x0a", 2) == 0)) {
-            DEBUGC(DBCLASS_NET, "got a SIP TCP keepalive from [%s:%i] fd=%i",
-                   utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port),
-                   sip_tcp_cache[i].fd);
-            return 0;
-         }
-
-         DEBUGC(DBCLASS_NET,"received TCP packet from [%s:%i] count=%i fd=%i",
-                utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port),
-                length, sip_tcp_cache[i].fd);
-         DUMP_BUFFER(DBCLASS_NETTRAF, buf, length);
-
-         /* check for <CR><LF> termination of TCP RX buffer */
-         if ((length > 2) && 
-             (memcmp(&buf[length-2], "\x0d\x0a", 2) != 0)) {
-            /* not terminated */
+         if (length == 0) {
             DEBUGC(DBCLASS_NET, "received incomplete fragment, buffering...");
-            /* append to RX buffer of this connection */
-            if (sip_tcp_cache[i].rxbuf_len+length < sip_tcp_cache[i].rxbuf_size) {
-               memcpy(&sip_tcp_cache[i].rx_buffer[sip_tcp_cache[i].rxbuf_len],
-                      buf, length);
-               sip_tcp_cache[i].rxbuf_len+=length;
-            } else {
-               /* out of RX buffer space, discard this SIP frame */
-               DEBUGC(DBCLASS_NET, "RX buffer too small, discarding this frame");
-               sip_tcp_cache[i].rxbuf_len=0;
-            }
-
+            *data=buf;
             return 0;
+         }
 
-         } else {
-            /* terminated by <CR><LF> */
-            if (sip_tcp_cache[i].rxbuf_len != 0) {
-               /* have already buffered data waiting. Copy new fragment to end
-                * of RX buffer and then copy all back... */
-
-               if (sip_tcp_cache[i].rxbuf_len+length < sip_tcp_cache[i].rxbuf_size) {
-                  DEBUGC(DBCLASS_NET, "received last fragment, assembling...");
-                  memcpy(&sip_tcp_cache[i].rx_buffer[sip_tcp_cache[i].rxbuf_len],
-                         buf, length);
-                  sip_tcp_cache[i].rxbuf_len+=length;
-               } else {
-                  /* out of RX buffer space, discard this SIP frame */
-                  DEBUGC(DBCLASS_NET, "RX buffer too small, discarding this frame");
-                  sip_tcp_cache[i].rxbuf_len=0;
-                  return 0;
-               }
-
-               /* copy whole RX buffer to the callers buffer */
-               if (sip_tcp_cache[i].rxbuf_len <= bufsize) {
-                  memcpy (buf, sip_tcp_cache[i].rx_buffer, sip_tcp_cache[i].rxbuf_len);
-                  length = sip_tcp_cache[i].rxbuf_len;
-                  sip_tcp_cache[i].rxbuf_len=0;
-               } else {
-                  /* TCP RX buffer bigger than callers buffer... */
-                  DEBUGC(DBCLASS_NET, "buffer passed to sipsock_waitfordata is too small");
-                  sip_tcp_cache[i].rxbuf_len=0;
-                  length =0;
-               }
-            }
-
-            /* update activity timestamp */
-            if (length > 0) {
-               time(&sip_tcp_cache[i].traffic_ts);
-               sip_tcp_cache[i].keepalive_ts=sip_tcp_cache[i].traffic_ts;
-            }
+         /* update activity timestamp */
+         tcp_touch(i);
 
-            return length;
-         }
+         tcp_rx_last=i;
+         return length;
 
       } /* FD_ISSET(sip_tcp_cache[i].fd, &fdset */
    } /* for i */
@@ -443,6 +763,17 @@ int sipsock_send(struct in_addr addr, int port, int protocol,
       DEBUGC(DBCLASS_NET,"send UDP packet to %s: %i", utils_inet_ntoa(addr),port);
       DUMP_BUFFER(DBCLASS_NETTRAF, buffer, size);
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+      /* while processing a received batch, queue for sendmmsg() */
+      if (udp_tx_batching) {
+         if (udp_tx_queue(&dst_addr, buffer, size) == STS_SUCCESS) {
+            return STS_SUCCESS;
+         }
+         /* could not be queued, send directly but keep the order */
+         udp_tx_flush();
+      }
+#endif
+
       sts = sendto(sip_udp_socket, buffer, size, 0,
                    (const struct sockaddr *)&dst_addr,
                    (socklen_t)sizeof(dst_addr));
@@ -468,7 +799,9 @@ int sipsock_send(struct in_addr addr, int port, int protocol,
       /* check connection cache for an existing TCP connection */
       i=tcp_find(dst_addr);
 
-      /* if no TCP connection found, do a connect (non blocking) and add to list */
+      /* if no TCP connection found, start a connect (non blocking)
+       * and add to list. The data is queued until the connect()
+       * has completed */
       if (i < 0) {
          DEBUGC(DBCLASS_NET,"no TCP connection found to %s:%i - connecting",
                 utils_inet_ntoa(addr), port);
@@ -485,15 +818,15 @@ int sipsock_send(struct in_addr addr, int port, int protocol,
       DEBUGC(DBCLASS_NET,"send TCP packet to %s:%i", utils_inet_ntoa(addr), port);
       DUMP_BUFFER(DBCLASS_NETTRAF, buffer, size);
 
-      time(&sip_tcp_cache[i].traffic_ts);
-      sip_tcp_cache[i].keepalive_ts=sip_tcp_cache[i].traffic_ts;
+      tcp_touch(i);
 
-      sts = send(sip_tcp_cache[i].fd, buffer, size, 0);
+      sts = tcp_tx(i, buffer, size);
 
-      if (sts == -1) {
+      if (sts != STS_SUCCESS) {
          ERROR("send() [%s:%i size=%ld] call failed: %s",
                utils_inet_ntoa(addr),
                port, (long)size, strerror(errno));
+         if (errno != ENOBUFS) tcp_remove(i);
          return STS_FAILURE;
       }
 
@@ -510,6 +843,255 @@ int sipsock_send(struct in_addr addr, int port, int protocol,
 
 
 
+/*
+ * move the datagrams waiting on a SIP UDP socket into the priority
+ * queue, as long as there is space. What does not fit stays in the
+ * kernel receive queue.
+ *
+ * RETURNS: -
+ */
+static void udp_rx_queue(int idx) {
+   char buf[BUFFER_SIZE];
+   struct sockaddr_in from;
+   socklen_t fromlen;
+   int length, num;
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+   if (udp_batch > 1) {
+      while (sip_prio_space() >= udp_batch) {
+         udp_rx_batch(idx);
+         num=udp_rx_count;
+         for (; udp_rx_count > 0; udp_rx_head++, udp_rx_count--) {
+            if (udp_rx_ring[udp_rx_head].len <= 0) continue;
+            sip_prio_put(udp_rx_ring[udp_rx_head].buf,
+                         udp_rx_ring[udp_rx_head].len,
+                         &udp_rx_ring[udp_rx_head].from, PROTO_UDP);
+         }
+         /* socket is empty */
+         if (num < udp_batch) break;
+      }
+      return;
+   }
+#endif
+
+   for (num=0; sip_prio_space() > 0; num++) {
+      fromlen=sizeof(struct sockaddr_in);
+      length=recvfrom(sip_udp_group[idx].fd, buf, sizeof(buf), MSG_DONTWAIT,
+                      (struct sockaddr *)&from, &fromlen);
+      if (length < 0) {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+             (errno != EINTR)) {
+            WARN("recvfrom() returned error [%s]",strerror(errno));
+         }
+         break;
+      }
+      sip_udp_group[idx].rx_count++;
+      if (length > 0) sip_prio_put(buf, length, &from, PROTO_UDP);
+   }
+
+   DEBUGC(DBCLASS_NET,"queued %i UDP packets sock=%i, %i waiting",
+          num, idx, sip_prio_count());
+}
+
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+/*
+ * read up to udp_batch datagrams from a SIP UDP socket into the
+ * receive ring with one single recvmmsg() call. Only called
+ * if the ring is empty.
+ *
+ * RETURNS: -
+ */
+static void udp_rx_batch(int idx) {
+   struct mmsghdr msgs[SIP_UDP_BATCH_MAX];
+   struct iovec iovecs[SIP_UDP_BATCH_MAX];
+   int i, num;
+
+   memset(msgs, 0, sizeof(msgs));
+   for (i=0; i<udp_batch; i++) {
+      iovecs[i].iov_base=udp_rx_ring[i].buf;
+      iovecs[i].iov_len=sizeof(udp_rx_ring[i].buf);
+      msgs[i].msg_hdr.msg_iov=&iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+      msgs[i].msg_hdr.msg_name=&udp_rx_ring[i].from;
+      msgs[i].msg_hdr.msg_namelen=sizeof(udp_rx_ring[i].from);
+   }
+
+   num=recvmmsg(sip_udp_group[idx].fd, msgs, udp_batch, MSG_DONTWAIT, NULL);
+   if (num < 0) {
+      if ((errno != EAGAIN) && (errno != EINTR)) {
+         WARN("recvmmsg() returned error [%s]",strerror(errno));
+      }
+      num=0;
+   }
+
+   for (i=0; i<num; i++) {
+      udp_rx_ring[i].len=msgs[i].msg_len;
+   }
+   udp_rx_head=0;
+   udp_rx_count=num;
+   sip_udp_group[idx].rx_count+=num;
+
+   /* more than one message - coalesce the sends until processed */
+   if (num > 1) udp_tx_batching=1;
+
+   DEBUGC(DBCLASS_NET,"received batch of %i UDP packets sock=%i", num, idx);
+}
+
+
+/*
+ * deliver the next datagram from the receive ring
+ *
+ * RETURNS number of bytes (=0 if ring is empty)
+ */
+static int udp_rx_next(char *buf, size_t bufsize,
+                       struct sockaddr_in *from, int *protocol) {
+   int length;
+
+   if (udp_rx_count <= 0) return 0;
+
+   length=udp_rx_ring[udp_rx_head].len;
+   if (length > bufsize) length=bufsize;
+   memcpy(buf, udp_rx_ring[udp_rx_head].buf, length);
+   memcpy(from, &udp_rx_ring[udp_rx_head].from, sizeof(struct sockaddr_in));
+   *protocol = PROTO_UDP;
+
+   udp_rx_head++;
+   udp_rx_count--;
+
+   DEBUGC(DBCLASS_NET,"received UDP packet from [%s:%i] count=%i",
+          utils_inet_ntoa(from->sin_addr), ntohs(from->sin_port), length);
+   DUMP_BUFFER(DBCLASS_NETTRAF, buf, length);
+
+   return length;
+}
+
+
+/*
+ * queue a datagram for sending with sendmmsg(). If the queue
+ * is full, it is flushed first.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if the datagram can not be queued (too large)
+ */
+static int udp_tx_queue(struct sockaddr_in *dst_addr,
+                        char *buffer, size_t size) {
+   if (size > sizeof(udp_tx_ring[0].buf)) return STS_FAILURE;
+
+   if (udp_tx_count >= udp_batch) udp_tx_flush();
+
+   memcpy(udp_tx_ring[udp_tx_count].buf, buffer, size);
+   udp_tx_ring[udp_tx_count].len=size;
+   memcpy(&udp_tx_ring[udp_tx_count].dst_addr, dst_addr,
+          sizeof(struct sockaddr_in));
+   udp_tx_count++;
+
+   return STS_SUCCESS;
+}
+
+
+/*
+ * send all queued datagrams with sendmmsg(). A datagram that
+ * fails is logged and skipped, the remaining ones are still sent.
+ *
+ * RETURNS: -
+ */
+static void udp_tx_flush(void) {
+   struct mmsghdr msgs[SIP_UDP_BATCH_MAX];
+   struct iovec iovecs[SIP_UDP_BATCH_MAX];
+   int i, sts;
+
+   if (udp_tx_count == 0) return;
+
+   memset(msgs, 0, sizeof(msgs));
+   for (i=0; i<udp_tx_count; i++) {
+      iovecs[i].iov_base=udp_tx_ring[i].buf;
+      iovecs[i].iov_len=udp_tx_ring[i].len;
+      msgs[i].msg_hdr.msg_iov=&iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+      msgs[i].msg_hdr.msg_name=&udp_tx_ring[i].dst_addr;
+      msgs[i].msg_hdr.msg_namelen=sizeof(udp_tx_ring[i].dst_addr);
+   }
+
+   DEBUGC(DBCLASS_NET,"sending batch of %i UDP packets", udp_tx_count);
+
+   i=0;
+   while (i < udp_tx_count) {
+      sts=sendmmsg(sip_udp_socket, &msgs[i], udp_tx_count-i, 0);
+      if ((sts < 0) && (errno == EINTR)) continue;
+      if (sts <= 0) {
+         /* the datagram at position i failed, skip it */
+         if (errno != ECONNREFUSED) {
+            ERROR("sendmmsg() [%s:%i size=%ld] call failed: %s",
+                  utils_inet_ntoa(udp_tx_ring[i].dst_addr.sin_addr),
+                  ntohs(udp_tx_ring[i].dst_addr.sin_port),
+                  (long)udp_tx_ring[i].len, strerror(errno));
+         }
+         i++;
+         continue;
+      }
+      i+=sts;
+   }
+
+   udp_tx_count=0;
+}
+#endif
+
+
+/*
+ * get the statistics of a SIP UDP listen socket. The receive counter
+ * is maintained by siproxd, queue size, buffer size and drops are
+ * read from the kernel (-1 if not available on this platform).
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE if idx does not refer to an open UDP socket
+ */
+int sipsock_udp_stats(int idx, sipsock_stats_t *stats) {
+#if defined(SO_MEMINFO) && defined(HAVE_LINUX_SOCK_DIAG_H)
+   /* larger than SK_MEMINFO_VARS, the kernel returns what it has.
+    * SK_MEMINFO_DROPS (index 8) is not known to older headers */
+   unsigned int meminfo[16];
+#define MEMINFO_DROPS	8
+#endif
+   socklen_t optlen;
+   int rcvbuf;
+
+   if ((idx < 0) || (idx >= sip_udp_num) || (stats == NULL)) {
+      return STS_FAILURE;
+   }
+
+   stats->fd=sip_udp_group[idx].fd;
+   stats->rx_count=sip_udp_group[idx].rx_count;
+   stats->rx_queued=-1;
+   stats->rcvbuf=-1;
+   stats->drops=-1;
+
+#if defined(SO_MEMINFO) && defined(HAVE_LINUX_SOCK_DIAG_H)
+   memset(meminfo, 0, sizeof(meminfo));
+   optlen=sizeof(meminfo);
+   if (getsockopt(stats->fd, SOL_SOCKET, SO_MEMINFO,
+                  meminfo, &optlen) == 0) {
+      stats->rx_queued=meminfo[SK_MEMINFO_RMEM_ALLOC];
+      stats->rcvbuf=meminfo[SK_MEMINFO_RCVBUF];
+      if (optlen > MEMINFO_DROPS * sizeof(meminfo[0])) {
+         stats->drops=meminfo[MEMINFO_DROPS];
+      }
+      return STS_SUCCESS;
+   }
+#endif
+
+   /* fallback: at least get the configured buffer size */
+   optlen=sizeof(rcvbuf);
+   if (getsockopt(stats->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == 0) {
+      stats->rcvbuf=rcvbuf;
+   }
+
+   return STS_SUCCESS;
+}
+
+
 /*
  * generic routine to allocate and bind a socket to a specified
  * local address and port (UDP)
@@ -583,7 +1165,136 @@ int sockbind(struct in_addr ipaddr, int localport, int protocol, int errflg) {
 
 
 /*
- * age and expire TCP connections
+ * allocate and bind one SIP UDP listen socket. If reuseport is set,
+ * the socket becomes member of an SO_REUSEPORT group that shares
+ * the same local address and port. The kernel receive buffer is set
+ * to configuration.sip_udp_rcvbuf (if given).
+ *
+ * RETURNS socket number on success, zero on failure
+ */
+static int udp_bind(struct in_addr ipaddr, int localport, int reuseport) {
+   struct sockaddr_in my_addr;
+   int sts, on=1;
+   int sock;
+   int flags;
+   int rcvbuf;
+   socklen_t optlen;
+
+   memset(&my_addr, 0, sizeof(my_addr));
+
+   my_addr.sin_family = AF_INET;
+   memcpy(&my_addr.sin_addr, &ipaddr, sizeof(struct in_addr));
+   my_addr.sin_port = htons(localport);
+
+   sock=socket (PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if (sock < 0) {
+      ERROR("socket call failed: %s",strerror(errno));
+      return 0;
+   }
+
+   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on , sizeof(on)) < 0) {
+      ERROR("setsockopt returned error [%i:%s]",errno, strerror(errno));
+      close(sock);
+      return 0;
+   }
+
+#ifdef SO_REUSEPORT
+   if (reuseport &&
+       (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on , sizeof(on)) < 0)) {
+      ERROR("setsockopt(SO_REUSEPORT) returned error [%i:%s]",
+            errno, strerror(errno));
+      close(sock);
+      return 0;
+   }
+#endif
+
+   /* kernel receive buffer, must be set before bind() to take
+    * effect for datagrams that arrive immediately */
+   if (configuration.sip_udp_rcvbuf > 0) {
+      rcvbuf=configuration.sip_udp_rcvbuf;
+      if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+                     &rcvbuf, sizeof(rcvbuf)) < 0) {
+         WARN("setsockopt(SO_RCVBUF=%i) returned error [%i:%s]",
+              rcvbuf, errno, strerror(errno));
+      }
+      optlen=sizeof(rcvbuf);
+      if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == 0) {
+         DEBUGC(DBCLASS_NET,"UDP socket %i: SO_RCVBUF is %i bytes",
+                sock, rcvbuf);
+      }
+   }
+
+   sts=bind(sock, (struct sockaddr *)&my_addr, sizeof(my_addr));
+   if (sts != 0) {
+      ERROR("bind failed: %s",strerror(errno));
+      close(sock);
+      return 0;
+   }
+
+   /* non blocking, see sockbind() */
+   flags = fcntl(sock, F_GETFL);
+   if (flags < 0) {
+      ERROR("fcntl(F_SETFL) failed: %s",strerror(errno));
+      close(sock);
+      return 0;
+   }
+   if (fcntl(sock, F_SETFL, (long) flags | O_NONBLOCK) < 0) {
+      ERROR("fcntl(F_SETFL) failed: %s",strerror(errno));
+      close(sock);
+      return 0;
+   }
+
+   return sock;
+}
+
+
+/*
+ * attach a classic BPF program to the SO_REUSEPORT group of the
+ * SIP UDP sockets. The program selects the receiving socket by a
+ * hash of the source IP address, so a given UA always lands on the
+ * same socket (ordering of its messages is preserved).
+ * If not supported, the kernel default (4-tuple hash) is used.
+ *
+ * RETURNS: -
+ */
+static void udp_attach_steering(void) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(HAVE_LINUX_FILTER_H)
+   /* A = src IP; A ^= A >> 16; return A % number_of_sockets
+    * The packet data starts at the UDP payload, the IP header is
+    * reached via the SKF_NET_OFF negative offset */
+   struct sock_filter code[] = {
+      { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+      { BPF_MISC| BPF_TAX,           0, 0, 0 },
+      { BPF_ALU | BPF_RSH | BPF_K,   0, 0, 16 },
+      { BPF_ALU | BPF_XOR | BPF_X,   0, 0, 0 },
+      { BPF_ALU | BPF_MOD | BPF_K,   0, 0, 0 },
+      { BPF_RET | BPF_A,             0, 0, 0 },
+   };
+   struct sock_fprog prog;
+
+   code[4].k = sip_udp_num;
+   prog.len = sizeof(code)/sizeof(code[0]);
+   prog.filter = code;
+
+   /* attaching to one member applies to the whole group */
+   if (setsockopt(sip_udp_group[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                  &prog, sizeof(prog)) < 0) {
+      WARN("attaching UDP steering program failed [%i:%s], "
+           "using kernel default distribution", errno, strerror(errno));
+      return;
+   }
+   DEBUGC(DBCLASS_NET,"attached UDP steering program to %i sockets",
+          sip_udp_num);
+#else
+   WARN("sip_udp_steering not supported on this platform, "
+        "using kernel default distribution");
+#endif
+}
+
+
+/*
+ * age and expire TCP connections. Both lists are ordered by
+ * their timestamp, so only the due entries are visited.
  *
  * RETURNS: -
  */
@@ -595,34 +1306,35 @@ static void tcp_expire(void) {
 
    time(&now);
    to_limit = now - configuration.tcp_timeout;
-   
-   for (i=0; i<(sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0])); i++) {
-      if (sip_tcp_cache[i].fd == 0) continue;
-
-      if (sip_tcp_cache[i].traffic_ts < to_limit) {
-         /* TCP has expired, close & cleanup */
-         DEBUGC(DBCLASS_NET, "TCP inactivity T/O, disconnecting: [%s] fd=%i",
-                utils_inet_ntoa((&sip_tcp_cache[i].dst_addr)->sin_addr),
-                sip_tcp_cache[i].fd);
-         tcp_remove(i);
-      } else 
 
-      /* TCP keepalive handling */
-      if ((sip_tcp_cache[i].keepalive_ts + configuration.tcp_keepalive) <= now) {
-         DEBUGC(DBCLASS_NET, "sending TCP keepalive [%s:%i] fd=%i idx=%i",
-                utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
-                ntohs(sip_tcp_cache[i].dst_addr.sin_port), sip_tcp_cache[i].fd, i);
+   /* idle connections */
+   while (((i=tcp_list_head[TCP_LIST_TRAFFIC]) >= 0) &&
+          (sip_tcp_cache[i].traffic_ts < to_limit)) {
+      /* TCP has expired, close & cleanup */
+      DEBUGC(DBCLASS_NET, "TCP inactivity T/O, disconnecting: [%s] fd=%i",
+             utils_inet_ntoa((&sip_tcp_cache[i].dst_addr)->sin_addr),
+             sip_tcp_cache[i].fd);
+      tcp_remove(i);
+   }
+
+   /* TCP keepalive handling */
+   if (configuration.tcp_keepalive <= 0) return;
+   while (((i=tcp_list_head[TCP_LIST_KEEPALIVE]) >= 0) &&
+          ((sip_tcp_cache[i].keepalive_ts + configuration.tcp_keepalive) <= now)) {
+      DEBUGC(DBCLASS_NET, "sending TCP keepalive [%s:%i] fd=%i idx=%i",
+             utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
+             ntohs(sip_tcp_cache[i].dst_addr.sin_port), sip_tcp_cache[i].fd, i);
 
-         sip_tcp_cache[i].keepalive_ts = now;
+      sip_tcp_cache[i].keepalive_ts = now;
+      tcp_list_unlink(TCP_LIST_KEEPALIVE, i);
+      tcp_list_append(TCP_LIST_KEEPALIVE, i);
 
-         sts = send(sip_tcp_cache[i].fd, "\x0d\x0a", 2, 0);
+      sts = tcp_tx(i, "\x0d\x0a", 2);
 
-         if (sts == -1) {
-            WARN("keepalive send() failed: %s", strerror(errno));
-         }
+      if (sts != STS_SUCCESS) {
+         WARN("keepalive send() failed: %s", strerror(errno));
       }
-
-   } /* for */
+   }
 }
 
 
@@ -634,11 +1346,11 @@ static void tcp_expire(void) {
 int tcp_find(struct sockaddr_in dst_addr) {
    int i;
 
-   /* check connection cache for an existing TCP connection */
-   for (i=0; i<(sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0])); i++) {
-      /* occupied entry? */
-      if (sip_tcp_cache[i].fd == 0) continue;
+   if (tcp_hash == NULL) return -1;
 
+   /* check connection cache for an existing TCP connection */
+   for (i=tcp_hash[tcp_hash_key(&dst_addr)]; i >= 0;
+        i=sip_tcp_cache[i].hash_next) {
       /* address & port match */
       if ((memcmp(&dst_addr.sin_addr, &sip_tcp_cache[i].dst_addr.sin_addr,
                     sizeof(struct in_addr)) ==0) &&
@@ -646,30 +1358,43 @@ int tcp_find(struct sockaddr_in dst_addr) {
    } /* for */
 
    /* if no TCP connection found return -1 */
-   if (i >= (sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0]))) return -1;
-
    return i;
 }
 
 
 /*
- * add a TCP connection into cache
+ * add a TCP connection into cache. If the cache is full, the least
+ * recently used connection is closed to make room.
  *
- * RETURNS: index into TCP cache or -1 on failure (out of space)
+ * RETURNS: index into TCP cache or -1 on failure
  */
 static int tcp_add(struct sockaddr_in addr, int fd) {
    int i;
+   int flags;
+   unsigned int key;
 
-   /* find free entry in TCP cache */
-   for (i=0; i<(sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0])); i++) {
-      if (sip_tcp_cache[i].fd == 0) break;
-   }
-   if (i >= (sizeof(sip_tcp_cache)/sizeof(sip_tcp_cache[0]))) {
-      DEBUGC(DBCLASS_NET, "out of space in TCP cache [%s] fd=%i",
-          utils_inet_ntoa(addr.sin_addr), fd);
+   /* select() can not handle this fd */
+   if (fd >= FD_SETSIZE) {
+      DEBUGC(DBCLASS_NET, "fd=%i exceeds FD_SETSIZE [%s]",
+             fd, utils_inet_ntoa(addr.sin_addr));
       return -1;
    }
 
+   /* cache full - evict the least recently used connection */
+   if (tcp_free < 0) {
+      i=tcp_list_head[TCP_LIST_TRAFFIC];
+      if (i < 0) return -1;
+      WARN("TCP connection cache full (%i), closing idle connection "
+           "[%s:%i] fd=%i", tcp_cache_size,
+           utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
+           ntohs(sip_tcp_cache[i].dst_addr.sin_port), sip_tcp_cache[i].fd);
+      tcp_remove(i);
+   }
+
+   /* take a free entry */
+   i=tcp_free;
+   tcp_free=sip_tcp_cache[i].hash_next;
+
    /* store connection data in TCP cache */
    sip_tcp_cache[i].fd = fd;
    memcpy(&sip_tcp_cache[i].dst_addr, &addr, sizeof(struct sockaddr_in));
@@ -687,11 +1412,34 @@ static int tcp_add(struct sockaddr_in addr, int fd) {
    sip_tcp_cache[i].rx_buffer=malloc(BUFFER_SIZE);
    if (sip_tcp_cache[i].rx_buffer == NULL) {
       DEBUGC(DBCLASS_NET, "malloc() of %i bytes failed", BUFFER_SIZE);
+      sip_tcp_cache[i].fd=0;
+      sip_tcp_cache[i].hash_next=tcp_free;
+      tcp_free=i;
       return -1;
    }
    sip_tcp_cache[i].rxbuf_size=BUFFER_SIZE;
    sip_tcp_cache[i].rxbuf_len=0;
+   sip_tcp_cache[i].rxbuf_start=0;
+   sip_tcp_cache[i].rxbuf_term=-1;
+   sip_tcp_cache[i].connecting=0;
+   sip_tcp_cache[i].txbuf_size=0;
+   sip_tcp_cache[i].txbuf_len=0;
+   sip_tcp_cache[i].tx_buffer=NULL;
+
+   /* never block in send(), output is queued by tcp_tx() */
+   flags = fcntl(fd, F_GETFL);
+   if ((flags >= 0) && !(flags & O_NONBLOCK)) {
+      if (fcntl(fd, F_SETFL, (long) flags | O_NONBLOCK) < 0) {
+         WARN("fcntl(F_SETFL) failed: %s",strerror(errno));
+      }
+   }
 
+   /* link into hash chain and lists */
+   key=tcp_hash_key(&addr);
+   sip_tcp_cache[i].hash_next=tcp_hash[key];
+   tcp_hash[key]=i;
+   tcp_list_append(TCP_LIST_TRAFFIC, i);
+   tcp_list_append(TCP_LIST_KEEPALIVE, i);
 
    DEBUGC(DBCLASS_NET, "added TCP connection [%s] fd=%i to cache idx=%i",
           utils_inet_ntoa(addr.sin_addr), fd, i);
@@ -701,7 +1449,11 @@ static int tcp_add(struct sockaddr_in addr, int fd) {
 
 
 /*
- * connect to a remote TCP target
+ * connect to a remote TCP target. The connect() is non-blocking,
+ * if it can not complete immediately the entry is marked as
+ * connecting and is completed by tcp_connect_done() from the
+ * main loop (or expired after tcp_connect_timeout msecs). Data
+ * sent meanwhile is queued in the output buffer.
  *
  * RETURNS: index into TCP cache or -1 on failure
  */
@@ -710,8 +1462,7 @@ static int tcp_connect(struct sockaddr_in dst_addr) {
    int flags;
    int sts;
    int i;
-   struct timeval timeout={0,0};
-   fd_set fdset;
+   int inprogress=0;
 
    /* get socket and connect to remote site */
    sock=socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -735,66 +1486,10 @@ static int tcp_connect(struct sockaddr_in dst_addr) {
 
    sts=connect(sock, (struct sockaddr *)&dst_addr, sizeof(struct sockaddr_in));
    if ((sts == -1 ) && (errno == EINPROGRESS)) {
-      /* if non-blocking connect(), wait until connection 
-         successful, discarded or timeout */
-      DEBUGC(DBCLASS_NET, "connection in progress, waiting %i msec to succeed",
+      /* completed later from the main loop */
+      DEBUGC(DBCLASS_NET, "connection in progress, allowing %i msec to succeed",
              configuration.tcp_connect_timeout);
-
-      /* timeout for connect */
-      timeout.tv_sec  = (configuration.tcp_connect_timeout/1000);
-      timeout.tv_usec = (configuration.tcp_connect_timeout%1000)*1000;
-      
-      do {
-         /* prepare fd set */
-         FD_ZERO(&fdset);
-         FD_SET(sock, &fdset);
-         sts = select(sock+1, NULL, &fdset, NULL, &timeout);
-         if ((sts < 0) && (errno == EINTR)) {
-            /* select() has been interrupted, do it again */
-            continue;
-         } else if (sts < 0) {
-            ERROR("waiting for TCP connect failed: %s",strerror(errno));
-            close(sock);
-            return -1;
-         } else if (sts > 0) {
-            /* fd available for write */
-            int valopt;
-            socklen_t optlen=sizeof(valopt);
-
-            /* get error status from delayed connect() */
-            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, 
-                           &valopt, &optlen) < 0) {
-               ERROR("getsockopt(SO_ERROR) failed: %s",strerror(errno));
-               close(sock);
-               return -1;
-            }
-
-            if (valopt == EINPROGRESS) {
-               ERROR("connect() returned: %s",strerror(valopt));
-               continue;
-            }
-
-            DEBUGC(DBCLASS_NET, "connect() completed after %i msec",
-                   (int)(configuration.tcp_connect_timeout 
-                   - (timeout.tv_sec*1000) 
-                   - (timeout.tv_usec/1000)));
-            
-            /* check the returned error value from connect() */
-            if (valopt) {
-               ERROR("delayed TCP connect() failed : %s",strerror(errno));
-               close(sock);
-               return -1;
-            }
-            /* all went fine, continue */
-            break;
-
-         } else {
-            DEBUGC(DBCLASS_NET, "tcp_connect() timeout");
-            close(sock);
-            return -1;
-         }
-      } while (1);
-
+      inprogress=1;
    } else if (sts == -1 ) {
       if ((errno != ECONNREFUSED) && (errno != ETIMEDOUT)) {
          ERROR("connect() [%s:%i] call failed: %s",
@@ -815,6 +1510,22 @@ static int tcp_connect(struct sockaddr_in dst_addr) {
       return -1;
    }
 
+   if (inprogress) {
+      sip_tcp_cache[i].connecting=1;
+      gettimeofday(&sip_tcp_cache[i].connect_to, NULL);
+      sip_tcp_cache[i].connect_to.tv_sec +=
+         configuration.tcp_connect_timeout/1000;
+      sip_tcp_cache[i].connect_to.tv_usec +=
+         (configuration.tcp_connect_timeout%1000)*1000;
+      if (sip_tcp_cache[i].connect_to.tv_usec >= 1000000) {
+         sip_tcp_cache[i].connect_to.tv_sec++;
+         sip_tcp_cache[i].connect_to.tv_usec -= 1000000;
+      }
+      tcp_list_append(TCP_LIST_CONNECT, i);
+      tcp_connecting++;
+      return i;
+   }
+
    DEBUGC(DBCLASS_NET, "connected TCP connection to [%s:%i] fd=%i",
           utils_inet_ntoa(dst_addr.sin_addr),
           ntohs(dst_addr.sin_port), sock);
@@ -829,11 +1540,560 @@ static int tcp_connect(struct sockaddr_in dst_addr) {
  * RETURNS: 0
  */
 static int tcp_remove(int idx) {
+   int *ip;
+
+   /* unlink from hash chain and lists, put to free list */
+   for (ip=&tcp_hash[tcp_hash_key(&sip_tcp_cache[idx].dst_addr)]; *ip >= 0;
+        ip=&sip_tcp_cache[*ip].hash_next) {
+      if (*ip == idx) {
+         *ip=sip_tcp_cache[idx].hash_next;
+         break;
+      }
+   }
+   tcp_list_unlink(TCP_LIST_TRAFFIC, idx);
+   tcp_list_unlink(TCP_LIST_KEEPALIVE, idx);
+   sip_tcp_cache[idx].hash_next=tcp_free;
+   tcp_free=idx;
+
    close(sip_tcp_cache[idx].fd);
    sip_tcp_cache[idx].fd=0;
    free(sip_tcp_cache[idx].rx_buffer);
    sip_tcp_cache[idx].rx_buffer=NULL;
    sip_tcp_cache[idx].rxbuf_size=0;
    sip_tcp_cache[idx].rxbuf_len=0;
+   sip_tcp_cache[idx].rxbuf_start=0;
+   sip_tcp_cache[idx].rxbuf_term=-1;
+   if (sip_tcp_cache[idx].connecting) {
+      tcp_list_unlink(TCP_LIST_CONNECT, idx);
+      tcp_connecting--;
+   }
+   sip_tcp_cache[idx].connecting=0;
+   free(sip_tcp_cache[idx].tx_buffer);
+   sip_tcp_cache[idx].tx_buffer=NULL;
+   sip_tcp_cache[idx].txbuf_size=0;
+   sip_tcp_cache[idx].txbuf_len=0;
+   if (tcp_rx_last == idx) tcp_rx_last=-1;
+   return 0;
+}
+
+
+/*
+ * read data from a TCP connection into its receive buffer.
+ * Processed data is discarded, the buffer grows if required
+ * (up to TCP_RXBUF_MAX bytes). One byte is always kept free
+ * for \0 termination.
+ *
+ * RETURNS: number of bytes read, 0 on disconnect, -1 on error
+ */
+static int tcp_rx_read(int idx) {
+   int free_space;
+   int newsize;
+   int length;
+   char *newbuf;
+
+   /* discard processed data */
+   if (sip_tcp_cache[idx].rxbuf_start > 0) {
+      memmove(sip_tcp_cache[idx].rx_buffer,
+              &sip_tcp_cache[idx].rx_buffer[sip_tcp_cache[idx].rxbuf_start],
+              sip_tcp_cache[idx].rxbuf_len - sip_tcp_cache[idx].rxbuf_start);
+      sip_tcp_cache[idx].rxbuf_len -= sip_tcp_cache[idx].rxbuf_start;
+      sip_tcp_cache[idx].rxbuf_start=0;
+   }
+
+   /* grow the buffer if full */
+   free_space=sip_tcp_cache[idx].rxbuf_size - sip_tcp_cache[idx].rxbuf_len - 1;
+   if ((free_space <= 0) && (sip_tcp_cache[idx].rxbuf_size < TCP_RXBUF_MAX)) {
+      newsize=sip_tcp_cache[idx].rxbuf_size * 2;
+      if (newsize > TCP_RXBUF_MAX) newsize=TCP_RXBUF_MAX;
+      newbuf=realloc(sip_tcp_cache[idx].rx_buffer, newsize);
+      if (newbuf) {
+         DEBUGC(DBCLASS_NET, "TCP RX buffer of fd=%i grown to %i bytes",
+                sip_tcp_cache[idx].fd, newsize);
+         sip_tcp_cache[idx].rx_buffer=newbuf;
+         sip_tcp_cache[idx].rxbuf_size=newsize;
+         free_space=newsize - sip_tcp_cache[idx].rxbuf_len - 1;
+      }
+   }
+   if (free_space <= 0) {
+      /* message larger than TCP_RXBUF_MAX */
+      errno=EMSGSIZE;
+      return -1;
+   }
+
+   length=recv(sip_tcp_cache[idx].fd,
+               &sip_tcp_cache[idx].rx_buffer[sip_tcp_cache[idx].rxbuf_len],
+               free_space, 0);
+   if (length > 0) sip_tcp_cache[idx].rxbuf_len += length;
+   return length;
+}
+
+
+/*
+ * read from a TCP connection that select() has reported readable.
+ * On errors and remote disconnects the connection is removed.
+ *
+ * RETURNS: number of bytes read, 0 if nothing has been read
+ */
+static int tcp_rx_ready(int idx) {
+   struct sockaddr_in *addr=&sip_tcp_cache[idx].dst_addr;
+   int length;
+
+   length = tcp_rx_read(idx);
+   if ((length < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                        (errno == EINTR))) {
+      /* non-blocking socket, nothing there (yet) */
+      return 0;
+   }
+   if (length < 0) {
+      WARN("recv() returned error [%s], disconnecting TCP [%s] fd=%i",
+           strerror(errno), utils_inet_ntoa(addr->sin_addr),
+           sip_tcp_cache[idx].fd);
+      tcp_remove(idx);
+      return 0;
+   }
+   if (length == 0) {
+      /* length=0 indicates a disconnect from remote side */
+      DEBUGC(DBCLASS_NET, "received TCP disconnect [%s:%i] fd=%i",
+             utils_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+             sip_tcp_cache[idx].fd);
+      tcp_remove(idx);
+      return 0;
+   }
+
+   DEBUGC(DBCLASS_NET,"received TCP packet from [%s:%i] count=%i fd=%i",
+          utils_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+          length, sip_tcp_cache[idx].fd);
+   DUMP_BUFFER(DBCLASS_NETTRAF,
+               &sip_tcp_cache[idx].rx_buffer[sip_tcp_cache[idx].rxbuf_len-length],
+               length);
+   return length;
+}
+
+
+/*
+ * move the complete messages in the receive buffer of a TCP
+ * connection into the priority queue. A message that can not be
+ * queued (larger than a queue entry, queue full) is returned to be
+ * processed directly, the messages after it stay in the buffer.
+ *
+ * RETURNS: length of a message to be processed directly (*data
+ *          points to it), 0 if all complete messages are queued,
+ *          -1 if the message can never fit into the buffer
+ */
+static int tcp_rx_queue(int idx, char **data) {
+   int length;
+
+   while ((length=tcp_rx_frame(idx, data)) > 0) {
+      tcp_touch(idx);
+      if ((length >= BUFFER_SIZE) ||
+          (sip_prio_put(*data, length, &sip_tcp_cache[idx].dst_addr,
+                        PROTO_TCP) != STS_SUCCESS)) {
+         return length;
+      }
+      tcp_rx_release(idx);
+   }
+   return length;
+}
+
+
+/*
+ * find the next complete SIP message in the receive buffer of a
+ * TCP connection (RFC3261, 18.3: the message ends after the empty
+ * line plus Content-Length bytes of body). <CR><LF> keepalives
+ * between messages are consumed, a <CR><LF><CR><LF> ping is
+ * delivered as message of its own (answered by the fast path).
+ * The message is \0 terminated in place - the overwritten byte
+ * is restored by tcp_rx_release().
+ *
+ * RETURNS: length of the message (*data points to it),
+ *          0 if no complete message is available,
+ *          -1 if the message can never fit into the buffer
+ */
+static int tcp_rx_frame(int idx, char **data) {
+   char *start, *end, *p;
+   int avail;
+   int hdrlen;
+   int clen;
+   int length;
+
+   start=&sip_tcp_cache[idx].rx_buffer[sip_tcp_cache[idx].rxbuf_start];
+   end=&sip_tcp_cache[idx].rx_buffer[sip_tcp_cache[idx].rxbuf_len];
+
+   /* keepalives */
+   while ((end - start >= 2) && (memcmp(start, "\x0d\x0a", 2) == 0)) {
+      if ((end - start >= 4) && (memcmp(start+2, "\x0d\x0a", 2) == 0)) {
+         length=4;
+         goto deliver;
+      }
+      DEBUGC(DBCLASS_NET, "got a SIP TCP keepalive from [%s:%i] fd=%i",
+             utils_inet_ntoa(sip_tcp_cache[idx].dst_addr.sin_addr),
+             ntohs(sip_tcp_cache[idx].dst_addr.sin_port),
+             sip_tcp_cache[idx].fd);
+      start+=2;
+      sip_tcp_cache[idx].rxbuf_start+=2;
+   }
+   avail=end - start;
+   if (avail <= 0) return 0;
+
+   /* end of headers */
+   for (p=start; (p=memchr(p, '\x0d', end - p)) != NULL; p++) {
+      if ((end - p) < 4) {
+         p=NULL;
+         break;
+      }
+      if (memcmp(p, "\x0d\x0a\x0d\x0a", 4) == 0) break;
+   }
+   if (p == NULL) {
+      /* incomplete header - may it still fit? */
+      if (avail >= TCP_RXBUF_MAX - 1) return -1;
+      return 0;
+   }
+   hdrlen=(p + 4) - start;
+
+   clen=tcp_content_length(start, hdrlen);
+   if ((clen < 0) || (clen > TCP_RXBUF_MAX - 1 - hdrlen)) return -1;
+
+   length=hdrlen + clen;
+   if (avail < length) return 0;
+
+deliver:
+   sip_tcp_cache[idx].rxbuf_term=sip_tcp_cache[idx].rxbuf_start + length;
+   sip_tcp_cache[idx].rxbuf_saved=start[length];
+   start[length]='\0';
+   sip_tcp_cache[idx].rxbuf_start+=length;
+   *data=start;
+   return length;
+}
+
+
+/*
+ * undo the \0 termination of the last delivered message
+ *
+ * RETURNS: -
+ */
+static void tcp_rx_release(int idx) {
+   if (sip_tcp_cache[idx].rxbuf_term >= 0) {
+      sip_tcp_cache[idx].rx_buffer[sip_tcp_cache[idx].rxbuf_term]=
+         sip_tcp_cache[idx].rxbuf_saved;
+      sip_tcp_cache[idx].rxbuf_term=-1;
+   }
+}
+
+
+/*
+ * get the Content-Length from a raw SIP header (long or compact form)
+ *
+ * RETURNS: value of Content-Length, 0 if not present, -1 if invalid
+ */
+static int tcp_content_length(char *hdr, int hdrlen) {
+   char *p, *eol, *end;
+   long value;
+
+   end=hdr + hdrlen;
+   for (p=hdr; p < end; p=eol) {
+      eol=memchr(p, '\x0a', end - p);
+      eol=(eol)? eol+1 : end;
+
+      if ((eol - p > 14) && (strncasecmp(p, "Content-Length", 14) == 0)) {
+         p+=14;
+      } else if ((p[0] == 'l') || (p[0] == 'L')) {
+         p+=1;
+      } else {
+         continue;
+      }
+      while ((p < eol) && ((*p == ' ') || (*p == '\t'))) p++;
+      if ((p >= eol) || (*p != ':')) continue;
+      p++;
+      while ((p < eol) && ((*p == ' ') || (*p == '\t'))) p++;
+      if ((p >= eol) || !isdigit((int)*p)) return -1;
+
+      value=strtol(p, NULL, 10);
+      if ((value < 0) || (value > TCP_RXBUF_MAX)) return -1;
+      return (int)value;
+   }
    return 0;
 }
+
+
+/*
+ * send data via a TCP connection. Whatever can not be sent right
+ * now (connect() pending, socket send buffer full) is queued in the
+ * output buffer of the connection and sent by tcp_tx_flush() when
+ * the socket becomes writeable. At most TCP_TXBUF_MAX bytes are
+ * queued per connection - if a peer does not read, further
+ * messages are refused (errno=ENOBUFS) instead of blocking.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success (sent or queued)
+ *	STS_FAILURE on error
+ */
+static int tcp_tx(int idx, char *buffer, size_t size) {
+   int sts;
+   size_t sent=0;
+   size_t newsize;
+   char *newbuf;
+
+   /* nothing queued, try to send directly */
+   if (!sip_tcp_cache[idx].connecting && (sip_tcp_cache[idx].txbuf_len == 0)) {
+      sts=send(sip_tcp_cache[idx].fd, buffer, size, 0);
+      if (sts < 0) {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            return STS_FAILURE;
+         }
+         sts=0;
+      }
+      sent=sts;
+      if (sent >= size) return STS_SUCCESS;
+   }
+
+   /* backpressure - but a partially sent message must be completed */
+   if ((sent == 0) &&
+       (sip_tcp_cache[idx].txbuf_len + size > TCP_TXBUF_MAX)) {
+      errno=ENOBUFS;
+      return STS_FAILURE;
+   }
+
+   /* queue the remainder */
+   newsize=sip_tcp_cache[idx].txbuf_size;
+   if (newsize == 0) newsize=BUFFER_SIZE;
+   while (newsize < sip_tcp_cache[idx].txbuf_len + (size-sent)) newsize *= 2;
+   if (newsize != sip_tcp_cache[idx].txbuf_size) {
+      newbuf=realloc(sip_tcp_cache[idx].tx_buffer, newsize);
+      if (newbuf == NULL) {
+         errno=ENOMEM;
+         return STS_FAILURE;
+      }
+      sip_tcp_cache[idx].tx_buffer=newbuf;
+      sip_tcp_cache[idx].txbuf_size=newsize;
+   }
+   memcpy(&sip_tcp_cache[idx].tx_buffer[sip_tcp_cache[idx].txbuf_len],
+          buffer+sent, size-sent);
+   sip_tcp_cache[idx].txbuf_len += size-sent;
+
+   DEBUGC(DBCLASS_NET, "queued %i bytes for TCP fd=%i, %i bytes pending",
+          (int)(size-sent), sip_tcp_cache[idx].fd,
+          sip_tcp_cache[idx].txbuf_len);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * send queued output of a TCP connection (as much as possible)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success (all or parts sent)
+ *	STS_FAILURE on error
+ */
+static int tcp_tx_flush(int idx) {
+   int sts;
+
+   if (sip_tcp_cache[idx].txbuf_len == 0) return STS_SUCCESS;
+
+   sts=send(sip_tcp_cache[idx].fd, sip_tcp_cache[idx].tx_buffer,
+            sip_tcp_cache[idx].txbuf_len, 0);
+   if (sts < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+         return STS_SUCCESS;
+      }
+      return STS_FAILURE;
+   }
+
+   sip_tcp_cache[idx].txbuf_len -= sts;
+   if (sip_tcp_cache[idx].txbuf_len > 0) {
+      memmove(sip_tcp_cache[idx].tx_buffer,
+              &sip_tcp_cache[idx].tx_buffer[sts],
+              sip_tcp_cache[idx].txbuf_len);
+   } else if (sip_tcp_cache[idx].txbuf_size > BUFFER_SIZE) {
+      /* do not keep a large buffer after a burst */
+      free(sip_tcp_cache[idx].tx_buffer);
+      sip_tcp_cache[idx].tx_buffer=NULL;
+      sip_tcp_cache[idx].txbuf_size=0;
+   }
+
+   DEBUGC(DBCLASS_NET, "sent %i queued bytes to TCP fd=%i, %i bytes pending",
+          sts, sip_tcp_cache[idx].fd, sip_tcp_cache[idx].txbuf_len);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * a pending connect() has signalled writeability: check the
+ * result and send the queued output or drop the connection
+ *
+ * RETURNS: -
+ */
+static void tcp_connect_done(int idx) {
+   int valopt=0;
+   socklen_t optlen=sizeof(valopt);
+
+   /* get error status from delayed connect() */
+   if (getsockopt(sip_tcp_cache[idx].fd, SOL_SOCKET, SO_ERROR,
+                  &valopt, &optlen) < 0) {
+      valopt=errno;
+   }
+   if (valopt == EINPROGRESS) return;
+
+   if (valopt) {
+      ERROR("delayed TCP connect() [%s:%i] failed: %s, "
+            "discarding %i queued bytes",
+            utils_inet_ntoa(sip_tcp_cache[idx].dst_addr.sin_addr),
+            ntohs(sip_tcp_cache[idx].dst_addr.sin_port), strerror(valopt),
+            sip_tcp_cache[idx].txbuf_len);
+      tcp_remove(idx);
+      return;
+   }
+
+   tcp_list_unlink(TCP_LIST_CONNECT, idx);
+   sip_tcp_cache[idx].connecting=0;
+   tcp_connecting--;
+
+   DEBUGC(DBCLASS_NET, "connected TCP connection to [%s:%i] fd=%i",
+          utils_inet_ntoa(sip_tcp_cache[idx].dst_addr.sin_addr),
+          ntohs(sip_tcp_cache[idx].dst_addr.sin_port),
+          sip_tcp_cache[idx].fd);
+
+   if (tcp_tx_flush(idx) != STS_SUCCESS) {
+      WARN("send() returned error [%s], disconnecting TCP [%s:%i] fd=%i",
+           strerror(errno),
+           utils_inet_ntoa(sip_tcp_cache[idx].dst_addr.sin_addr),
+           ntohs(sip_tcp_cache[idx].dst_addr.sin_port),
+           sip_tcp_cache[idx].fd);
+      tcp_remove(idx);
+   }
+}
+
+
+/*
+ * drop connections whose connect() did not complete within
+ * tcp_connect_timeout msecs. The pending connects are ordered
+ * by their deadline, only the expired ones are looked at.
+ *
+ * RETURNS: -
+ */
+static void tcp_connect_expire(void) {
+   struct timeval now;
+   int i;
+
+   gettimeofday(&now, NULL);
+   while ((i=tcp_list_head[TCP_LIST_CONNECT]) >= 0) {
+      if (timercmp(&now, &sip_tcp_cache[i].connect_to, <)) break;
+
+      ERROR("TCP connect() [%s:%i] timeout, discarding %i queued bytes",
+            utils_inet_ntoa(sip_tcp_cache[i].dst_addr.sin_addr),
+            ntohs(sip_tcp_cache[i].dst_addr.sin_port),
+            sip_tcp_cache[i].txbuf_len);
+      tcp_remove(i);
+   }
+}
+
+
+/*
+ * allocate the TCP connection cache and its hash table
+ * (tcp_max_connections entries)
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+static int tcp_cache_init(void) {
+   int i;
+   int hashsize;
+
+   tcp_cache_size=configuration.tcp_max_connections;
+   if (tcp_cache_size < 1) tcp_cache_size=TCP_CACHE_SIZE;
+   if (tcp_cache_size > FD_SETSIZE) {
+      WARN("tcp_max_connections=%i too large, limiting to %i",
+           tcp_cache_size, FD_SETSIZE);
+      tcp_cache_size=FD_SETSIZE;
+   }
+
+   /* hash table: power of 2, at least as large as the cache */
+   for (hashsize=64; hashsize < tcp_cache_size; hashsize <<= 1);
+   tcp_hash_mask=hashsize-1;
+
+   sip_tcp_cache=calloc(tcp_cache_size, sizeof(sip_tcp_cache[0]));
+   tcp_hash=malloc(hashsize*sizeof(tcp_hash[0]));
+   if ((sip_tcp_cache == NULL) || (tcp_hash == NULL)) {
+      ERROR("unable to allocate TCP connection cache of %i entries",
+            tcp_cache_size);
+      return STS_FAILURE;
+   }
+
+   for (i=0; i<hashsize; i++) tcp_hash[i]=-1;
+   for (i=0; i<tcp_cache_size; i++) {
+      sip_tcp_cache[i].rxbuf_term=-1;
+      sip_tcp_cache[i].hash_next=(i+1 < tcp_cache_size)? i+1 : -1;
+   }
+   tcp_free=0;
+
+   DEBUGC(DBCLASS_NET, "TCP connection cache: %i entries, %i hash buckets",
+          tcp_cache_size, hashsize);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * hash of a remote TCP address (IP and port)
+ *
+ * RETURNS: hash bucket
+ */
+static unsigned int tcp_hash_key(struct sockaddr_in *addr) {
+   unsigned int h;
+
+   h=ntohl(addr->sin_addr.s_addr) ^ ((unsigned int)ntohs(addr->sin_port) << 16);
+   h*=2654435761U;		/* Knuth multiplicative hashing */
+   return (h ^ (h >> 16)) & tcp_hash_mask;
+}
+
+
+/*
+ * remove an entry from one of the TCP_LIST_xxx lists
+ *
+ * RETURNS: -
+ */
+static void tcp_list_unlink(int list, int idx) {
+   int prev=sip_tcp_cache[idx].list_prev[list];
+   int next=sip_tcp_cache[idx].list_next[list];
+
+   if (prev >= 0) sip_tcp_cache[prev].list_next[list]=next;
+   else tcp_list_head[list]=next;
+   if (next >= 0) sip_tcp_cache[next].list_prev[list]=prev;
+   else tcp_list_tail[list]=prev;
+
+   sip_tcp_cache[idx].list_prev[list]=-1;
+   sip_tcp_cache[idx].list_next[list]=-1;
+}
+
+
+/*
+ * append an entry to the end (most recent) of one of the
+ * TCP_LIST_xxx lists
+ *
+ * RETURNS: -
+ */
+static void tcp_list_append(int list, int idx) {
+   sip_tcp_cache[idx].list_prev[list]=tcp_list_tail[list];
+   sip_tcp_cache[idx].list_next[list]=-1;
+   if (tcp_list_tail[list] >= 0) {
+      sip_tcp_cache[tcp_list_tail[list]].list_next[list]=idx;
+   } else {
+      tcp_list_head[list]=idx;
+   }
+   tcp_list_tail[list]=idx;
+}
+
+
+/*
+ * SIP traffic on a TCP connection: update the activity timestamps
+ * and make it the most recently used one
+ *
+ * RETURNS: -
+ */
+static void tcp_touch(int idx) {
+   time(&sip_tcp_cache[idx].traffic_ts);
+   sip_tcp_cache[idx].keepalive_ts=sip_tcp_cache[idx].traffic_ts;
+   tcp_list_unlink(TCP_LIST_TRAFFIC, idx);
+   tcp_list_append(TCP_LIST_TRAFFIC, idx);
+   tcp_list_unlink(TCP_LIST_KEEPALIVE, idx);
+   tcp_list_append(TCP_LIST_KEEPALIVE, idx);
+}
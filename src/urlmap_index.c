@@ -0,0 +1,461 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+/* URL mapping table */
+extern struct urlmap_s *urlmap;
+extern int urlmap_size;
+
+/*
+ * Indexes over the URL mapping table
+ *
+ * Looking up a registration used to be a linear scan over all urlmap
+ * entries calling compare_url() for each of them. The indexes here
+ * deliver the (few) entries that possibly match, the caller then does
+ * the same comparison as before on these candidates only.
+ *
+ * compare_url() matches the user part exactly but compares the host
+ * part by its resolved IP address, so the user part is the only
+ * stable key: the URL indexes (true, masqueraded and registered URL)
+ * are keyed by username. The address index is keyed by the IP
+ * address of the true URL. Entries where this is a host name (which
+ * may resolve differently later) are kept on a separate list that
+ * is always part of the candidates.
+ *
+ * Candidates are returned in ascending urlmap order, so the first
+ * matching candidate is the same entry the linear scan would have
+ * found.
+ *
+ * The index also keeps the list of free urlmap slots and a min-heap
+ * of the indexed entries ordered by expiration time, so the aging
+ * only looks at the entries that are due.
+ */
+
+/* index numbers, the URLMAP_IDX_* masks are (1 << index number) */
+#define IDX_TRUE		0
+#define IDX_MASQ		1
+#define IDX_REG			2
+#define IDX_ADDR		3
+#define URLMAP_NUM_IDX		4
+
+static struct {
+   int indexed;
+   unsigned int bucket[URLMAP_NUM_IDX];	/* bucket the slot is linked in */
+   int next[URLMAP_NUM_IDX];		/* next slot in chain, -1=end */
+   int heap_pos;			/* position in expiry heap */
+} *urlidx=NULL;
+
+static int urlidx_size=0;		/* urlmap size the index is built for */
+static int *urlidx_hash[URLMAP_NUM_IDX];
+static unsigned int urlidx_hash_size=0;	/* +1 bucket for dynamic hosts */
+static int *urlidx_free=NULL;		/* stack of free slots */
+static int urlidx_num_free=0;
+static int *urlidx_cand=NULL;		/* lookup result */
+static unsigned int *urlidx_mark=NULL;	/* dedup of candidates */
+static unsigned int urlidx_gen=0;
+static int *urlidx_heap=NULL;		/* expiry heap of slots */
+static int urlidx_heap_len=0;
+
+/* local prototypes */
+static unsigned int urlidx_user_hash(osip_uri_t *url);
+static int urlidx_addr_bucket(osip_uri_t *url);
+static void urlidx_link(int idx);
+static void urlidx_unlink(int idx);
+static int urlidx_collect(int key, unsigned int bucket, int n);
+static int urlidx_cmp(const void *a, const void *b);
+static void urlidx_heap_insert(int idx);
+static void urlidx_heap_delete(int idx);
+static void urlidx_heap_up(int pos);
+static void urlidx_heap_down(int pos);
+
+
+/*
+ * (re-)build the indexes from the current URL mapping table
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on error
+ */
+int urlmap_index_init(void) {
+   int i, k;
+
+   /* (re-)allocate if the table has been resized */
+   if (urlidx_size != urlmap_size) {
+      free(urlidx);
+      free(urlidx_free);
+      free(urlidx_cand);
+      free(urlidx_mark);
+      free(urlidx_heap);
+      for (k=0; k<URLMAP_NUM_IDX; k++) {
+         free(urlidx_hash[k]);
+         urlidx_hash[k]=NULL;
+      }
+      urlidx_size=0;
+      urlidx_gen=0;
+
+      for (urlidx_hash_size=64; urlidx_hash_size < urlmap_size;
+           urlidx_hash_size <<= 1);
+      urlidx=calloc(urlmap_size, sizeof(*urlidx));
+      urlidx_free=malloc(urlmap_size*sizeof(int));
+      urlidx_cand=malloc(urlmap_size*sizeof(int));
+      urlidx_mark=calloc(urlmap_size, sizeof(unsigned int));
+      urlidx_heap=malloc(urlmap_size*sizeof(int));
+      for (k=0; k<URLMAP_NUM_IDX; k++) {
+         urlidx_hash[k]=malloc((urlidx_hash_size+1)*sizeof(int));
+         if (urlidx_hash[k] == NULL) break;
+      }
+      if ((urlidx == NULL) || (urlidx_free == NULL) ||
+          (urlidx_cand == NULL) || (urlidx_mark == NULL) ||
+          (urlidx_heap == NULL) || (k < URLMAP_NUM_IDX)) {
+         ERROR("unable to allocate urlmap index");
+         free(urlidx);
+         urlidx=NULL;
+         return STS_FAILURE;
+      }
+      urlidx_size=urlmap_size;
+   }
+
+   for (k=0; k<URLMAP_NUM_IDX; k++) {
+      for (i=0; i<=urlidx_hash_size; i++) urlidx_hash[k][i]=-1;
+   }
+   memset(urlidx, 0, urlidx_size*sizeof(*urlidx));
+   urlidx_heap_len=0;
+
+   /* free slots are pushed in descending order, lowest is used first */
+   urlidx_num_free=0;
+   for (i=urlidx_size-1; i>=0; i--) {
+      if (urlmap[i].active) {
+         urlidx_link(i);
+      } else {
+         urlidx_free[urlidx_num_free++]=i;
+      }
+   }
+
+   DEBUGC(DBCLASS_REG, "urlmap index: %i entries, %i free",
+          urlidx_size-urlidx_num_free, urlidx_num_free);
+   return STS_SUCCESS;
+}
+
+
+/*
+ * add an urlmap entry to the indexes, must be called whenever
+ * an entry has been created or its URLs have been replaced
+ *
+ * RETURNS: -
+ */
+void urlmap_index_add(int idx) {
+   if ((urlidx == NULL) || (idx < 0) || (idx >= urlidx_size)) return;
+
+   if (urlidx[idx].indexed) {
+      urlidx_unlink(idx);
+   } else {
+      int i;
+      /* slot is no longer free */
+      for (i=urlidx_num_free-1; i>=0; i--) {
+         if (urlidx_free[i] == idx) {
+            memmove(&urlidx_free[i], &urlidx_free[i+1],
+                    (urlidx_num_free-i-1)*sizeof(int));
+            urlidx_num_free--;
+            break;
+         }
+      }
+   }
+   urlidx_link(idx);
+}
+
+
+/*
+ * remove an urlmap entry from the indexes, must be called before
+ * the URLs of the entry are freed
+ *
+ * RETURNS: -
+ */
+void urlmap_index_remove(int idx) {
+   if ((urlidx == NULL) || (idx < 0) || (idx >= urlidx_size)) return;
+   if (urlidx[idx].indexed == 0) return;
+
+   urlidx_unlink(idx);
+   urlidx_free[urlidx_num_free++]=idx;
+}
+
+
+/*
+ * get a free urlmap slot. The slot is taken by the following
+ * urlmap_index_add().
+ *
+ * RETURNS
+ *	index of a free slot, -1 if the table is full
+ */
+int urlmap_index_freeslot(void) {
+   if ((urlidx == NULL) || (urlidx_num_free <= 0)) return -1;
+   return urlidx_free[urlidx_num_free-1];
+}
+
+
+/*
+ * the expiration time of an urlmap entry has changed
+ *
+ * RETURNS: -
+ */
+void urlmap_index_update(int idx) {
+   int pos;
+
+   if ((urlidx == NULL) || (idx < 0) || (idx >= urlidx_size)) return;
+   if (urlidx[idx].indexed == 0) return;
+
+   pos=urlidx[idx].heap_pos;
+   urlidx_heap_up(pos);
+   urlidx_heap_down(urlidx[idx].heap_pos);
+}
+
+
+/*
+ * number of entries in the indexes
+ *
+ * RETURNS
+ *	number of indexed urlmap entries
+ */
+int urlmap_index_count(void) {
+   return urlidx_heap_len;
+}
+
+
+/*
+ * get the entry that expires next
+ *
+ * RETURNS
+ *	index of the entry, -1 if the table is empty
+ */
+int urlmap_index_next_expiry(void) {
+   if ((urlidx == NULL) || (urlidx_heap_len == 0)) return -1;
+   return urlidx_heap[0];
+}
+
+
+/*
+ * get the urlmap entries possibly matching an URL or an address
+ * keys: URLMAP_IDX_* to search, combined by OR
+ * url:  URL for the URL indexes (user part is used)
+ * addr: IP address for the address index
+ * list: returns a pointer to the candidate list, sorted ascending.
+ *       It is valid until the next call.
+ *
+ * RETURNS
+ *	number of candidates
+ */
+int urlmap_index_lookup(int keys, osip_uri_t *url, struct in_addr *addr,
+                        int **list) {
+   unsigned int h=0;
+   int n=0;
+   int k;
+
+   *list=urlidx_cand;
+   if (urlidx == NULL) return 0;
+
+   /* new generation of candidate marks */
+   if (++urlidx_gen == 0) {
+      memset(urlidx_mark, 0, urlidx_size*sizeof(unsigned int));
+      urlidx_gen=1;
+   }
+
+   if (url) h=urlidx_user_hash(url);
+   for (k=0; k<IDX_ADDR; k++) {
+      if (((keys & (1<<k)) == 0) || (url == NULL)) continue;
+      n=urlidx_collect(k, h, n);
+   }
+   if ((keys & URLMAP_IDX_ADDR) && addr) {
+      h=(ntohl(addr->s_addr) * 2654435761U) & (urlidx_hash_size-1);
+      n=urlidx_collect(IDX_ADDR, h, n);
+      n=urlidx_collect(IDX_ADDR, urlidx_hash_size, n);
+   }
+
+   if (n > 1) qsort(urlidx_cand, n, sizeof(int), urlidx_cmp);
+   return n;
+}
+
+
+/*
+ * module local functions
+ */
+
+/*
+ * bucket of the URL indexes for an URL (by the user part)
+ */
+static unsigned int urlidx_user_hash(osip_uri_t *url) {
+   unsigned int h=2166136261U;		/* FNV-1a */
+   char *p;
+
+   if (url->username) {
+      for (p=url->username; *p; p++) h=(h ^ (unsigned char)*p) * 16777619U;
+   }
+   return h & (urlidx_hash_size-1);
+}
+
+
+/*
+ * bucket of the address index for an URL. Host names go to the
+ * extra bucket urlidx_hash_size.
+ */
+static int urlidx_addr_bucket(osip_uri_t *url) {
+   struct in_addr addr;
+
+   if ((url->host == NULL) || (utils_inet_aton(url->host, &addr) <= 0)) {
+      return urlidx_hash_size;
+   }
+   return (ntohl(addr.s_addr) * 2654435761U) & (urlidx_hash_size-1);
+}
+
+
+static void urlidx_link(int idx) {
+   osip_uri_t *url[IDX_ADDR];
+   unsigned int b;
+   int k;
+
+   url[IDX_TRUE]=urlmap[idx].true_url;
+   url[IDX_MASQ]=urlmap[idx].masq_url;
+   url[IDX_REG]=urlmap[idx].reg_url;
+
+   for (k=0; k<URLMAP_NUM_IDX; k++) {
+      if (k == IDX_ADDR) {
+         b=(url[IDX_TRUE])? urlidx_addr_bucket(url[IDX_TRUE]) :
+                            urlidx_hash_size;
+      } else {
+         b=(url[k])? urlidx_user_hash(url[k]) : 0;
+      }
+      urlidx[idx].bucket[k]=b;
+      urlidx[idx].next[k]=urlidx_hash[k][b];
+      urlidx_hash[k][b]=idx;
+   }
+   urlidx[idx].indexed=1;
+   urlidx_heap_insert(idx);
+}
+
+
+static void urlidx_unlink(int idx) {
+   int *pp;
+   int k;
+
+   for (k=0; k<URLMAP_NUM_IDX; k++) {
+      for (pp=&urlidx_hash[k][urlidx[idx].bucket[k]]; *pp >= 0;
+           pp=&urlidx[*pp].next[k]) {
+         if (*pp == idx) {
+            *pp=urlidx[idx].next[k];
+            break;
+         }
+      }
+   }
+   urlidx[idx].indexed=0;
+   urlidx_heap_delete(idx);
+}
+
+
+/*
+ * append the slots of one hash chain to the candidate list
+ */
+static int urlidx_collect(int key, unsigned int bucket, int n) {
+   int i;
+
+   for (i=urlidx_hash[key][bucket]; i >= 0; i=urlidx[i].next[key]) {
+      if (urlidx_mark[i] == urlidx_gen) continue;
+      urlidx_mark[i]=urlidx_gen;
+      urlidx_cand[n++]=i;
+   }
+   return n;
+}
+
+
+static int urlidx_cmp(const void *a, const void *b) {
+   return *(const int *)a - *(const int *)b;
+}
+
+
+/*
+ * expiry heap, ordered by urlmap[].expires
+ */
+static void urlidx_heap_insert(int idx) {
+   urlidx_heap[urlidx_heap_len]=idx;
+   urlidx[idx].heap_pos=urlidx_heap_len;
+   urlidx_heap_len++;
+   urlidx_heap_up(urlidx_heap_len-1);
+}
+
+
+static void urlidx_heap_delete(int idx) {
+   int pos=urlidx[idx].heap_pos;
+   int last;
+
+   urlidx_heap_len--;
+   if (pos == urlidx_heap_len) return;
+
+   /* move the last element into the gap */
+   last=urlidx_heap[urlidx_heap_len];
+   urlidx_heap[pos]=last;
+   urlidx[last].heap_pos=pos;
+   urlidx_heap_up(pos);
+   urlidx_heap_down(urlidx[last].heap_pos);
+}
+
+
+static void urlidx_heap_up(int pos) {
+   int idx=urlidx_heap[pos];
+   int parent;
+
+   while (pos > 0) {
+      parent=(pos-1)/2;
+      if (urlmap[urlidx_heap[parent]].expires <= urlmap[idx].expires) break;
+      urlidx_heap[pos]=urlidx_heap[parent];
+      urlidx[urlidx_heap[pos]].heap_pos=pos;
+      pos=parent;
+   }
+   urlidx_heap[pos]=idx;
+   urlidx[idx].heap_pos=pos;
+}
+
+
+static void urlidx_heap_down(int pos) {
+   int idx=urlidx_heap[pos];
+   int child;
+
+   for (;;) {
+      child=2*pos+1;
+      if (child >= urlidx_heap_len) break;
+      if ((child+1 < urlidx_heap_len) &&
+          (urlmap[urlidx_heap[child+1]].expires <
+           urlmap[urlidx_heap[child]].expires)) child++;
+      if (urlmap[idx].expires <= urlmap[urlidx_heap[child]].expires) break;
+      urlidx_heap[pos]=urlidx_heap[child];
+      urlidx[urlidx_heap[pos]].heap_pos=pos;
+      pos=child;
+   }
+   urlidx_heap[pos]=idx;
+   urlidx[idx].heap_pos=pos;
+}
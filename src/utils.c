@@ -55,32 +55,29 @@ extern struct siproxd_config configuration;
 
 extern int h_errno;
 
+#ifndef _PATH_HOSTS
+#define _PATH_HOSTS	"/etc/hosts"
+#endif
+
+/* local prototypes */
+static int hosts_file_lookup(char *hostname, struct in_addr *addr);
+
 
 /*
  * resolve a hostname and return in_addr
- * handles its own little DNS cache.
+ * uses the DNS cache (dns_cache.c).
+ *
+ * If the asynchronous resolver is running, a name that is not
+ * in the cache is not resolved here. The lookup is started in the
+ * background and STS_FAILURE is returned.
  *
  * RETURNS
  *	STS_SUCCESS on success
  *	STS_FAILURE on failure
  */
 int get_ip_by_host(char *hostname, struct in_addr *addr) {
-   int i, j, k, idx;
-   time_t t1, t2;
-   struct hostent *hostentry;
-#if defined(HAVE_GETHOSTBYNAME_R)
-   struct hostent result_buffer;
-   char tmp[GETHOSTBYNAME_BUFLEN];
-#endif
-   int error;
-   static struct {
-      time_t expires_timestamp;	/* time of expiration */
-      struct in_addr addr;	/* IP address or 0.0.0.0 if a bad entry */
-      char   error_count;	/* counts failed resolution attempts */
-      char   bad_entry;		/* != 0 if resolving failed */
-      char hostname[HOSTNAME_SIZE+1];
-   } dns_cache[DNS_CACHE_SIZE];
-   static int cache_initialized=0;
+   int sts;
+   int ttl;
 
    if (hostname == NULL) {
       ERROR("get_ip_by_host: NULL hostname requested");
@@ -100,52 +97,102 @@ int get_ip_by_host(char *hostname, struct in_addr *addr) {
       return STS_SUCCESS;
    }
 
-   /* first time: initialize DNS cache */
-   if (cache_initialized == 0) {
-      DEBUGC(DBCLASS_DNS, "initializing DNS cache (%i entries)", DNS_CACHE_SIZE);
-      memset(dns_cache, 0, sizeof(dns_cache));
-      cache_initialized=1;
-   }
-
-   time(&t1);
-   /* clean expired entries */
-   for (i=0; i<DNS_CACHE_SIZE; i++) {
-      if (dns_cache[i].hostname[0]=='\0') continue;
-      if ( (dns_cache[i].expires_timestamp) < t1 ) {
-         DEBUGC(DBCLASS_DNS, "cleaning DNS cache (entry %i)", i);
-         memset (&dns_cache[i], 0, sizeof(dns_cache[0]));
-      }
-   }
-
    /*
     * search requested entry in cache
     */
-   idx=0;
-   for (i=0; i<DNS_CACHE_SIZE; i++) {
-      if (dns_cache[i].hostname[0]=='\0') continue; /* empty */
-      if (strcasecmp(hostname, dns_cache[i].hostname) == 0) { /* match */
-         memcpy(addr, &dns_cache[i].addr, sizeof(struct in_addr));
-         if (dns_cache[i].bad_entry) {
-            DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisted from cache: %s",
-                   hostname);
-            return STS_FAILURE;
-         }
-         if (dns_cache[i].error_count > 0) {
-            DEBUGC(DBCLASS_DNS, "DNS lookup - previous resolution failed: %s"
-                   ", attempt %i", hostname, dns_cache[i].error_count);
-            idx=i;
-            break;
-         }
+   switch (dns_cache_lookup(hostname, addr)) {
+   case DNS_CACHE_HIT:
 // avoid: causes tremendous logging during URL lookups through
 //        the urlmap...
-//         DEBUGC(DBCLASS_BABBLE, "DNS lookup - from cache: %s -> %s",
-//                hostname, utils_inet_ntoa(*addr));
-         return STS_SUCCESS;
+//      DEBUGC(DBCLASS_BABBLE, "DNS lookup - from cache: %s -> %s",
+//             hostname, utils_inet_ntoa(*addr));
+      return STS_SUCCESS;
+
+   case DNS_CACHE_STALE:
+      /* stale entry: use it and refresh it in the background */
+      DEBUGC(DBCLASS_DNS, "DNS lookup - refreshing stale entry: %s",
+             hostname);
+      dns_async_lookup(hostname);
+      return STS_SUCCESS;
+
+   case DNS_CACHE_NEGATIVE:
+      DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisted from cache: %s",
+             hostname);
+      return STS_FAILURE;
+
+   case DNS_CACHE_FAILED:
+      DEBUGC(DBCLASS_DNS, "DNS lookup - previous resolution failed: %s",
+             hostname);
+      if (dns_async_running() == STS_TRUE) {
+         dns_async_lookup(hostname);
+         return STS_FAILURE;
       }
+      break;
+
+   default:
+      if (dns_async_running() == STS_TRUE) {
+         DEBUGC(DBCLASS_DNS, "DNS lookup - pending: %s", hostname);
+         dns_async_lookup(hostname);
+         return STS_FAILURE;
+      }
+      break;
    }
-   
+
    /* I did not find it in cache, so I have to resolve it */
+   sts=dns_resolve_host(hostname, addr, &ttl);
+   dns_cache_store(hostname, (sts == STS_SUCCESS) ? addr : NULL, ttl);
+   return sts;
+}
+
+
+/*
+ * resolve a hostname, without using the DNS cache.
+ * This call blocks and may be used by other threads.
+ *
+ * Names listed in the hosts file are taken from there, without any
+ * DNS query. Other names are looked up in DNS, address and TTL are
+ * taken from the same answer. Only if DNS has no A record for it
+ * (e.g. a name that needs the search domains or is provided by
+ * another NSS source) or DNS fails, the system resolver
+ * (gethostbyname) is asked.
+ *
+ * ttl returns the time the result may be cached: the TTL of the
+ * A record (if the name was resolved by DNS), DNS_GOOD_AGE for names
+ * resolved otherwise, dns_negative_ttl for a name that does not exist
+ * and 0 for other failures.
+ *
+ * RETURNS
+ *	STS_SUCCESS on success
+ *	STS_FAILURE on failure
+ */
+int dns_resolve_host(char *hostname, struct in_addr *addr, int *ttl) {
+   struct hostent *hostentry;
+#if defined(HAVE_GETHOSTBYNAME_R)
+   struct hostent result_buffer;
+   char tmp[GETHOSTBYNAME_BUFLEN];
+#endif
+   int error, sts;
+
    error = 0;
+   *ttl = 0;
+
+   /* hosts file: no DNS query, as the system resolver would do */
+   if (hosts_file_lookup(hostname, addr) == STS_SUCCESS) {
+      *ttl = DNS_GOOD_AGE;
+      DEBUGC(DBCLASS_DNS, "DNS lookup - from %s: %s -> %s, ttl=%i",
+             _PATH_HOSTS, hostname, utils_inet_ntoa(*addr), *ttl);
+      return STS_SUCCESS;
+   }
+
+   /* DNS: address and TTL in one query */
+   sts = resolve_A(hostname, addr, ttl);
+   if (sts > 0) {
+      if (*ttl < DNS_MIN_TTL) *ttl = DNS_MIN_TTL;
+      if (*ttl > DNS_MAX_TTL) *ttl = DNS_MAX_TTL;
+      DEBUGC(DBCLASS_DNS, "DNS lookup - resolved: %s -> %s, ttl=%i",
+             hostname, utils_inet_ntoa(*addr), *ttl);
+      return STS_SUCCESS;
+   }
 
    /* need to deal with reentrant versions of gethostbyname_r()
     * as we may use threads... */
@@ -200,6 +247,8 @@ int get_ip_by_host(char *hostname, struct in_addr *addr) {
       if ((error == HOST_NOT_FOUND) ||
           (error == NO_ADDRESS) ||
           (error == NO_DATA)) {
+         /* a definite answer, may be cached */
+         *ttl = configuration.dns_negative_ttl;
 #ifdef HAVE_HSTRERROR
          DEBUGC(DBCLASS_DNS, "gethostbyname(%s) failed: h_errno=%i [%s]",
                 hostname, h_errno, hstrerror(error));
@@ -219,66 +268,54 @@ int get_ip_by_host(char *hostname, struct in_addr *addr) {
 
    if (hostentry) {
       memcpy(addr, hostentry->h_addr, sizeof(struct in_addr));
-      DEBUGC(DBCLASS_DNS, "DNS lookup - resolved: %s -> %s",
-             hostname, utils_inet_ntoa(*addr));
+
+      /* not resolved by DNS, no TTL known */
+      *ttl = DNS_GOOD_AGE;
+
+      DEBUGC(DBCLASS_DNS, "DNS lookup - resolved: %s -> %s, ttl=%i",
+             hostname, utils_inet_ntoa(*addr), *ttl);
    }
 
-   /* if we already have the entry, skip finding a new empty one */
-   if (idx == 0) {
-      /*
-       * find an empty slot in the cache
-       */
-      j=0;
-      k=0;
-      t1=INT_MAX;
-      t2=INT_MAX;
-      for (i=0; i<DNS_CACHE_SIZE; i++) {
-         if (dns_cache[i].hostname[0]=='\0') break;
-         if ((dns_cache[i].expires_timestamp < t1) &&
-             (dns_cache[i].bad_entry == 0)) {
-            /* remember oldest good entry */
-            t1=dns_cache[i].expires_timestamp;
-            j=i;
-         } else 
-         if (dns_cache[i].expires_timestamp < t2) {
-            /* remember oldest bad entry */
-            t2=dns_cache[i].expires_timestamp;
-            k=i;
+   return (hostentry) ? STS_SUCCESS : STS_FAILURE;
+}
+
+
+/*
+ * look up a hostname in the hosts file (first IPv4 entry)
+ *
+ * RETURNS
+ *	STS_SUCCESS if found
+ *	STS_FAILURE if not found
+ */
+static int hosts_file_lookup(char *hostname, struct in_addr *addr) {
+   FILE *fp;
+   char line[512];
+   char *p, *tok, *save;
+   struct in_addr ip;
+   int found=0;
+
+   fp=fopen(_PATH_HOSTS, "r");
+   if (fp == NULL) return STS_FAILURE;
+
+   while (!found && (fgets(line, sizeof(line), fp) != NULL)) {
+      p=strchr(line, '#');
+      if (p) *p='\0';
+
+      /* address, then canonical name and aliases */
+      tok=strtok_r(line, " \t\r\n", &save);
+      if ((tok == NULL) || (utils_inet_aton(tok, &ip) <= 0)) continue;
+
+      while ((tok=strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+         if (strcasecmp(tok, hostname) == 0) {
+            memcpy(addr, &ip, sizeof(struct in_addr));
+            found=1;
+            break;
          }
       }
-      /* if no empty slot found, victimize oldest one.
-       * Give preference to the oldest "bad" entry if 
-       * one exists */
-      if (i >= DNS_CACHE_SIZE) {
-         if (k > 0) i=k;
-         else       i=j;
-      }
-      idx=i;
-      memset(&dns_cache[idx], 0, sizeof(dns_cache[0]));
    }
 
-   /*
-    * store the result in the cache
-    */
-   DEBUGC(DBCLASS_DNS, "DNS lookup - store into cache, entry %i)", idx);
-   strncpy(dns_cache[idx].hostname, hostname, HOSTNAME_SIZE);
-   dns_cache[idx].hostname[HOSTNAME_SIZE]='\0';
-   dns_cache[idx].expires_timestamp = time(NULL) + DNS_GOOD_AGE;
-   if (hostentry) {
-      memcpy(&dns_cache[idx].addr, addr, sizeof(struct in_addr));
-      dns_cache[idx].error_count = 0;
-      dns_cache[idx].bad_entry = 0;
-   } else {
-      dns_cache[idx].error_count++;
-      DEBUGC(DBCLASS_DNS, "DNS lookup - errcnt=%i", dns_cache[idx].error_count);
-      if (dns_cache[idx].error_count >= DNS_ATTEMPTS) {
-         DEBUGC(DBCLASS_DNS, "DNS lookup - blacklisting entry");
-         dns_cache[idx].expires_timestamp = time(NULL) + DNS_BAD_AGE;
-         dns_cache[idx].bad_entry = 1;
-      }
-      return STS_FAILURE;
-   }
-   return STS_SUCCESS;
+   fclose(fp);
+   return (found) ? STS_SUCCESS : STS_FAILURE;
 }
 
 
@@ -450,6 +487,15 @@ int get_ip_by_ifname(char *ifname, struct in_addr *retaddr) {
 
    if (retaddr) memset(retaddr, 0, sizeof(struct in_addr));
 
+   /* interface table kept current by rtnetlink events */
+   if (if_watch_lookup(ifname, &ifaddr, &isup) == STS_SUCCESS) {
+      if (retaddr) memcpy(retaddr, &ifaddr, sizeof(struct in_addr));
+      DEBUGC(DBCLASS_DNS, "ifaddr lookup - tracked: %s -> %s %s",
+             ifname, utils_inet_ntoa(ifaddr), (isup)? "UP":"DOWN");
+      if (ifaddr.s_addr == INADDR_ANY) return STS_FAILURE;
+      return (isup)? STS_SUCCESS: STS_FAILURE;
+   }
+
    time(&t);
    /* clean expired entries */
    for (i=0; i<IFADR_CACHE_SIZE; i++) {
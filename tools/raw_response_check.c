@@ -0,0 +1,466 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Compares the responses rendered from the raw request
+ * (sip_raw_build_response) with the ones libosip2 builds
+ * (msg_make_template_reply) for mutated requests.
+ *
+ * For every request that libosip2 accepts and every status code the
+ * raw responder renders, the raw response is parsed again and must
+ * match the osip response in: status code, all Via headers (in
+ * order), From, To (including the tag), Call-ID, CSeq and, for 200,
+ * the Contact.
+ *
+ * Built and run by "make check", by hand:
+ *   tools/raw_response_check [iterations [seed]]
+ *
+ * Exits with 1 if a mismatch was found, the offending request is
+ * printed.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+#define MAX_LINES	32
+#define LINE_SIZE	512
+
+/*
+ * what sip_raw.c / sip_utils.c need from the rest of siproxd
+ */
+struct siproxd_config configuration;
+struct urlmap_s *urlmap=NULL;
+int urlmap_size=0;
+
+void log_debug(unsigned int class, char *file, int line,
+               const char *format, ...) {}
+void log_error(char *file, int line, const char *format, ...) {}
+void log_warn(char *file, int line, const char *format, ...) {}
+void log_info(char *file, int line, const char *format, ...) {}
+
+char *utils_inet_ntoa(struct in_addr in) { return inet_ntoa(in); }
+int utils_inet_aton(const char *cp, struct in_addr *inp) {
+   return inet_aton(cp, inp);
+}
+int get_ip_by_host(char *hostname, struct in_addr *addr) {
+   return (inet_aton(hostname, addr)) ? STS_SUCCESS : STS_FAILURE;
+}
+int get_interface_ip(int interface, struct in_addr *retaddr) {
+   return STS_FAILURE;
+}
+int sipsock_send(struct in_addr addr, int port, int protocol,
+                 char *buffer, size_t size) { return STS_SUCCESS; }
+int tcp_find(struct sockaddr_in dst_addr) { return -1; }
+void sip_trans_store_response(sip_ticket_t *ticket, int code,
+                              struct in_addr addr, int port, int protocol,
+                              char *buffer, size_t len) {}
+int sip_dialog_find_direction(sip_ticket_t *ticket, int *urlidx) {
+   return STS_FAILURE;
+}
+void sip_dialog_learn(sip_ticket_t *ticket, int type, int urlidx) {}
+int urlmap_index_lookup(int keys, osip_uri_t *url, struct in_addr *addr,
+                        int **list) { return 0; }
+void CvtHex(unsigned char *hash, unsigned char *hashstring) {}
+
+
+/*
+ * seed requests, one header per line
+ */
+static const char *seeds[]={
+   "REGISTER sip:example.com SIP/2.0\n"
+   "Via: SIP/2.0/UDP 192.168.1.10:5060;branch=z9hG4bK776asdhds;rport\n"
+   "Max-Forwards: 70\n"
+   "To: Bob <sip:bob@example.com>\n"
+   "From: Bob <sip:bob@example.com>;tag=456248\n"
+   "Call-ID: 843817637684230@998sdasdh09\n"
+   "CSeq: 1826 REGISTER\n"
+   "Contact: <sip:bob@192.168.1.10:5060>;expires=3600\n"
+   "Expires: 3600\n",
+
+   "INVITE sip:alice@example.com SIP/2.0\n"
+   "Via: SIP/2.0/UDP 10.0.0.1:5062;branch=z9hG4bKnashds8;received=10.0.0.1\n"
+   "Via: SIP/2.0/TCP 10.0.0.2;branch=z9hG4bK77ef4c2312983.1\n"
+   "Max-Forwards: 69\n"
+   "To: \"Alice, A.\" <sip:alice@example.com>\n"
+   "From: \"Bob\" <sip:bob@example.org;transport=udp>;tag=1928301774\n"
+   "Call-ID: a84b4c76e66710\n"
+   "CSeq: 314159 INVITE\n"
+   "Contact: <sip:bob@10.0.0.1:5062>\n"
+   "Content-Type: application/sdp\n",
+
+   "OPTIONS sip:carol@example.com SIP/2.0\n"
+   "v: SIP/2.0/UDP 172.16.0.5:5080;branch=z9hG4bKhjhs8ass877, "
+   "SIP/2.0/UDP 172.16.0.6;branch=z9hG4bK1\n"
+   "t: <sip:carol@example.com>;tag=abc\n"
+   "f: sip:dave@example.net;tag=xyz\n"
+   "i: 1j9FpLxk3uxtm8tn@172.16.0.5\n"
+   "CSeq: 63104 OPTIONS\n"
+   "m: <sip:dave@172.16.0.5:5080>, <sip:dave@172.16.0.5:5081>\n"
+   "Accept: application/sdp\n",
+
+   "BYE sip:bob@192.0.2.4 SIP/2.0\n"
+   "Via: SIP/2.0/UDP 192.0.2.1:5060;branch=z9hG4bKnashds10\n"
+   "Max-Forwards: 70\n"
+   "From: Alice <sip:alice@atlanta.example.com>;tag=1928301774\n"
+   "To: Bob <sip:bob@biloxi.example.com>;tag=a6c85cf\n"
+   "Call-ID: a84b4c76e66710@pc33.atlanta.example.com\n"
+   "CSeq: 231 BYE\n"
+};
+
+static const struct {
+   const char *name;
+   const char *compact;
+} compact_names[]={
+   {"Via", "v"}, {"From", "f"}, {"To", "t"}, {"Call-ID", "i"},
+   {"Contact", "m"}
+};
+
+static const int codes[]={200, 401, 403, 407, 408, 482, 483, 503, 486};
+
+static unsigned int rnd_state;
+
+static unsigned int rnd(unsigned int n) {
+   rnd_state ^= rnd_state << 13;
+   rnd_state ^= rnd_state >> 17;
+   rnd_state ^= rnd_state << 5;
+   return (n) ? rnd_state % n : 0;
+}
+
+
+/*
+ * split a seed into its lines
+ */
+static int split_lines(const char *seed, char lines[][LINE_SIZE]) {
+   int n=0;
+   const char *p=seed, *e;
+
+   while ((*p) && (n < MAX_LINES)) {
+      e=strchr(p, '\n');
+      if (e == NULL) e=p+strlen(p);
+      snprintf(lines[n], LINE_SIZE, "%.*s", (int)(e-p), p);
+      n++;
+      p=(*e) ? e+1 : e;
+   }
+   return n;
+}
+
+
+/*
+ * name of a header line and its length
+ */
+static size_t header_name(char *line) {
+   return strcspn(line, " \t:");
+}
+
+
+/*
+ * apply one random mutation to the header lines (never line 0)
+ */
+static int mutate(char lines[][LINE_SIZE], int n) {
+   char tmp[LINE_SIZE];
+   int i, j, k;
+   size_t l;
+
+   if (n < 2) return n;
+   i=1+rnd(n-1);
+   l=header_name(lines[i]);
+
+   switch (rnd(9)) {
+   case 0:	/* long <-> compact header name */
+      for (k=0; k < (int)(sizeof(compact_names)/sizeof(compact_names[0])); k++) {
+         if ((l == strlen(compact_names[k].name)) &&
+             (strncasecmp(lines[i], compact_names[k].name, l) == 0)) {
+            snprintf(tmp, sizeof(tmp), "%s%s", compact_names[k].compact,
+                     lines[i]+l);
+            strcpy(lines[i], tmp);
+            break;
+         }
+      }
+      break;
+   case 1:	/* case of the header name */
+      for (k=0; k < (int)l; k++) {
+         lines[i][k]=(rnd(2)) ? toupper((int)lines[i][k]) :
+                                tolower((int)lines[i][k]);
+      }
+      break;
+   case 2:	/* white space around the colon */
+      if (lines[i][l] == ':') {
+         static const char *ws[]={"", " ", "\t", "  "};
+         snprintf(tmp, sizeof(tmp), "%.*s%s:%s%s", (int)l, lines[i],
+                  ws[rnd(4)], ws[rnd(4)],
+                  lines[i]+l+1+strspn(lines[i]+l+1, " \t"));
+         strcpy(lines[i], tmp);
+      }
+      break;
+   case 3:	/* move a header, keeping the order of the Vias */
+      j=1+rnd(n-1);
+      if ((strncasecmp(lines[i], "v", 1) != 0) &&
+          (strncasecmp(lines[j], "v", 1) != 0)) {
+         strcpy(tmp, lines[i]);
+         strcpy(lines[i], lines[j]);
+         strcpy(lines[j], tmp);
+      }
+      break;
+   case 4:	/* headers that look like the copied ones */
+      if (n < MAX_LINES) {
+         static const char *decoys[]={
+            "X-Via: SIP/2.0/UDP 10.9.9.9;branch=z9hG4bKdecoy",
+            "Subject: To: nobody",
+            "Reply-To: <sip:decoy@example.com>",
+            "Call-Info: <http://example.com/i>",
+            "P-From: sip:x@y",
+            "Contact-X: <sip:decoy@1.2.3.4>"
+         };
+         memmove(lines[i+1], lines[i], (n-i)*LINE_SIZE);
+         snprintf(lines[i], LINE_SIZE, "%s",
+                  decoys[rnd(sizeof(decoys)/sizeof(decoys[0]))]);
+         n++;
+      }
+      break;
+   case 5:	/* parameters of the topmost Via */
+      for (k=1; k<n; k++) {
+         if ((strncasecmp(lines[k], "Via", 3) == 0) ||
+             (strncasecmp(lines[k], "v:", 2) == 0) ||
+             (strncasecmp(lines[k], "v ", 2) == 0)) {
+            static const char *params[]={
+               ";rport=5070", ";received=192.0.2.99", ";ttl=16",
+               ";maddr=192.0.2.1", ";x-foo"
+            };
+            l=strlen(lines[k]);
+            snprintf(lines[k]+l, LINE_SIZE-l, "%s",
+                     params[rnd(sizeof(params)/sizeof(params[0]))]);
+            break;
+         }
+      }
+      break;
+   case 6:	/* To tag */
+      if (((strncasecmp(lines[i], "To", 2) == 0) ||
+           (strncasecmp(lines[i], "t", 1) == 0)) &&
+          (strstr(lines[i], "tag=") == NULL)) {
+         l=strlen(lines[i]);
+         snprintf(lines[i]+l, LINE_SIZE-l, ";tag=%x", rnd(0x7fffffff));
+      }
+      break;
+   case 7:	/* additional Via */
+      if (n < MAX_LINES) {
+         memmove(lines[i+1], lines[i], (n-i)*LINE_SIZE);
+         snprintf(lines[i], LINE_SIZE,
+                  "Via: SIP/2.0/UDP 198.51.100.%i:%i;branch=z9hG4bK%x",
+                  1+rnd(254), 1024+rnd(60000), rnd(0x7fffffff));
+         n++;
+      }
+      break;
+   case 8:	/* a random printable character in a value */
+      l=strlen(lines[i]);
+      if (l > 0) lines[i][rnd(l)]=(char)(' '+rnd(95));
+      break;
+   }
+   return n;
+}
+
+
+/*
+ * osip rendering of a header, for comparison
+ */
+#define TO_STR(func, hdr, str) \
+   do { \
+      str=NULL; \
+      if ((hdr) != NULL) func((hdr), &str); \
+   } while (0)
+
+static int str_equal(char *a, char *b) {
+   if ((a == NULL) || (b == NULL)) return (a == b);
+   return (strcmp(a, b) == 0);
+}
+
+
+/*
+ * compare the raw response with the osip one
+ *
+ * RETURNS
+ *	NULL if they match, else the name of the differing header
+ */
+static const char *compare(osip_message_t *raw, osip_message_t *ref,
+                           int code) {
+   osip_via_t *v1, *v2;
+   osip_contact_t *c1, *c2;
+   char *s1, *s2;
+   const char *diff=NULL;
+   int i, sz;
+
+   if ((raw->status_code != code) || (ref->status_code != code)) {
+      return "status line";
+   }
+
+   sz=osip_list_size(&raw->vias);
+   if (sz != osip_list_size(&ref->vias)) return "Via (count)";
+   for (i=0; i<sz; i++) {
+      osip_message_get_via(raw, i, &v1);
+      osip_message_get_via(ref, i, &v2);
+      TO_STR(osip_via_to_str, v1, s1);
+      TO_STR(osip_via_to_str, v2, s2);
+      if (!str_equal(s1, s2)) diff="Via";
+      osip_free(s1);
+      osip_free(s2);
+      if (diff) return diff;
+   }
+
+   TO_STR(osip_from_to_str, raw->from, s1);
+   TO_STR(osip_from_to_str, ref->from, s2);
+   if (!str_equal(s1, s2)) diff="From";
+   osip_free(s1);
+   osip_free(s2);
+   if (diff) return diff;
+
+   /* To, including the tag (or its absence) */
+   TO_STR(osip_to_to_str, raw->to, s1);
+   TO_STR(osip_to_to_str, ref->to, s2);
+   if (!str_equal(s1, s2)) diff="To";
+   osip_free(s1);
+   osip_free(s2);
+   if (diff) return diff;
+
+   TO_STR(osip_call_id_to_str, raw->call_id, s1);
+   TO_STR(osip_call_id_to_str, ref->call_id, s2);
+   if (!str_equal(s1, s2)) diff="Call-ID";
+   osip_free(s1);
+   osip_free(s2);
+   if (diff) return diff;
+
+   TO_STR(osip_cseq_to_str, raw->cseq, s1);
+   TO_STR(osip_cseq_to_str, ref->cseq, s2);
+   if (!str_equal(s1, s2)) diff="CSeq";
+   osip_free(s1);
+   osip_free(s2);
+   if (diff) return diff;
+
+   if (code == 200) {
+      if (osip_list_size(&raw->contacts) != osip_list_size(&ref->contacts)) {
+         return "Contact (count)";
+      }
+      c1=NULL;
+      c2=NULL;
+      osip_message_get_contact(raw, 0, &c1);
+      osip_message_get_contact(ref, 0, &c2);
+      TO_STR(osip_contact_to_str, c1, s1);
+      TO_STR(osip_contact_to_str, c2, s2);
+      if (!str_equal(s1, s2)) diff="Contact";
+      osip_free(s1);
+      osip_free(s2);
+   }
+   return diff;
+}
+
+
+int main(int argc, char *argv[]) {
+   char lines[MAX_LINES+1][LINE_SIZE];
+   char req[BUFFER_SIZE], resp[BUFFER_SIZE];
+   sip_ticket_t ticket;
+   osip_message_t *sipmsg, *raw, *ref;
+   struct in_addr addr;
+   size_t len, resplen;
+   const char *diff;
+   int iterations=100000;
+   int i, k, n, m, c, port;
+   unsigned long parsed=0, rendered=0, fallback=0, mismatch=0;
+
+   if (argc > 1) iterations=atoi(argv[1]);
+   rnd_state=(argc > 2) ? (unsigned int)strtoul(argv[2], NULL, 0) : 2463534242U;
+   if (rnd_state == 0) rnd_state=1;
+
+   parser_init();
+
+   for (i=0; i<iterations; i++) {
+      /* mutated request */
+      n=split_lines(seeds[rnd(sizeof(seeds)/sizeof(seeds[0]))], lines);
+      m=1+rnd(4);
+      for (k=0; k<m; k++) n=mutate(lines, n);
+
+      len=0;
+      for (k=0; k<n; k++) {
+         len += snprintf(req+len, sizeof(req)-len, "%s\r\n", lines[k]);
+      }
+      len += snprintf(req+len, sizeof(req)-len, "Content-Length: 0\r\n\r\n");
+
+      /* only requests libosip2 accepts reach the responders */
+      if (osip_message_init(&sipmsg) != 0) return 2;
+      if ((osip_message_parse(sipmsg, req, len) != 0) ||
+          (sipmsg->to == NULL) || (sipmsg->from == NULL) ||
+          (sipmsg->call_id == NULL) || (sipmsg->cseq == NULL) ||
+          (osip_list_size(&sipmsg->vias) == 0)) {
+         osip_message_free(sipmsg);
+         continue;
+      }
+      parsed++;
+
+      memset(&ticket, 0, sizeof(ticket));
+      ticket.sipmsg=sipmsg;
+      ticket.raw_buffer=req;
+      ticket.raw_buffer_len=len;
+      ticket.protocol=PROTO_UDP;
+
+      for (c=0; c < (int)(sizeof(codes)/sizeof(codes[0])); c++) {
+         if (sip_raw_build_response(&ticket, codes[c], NULL, NULL, NULL,
+                                    resp, sizeof(resp), &resplen,
+                                    &addr, &port) != STS_SUCCESS) {
+            fallback++;
+            continue;
+         }
+         rendered++;
+
+         ref=msg_make_template_reply(&ticket, codes[c]);
+         osip_message_init(&raw);
+         if ((ref == NULL) || (osip_message_parse(raw, resp, resplen) != 0)) {
+            diff="unparsable response";
+         } else {
+            diff=compare(raw, ref, codes[c]);
+         }
+
+         if (diff) {
+            mismatch++;
+            printf("=== mismatch in %s, code %i, iteration %i\n"
+                   "--- request:\n%.*s--- raw response:\n%.*s\n",
+                   diff, codes[c], i, (int)len, req, (int)resplen, resp);
+         }
+         osip_message_free(raw);
+         if (ref) osip_message_free(ref);
+      }
+      osip_message_free(sipmsg);
+   }
+
+   printf("%i requests, %lu parsed by libosip2, %lu responses rendered raw, "
+          "%lu fallbacks, %lu mismatches\n", iterations, parsed, rendered,
+          fallback, mismatch);
+   return (mismatch) ? 1 : 0;
+}
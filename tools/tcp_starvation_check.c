@@ -0,0 +1,207 @@
+/*
+    Copyright (C) 2026  Thomas Ries <tries@gmx.net>
+
+    This file is part of Siproxd.
+
+    Siproxd is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Siproxd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Siproxd; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Checks that SIP over TCP is not starved by priority scheduling.
+ *
+ * The UDP socket is kept flooded with REGISTERs so the priority
+ * queue never runs empty. A REGISTER sent over a TCP connection
+ * (the lowest class, no advantage from classification) must still
+ * be delivered by sipsock_waitfordata() within a bounded number
+ * of calls.
+ *
+ * Built and run by "make check", by hand:
+ *   tools/tcp_starvation_check
+ *
+ * Exits with 1 if the TCP message has not been delivered, 77 (skip)
+ * if no local sockets can be used.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <osipparser2/osip_parser.h>
+
+#include "siproxd.h"
+#include "log.h"
+
+#define QUEUE_SIZE	64
+#define MAX_CALLS	(20*QUEUE_SIZE)
+#define FLOOD		16
+
+/*
+ * what sock.c / sip_prio.c need from the rest of siproxd
+ */
+struct siproxd_config configuration;
+
+void log_debug(unsigned int class, char *file, int line,
+               const char *format, ...) {}
+void log_error(char *file, int line, const char *format, ...) {}
+void log_warn(char *file, int line, const char *format, ...) {}
+void log_info(char *file, int line, const char *format, ...) {}
+void log_dump_buffer(unsigned int class, char *file, int line,
+                     char *buffer, int length) {}
+
+char *utils_inet_ntoa(struct in_addr in) { return inet_ntoa(in); }
+int sip_raw_has_to_tag(char *buf, size_t size) { return STS_FALSE; }
+int dns_async_fd(void) { return -1; }
+void dns_async_complete(void) {}
+int dns_async_resume(char *buf, size_t bufsize,
+                     struct sockaddr_in *from, int *protocol) { return 0; }
+int if_watch_fd(void) { return -1; }
+void if_watch_process(void) {}
+
+
+static const char udp_msg[]=
+   "REGISTER sip:example.com SIP/2.0\r\n"
+   "Via: SIP/2.0/UDP 127.0.0.1:5062;branch=z9hG4bKudp\r\n"
+   "To: <sip:udp@example.com>\r\n"
+   "From: <sip:udp@example.com>;tag=1\r\n"
+   "Call-ID: udp-flood\r\n"
+   "CSeq: 1 REGISTER\r\n"
+   "Content-Length: 0\r\n\r\n";
+
+static const char tcp_msg[]=
+   "REGISTER sip:example.com SIP/2.0\r\n"
+   "Via: SIP/2.0/TCP 127.0.0.1:5063;branch=z9hG4bKtcp\r\n"
+   "To: <sip:tcp@example.com>\r\n"
+   "From: <sip:tcp@example.com>;tag=2\r\n"
+   "Call-ID: tcp-starvation\r\n"
+   "CSeq: 1 REGISTER\r\n"
+   "Content-Length: 0\r\n\r\n";
+
+
+/*
+ * a free local port for the UDP and the TCP listen socket
+ */
+static int free_port(void) {
+   struct sockaddr_in addr;
+   socklen_t len=sizeof(addr);
+   int fd, port=0;
+
+   fd=socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) return 0;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family=AF_INET;
+   addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+   if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) &&
+       (getsockname(fd, (struct sockaddr *)&addr, &len) == 0)) {
+      port=ntohs(addr.sin_port);
+   }
+   close(fd);
+   return port;
+}
+
+
+int main(int argc, char *argv[]) {
+   static char buf[BUFFER_SIZE+1];
+   struct sockaddr_in dst, from;
+   char *data;
+   int port, udp, tcp;
+   int i, j, length, protocol;
+   int udp_seen=0;
+
+   port=free_port();
+   if (port == 0) {
+      fprintf(stderr, "no local port available, skipped\n");
+      return 77;
+   }
+
+   memset(&configuration, 0, sizeof(configuration));
+   configuration.sip_listen_port=port;
+   configuration.sip_udp_sockets=1;
+   configuration.sip_udp_batch=1;
+   configuration.sip_prio_max_wait=60000;
+   configuration.tcp_max_connections=16;
+   configuration.tcp_timeout=600;
+   configuration.tcp_connect_timeout=500;
+
+   if ((sip_prio_init(QUEUE_SIZE) != STS_SUCCESS) ||
+       (sipsock_listen() != STS_SUCCESS)) {
+      fprintf(stderr, "unable to listen on port %i, skipped\n", port);
+      return 77;
+   }
+
+   memset(&dst, 0, sizeof(dst));
+   dst.sin_family=AF_INET;
+   dst.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+   dst.sin_port=htons(port);
+
+   udp=socket(AF_INET, SOCK_DGRAM, 0);
+   tcp=socket(AF_INET, SOCK_STREAM, 0);
+   if ((udp < 0) || (tcp < 0) ||
+       (connect(tcp, (struct sockaddr *)&dst, sizeof(dst)) != 0)) {
+      fprintf(stderr, "unable to connect to port %i, skipped\n", port);
+      return 77;
+   }
+
+   /* fill the priority queue before the TCP message is sent */
+   for (i=0; i<4; i++) {
+      for (j=0; j<FLOOD; j++) {
+         sendto(udp, udp_msg, sizeof(udp_msg)-1, 0,
+                (struct sockaddr *)&dst, sizeof(dst));
+      }
+      sipsock_waitfordata(buf, sizeof(buf)-1, &from, &protocol, &data);
+   }
+   if (send(tcp, tcp_msg, sizeof(tcp_msg)-1, 0) != sizeof(tcp_msg)-1) {
+      fprintf(stderr, "send() over TCP failed, skipped\n");
+      return 77;
+   }
+
+   /* keep the UDP socket busy while waiting for the TCP message */
+   for (i=0; i<MAX_CALLS; i++) {
+      for (j=0; j<2; j++) {
+         sendto(udp, udp_msg, sizeof(udp_msg)-1, 0,
+                (struct sockaddr *)&dst, sizeof(dst));
+      }
+      length=sipsock_waitfordata(buf, sizeof(buf)-1, &from, &protocol, &data);
+      if (length <= 0) continue;
+
+      if (protocol == PROTO_UDP) {
+         udp_seen++;
+         continue;
+      }
+      if ((length != sizeof(tcp_msg)-1) ||
+          (memcmp(data, tcp_msg, length) != 0)) {
+         fprintf(stderr, "TCP message corrupted (%i bytes)\n", length);
+         return 1;
+      }
+      if (sip_prio_count() == 0) {
+         fprintf(stderr, "priority queue ran empty, check is void\n");
+         return 1;
+      }
+      printf("TCP message delivered after %i calls, "
+             "%i UDP messages, %i queued\n", i+1, udp_seen, sip_prio_count());
+      return 0;
+   }
+
+   fprintf(stderr, "TCP message not delivered within %i calls "
+           "(%i UDP messages delivered)\n", MAX_CALLS, udp_seen);
+   return 1;
+}